@@ -0,0 +1,104 @@
+#include <barrier>
+#include <cstdio>
+#include <thread>
+#include <Havk/Havk.h>
+#include <Havx/SystemUtils.h>
+
+#define HAVK_PERFMON_OVERRIDE_TRACY_MACROS
+#include <Havx/PerfMonitor.h>
+
+// Measures the CPU cost of entering and leaving PerfMon scopes. Scopes are nested two levels deep, under a parent with
+// many siblings, so that lookups by label have to skip over them. Each scope reads the clock twice, which is measured
+// separately because its cost varies a lot between machines, e.g. under virtualization.
+using havx::PerfMon::BeginScope;
+
+constexpr uint32_t kNumFrames = 200;
+constexpr uint32_t kNumItersPerFrame = 400;  // Two scopes each, timestamps are only recorded for the first 1024 per frame.
+constexpr uint32_t kNumSiblings = 64;
+constexpr double kNumScopes = kNumFrames * kNumItersPerFrame * 2.0;
+
+static void RecordSiteScopes() {
+    for (uint32_t i = 0; i < kNumItersPerFrame; i++) {
+        ZoneScopedN("Outer");
+        {
+            ZoneScopedN("Inner");
+        }
+    }
+}
+static void RecordLabelScopes() {
+    for (uint32_t i = 0; i < kNumItersPerFrame; i++) {
+        auto outer = BeginScope("Outer");
+        auto inner = BeginScope("Inner");
+    }
+}
+static double TimeScopes(void (*recordScopes)()) {
+    double startTime = havx::GetMonotonicTime();
+    recordScopes();
+    return havx::GetMonotonicTime() - startTime;
+}
+
+int main(int argc, const char** args) {
+    auto device = havk::CreateContext({});
+
+    constexpr uint32_t kNumClockReads = 100000;
+    double clockStartTime = havx::GetMonotonicTime();
+    for (uint32_t i = 0; i < kNumClockReads; i++) {
+        havx::GetMonotonicTime();
+    }
+    double clockReadTime = (havx::GetMonotonicTime() - clockStartTime) / kNumClockReads;
+    printf("%-20s %7.1f ns/call\n", "Clock read", clockReadTime * 1e9);
+
+    // Scopes only read the clock while profiling.
+    auto printResult = [&](const char* name, double elapsed, uint32_t numClockReads = 2) {
+        double perScope = elapsed / kNumScopes;
+        double bookkeeping = perScope - clockReadTime * numClockReads;
+        printf("%-20s %7.1f ns/scope, %5.1f ns excluding clock reads\n", name, perScope * 1e9, bookkeeping * 1e9);
+    };
+    // `recordFrame` returns the time taken to record the measured scopes.
+    auto runFrames = [&](bool profile, auto&& recordFrame) {
+        double elapsed = 0;
+
+        for (uint32_t i = 0; i < kNumFrames; i++) {
+            auto cmds = device->CreateCommandList();
+            if (profile) {
+                havx::PerfMon::NewFrame(*cmds);
+            }
+            {
+                auto root = BeginScope("Root");
+                for (uint32_t j = 0; j < kNumSiblings; j++) {
+                    char label[32];
+                    snprintf(label, sizeof(label), "Sibling %u", j);
+                    BeginScope(label);
+                }
+                elapsed += recordFrame();
+            }
+            cmds->Submit().Wait();
+        }
+        return elapsed;
+    };
+    printResult("Disabled", runFrames(false, [] { return TimeScopes(RecordSiteScopes); }), 0);
+    printResult("By label", runFrames(true, [] { return TimeScopes(RecordLabelScopes); }));
+    printResult("By site", runFrames(true, [] { return TimeScopes(RecordSiteScopes); }));
+
+    // Scopes of other threads only go to their timeline buffer, which is drained by NewFrame().
+    std::barrier frameSync(2);
+    double workerElapsed = 0;
+    std::thread worker([&]() {
+        havx::PerfMon::SetThreadName("Worker");
+        for (uint32_t i = 0; i < kNumFrames; i++) {
+            frameSync.arrive_and_wait();
+            workerElapsed += TimeScopes(RecordSiteScopes);
+            frameSync.arrive_and_wait();
+        }
+    });
+    runFrames(true, [&] {
+        frameSync.arrive_and_wait();
+        frameSync.arrive_and_wait();
+        return 0.0;
+    });
+    worker.join();
+    printResult("Other thread", workerElapsed);
+
+    havx::PerfMon::Shutdown();
+    return 0;
+}
@@ -52,6 +52,11 @@ static bool CheckDeviceExtensionSupport(PhysicalDeviceInfo& device, const Device
     device.Features.FragShaderInterlock = HasExtension(availExtensions, VK_EXT_FRAGMENT_SHADER_INTERLOCK_EXTENSION_NAME);
     device.Features.ConservativeRaster = HasExtension(availExtensions, VK_EXT_CONSERVATIVE_RASTERIZATION_EXTENSION_NAME);
     device.Features.ShaderClock = HasExtension(availExtensions, VK_KHR_SHADER_CLOCK_EXTENSION_NAME);
+    device.Features.CalibratedTimestamps = HasExtension(availExtensions, VK_KHR_CALIBRATED_TIMESTAMPS_EXTENSION_NAME);
+
+    VkPhysicalDeviceFeatures availFeatures;
+    vkGetPhysicalDeviceFeatures(device.Handle, &availFeatures);
+    device.Features.PipelineStatistics = availFeatures.pipelineStatisticsQuery;
 
     if (pars.EnableDebugExtensions) {
         device.Features.PerformanceQuery = HasExtension(availExtensions, VK_KHR_PERFORMANCE_QUERY_EXTENSION_NAME);
@@ -110,6 +115,18 @@ static PhysicalDeviceInfo SelectPhysicalDevice(const DeviceCreateParams& pars, V
 
         vkGetPhysicalDeviceProperties(device, &info.Props);
 
+        info.IdProps = { .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES };
+        info.SubgroupSizeProps = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_SIZE_CONTROL_PROPERTIES,
+            .pNext = &info.IdProps,
+        };
+        VkPhysicalDeviceProperties2 props2 = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+            .pNext = &info.SubgroupSizeProps,
+        };
+        vkGetPhysicalDeviceProperties2(device, &props2);
+        info.SubgroupSizeProps.pNext = nullptr;
+
         return info;
     }
 
@@ -207,6 +224,9 @@ static VkDevice CreateLogicalDevice(const DeviceCreateParams& pars, const Physic
         featureChain = &perfQueryFeatures;
         enabledExtensions.push_back(VK_KHR_PERFORMANCE_QUERY_EXTENSION_NAME);
     }
+    if (devInfo.Features.CalibratedTimestamps) {
+        enabledExtensions.push_back(VK_KHR_CALIBRATED_TIMESTAMPS_EXTENSION_NAME);
+    }
 
     VkPhysicalDeviceMaintenance5FeaturesKHR maintenance5Features = {
         .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MAINTENANCE_5_FEATURES_KHR,
@@ -273,6 +293,7 @@ static VkDevice CreateLogicalDevice(const DeviceCreateParams& pars, const Physic
         .depthClamp = VK_TRUE,
         .wideLines = VK_TRUE,
         .samplerAnisotropy = VK_TRUE,
+        .pipelineStatisticsQuery = (VkBool32)devInfo.Features.PipelineStatistics,
         .vertexPipelineStoresAndAtomics = VK_TRUE,
         .fragmentStoresAndAtomics = VK_TRUE,
         .shaderInt64 = VK_TRUE,
@@ -482,7 +503,13 @@ uint32_t DeviceContext::s_nextStaticProgramId = 0;
 DeviceContext::~DeviceContext() {
     vkDeviceWaitIdle(Device);
 
+    // Stop background pipeline rebuilds before tearing anything down.
+    _reloadWatcher.reset();
+    Tuner.reset();
+
     _staticPrograms.clear();
+    _specializedPrograms.clear();
+    _freeScratchBlocks.clear();
 
     // Deletion queues will only be marked as ready to retire after a Submit(),
     // so we have to flush any pending recyclers manually.
@@ -591,6 +618,13 @@ Future CommandList::Submit(VkSemaphore waitSemaphore, VkSemaphore signalSemaphor
 
     // Schedule flushing of associated deletion queue
     HAVK_ASSERT(Queue == Context->GetQueue(QueueDomain::Main));
+
+    for (auto& block : ScratchBlocks_) {
+        Context->_freeScratchBlocks.push_back({ .Buffer = std::move(block), .ReuseTimestamp = finishTS, .FreeTime = Context->_gcCounter });
+    }
+    ScratchBlocks_.clear();
+    ScratchOffset_ = 0;
+
     Recycler_->FlushTimestamp = std::max(Recycler_->FlushTimestamp, finishTS);
     // Context->Log(LogLevel::Trace, "Submit: DQ=%p FinishTS=%llu Now=%llu", Recycler_, finishTS, queueTs);
 
@@ -634,6 +668,15 @@ void DeviceContext::GarbageCollect() {
         _reloadWatcher->Poll(this);
     }
 
+    // Evict specialized programs that haven't been used in a while. Pipelines go through
+    // the deletion queue, so they can still be referenced by pending command lists.
+    if (++_gcCounter % 64 == 0) {
+        std::erase_if(_specializedPrograms, [&](auto& entry) { return _gcCounter - entry.second.LastUseTime > kSpecializedProgramMaxAge; });
+
+        // Likewise for scratch blocks left over from a spike in usage.
+        std::erase_if(_freeScratchBlocks, [&](auto& block) { return _gcCounter - block.FreeTime > kScratchBlockMaxAge; });
+    }
+
     Recycler* prev = _currRecycler.get();
     while (auto& rc = prev->Next) {
         uint64_t queueTs;
@@ -698,6 +741,34 @@ static void SetPipelineDebugName(DeviceContext* ctx, VkPipeline handle, std::str
     ctx->Pfn.SetDebugUtilsObjectNameEXT(ctx->Device, &nameInfo);
 }
 
+// Applies subgroup size requirements from module to stage create info, if supported by the device.
+// Otherwise, both requirements are dropped and the driver is free to pick any subgroup size.
+static void SetSubgroupSizeControl(DeviceContext* ctx, const ModuleDesc& mod, VkPipelineShaderStageCreateInfo& stageCI,
+                                   VkPipelineShaderStageRequiredSubgroupSizeCreateInfo& sizeCI) {
+    if (mod.RequiredSubgroupSize == 0 && !(mod.Flags & ModuleDesc::kRequireFullSubgroups)) return;
+
+    auto& props = ctx->PhysicalDevice.SubgroupSizeProps;
+    uint32_t size = mod.RequiredSubgroupSize;
+
+    if (size != 0) {
+        if (size < props.minSubgroupSize || size > props.maxSubgroupSize || (size & (size - 1)) != 0 ||
+            !(props.requiredSubgroupSizeStages & stageCI.stage)) {
+            ctx->Log(LogLevel::Warn, "Required subgroup size %d for '%s' is not supported by device (supported range: %d-%d), ignoring.",
+                     size, mod.EntryPoint, props.minSubgroupSize, props.maxSubgroupSize);
+            return;
+        }
+        sizeCI = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_REQUIRED_SUBGROUP_SIZE_CREATE_INFO,
+            .pNext = (void*)stageCI.pNext,
+            .requiredSubgroupSize = size,
+        };
+        stageCI.pNext = &sizeCI;
+    }
+    if (mod.Flags & ModuleDesc::kRequireFullSubgroups) {
+        stageCI.flags |= VK_PIPELINE_SHADER_STAGE_CREATE_REQUIRE_FULL_SUBGROUPS_BIT;
+    }
+}
+
 ComputePipelinePtr DeviceContext::CreateComputePipeline(const ModuleDesc& module, const SpecConstMap& specMap) {
     VkShaderModuleCreateInfo moduleCI = {
         .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
@@ -705,6 +776,7 @@ ComputePipelinePtr DeviceContext::CreateComputePipeline(const ModuleDesc& module
         .pCode = module.Code,
     };
     VkSpecializationInfo specInfo = specMap.GetSpecInfo();
+    VkPipelineShaderStageRequiredSubgroupSizeCreateInfo subgroupSizeCI;
 
     VkComputePipelineCreateInfo pipelineCI = {
         .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
@@ -717,26 +789,28 @@ ComputePipelinePtr DeviceContext::CreateComputePipeline(const ModuleDesc& module
         },
         .layout = DescriptorHeap->BindlessPipelineLayout,
     };
-    auto instance = MakeUniqueResource<ComputePipeline>();
+    SetSubgroupSizeControl(this, module, pipelineCI.stage, subgroupSizeCI);
 
+    // Only wrap the handle once creation succeeded. The reload thread catches failures, and must not unwind
+    // through QueuedDeleter since the recycler is owned by the main thread.
+    VkPipeline handle = nullptr;
     if (OnCreatePipelineHook_) {
-        HAVK_CHECK(OnCreatePipelineHook_({ &module, 1 }, (VkBaseInStructure*)&pipelineCI, &pipelineCI.stage, &instance->Handle));
+        HAVK_CHECK(OnCreatePipelineHook_({ &module, 1 }, (VkBaseInStructure*)&pipelineCI, &pipelineCI.stage, &handle));
     } else {
-        HAVK_CHECK(vkCreateComputePipelines(Device, PipelineCache, 1, &pipelineCI, nullptr, &instance->Handle));
+        HAVK_CHECK(vkCreateComputePipelines(Device, PipelineCache, 1, &pipelineCI, nullptr, &handle));
     }
+    auto instance = MakeUniqueResource<ComputePipeline>();
+    instance->Handle = handle;
+    instance->Name = GetPipelineDebugName({ module });
 
     if (Pfn.SetDebugUtilsObjectNameEXT != nullptr) {
-        SetPipelineDebugName(this, instance->Handle, GetPipelineDebugName({ module }));
+        SetPipelineDebugName(this, instance->Handle, instance->Name);
     }
     if (_reloadWatcher != nullptr && (module.Flags & ModuleDesc::kNoReload) == 0) {
-        std::string name = GetPipelineDebugName({ module });
-        auto reloadCb = [=, pipe = instance.get()](Span<const ModuleDesc> modules) {
-            pipe->Context->Log(LogLevel::Info, "Reloading pipeline '%s'", name.data());
-
-            auto newPipe = pipe->Context->CreateComputePipeline(modules[0], specMap);
-            std::swap(newPipe->Handle, pipe->Handle);
+        auto reloadCb = [this, specMap](Span<const ModuleDesc> modules) -> ReloadWatcher::PipelinePtr {
+            return CreateComputePipeline(modules[0], specMap);
         };
-        _reloadWatcher->BeginTracking(instance.get(), { module }, std::move(reloadCb));
+        _reloadWatcher->BeginTracking(instance.get(), { module }, GetPipelineDebugName({ module }), std::move(reloadCb));
     }
     return instance;
 }
@@ -745,6 +819,7 @@ GraphicsPipelinePtr DeviceContext::CreateGraphicsPipeline(Span<const ModuleDesc>
                                                           const AttachmentLayout& outputs, const SpecConstMap& specMap) {
     auto moduleInfos = std::vector<VkShaderModuleCreateInfo>(modules.size());
     auto stageInfos = std::vector<VkPipelineShaderStageCreateInfo>(modules.size());
+    auto subgroupSizeInfos = std::vector<VkPipelineShaderStageRequiredSubgroupSizeCreateInfo>(modules.size());
     auto dynamicStates = std::vector<VkDynamicState> { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
     VkSpecializationInfo specInfo = specMap.GetSpecInfo();
 
@@ -763,6 +838,7 @@ GraphicsPipelinePtr DeviceContext::CreateGraphicsPipeline(Span<const ModuleDesc>
             .pName = mod.EntryPoint,
             .pSpecializationInfo = &specInfo,
         };
+        SetSubgroupSizeControl(this, mod, stageInfos[i], subgroupSizeInfos[i]);
     }
 
     VkPipelineVertexInputStateCreateInfo vertexInputCI = {
@@ -868,26 +944,25 @@ GraphicsPipelinePtr DeviceContext::CreateGraphicsPipeline(Span<const ModuleDesc>
         .pDynamicState = &dynamicStateCI,
         .layout = DescriptorHeap->BindlessPipelineLayout,
     };
-    auto instance = MakeUniqueResource<GraphicsPipeline>();
-
+    // See CreateComputePipeline().
+    VkPipeline handle = nullptr;
     if (OnCreatePipelineHook_) {
-        HAVK_CHECK(OnCreatePipelineHook_(modules, (VkBaseInStructure*)&pipelineCI, stageInfos.data(), &instance->Handle));
+        HAVK_CHECK(OnCreatePipelineHook_(modules, (VkBaseInStructure*)&pipelineCI, stageInfos.data(), &handle));
     } else {
-        HAVK_CHECK(vkCreateGraphicsPipelines(Device, PipelineCache, 1, &pipelineCI, nullptr, &instance->Handle));
+        HAVK_CHECK(vkCreateGraphicsPipelines(Device, PipelineCache, 1, &pipelineCI, nullptr, &handle));
     }
+    auto instance = MakeUniqueResource<GraphicsPipeline>();
+    instance->Handle = handle;
+    instance->Name = GetPipelineDebugName(modules);
 
     if (Pfn.SetDebugUtilsObjectNameEXT != nullptr) {
-        SetPipelineDebugName(this, instance->Handle, GetPipelineDebugName(modules));
+        SetPipelineDebugName(this, instance->Handle, instance->Name);
     }
     if (_reloadWatcher != nullptr && (modules[0].Flags & ModuleDesc::kNoReload) == 0) {
-        std::string name = GetPipelineDebugName(modules);
-        auto reloadCb = [=, pipe = instance.get()](Span<const ModuleDesc> modules) {
-            pipe->Context->Log(LogLevel::Info, "Reloading pipeline '%s'", name.data());
-
-            auto newPipe = pipe->Context->CreateGraphicsPipeline(modules, state, outputs, specMap);
-            std::swap(newPipe->Handle, pipe->Handle);
+        auto reloadCb = [this, state, outputs, specMap](Span<const ModuleDesc> modules) -> ReloadWatcher::PipelinePtr {
+            return CreateGraphicsPipeline(modules, state, outputs, specMap);
         };
-        _reloadWatcher->BeginTracking(instance.get(), modules, std::move(reloadCb));
+        _reloadWatcher->BeginTracking(instance.get(), modules, GetPipelineDebugName(modules), std::move(reloadCb));
     }
     return instance;
 }
@@ -901,6 +976,44 @@ ComputePipeline* DeviceContext::CreateStaticComputeProgram(uint32_t id, const Mo
     _staticPrograms[id] = std::move(instance);
     return _staticPrograms[id].get();
 }
+VkDeviceAddress CommandList::AllocScratch(const void* data, uint32_t size) {
+    uint32_t offset = (ScratchOffset_ + 15) & ~15u;
+
+    if (ScratchBlocks_.empty() || offset + size > ScratchBlocks_.back()->Size) {
+        ScratchBlocks_.push_back(Context->AcquireScratchBlock(size));
+        offset = 0;
+    }
+    Buffer& block = *ScratchBlocks_.back();
+    block.Write(offset, (const uint8_t*)data, size);
+    ScratchOffset_ = offset + size;
+
+    return block.DeviceAddress + offset;
+}
+BufferPtr DeviceContext::AcquireScratchBlock(uint32_t minSize) {
+    uint64_t queueTs;
+    vkGetSemaphoreCounterValue(Device, GetQueue(QueueDomain::Main)->SubmitSemaphore, &queueTs);
+
+    for (auto iter = _freeScratchBlocks.begin(); iter != _freeScratchBlocks.end(); iter++) {
+        if (iter->ReuseTimestamp <= queueTs && iter->Buffer->Size >= minSize) {
+            BufferPtr block = std::move(iter->Buffer);
+            _freeScratchBlocks.erase(iter);
+            return block;
+        }
+    }
+    return CreateBuffer(std::max(minSize, kScratchBlockSize), BufferFlags::DeviceMem | BufferFlags::MapSeqWrite, 0, "ScratchBlock");
+}
+
+ComputePipeline* DeviceContext::CreateSpecializedProgram(uint64_t key, uint32_t id, const ModuleDesc& mod, const SpecConstMap& specMap,
+                                                        std::shared_ptr<const void> specConsts) {
+    auto& entry = _specializedPrograms[key];
+    entry = {
+        .Pipeline = CreateComputePipeline(mod, specMap),
+        .ProgramId = id,
+        .LastUseTime = _gcCounter,
+        .SpecConsts = std::move(specConsts),
+    };
+    return entry.Pipeline.get();
+}
 
 Pipeline::~Pipeline() {
     if (Context->_reloadWatcher != nullptr) {
@@ -1290,7 +1403,7 @@ DescriptorHeap::DescriptorHeap(DeviceContext* ctx) {
     };
     HAVK_CHECK(vkAllocateDescriptorSets(Context->Device, &allocCI, &Set));
 
-    VkPushConstantRange pcRange = { VK_SHADER_STAGE_ALL, 0, 256 };
+    VkPushConstantRange pcRange = { VK_SHADER_STAGE_ALL, 0, kMaxPushConstantSize };
     VkPipelineLayoutCreateInfo pipelineLayoutCI = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
         .setLayoutCount = 1,
@@ -1769,6 +1882,7 @@ void CommandList::CopyBufferToImage(const CopyBufferToImageParams& pars) {
         .imageExtent = { extent.x, extent.y, isLayered ? 1 : extent.z },
     };
     VkImage imageHandle = pars.DstImage.Handle;
+    ObservedCommand_ observed(*this, nullptr, "CopyBufferToImage");
     vkCmdCopyBufferToImage(Handle, pars.SrcData.source_buffer().Handle, imageHandle, VK_IMAGE_LAYOUT_GENERAL, 1, &region);
 
     if (pars.GenerateMips) {
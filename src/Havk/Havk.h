@@ -1,10 +1,13 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <cstring>
 #include <memory>
+#include <string>
 #include <vector>
 #include <functional>
+#include <unordered_map>
 
 #include <vulkan/vulkan.h>
 #include <vk_mem_alloc.h>
@@ -82,6 +85,7 @@ struct DescriptorHeap;
 struct GraphicsPipelineState;
 struct AttachmentLayout;
 
+struct CommandList;
 struct ReloadWatcher; // Internal
 
 template<typename T>
@@ -94,6 +98,31 @@ concept ComputeProgramShape = requires {
     requires ProgramShape<T>;
     std::is_same_v<decltype(T::GroupSize), vectors::uint3>;
 };
+// Compute programs with spec constants declared via `// @tune` comments.
+template<typename T>
+concept TunableProgramShape = ComputeProgramShape<T> && requires {
+    std::size(T::TuneCandidates);
+};
+
+// Picks between `TuneCandidates` of tunable programs. See `havx::KernelTuner`.
+struct ProgramTuner {
+    virtual ~ProgramTuner() = default;
+
+    // Returns index of the candidate to use for the dispatch about to be recorded.
+    virtual uint32_t BeginDispatch(CommandList& cmdList, const ModuleDesc& mod, uint32_t numCandidates, vectors::uint3 numGroups) = 0;
+    // Called right after the dispatch is recorded.
+    virtual void EndDispatch(CommandList& cmdList, const ModuleDesc& mod) = 0;
+};
+
+// Observes dispatch, draw and transfer commands as they are recorded, see `DeviceContext::CommandObserver_`.
+struct CommandObserver {
+    virtual ~CommandObserver() = default;
+
+    // `pipeline` is null for transfer commands. `name` is a string literal naming the command, e.g. "CopyBuffer".
+    virtual void BeginCommand(CommandList& cmdList, const Pipeline* pipeline, const char* name) = 0;
+    // Called right after the command is recorded.
+    virtual void EndCommand(CommandList& cmdList) = 0;
+};
 
 // Debug text for Vulkan object handles.
 // Defaults to caller's source location, but can be a custom
@@ -191,13 +220,15 @@ struct DispatchTable {
 };
 
 struct DeviceFeatures {
-    bool RayQuery;             // VK_KHR_ray_query
-    bool RayTracingPipeline;   // VK_KHR_ray_tracing_pipeline
-    bool MeshShader;           // VK_EXT_mesh_shader
-    bool FragShaderInterlock;  // VK_EXT_fragment_shader_interlock    (pixel + sample)
-    bool ConservativeRaster;   // VK_EXT_conservative_rasterization
-    bool ShaderClock;          // VK_KHR_shader_clock
-    bool PerformanceQuery;     // VK_KHR_performance_query
+    bool RayQuery;              // VK_KHR_ray_query
+    bool RayTracingPipeline;    // VK_KHR_ray_tracing_pipeline
+    bool MeshShader;            // VK_EXT_mesh_shader
+    bool FragShaderInterlock;   // VK_EXT_fragment_shader_interlock    (pixel + sample)
+    bool ConservativeRaster;    // VK_EXT_conservative_rasterization
+    bool ShaderClock;           // VK_KHR_shader_clock
+    bool PerformanceQuery;      // VK_KHR_performance_query
+    bool CalibratedTimestamps;  // VK_KHR_calibrated_timestamps
+    bool PipelineStatistics;    // pipelineStatisticsQuery
 };
 struct PhysicalDeviceInfo {
     VkPhysicalDevice Handle = nullptr;
@@ -206,6 +237,8 @@ struct PhysicalDeviceInfo {
 
     DeviceFeatures Features = {};
     VkPhysicalDeviceProperties Props;
+    VkPhysicalDeviceIDProperties IdProps;
+    VkPhysicalDeviceSubgroupSizeControlProperties SubgroupSizeProps;
 };
 
 enum class QueueDomain { Main, AsyncCompute, AsyncTransfer, Count_ };
@@ -250,9 +283,19 @@ struct DeviceContext {
 
     LoggerCallback LoggerSink;
 
+    // Optional, selects candidates for `TunableProgramShape` dispatches. The first candidate is used if null.
+    std::unique_ptr<ProgramTuner> Tuner;
+
     // Hook points (adhoc APIs, will change in the future!).
     std::function<void(CommandList&, VkQueue, VkSubmitInfo&, VkFence)> SubmitHook_;
-
+    // Begin command lists without ONE_TIME_SUBMIT, so that SubmitHook_ can replay them.
+    bool ReusableCommandLists_ = false;
+    // Called around every dispatch, draw and transfer command, if set. Not owned.
+    // May be changed while other threads are recording; commands already begun end on the previous observer,
+    // so it must outlive them.
+    std::atomic<CommandObserver*> CommandObserver_ = nullptr;
+
+    // May be called from the shader reload thread.
     std::function<VkResult(Span<const ModuleDesc> mods, VkBaseInStructure* createInfo,
                            VkPipelineShaderStageCreateInfo* stages, VkPipeline* pipeline)> OnCreatePipelineHook_;
     std::function<void(Pipeline&)> OnDestroyPipelineHook_;
@@ -285,6 +328,36 @@ struct DeviceContext {
         }
         return _staticPrograms[id].get();
     }
+    // Returns pipeline specialized with the given constants, creating it on first use.
+    // Variants that go unused for `kSpecializedProgramMaxAge` GCs are evicted, so returned pointers should not be kept around.
+    template<ComputeProgramShape TProgram>
+        requires(!std::is_void_v<typename TProgram::SpecConst>)
+    ComputePipeline* GetProgram(const typename TProgram::SpecConst& specConsts) {
+        static uint32_t id = ++s_nextStaticProgramId;
+        uint64_t key = specConsts.GetHash() ^ (id * 0x9E3779B97F4A7C15ull);
+
+        // Values are compared as well since the key is only a hash. `ProgramId` implies the stored type.
+        auto iter = _specializedPrograms.find(key);
+        if (iter == _specializedPrograms.end() || iter->second.ProgramId != id ||
+            *(const typename TProgram::SpecConst*)iter->second.SpecConsts.get() != specConsts) [[unlikely]] {
+            auto values = std::make_shared<const typename TProgram::SpecConst>(specConsts);
+            return CreateSpecializedProgram(key, id, TProgram::Module, specConsts, std::move(values));
+        }
+        iter->second.LastUseTime = _gcCounter;
+        return iter->second.Pipeline.get();
+    }
+    // Returns pipeline for a permutation of the given program, creating it on first use.
+    template<ComputeProgramShape TProgram>
+    ComputePipeline* GetProgram(const typename TProgram::Variant& key) {
+        constexpr uint32_t numVariants = std::size(TProgram::Variants);
+        static uint32_t baseId = (s_nextStaticProgramId += numVariants) - numVariants + 1;
+        uint32_t id = baseId + key.GetIndex();
+
+        if (_staticPrograms.size() <= id || _staticPrograms[id] == nullptr) [[unlikely]] {
+            return CreateStaticComputeProgram(id, TProgram::Variants[key.GetIndex()]);
+        }
+        return _staticPrograms[id].get();
+    }
 
     // Create one-time submit command list.
     CommandListPtr CreateCommandList(QueueDomain queue = QueueDomain::Main, bool beginRecording = true);
@@ -329,6 +402,26 @@ private:
     std::unique_ptr<Recycler> _currRecycler = std::make_unique<Recycler>();
     std::vector<ComputePipelinePtr> _staticPrograms;
 
+    struct SpecializedProgram {
+        ComputePipelinePtr Pipeline;
+        uint32_t ProgramId;
+        uint32_t LastUseTime;  // Value of `_gcCounter` at last GetProgram() call
+        std::shared_ptr<const void> SpecConsts;  // Copy of `TProgram::SpecConst` values
+    };
+    static const uint32_t kSpecializedProgramMaxAge = 1024;
+    std::unordered_map<uint64_t, SpecializedProgram> _specializedPrograms;  // Keyed by program id and spec constants hash
+    uint32_t _gcCounter = 0;
+
+    // Host-visible memory for spilled push constants, reused once command lists using it have completed.
+    struct ScratchBlock {
+        BufferPtr Buffer;
+        uint64_t ReuseTimestamp;  // Main queue submit timestamp
+        uint32_t FreeTime;        // Value of `_gcCounter` when released
+    };
+    static constexpr uint32_t kScratchBlockSize = 1024 * 64;
+    static const uint32_t kScratchBlockMaxAge = 256;
+    std::vector<ScratchBlock> _freeScratchBlocks;
+
     CommandListPtr _prologueCmds;
 
     DeviceQueue _queues[(int)QueueDomain::Count_];
@@ -339,6 +432,9 @@ private:
 
     static uint32_t s_nextStaticProgramId;
     ComputePipeline* CreateStaticComputeProgram(uint32_t id, const ModuleDesc& mod);
+    ComputePipeline* CreateSpecializedProgram(uint64_t key, uint32_t id, const ModuleDesc& mod, const SpecConstMap& specMap,
+                                             std::shared_ptr<const void> specConsts);
+    BufferPtr AcquireScratchBlock(uint32_t minSize);
 
     template<typename R, typename... Args>
     auto MakeUniqueResource(Args&&... args) {
@@ -362,6 +458,9 @@ struct DescriptorHeap {
     VkDescriptorSet Set = nullptr;
     VkPipelineLayout BindlessPipelineLayout = nullptr;
 
+    // Larger parameters are copied to scratch memory and passed as a pointer. See `CommandList::PushConstants()`.
+    static constexpr uint32_t kMaxPushConstantSize = 256;
+
     DescriptorHeap(DeviceContext* ctx);
     ~DescriptorHeap();
 
@@ -392,6 +491,7 @@ private:
 
 struct Pipeline : Resource {
     VkPipeline Handle = nullptr;
+    std::string Name;  // `SourceFile:EntryPoint`, comma separated for graphics pipelines.
     ~Pipeline() override;
 };
 struct GraphicsPipeline final : Pipeline {};
@@ -878,6 +978,25 @@ struct CommandList final : Resource {
     // Internal
     VkPipeline BoundPipeline_ = nullptr;
     DeviceContext::Recycler* Recycler_ = nullptr;
+    bool Reusable_ = false;
+
+    // Notifies `DeviceContext::CommandObserver_` around a recorded command.
+    struct ObservedCommand_ {
+        CommandList* List;
+        CommandObserver* Observer;
+
+        ObservedCommand_(CommandList& list, const Pipeline* pipeline, const char* name)
+            : List(&list), Observer(list.Context->CommandObserver_.load(std::memory_order_acquire)) {
+            if (Observer != nullptr) [[unlikely]] {
+                Observer->BeginCommand(list, pipeline, name);
+            }
+        }
+        ~ObservedCommand_() {
+            if (Observer != nullptr) [[unlikely]] Observer->EndCommand(*List);
+        }
+    };
+    std::vector<BufferPtr> ScratchBlocks_;  // Allocations are made from the last block.
+    uint32_t ScratchOffset_ = 0;
 
     ~CommandList() override {
         vkFreeCommandBuffers(Context->Device, Queue->CmdPool, 1, &Handle);
@@ -885,9 +1004,10 @@ struct CommandList final : Resource {
     }
 
     void Begin() {
+        Reusable_ = Context->ReusableCommandLists_;
         VkCommandBufferBeginInfo beginInfo = {
             .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+            .flags = Reusable_ ? 0u : VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
         };
         HAVK_CHECK(vkBeginCommandBuffer(Handle, &beginInfo));
 
@@ -909,15 +1029,23 @@ struct CommandList final : Resource {
             vkCmdBindPipeline(Handle, bindpoint, pipeline.Handle);
             vkCmdBindDescriptorSets(Handle, bindpoint, Context->DescriptorHeap->BindlessPipelineLayout, 0, 1, &Context->DescriptorHeap->Set, 0, nullptr);
         }
-        if (pc.Size > 0) {
-            vkCmdPushConstants(Handle, Context->DescriptorHeap->BindlessPipelineLayout, VK_SHADER_STAGE_ALL, pc.DstOffset, pc.Size, pc.Ptr);
-        }
+        PushConstants(pc);
     }
+    // Parameters larger than `kMaxPushConstantSize` are copied to scratch memory, and only their address is pushed.
+    // ShaderBuildTool rewrites shaders with such parameters to read them through that pointer.
     void PushConstants(PushConstantData pc) {
+        VkDeviceAddress spillAddr;
+        if (pc.Size > DescriptorHeap::kMaxPushConstantSize) [[unlikely]] {
+            HAVK_ASSERT(pc.DstOffset == 0 && "Spilled push constants must be updated at once");
+            spillAddr = AllocScratch(pc.Ptr, pc.Size);
+            pc = PushConstantData(&spillAddr, 0, sizeof(spillAddr));
+        }
         if (pc.Size > 0) {
             vkCmdPushConstants(Handle, Context->DescriptorHeap->BindlessPipelineLayout, VK_SHADER_STAGE_ALL, pc.DstOffset, pc.Size, pc.Ptr);
         }
     }
+    // Copies data to scratch memory that is kept alive until the command list completes, and returns its device address.
+    VkDeviceAddress AllocScratch(const void* data, uint32_t size);
 
     // Dispatches the minimum number of groups covering the given invocation count: `numGroups = ceil(numInvocs / GroupSize)`.
     template<ComputeProgramShape TCompute>
@@ -925,39 +1053,67 @@ struct CommandList final : Resource {
         auto numGroups = (numInvocs + TCompute::GroupSize - 1u) / TCompute::GroupSize;
         DispatchGroups(*Context->GetProgram<TCompute>(), numGroups, pc);
     }
+    template<TunableProgramShape TCompute>
+    void Dispatch(vectors::uint3 numInvocs, const TCompute::Params& pc) {
+        auto numGroups = (numInvocs + TCompute::GroupSize - 1u) / TCompute::GroupSize;
+        ProgramTuner* tuner = Context->Tuner.get();
+        uint32_t numCandidates = (uint32_t)std::size(TCompute::TuneCandidates);
+        uint32_t index = tuner ? tuner->BeginDispatch(*this, TCompute::Module, numCandidates, numGroups) : 0;
+
+        DispatchGroups(*Context->GetProgram<TCompute>(TCompute::TuneCandidates[index]), numGroups, pc);
+        if (tuner) tuner->EndDispatch(*this, TCompute::Module);
+    }
+    template<ComputeProgramShape TCompute>
+    void Dispatch(vectors::uint3 numInvocs, const TCompute::Params& pc, const typename TCompute::Variant& variant) {
+        auto numGroups = (numInvocs + TCompute::GroupSize - 1u) / TCompute::GroupSize;
+        DispatchGroups(*Context->GetProgram<TCompute>(variant), numGroups, pc);
+    }
+    template<ComputeProgramShape TCompute>
+        requires(!std::is_void_v<typename TCompute::SpecConst>)
+    void Dispatch(vectors::uint3 numInvocs, const TCompute::Params& pc, const typename TCompute::SpecConst& specConsts) {
+        auto numGroups = (numInvocs + TCompute::GroupSize - 1u) / TCompute::GroupSize;
+        DispatchGroups(*Context->GetProgram<TCompute>(specConsts), numGroups, pc);
+    }
     void DispatchGroups(const ComputePipeline& pipeline, vectors::uint3 numGroups, PushConstantData pc = {}) {
         BindPipeline(pipeline, pc);
+        ObservedCommand_ observed(*this, &pipeline, "Dispatch");
         vkCmdDispatch(Handle, numGroups.x, numGroups.y, numGroups.z);
     }
 
     void Draw(const GraphicsPipeline& pipeline, const DrawCommand& cmd, PushConstantData pc = {}) {
         BindPipeline(pipeline, pc);
+        ObservedCommand_ observed(*this, &pipeline, "Draw");
         vkCmdDraw(Handle, cmd.NumVertices, cmd.NumInstances, cmd.VertexOffset, cmd.InstanceOffset);
     }
     void DrawIndexed(const GraphicsPipeline& pipeline, const DrawIndexedCommand& cmd, PushConstantData pc = {}) {
         BindPipeline(pipeline, pc);
+        ObservedCommand_ observed(*this, &pipeline, "DrawIndexed");
         vkCmdDrawIndexed(Handle, cmd.NumIndices, cmd.NumInstances, cmd.IndexOffset, (int32_t)cmd.VertexOffset, cmd.InstanceOffset);
     }
     template<typename TCmd>
     void DrawIndexedIndirect(const GraphicsPipeline& pipeline, BufferSpan<TCmd> cmds, PushConstantData pc = {}) {
         BindPipeline(pipeline, pc);
+        ObservedCommand_ observed(*this, &pipeline, "DrawIndexedIndirect");
         vkCmdDrawIndexedIndirect(Handle, cmds.source_buffer().Handle, cmds.offset_bytes(), cmds.size(), sizeof(TCmd));
     }
     template<typename TCmd>
     void DrawIndexedIndirectCount(const GraphicsPipeline& pipeline, BufferSpan<TCmd> cmds, BufferSpan<uint32_t> count,
                                   PushConstantData pc = {}) {
         BindPipeline(pipeline, pc);
+        ObservedCommand_ observed(*this, &pipeline, "DrawIndexedIndirectCount");
         vkCmdDrawIndexedIndirectCount(Handle, cmds.source_buffer().Handle, cmds.offset_bytes(), count.source_buffer().Handle,
                                       count.offset_bytes(), cmds.size(), sizeof(TCmd));
     }
 
     void DrawMeshTasks(const GraphicsPipeline& pipeline, vectors::uint3 numGroups, PushConstantData pc = {}) {
         BindPipeline(pipeline, pc);
+        ObservedCommand_ observed(*this, &pipeline, "DrawMeshTasks");
         Context->Pfn.CmdDrawMeshTasksEXT(Handle, numGroups.x, numGroups.y, numGroups.z);
     }
     template<typename TCmd>
     void DrawMeshTasksIndirect(const GraphicsPipeline& pipeline, BufferSpan<TCmd> cmds, PushConstantData pc = {}) {
         BindPipeline(pipeline, pc);
+        ObservedCommand_ observed(*this, &pipeline, "DrawMeshTasksIndirect");
         Context->Pfn.CmdDrawMeshTasksIndirectEXT(Handle, cmds.source_buffer().Handle, cmds.offset_bytes(), cmds.size(),
                                                  sizeof(TCmd));
     }
@@ -965,6 +1121,7 @@ struct CommandList final : Resource {
     void DrawMeshTasksIndirectCount(const GraphicsPipeline& pipeline, BufferSpan<TCmd> cmds, BufferSpan<uint32_t> count,
                                     PushConstantData pc = {}) {
         BindPipeline(pipeline, pc);
+        ObservedCommand_ observed(*this, &pipeline, "DrawMeshTasksIndirectCount");
         Context->Pfn.CmdDrawMeshTasksIndirectCountEXT(Handle, cmds.source_buffer().Handle, cmds.offset_bytes(),
                                                       count.source_buffer().Handle, count.offset_bytes(), cmds.size(),
                                                       sizeof(TCmd));
@@ -986,12 +1143,14 @@ struct CommandList final : Resource {
 
     // Splats a 32-bit value to the given buffer range (must be 4-byte aligned).
     void FillBuffer(BufferSpan<uint32_t> buffer, uint32_t value) {
+        ObservedCommand_ observed(*this, nullptr, "FillBuffer");
         vkCmdFillBuffer(Handle, buffer.source_buffer().Handle, buffer.offset_bytes(), buffer.size_bytes(), value);
     }
 
     // Copies host data to buffer in device timeline. This is limited to 64KB per call and larger copies
     // should be avoided, see docs for `vkCmdUpdateBuffer`.
     void UpdateBuffer(Buffer& buffer, size_t destOffset, uint32_t dataSize, const void* data) {
+        ObservedCommand_ observed(*this, nullptr, "UpdateBuffer");
         vkCmdUpdateBuffer(Handle, buffer.Handle, destOffset, dataSize, data);
     }
     void CopyBuffer(Buffer& source, Buffer& dest, size_t srcOffset = 0, size_t destOffset = 0, size_t size = VK_WHOLE_SIZE) {
@@ -1000,6 +1159,7 @@ struct CommandList final : Resource {
         HAVK_ASSERT(destOffset + size <= dest.Size);
 
         VkBufferCopy region = { srcOffset, destOffset, size };
+        ObservedCommand_ observed(*this, nullptr, "CopyBuffer");
         vkCmdCopyBuffer(Handle, source.Handle, dest.Handle, 1, &region);
     }
 
@@ -1007,10 +1167,12 @@ struct CommandList final : Resource {
 
     void ClearColorImage(Image& image, VkClearColorValue value) {
         VkImageSubresourceRange range = image.GetEntireRange();
+        ObservedCommand_ observed(*this, nullptr, "ClearColorImage");
         vkCmdClearColorImage(Handle, image.Handle, VK_IMAGE_LAYOUT_GENERAL, &value, 1, &range);
     }
     void ClearDepthImage(Image& image, VkClearDepthStencilValue value) {
         VkImageSubresourceRange range = image.GetEntireRange();
+        ObservedCommand_ observed(*this, nullptr, "ClearDepthImage");
         vkCmdClearDepthStencilImage(Handle, image.Handle, VK_IMAGE_LAYOUT_GENERAL, &value, 1, &range);
     }
 
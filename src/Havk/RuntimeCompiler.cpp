@@ -0,0 +1,208 @@
+#include "RuntimeCompiler.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+// Shares the compilation pipeline and caches with the offline tool, so that outputs are identical.
+#include "ShaderCompiler.h"
+
+namespace havk {
+
+using namespace havk::detail;
+
+const ModuleDesc* RuntimeShader::FindModule(std::string_view entryPoint) const {
+    for (auto& mod : Modules) {
+        if (entryPoint == mod.EntryPoint) return &mod;
+    }
+    return nullptr;
+}
+
+struct RuntimeCompiler::Impl {
+    struct Job {
+        std::string Name;
+        std::filesystem::path SourceFile;
+        std::promise<RuntimeShaderPtr> Result;
+    };
+    RuntimeCompilerOptions Opts;
+    std::filesystem::path SourceDir;
+
+    std::mutex Mutex;
+    std::condition_variable JobAvailable;
+    std::deque<Job> PendingJobs;
+    std::unordered_map<uint64_t, std::shared_future<RuntimeShaderPtr>> Results;  // Keyed by hash of name and source
+    bool Stopping = false;
+    std::thread Worker;
+
+    // Only accessed by worker thread.
+    Slang::ComPtr<slang::IGlobalSession> GlobalSession;
+    SessionOptions Session;
+    slang::SessionDesc SessionDesc;
+    std::unique_ptr<CompileCache> Cache;
+    std::unique_ptr<ModuleCache> ModCache;
+
+    void RunWorker() {
+        slang::createGlobalSession(GlobalSession.writeRef());
+        InitOptions();
+
+        while (true) {
+            std::unique_lock lock(Mutex);
+            JobAvailable.wait(lock, [&]() { return Stopping || !PendingJobs.empty(); });
+            if (Stopping) break;
+
+            Job job = std::move(PendingJobs.front());
+            PendingJobs.pop_front();
+            lock.unlock();
+
+            job.Result.set_value(CompileJob(job));
+        }
+    }
+
+    void InitOptions() {
+        Session.BaseNamespace = Opts.BaseNamespace;
+        Session.OptLevel = std::clamp(Opts.OptLevel, 0, 3);
+        Session.DebugLevel = std::clamp(Opts.DebugLevel, 0, 3);
+        Session.MatrixLayout = Opts.RowMajor ? SLANG_MATRIX_LAYOUT_ROW_MAJOR : SLANG_MATRIX_LAYOUT_COLUMN_MAJOR;
+
+        for (auto& [name, value] : Opts.Defines) {
+            Session.Macros.push_back({ .name = name.data(), .value = value.data() });
+        }
+        for (auto& dir : Opts.IncludeDirs) {
+            Session.IncludeDirs.push_back(dir.data());
+        }
+        SessionDesc = Session.CreateSessionDesc(GlobalSession);
+
+        if (!Opts.CacheDir.empty()) {
+            Session.CreateCaches(GlobalSession, Opts.CacheDir, SourceDir, "runtime", Cache, ModCache);
+        }
+    }
+
+    RuntimeShaderPtr CompileJob(Job& job) {
+        ShaderOutputs outputs;
+
+        if (Cache != nullptr) {
+            std::vector<std::string> relDeps;
+            std::string key = Cache->Lookup(job.SourceFile, relDeps);
+            if (!key.empty() && Cache->Load(key, relDeps, outputs)) return CreateShader(job.Name, outputs);
+            outputs = {};
+        }
+
+        SourceDirectives directives;
+        if (!ParseDirectives(job.SourceFile, directives)) return nullptr;
+
+        if (!directives.Permutations.empty()) {
+            fprintf(stderr, "error: runtime shader '%s' declares permutations, which are not supported.\n", job.Name.data());
+            return nullptr;
+        }
+
+        Slang::ComPtr<slang::ISession> session;
+        GlobalSession->createSession(SessionDesc, session.writeRef());
+
+        if (ModCache != nullptr) {
+            ModCache->Preload(session, job.SourceFile);
+        }
+        TypeGraph typeGraph = { .BaseNamespace = Opts.BaseNamespace };
+
+        if (!CompileShader(GlobalSession, session, job.SourceFile, &typeGraph, {}, directives, 0, outputs)) {
+            fprintf(stderr, "error: failed to compile runtime shader '%s'\n", job.Name.data());
+            return nullptr;
+        }
+
+        if (Cache != nullptr) {
+            Cache->Store(job.SourceFile, outputs);
+            ModCache->Save(session, job.SourceFile);
+        }
+        return CreateShader(job.Name, outputs);
+    }
+
+    static RuntimeShaderPtr CreateShader(const std::string& name, const ShaderOutputs& outputs) {
+        auto shader = std::make_shared<RuntimeShader>();
+        shader->Name = name;
+        shader->Header = outputs.Header;
+        shader->ReflectJson.assign(outputs.ReflectJson.begin(), outputs.ReflectJson.end());
+
+        for (auto& bin : outputs.Spirv) {
+            auto& code = shader->_binaries.emplace_back(bin.Data.size() / 4);
+            memcpy(code.data(), bin.Data.data(), code.size() * 4);
+        }
+        for (auto& entry : outputs.EntryPoints) {
+            shader->_entryPoints.push_back(entry.Name);
+        }
+        for (size_t i = 0; i < shader->_entryPoints.size(); i++) {
+            const EntryPointInfo& entry = outputs.EntryPoints[i];
+            auto& code = shader->_binaries[entry.BinaryIndices[0]];
+
+            shader->Modules.push_back({
+                .Code = code.data(),
+                .CodeSize = (uint32_t)(code.size() * 4),
+                .Flags = ModuleDesc::kNoReload | (entry.RequireFullSubgroups ? (uint32_t)ModuleDesc::kRequireFullSubgroups : 0),
+                .EntryPoint = shader->_entryPoints[i].data(),
+                .SourcePath = shader->Name.data(),
+                .RequiredSubgroupSize = entry.WaveSize,
+            });
+        }
+        return shader;
+    }
+};
+
+RuntimeCompiler::RuntimeCompiler(RuntimeCompilerOptions opts) : _impl(std::make_unique<Impl>()) {
+    _impl->Opts = std::move(opts);
+
+    if (!_impl->Opts.CacheDir.empty()) {
+        _impl->SourceDir = std::filesystem::path(_impl->Opts.CacheDir) / "sources";
+    } else {
+        _impl->SourceDir = std::filesystem::temp_directory_path() / "havk-runtime-shaders";
+    }
+    _impl->Worker = std::thread([impl = _impl.get()]() { impl->RunWorker(); });
+}
+RuntimeCompiler::~RuntimeCompiler() {
+    {
+        std::lock_guard lock(_impl->Mutex);
+        _impl->Stopping = true;
+    }
+    _impl->JobAvailable.notify_one();
+    _impl->Worker.join();
+
+    // Leftover jobs will throw `broken_promise` from waiting futures.
+    _impl->PendingJobs.clear();
+}
+
+std::shared_future<RuntimeShaderPtr> RuntimeCompiler::CompileAsync(std::string_view name, std::string_view source) {
+    ContentHasher hasher;
+    hasher.Add(source);
+
+    // Results hold the given name, so identical sources with different names are compiled separately.
+    ContentHasher resultHasher = hasher;
+    resultHasher.Add(name);
+
+    std::lock_guard lock(_impl->Mutex);
+    auto iter = _impl->Results.find(resultHasher.State);
+    if (iter != _impl->Results.end()) return iter->second;
+
+    // Source files are named by content, so concurrent writers always agree.
+    std::filesystem::path sourceFile = _impl->SourceDir / ("rt_" + hasher.GetHex() + ".slang");
+    if (!IsFileContentEquals(sourceFile, (const uint8_t*)source.data(), source.size())) {
+        WriteFileAtomic(sourceFile, source);
+    }
+
+    Impl::Job& job = _impl->PendingJobs.emplace_back();
+    job.Name = name;
+    job.SourceFile = sourceFile;
+
+    auto result = job.Result.get_future().share();
+    _impl->Results[resultHasher.State] = result;
+    _impl->JobAvailable.notify_one();
+    return result;
+}
+
+void RuntimeCompiler::ClearCache() {
+    std::lock_guard lock(_impl->Mutex);
+    _impl->Results.clear();
+}
+
+};  // namespace havk
@@ -0,0 +1,62 @@
+#pragma once
+#include "ShaderBridge.h"
+
+#include <future>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace havk {
+
+struct RuntimeCompilerOptions {
+    std::vector<std::string> IncludeDirs;
+    std::vector<std::pair<std::string, std::string>> Defines;
+    std::string CacheDir;       // Persistent cache directory, can be shared with ShaderBuildTool. Disabled if empty.
+    std::string BaseNamespace;  // For declarations in `RuntimeShader::Header`.
+    int OptLevel = 1;           // 0..3
+    int DebugLevel = 0;         // 0..3
+    bool RowMajor = false;
+};
+
+// Program compiled at runtime. Modules point to data owned by this object, so it must outlive any pipelines created from them.
+struct RuntimeShader {
+    std::string Name;
+    std::vector<ModuleDesc> Modules;  // One per entry point, flagged with `kNoReload`.
+    std::string Header;               // Binding declarations, as generated by ShaderBuildTool.
+    std::string ReflectJson;          // Slang reflection, as in `.reflect.json` files.
+
+    const ModuleDesc* FindModule(std::string_view entryPoint) const;
+
+private:
+    friend struct RuntimeCompiler;
+    std::vector<std::vector<uint32_t>> _binaries;
+    std::vector<std::string> _entryPoints;
+};
+using RuntimeShaderPtr = std::shared_ptr<const RuntimeShader>;
+
+// Compiles Slang source strings to SPIR-V on a background thread, using the same options and codegen as ShaderBuildTool.
+// Results are cached in memory by source hash, and on disk if `CacheDir` is set.
+//
+// Sources are written to a file before compiling, so that imports and diagnostics work the same way as for offline
+// shaders. Permutations are not supported, `Defines` should be used instead.
+struct RuntimeCompiler {
+    RuntimeCompiler(RuntimeCompilerOptions opts = {});
+    ~RuntimeCompiler();
+
+    // Queues source for compilation. Result is null on failure, errors are printed to stderr.
+    // `name` is only used for labeling, results for identical sources are shared.
+    std::shared_future<RuntimeShaderPtr> CompileAsync(std::string_view name, std::string_view source);
+
+    RuntimeShaderPtr Compile(std::string_view name, std::string_view source) { return CompileAsync(name, source).get(); }
+
+    // Drops in-memory results. Shaders already returned are kept alive by their owners.
+    void ClearCache();
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+};  // namespace havk
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cassert>
 #include <cstring>
 #include <vector>
 
@@ -10,16 +11,25 @@ namespace havk {
 struct ModuleDesc {
     enum Flags {
         kNoReload = 1 << 0,     // Skip hot-reloading
+        kRequireFullSubgroups = 1 << 1,  // Compute/mesh/task only. Requires group size X to be a multiple of the subgroup size.
     };
     const uint32_t* Code;       // SPIR-V binary data
     uint32_t CodeSize;          // SPIR-V binary size
     uint32_t Flags = 0;
     const char* EntryPoint;
     const char* SourcePath;     // Optional. For labeling and hot-reload support.
+    uint32_t Variant = 0;       // Permutation index, for sources declaring `// @permute` defines.
+    uint32_t RequiredSubgroupSize = 0;  // From `[WaveSize(N)]`. Ignored with a warning if not supported by device.
 
     VkShaderStageFlagBits GetStage() const;
 };
 
+// Compute entry point compiled to C++ with `ShaderBuildTool --cpu-kernels`. See `havx::CpuDispatcher`.
+struct CpuKernel {
+    // Runs all groups in range [start, end), with a pointer to the entry point's `Params` struct.
+    void (*RunGroups)(const void* params, const uint32_t start[3], const uint32_t end[3]);
+};
+
 struct ImageHandle {
     uint32_t HeapIndex = 0;
     explicit operator bool() const { return HeapIndex != 0; }
@@ -52,6 +62,9 @@ struct SpecOpt {
 
     constexpr SpecOpt() : value(), present(false) {}
     constexpr SpecOpt(const T& value) : value(value), present(true) {}
+
+    // Bitwise, consistent with `SpecConstHasher`.
+    bool operator==(const SpecOpt& other) const { return present == other.present && memcmp(&value, &other.value, sizeof(T)) == 0; }
 };
 
 struct SpecConstMap {
@@ -69,6 +82,7 @@ struct SpecConstMap {
     void Add(uint32_t constId, const bool& value) {
         Add(constId, value ? VK_TRUE : VK_FALSE);
     }
+
     VkSpecializationInfo GetSpecInfo() const {
         return {
             .mapEntryCount = (uint32_t)Entries.size(),
@@ -79,6 +93,26 @@ struct SpecConstMap {
     }
 };
 
+// FNV-1a hash of specialization constant values, used to key pipeline caches.
+// Generated `SpecConst` structs compute it directly from set fields, without building a map.
+struct SpecConstHasher {
+    uint64_t State = 0xcbf29ce484222325ull;
+
+    void AddBytes(const void* data, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            State = (State ^ ((const uint8_t*)data)[i]) * 0x100000001b3ull;
+        }
+    }
+    template<typename T>
+    void Add(uint32_t constId, const T& value) {
+        AddBytes(&constId, sizeof(constId));
+        AddBytes(&value, sizeof(T));
+    }
+    void Add(uint32_t constId, const bool& value) {
+        Add(constId, value ? VK_TRUE : VK_FALSE);
+    }
+};
+
 // Same as VkDrawIndirectCommand, with defaults.
 struct DrawCommand {
     uint32_t NumVertices = 0;
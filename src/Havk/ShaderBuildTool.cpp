@@ -1,32 +1,34 @@
 #include <cstdarg>
+#include <cstdlib>
 #include <cstring>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <sstream>
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
+
+#if _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
 
 #include <slang.h>
 #include <slang-com-ptr.h>
 
 #include <Havx/SystemUtils.h>
 
-static bool IsFileContentEquals(const std::filesystem::path& path, const uint8_t* data, size_t length) {
-    auto fs = std::ifstream(path, std::ios::binary | std::ios::ate);
-    if (!fs.good() || (size_t)fs.tellg() != length) return false;
+#include "ShaderCompiler.h"
 
-    fs.seekg(0);
-    char buffer[4096];
+using namespace havk::detail;
 
-    for (size_t pos = 0; pos < length; pos += sizeof(buffer)) {
-        size_t chunkLen = std::min(sizeof(buffer), length - pos);
-        fs.read(buffer, chunkLen);
-
-        if (!fs.good() || memcmp(data + pos, buffer, chunkLen) != 0) return false;
-    }
-    return true;
-}
 // Overwrite file iff contents are different. This avoids dirtying timestamps and triggering rebuilds.
 static void UpdateFile(const std::filesystem::path& path, const void* data, size_t length) {
     if (IsFileContentEquals(path, (const uint8_t*)data, length)) return;
@@ -43,579 +45,129 @@ static bool IsSubpath(const std::filesystem::path& path, const std::filesystem::
     return !rel.empty() && rel.native()[0] != '.';
 }
 
-static bool IsBuiltinDescriptorHandle(slang::TypeReflection* type) {
-    const char* name = type->getName();
-    return strcmp(name, "ImageHandle") == 0 || strcmp(name, "SamplerHandle") == 0 || strcmp(name, "AccelStructHandle") == 0;
-}
-
-struct TypeGraph {
-    struct TypeInfo {
-        slang::IModule* Module;
-        std::string Namespace;
-    };
-    std::unordered_map<slang::TypeReflection*, TypeInfo> Entries;
-    std::unordered_map<slang::FunctionReflection*, std::string> ParentNamespaces;
-
-    std::string BaseNamespace;
-
-    TypeInfo* GetInfo(slang::TypeReflection* type) {
-        auto iter = Entries.find(type);
-        return iter != Entries.end() ? &iter->second : nullptr;
-    }
-
-    void RegisterTypes(slang::IModule* module, slang::DeclReflection* entity, const std::string& parentNs = "") {
-        std::string ns = parentNs;
-        if (ns.empty() && !BaseNamespace.empty()) {
-            ns = BaseNamespace;
-        }
-        if (entity->getKind() == slang::DeclReflection::Kind::Namespace) {
-            if (!ns.empty()) ns += "::";
-            ns += entity->getName();
-        }
-
-        for (uint32_t i = 0; i < entity->getChildrenCount(); i++) {
-            slang::DeclReflection* child = entity->getChild(i);
-
-            switch (child->getKind()) {
-                case slang::DeclReflection::Kind::Struct:
-                case slang::DeclReflection::Kind::Enum: {
-                    Entries.insert({ child->getType(), { .Module = module, .Namespace = ns } });
-                    break;
-                }
-                case slang::DeclReflection::Kind::Func: {
-                    ParentNamespaces.insert({ child->asFunction(), ns });
-                    break;
-                }
-                case slang::DeclReflection::Kind::Namespace: {
-                    RegisterTypes(module, child, ns);
-                    break;
-                }
-                default: break;
-            }
-        }
-    }
-
-    void GetOrderedDependencies(slang::TypeReflection* type, std::vector<slang::TypeReflection*>& postOrder) {
-        if (std::find(postOrder.begin(), postOrder.end(), type) != postOrder.end()) return;
-
-        switch (type->getKind()) {
-            case slang::TypeReflection::Kind::Struct: {
-                for (uint32_t i = 0; i < type->getFieldCount(); i++) {
-                    auto field = type->getFieldByIndex(i);
-                    GetOrderedDependencies(field->getType(), postOrder);
-                }
-                postOrder.push_back(type);
-                break;
-            }
-            case slang::TypeReflection::Kind::Enum: {
-                postOrder.push_back(type);
-                break;
-            }
-            case slang::TypeReflection::Kind::Pointer: {
-                auto elemType = type->getGenericContainer()->getConcreteType(type->getGenericContainer()->getTypeParameter(0));
-                GetOrderedDependencies(elemType, postOrder);
-                break;
-            }
-            case slang::TypeReflection::Kind::Array:
-                GetOrderedDependencies(type->getElementType(), postOrder);
-                break;
-            case slang::TypeReflection::Kind::Scalar:
-            case slang::TypeReflection::Kind::Vector:
-            case slang::TypeReflection::Kind::Matrix:
-                return; // ignore primitive types
-            default: {
-                fprintf(stderr, "warn: Don't know how to process type '%s' kind=%d\n", type->getName(), type->getKind());
-                return;
-            }
-        }
-    }
-};
-
-struct CodePrinter {
-    TypeGraph* Types;
-    std::string Buffer;
-    int IndentLevel = 0;
-
-    std::string CurrentNamespace;
-
-    CodePrinter(TypeGraph* tg) : Types(tg) { }
-
-    void Indent() { Buffer.append(IndentLevel * 4, ' '); }
-
-    void Begin(const char* fmt, const char* arg1 = nullptr, const char* arg2 = nullptr) {
-        Indent();
-        AppendFmt(fmt, arg1, arg2);
-        IndentLevel++;
-    }
-    void End(const char* fmt, const char* arg1 = nullptr) {
-        IndentLevel--;
-        Indent();
-        AppendFmt(fmt, arg1);
-    }
-
-    void SetNamespace(std::string_view ns) {
-        if (ns.empty() && !CurrentNamespace.empty()) {
-            End("}; // namespace %s\n", CurrentNamespace.data());
-            CurrentNamespace = "";
-        } else if (!ns.empty() && CurrentNamespace != ns) {
-            Begin("namespace %s {\n", ns.data());
-            CurrentNamespace = ns;
-        }
-    }
+// Merges outputs of all variants into the first one, deduplicating identical binaries.
+static bool MergeVariantOutputs(std::vector<ShaderOutputs>& variants, const std::filesystem::path& sourceFile) {
+    ShaderOutputs& merged = variants[0];
 
-    void Append(std::string_view str) { Buffer.append(str); }
-    void AppendFmt(const char* fmt, ...) {
-        if (fmt[0] == '\t') {
-            Indent();
-            fmt++;
-        }
-        size_t currSize = Buffer.size();
+    for (uint32_t v = 1; v < variants.size(); v++) {
+        ShaderOutputs& variant = variants[v];
 
-        while (true) {
-            size_t availSize = Buffer.capacity() - currSize;
-            Buffer.resize(currSize + availSize);
-    
-            va_list args;
-            va_start(args, fmt);
-            size_t appSize = vsnprintf(Buffer.data() + currSize, availSize, fmt, args);
-            va_end(args);
-    
-            if (appSize < availSize) {
-                Buffer.resize(currSize + appSize);
-                break;
-            }
-            Buffer.reserve(Buffer.capacity() * 2);
+        // All variants share the same header, so anything that ends up in there must not depend on permutations.
+        if (variant.Header != merged.Header) {
+            fprintf(stderr, "error: permutations of '%s' must not change parameters, group sizes or specialization constants (variant %d differs).\n",
+                    sourceFile.filename().string().data(), v);
+            return false;
         }
-    }
-    
-    void PrintTypeRef(slang::TypeReflection* type) {
-        const char* name = type->getName();
-        auto kind = type->getKind();
-
-        switch (type->getKind()) {
-            case slang::TypeReflection::Kind::Pointer: {
-                auto elemType = type->getGenericContainer()->getConcreteType(type->getGenericContainer()->getTypeParameter(0));
-                Append("havk::DevicePtr<");
-                PrintTypeRef(elemType);
-                Append(">");
-                break;
-            }
-            case slang::TypeReflection::Kind::Vector:
-            case slang::TypeReflection::Kind::Matrix: {
-                Append("havk::vectors::");
-                switch (type->getElementType()->getScalarType()) {
-                    case slang::TypeReflection::Int32: Append("int"); break;
-                    case slang::TypeReflection::UInt32: Append("uint"); break;
-                    case slang::TypeReflection::Float16: Append("float16_t"); break;
-                    case slang::TypeReflection::Float32: Append("float"); break;
-                    default: PrintTypeRef(type->getElementType());
-                }
-                if (kind == slang::TypeReflection::Kind::Vector){
-                    AppendFmt("%d", type->getColumnCount());
-                } else {
-                    AppendFmt("%dx%d", type->getRowCount(), type->getColumnCount());
-                }
-                break;
-            }
-            case slang::TypeReflection::Kind::Scalar: {
-                switch (type->getScalarType()) {
-                    case slang::TypeReflection::Int32: Append("int32_t"); break;
-                    case slang::TypeReflection::UInt32: Append("uint32_t"); break;
-                    case slang::TypeReflection::Float16: Append("havk::vectors::float16_t"); break;
-                    default: Append(name); break;
-                }
-                break;
+        for (auto& dep : variant.Dependencies) {
+            if (std::find(merged.Dependencies.begin(), merged.Dependencies.end(), dep) == merged.Dependencies.end()) {
+                merged.Dependencies.push_back(dep);
             }
-            case slang::TypeReflection::Kind::Struct: {
-                auto info = Types->GetInfo(type);
-                // If we don't have info about this type, it's probably a builtin
-                if (info == nullptr) {
-                    if (IsBuiltinDescriptorHandle(type)) {
-                        Append("havk::");
-                        Append(type->getName());
-                        break;
-                    }
-                    Slang::ComPtr<slang::IBlob> fullNameBlob;
-                    type->getFullName(fullNameBlob.writeRef());
-
-                    // "A.B.C" -> "A::B::"
-                    const char* str = (const char*)fullNameBlob->getBufferPointer();
-                    while (const char* end = strchr(str, '.')) {
-                        Append(std::string_view(str, end));
-                        Append("::");
-                        str = end + 1;
-                    }
-                } else if (!info->Namespace.empty()) {
-                    Append(info->Namespace);
-                    Append("::");
-                }
-                Append(name);
-                // TODO: should we care about generics?
-                break;
-            }
-            default:
-                Append(type->getName());
-                fprintf(stderr, "warn: Don't know how to emit ref to type '%s' kind=%d\n", type->getName(), type->getKind());
-                break;
-        }
-    }
-    
-    void PrintField(slang::TypeReflection* type, std::string_view name) {
-        auto kind = type->getKind();
-
-        if (type->isArray()) {
-            PrintTypeRef(type->unwrapArray());
-            AppendFmt(" %s", name.data());
-
-            do {
-                size_t size = type->getElementCount();
-                AppendFmt(size == 0 ? "[]" : "[%zu]", size);   
-                type = type->getElementType();
-            } while (type->isArray());
-
-            Append(";\n");
-        } else {
-            PrintTypeRef(type);
-            AppendFmt(" %s;\n", name.data());
-        }
-    }
-    void PrintTypeDef(slang::TypeReflection* type) {
-        if (auto info = Types->GetInfo(type)) {
-            SetNamespace(info->Namespace);
         }
+        std::vector<uint32_t> binaryRemap;
 
-        if (type->getKind() == slang::TypeReflection::Kind::Struct) {
-            Begin("struct %s {\n", type->getName());
+        for (auto& bin : variant.Spirv) {
+            auto existing = std::find_if(merged.Spirv.begin(), merged.Spirv.end(), [&](const SpirvBinary& other) { return other.Data == bin.Data; });
+            binaryRemap.push_back((uint32_t)(existing - merged.Spirv.begin()));
 
-            for (uint32_t i = 0; i < type->getFieldCount(); i++) {
-                auto field = type->getFieldByIndex(i);
-
-                Indent();
-                PrintField(field->getType(), field->getName());
-            }
-            End("};\n");
-        } else if (type->getKind() == slang::TypeReflection::Kind::Enum) {
-            AppendFmt("\tenum class %s : ", type->getName());
-            PrintTypeRef(type->getElementType());
-            Append(" {\n");
-            IndentLevel++;
-
-            for (uint32_t i = 0; i < type->getFieldCount(); i++) {
-                auto field = type->getFieldByIndex(i);
-                int64_t value = 0;
-                field->getDefaultValueInt(&value);
-                AppendFmt("\t%s = %lld,\n", field->getName(), value);
-            }
-            End("};\n");
-        } else {
-            fprintf(stderr, "warn: Don't know how to emit decl for type '%s' kind=%d\n", type->getName(), type->getKind());
-        }
-    }
-    void PrintImplicitParamStruct(slang::TypeLayoutReflection* type) {
-        std::vector<slang::VariableLayoutReflection*> fields;
-        
-        for (uint32_t i = 0; i < type->getFieldCount(); i++) {
-            slang::VariableLayoutReflection* field = type->getFieldByIndex(i);
-            if (field->getCategory() == slang::ParameterCategory::Uniform) {
-                fields.push_back(field);
+            if (existing == merged.Spirv.end()) {
+                merged.Spirv.push_back(std::move(bin));
+            } else {
+                existing->EntryPoints.insert(existing->EntryPoints.end(), bin.EntryPoints.begin(), bin.EntryPoints.end());
             }
         }
-        if (fields.size() == 1 && fields[0]->getType()->getKind() == slang::TypeReflection::Kind::Struct) {
-            AppendFmt("\tusing Params = ");
-            PrintTypeRef(fields[0]->getType());
-            Append(";\n");
-            return;
-        }
-        Begin("struct Params {\n");
-
-        for (auto field : fields) {
-            AppendFmt("\t/* %2d */ ", field->getOffset());
-            PrintField(field->getType(), field->getName());
+        for (uint32_t i = 0; i < merged.EntryPoints.size(); i++) {
+            merged.EntryPoints[i].BinaryIndices.push_back(binaryRemap[variant.EntryPoints[i].BinaryIndices[0]]);
         }
-        End("};\n");
-    }
-};
-
-static void PrintDiags(slang::IBlob* blob) {
-    if (blob != nullptr) {
-        fprintf(stderr, "%s\n", (const char*)blob->getBufferPointer());
     }
+    return true;
 }
 
-static bool CompileShader(
-    slang::IGlobalSession* globalSession, slang::ISession* session, 
-    const std::filesystem::path& sourceFile, const std::filesystem::path& outputFile, const std::filesystem::path& baseDir,
-    TypeGraph* typeGraph
-) {
-    // Parsing
-    Slang::ComPtr<slang::IBlob> diagnostics;
-    slang::IModule* module = session->loadModule((char*)sourceFile.u8string().data(), diagnostics.writeRef());
-
-    PrintDiags(diagnostics);
-    if (!module) return false;
-
-    // Compositing
-    std::vector<slang::IComponentType*> components = { module };
-    std::vector<Slang::ComPtr<slang::IEntryPoint>> entryPoints;
-
-    for (int32_t i = 0; i < module->getDefinedEntryPointCount(); i++) {
-        module->getDefinedEntryPoint(i, entryPoints.emplace_back().writeRef());
-        components.push_back(entryPoints.back());
-    }
-    Slang::ComPtr<slang::IComponentType> program;
-    session->createCompositeComponentType(components.data(), (SlangInt)components.size(), program.writeRef(), diagnostics.writeRef());
-
-    PrintDiags(diagnostics);
-    if (!program) return false;
-
-    // Linking
-    Slang::ComPtr<slang::IComponentType> linkedProgram;
-    program->link(linkedProgram.writeRef(), diagnostics.writeRef());
-    PrintDiags(diagnostics);
-
-    // Reflect
-    slang::ProgramLayout* layout = linkedProgram->getLayout();
-    slang::TypeLayoutReflection* globalPushConstType = nullptr;
-    std::vector<slang::VariableLayoutReflection*> definedSpecConstants;
-
-    for (uint32_t j = 0; j < layout->getParameterCount(); j++) {
-        slang::VariableLayoutReflection* par = layout->getParameterByIndex(j);
-        if (std::string_view(par->getName()).starts_with("havk__")) continue;
+static std::vector<std::string> ParseDependencyList(const std::filesystem::path& sourcePath, std::string* cacheKey = nullptr,
+                                                    std::vector<std::string>* spirvSuffixes = nullptr) {
+    std::vector<std::string> result;
+    std::ifstream is(sourcePath);
 
-        if (par->getCategory() == slang::ParameterCategory::PushConstantBuffer) {
-            if (globalPushConstType != nullptr) {
-                fprintf(stderr, "error: Only either one push constant binding or uniform entry point parameters can be defined.\n");
-                return false;
-            }
-            globalPushConstType = par->getTypeLayout()->getElementTypeLayout();
-        } else if (par->getCategory() == slang::ParameterCategory::SpecializationConstant) {
-            definedSpecConstants.push_back(par);
+    for (std::string line; std::getline(is, line); ) {
+        if (line.starts_with("// DEP: ")) {
+            result.push_back(line.substr(strlen("// DEP: ")));
+        } else if (line.starts_with("// OUT: ")) {
+            if (spirvSuffixes != nullptr) spirvSuffixes->push_back(line.substr(strlen("// OUT: ")));
+        } else if (line.starts_with("// KEY: ")) {
+            if (cacheKey != nullptr) *cacheKey = line.substr(strlen("// KEY: "));
+        } else if (!line.starts_with("// ")) {
+            break;
         }
     }
+    return result;
+}
 
-    // Code gen
-    Slang::ComPtr<slang::IBlob> kernelBlob = nullptr;
-    if (module->getDefinedEntryPointCount() > 0) {
-        linkedProgram->getTargetCode(0, kernelBlob.writeRef(), diagnostics.writeRef());
-
-        PrintDiags(diagnostics);
-        if (!kernelBlob) return false;
-    }
-
-    std::string relativeSourcePath = std::filesystem::relative(sourceFile, baseDir).string();
-    std::replace(relativeSourcePath.begin(), relativeSourcePath.end(), '\\', '/');
+static void WriteShaderOutputs(const std::filesystem::path& outputFile, const ShaderOutputs& outputs, std::string_view cacheKey) {
     std::filesystem::path outputFileMut = outputFile;
+    std::string header = "// This file has been auto generated. Any changes will be lost on next rebuild.\n";
 
-    // Populate type graph so we can query which modules/namespace decls are in.
-    // Slang unfortunately does not provide a way to query that info from from types.
-    for (uint32_t i = 0; i < module->getDependencyFileCount(); i++) {
-        std::string_view depPath = module->getDependencyFilePath(i);
-        if (depPath.ends_with("/Havk/Core.slang") || depPath.ends_with("\\Havk\\Core.slang")) continue;
-
-        slang::IModule* depModule = session->loadModule(depPath.data());
-        if (depModule == nullptr) continue;  // file is related to an #include
-
-        typeGraph->RegisterTypes(depModule, depModule->getModuleReflection());
-    }
-
-    // Find all types we define and depend on, in topological / post DFS order
-    std::vector<slang::TypeReflection*> sortedTypes;
-
-    for (auto& [type, info] : typeGraph->Entries) {
-        if (info.Module == module) {
-            typeGraph->GetOrderedDependencies(type, sortedTypes);
-        }
-    }
-    
-    for (uint32_t i = 0; i < layout->getEntryPointCount(); i++) {
-        slang::EntryPointReflection* entryReflect = layout->getEntryPointByIndex(i);
-        slang::VariableLayoutReflection* sigLayout = entryReflect->getVarLayout();
-
-        if (sigLayout->getCategory() == slang::ParameterCategory::PushConstantBuffer) {
-            auto pcLayout = sigLayout->getTypeLayout()->getElementTypeLayout();
-
-            for (uint32_t i = 0; i < pcLayout->getFieldCount(); i++) {
-                typeGraph->GetOrderedDependencies(pcLayout->getFieldByIndex(i)->getType(), sortedTypes);
-            }
-        }
+    for (auto& depPath : outputs.Dependencies) {
+        header += "// DEP: " + depPath + "\n";
     }
-    if (globalPushConstType != nullptr) {
-        typeGraph->GetOrderedDependencies(globalPushConstType->getType(), sortedTypes);
+    for (auto& bin : outputs.Spirv) {
+        header += "// OUT: " + bin.Suffix + "\n";
     }
-    
-    // Generate bridge code
-    // SPIR-V data is defined in a separate compilation unit to avoid triggering recompilation of dependent sources.
-    CodePrinter headerCode(typeGraph);
-    CodePrinter unitCode(typeGraph);
-
-    headerCode.Append("// This file has been auto generated. Any changes will be lost on next rebuild.\n");
-
-    for (int32_t i = 0; i < module->getDependencyFileCount(); i++) {
-        headerCode.AppendFmt("// DEP: %s\n", std::filesystem::canonical(module->getDependencyFilePath(i)).u8string().data());
+    if (!cacheKey.empty()) {
+        header += "// KEY: ";
+        header += cacheKey;
+        header += "\n";
     }
+    header += outputs.Header;
 
-    headerCode.Append("\n#pragma once\n");
-    headerCode.Append("#include <Havk/ShaderBridge.h>\n");
+    // Remove binaries that are no longer produced, e.g. after toggling `--whole-program`, so nothing loads stale code.
+    // Headers from older versions don't list outputs, but could have left a whole-program binary behind.
+    std::vector<std::string> prevSuffixes = { ".spv" };
+    ParseDependencyList(std::filesystem::path(outputFile).replace_extension(".h"), nullptr, &prevSuffixes);
 
-    unitCode.AppendFmt("#include \"%s\"\n", outputFileMut.replace_extension(".h").u8string().data());
-    
-    std::unordered_set<slang::IModule*> includedModules;
-
-    for (auto& type : sortedTypes) {
-        auto info = typeGraph->GetInfo(type);
-
-        if (info != nullptr && info->Module != module && includedModules.insert(info->Module).second) {
-            auto path = std::filesystem::relative(info->Module->getFilePath(), sourceFile.parent_path());
-            std::string relPath = path.replace_extension().string();
-            std::replace(relPath.begin(), relPath.end(), '\\', '/');
-            headerCode.AppendFmt("#include \"%s.h\"\n", relPath.data());
+    for (auto& suffix : prevSuffixes) {
+        auto isCurrent = [&](const SpirvBinary& bin) { return bin.Suffix == suffix; };
+        if (std::none_of(outputs.Spirv.begin(), outputs.Spirv.end(), isCurrent)) {
+            std::error_code ec;
+            std::filesystem::remove(std::filesystem::path(outputFile).replace_extension(suffix), ec);
         }
     }
 
-    // Generate types defined in this module
-    for (auto& type : sortedTypes) {
-        auto info = typeGraph->GetInfo(type);
-
-        if (info != nullptr && info->Module == module) {
-            headerCode.PrintTypeDef(type);
+    if (!outputs.Spirv.empty()) {
+        for (auto& bin : outputs.Spirv) {
+            UpdateFile(std::filesystem::path(outputFileMut).replace_extension(bin.Suffix), bin.Data.data(), bin.Data.size());
         }
+        UpdateFile(std::filesystem::path(outputFileMut).replace_extension(".reflect.json"), outputs.ReflectJson.data(), outputs.ReflectJson.size());
     }
-
-    if (module->getDefinedEntryPointCount() > 0) {
-        UpdateFile(outputFileMut.replace_extension(".spv"), kernelBlob->getBufferPointer(), kernelBlob->getBufferSize());
-        
-        Slang::ComPtr<slang::IBlob> reflectJson = nullptr;
-        layout->toJson(reflectJson.writeRef());
-        UpdateFile(std::filesystem::path(outputFileMut).replace_extension(".reflect.json"), reflectJson->getBufferPointer(), reflectJson->getBufferSize());
-
-#if 0
-        unitCode.Append("\n#if __clang__\n#pragma clang diagnostic ignored \"-Wc23-extensions\"\n#endif\n\n");
-        unitCode.Append("static const uint8_t g_ModuleSpirvCode[] = {\n");
-        unitCode.AppendFmt("    #embed \"%s\"", ChangeExtension(outputFile, ".spv").filename().string().data());
-#else
-        unitCode.Append("static const uint32_t g_ModuleSpirvCode[] = {");
-        auto spirvData = (const uint32_t*)kernelBlob->getBufferPointer();
-        uint32_t spirvWordCount = kernelBlob->getBufferSize() / 4;
-        for (uint32_t i = 0; i < spirvWordCount; i++) {
-            if (i % 8 == 0) unitCode.Append("\n    ");
-            unitCode.AppendFmt("0x%08X, ", spirvData[i]);
-        }
-#endif
-        unitCode.Append("\n};\n");
-        
-        // Header
-
-        for (uint32_t i = 0; i < layout->getEntryPointCount(); i++) {
-            slang::EntryPointReflection* entryReflect = layout->getEntryPointByIndex(i);
-            auto ns = typeGraph->ParentNamespaces.at(entryReflect->getFunction());
-
-            headerCode.SetNamespace(ns);
-            unitCode.SetNamespace(ns);
-
-            headerCode.Begin("struct %s {\n", entryReflect->getName());
-
-            slang::TypeLayoutReflection* pcLayout = globalPushConstType;
-            slang::VariableLayoutReflection* sigLayout = entryReflect->getVarLayout();
-            bool isImplicitPcStruct = false;
-            
-            if (sigLayout->getCategory() == slang::ParameterCategory::PushConstantBuffer) {
-                if (globalPushConstType != nullptr) {
-                    fprintf(stderr, "error: Only either one push constant binding or uniform entry point parameters can be defined.");
-                    return false;
-                }
-                pcLayout = sigLayout->getTypeLayout()->getElementTypeLayout();
-                isImplicitPcStruct = true;
-            }
-            if (isImplicitPcStruct) {
-                headerCode.PrintImplicitParamStruct(pcLayout);
-            } else if (pcLayout != nullptr) {
-                headerCode.AppendFmt("\tusing Params = %s;\n", pcLayout->getName());
-            } else {
-                headerCode.AppendFmt("\tusing Params = void;\n");
-            }
-
-            headerCode.AppendFmt("\tstatic const havk::ModuleDesc Module;\n");
-
-            unitCode.Begin("const havk::ModuleDesc %s::Module = {\n", entryReflect->getName());
-            unitCode.AppendFmt("\t.Code = g_ModuleSpirvCode,\n");
-            unitCode.AppendFmt("\t.CodeSize = sizeof(g_ModuleSpirvCode),\n");
-            unitCode.AppendFmt("\t.EntryPoint = \"%s\",\n", entryReflect->getName());
-            unitCode.AppendFmt("\t.SourcePath = \"%s\",\n", relativeSourcePath.data());
-            unitCode.End("};\n");
-
-            if (entryReflect->getStage() == SLANG_STAGE_COMPUTE || entryReflect->getStage() == SLANG_STAGE_MESH) {
-                SlangUInt numThreads[4] = {};
-                entryReflect->getComputeThreadGroupSize(3, numThreads);
-                entryReflect->getComputeWaveSize(&numThreads[3]);
-
-                headerCode.AppendFmt("\tstatic constexpr havk::vectors::uint3 GroupSize = { %d, %d, %d };\n", numThreads[0], numThreads[1], numThreads[2]);
-                if (numThreads[3] != 0) {
-                    headerCode.AppendFmt("\tstatic constexpr uint32_t WaveSize = %d;\n", numThreads[3]);
-                }
-            }
-
-            // Generate spec constants
-            std::vector<slang::VariableLayoutReflection*> usedSpecConstants;
-
-            if (definedSpecConstants.size() > 0) {
-                Slang::ComPtr<slang::IMetadata> metadata;
-                linkedProgram->getEntryPointMetadata(i, 0, metadata.writeRef());
-
-                for (auto* par : definedSpecConstants) {
-                    bool isUsed;
-                    metadata->isParameterLocationUsed((SlangParameterCategory)par->getCategory(),
-                                                      par->getBindingSpace(), par->getBindingIndex(), isUsed);
-                    if (isUsed) usedSpecConstants.push_back(par);
-                }
-            }
-
-            if (usedSpecConstants.size() == 0) {
-                headerCode.AppendFmt("\tusing SpecConst = void;\n");
-            } else {
-                headerCode.Begin("struct SpecConst {\n");
-                for (auto* par : usedSpecConstants) {
-                    headerCode.AppendFmt("\thavk::SpecOpt<");
-                    headerCode.PrintTypeRef(par->getType());
-                    headerCode.AppendFmt("> %s;\n", par->getName());
-                }
-                headerCode.Append("\n");
-
-                headerCode.Begin("operator havk::SpecConstMap() const {\n");
-                headerCode.AppendFmt("\thavk::SpecConstMap map;\n");
-                for (auto* par : usedSpecConstants) {
-                    const char* name = par->getName();
-                    headerCode.AppendFmt("\tif (%s.present) map.Add(%d, %s.value);\n", name, par->getBindingIndex(), name);
-                }
-                headerCode.AppendFmt("\treturn map;\n");
-                headerCode.End("}\n");
-
-                headerCode.End("};\n");
-            }
-
-            headerCode.End("};\n");
-        }
-    }
-    headerCode.SetNamespace("");
-    unitCode.SetNamespace("");
-
-    UpdateFile(outputFileMut.replace_extension(".h"), headerCode.Buffer.data(), headerCode.Buffer.size());
-    UpdateFile(outputFileMut.replace_extension(".cpp"), unitCode.Buffer.data(), unitCode.Buffer.size());
-    
-    return true;
+    UpdateFile(outputFileMut.replace_extension(".h"), header.data(), header.size());
+    UpdateFile(outputFileMut.replace_extension(".cpp"), outputs.Unit.data(), outputs.Unit.size());
 }
 
-static std::vector<std::string> ParseDependencyList(const std::filesystem::path& sourcePath) {
-    std::vector<std::string> result;
-    std::ifstream is(sourcePath);
-
-    for (std::string line; std::getline(is, line); ) {
-        if (line.starts_with("// DEP: ")) {
-            result.push_back(line.substr(strlen("// DEP: ")));
-        } else if (!line.starts_with("// ")) {
-            break;
+// Writes recompiled binaries to stdout as a message for ReloadWatcher, so it doesn't need to read them back from disk.
+// Format: "@reload <payloadSize> <sourcePath>\n" followed by payload:
+//   u32 entryCount, then for each entry: [u32 nameLen][name][u64 spirvHash][u32 spirvSize][spirv]
+// Hash is FNV-1a 64 over the SPIR-V bytes.
+static void WriteReloadFrame(const std::filesystem::path& sourceFile, const ShaderOutputs& outputs) {
+    std::string payload;
+    auto AppendU32 = [&](uint32_t value) { payload.append((char*)&value, sizeof(value)); };
+
+    uint32_t entryCount = 0;
+    for (auto& bin : outputs.Spirv) entryCount += bin.EntryPoints.size();
+    AppendU32(entryCount);
+
+    for (auto& bin : outputs.Spirv) {
+        ContentHasher hasher;
+        hasher.Add(bin.Data.data(), bin.Data.size());
+
+        for (auto& name : bin.EntryPoints) {
+            AppendU32((uint32_t)name.size());
+            payload.append(name);
+            payload.append((char*)&hasher.State, sizeof(hasher.State));
+            AppendU32((uint32_t)bin.Data.size());
+            payload.append((char*)bin.Data.data(), bin.Data.size());
         }
     }
-    return result;
+    printf("@reload %zu %s\n", payload.size(), (char*)sourceFile.u8string().data());
+    fwrite(payload.data(), 1, payload.size(), stdout);
+    fflush(stdout);
 }
 
 int main(int argc, const char** args) {
@@ -627,18 +179,15 @@ int main(int argc, const char** args) {
 
     std::filesystem::path baseDir = std::filesystem::current_path();
     std::filesystem::path outputDir = baseDir;
-    std::string baseNamespace = "";
-    int optLevel = SLANG_OPTIMIZATION_LEVEL_NONE;
-    int debugLevel = SLANG_DEBUG_INFO_LEVEL_NONE;
-    SlangMatrixLayoutMode matrixLayout = SLANG_MATRIX_LAYOUT_COLUMN_MAJOR;
+    std::filesystem::path cacheDir = "";
     bool skipUnchanged = false;
     bool watchChanges = false;
+    bool reloadFrames = false;
     bool verbose = false;
+    SessionOptions opts;
+    uint32_t numJobs = std::max(std::thread::hardware_concurrency(), 1u);
 
-    std::vector<const char*> includeDirs;
-    std::vector<slang::PreprocessorMacroDesc> prepDefs;
     std::vector<std::unique_ptr<char[]>> prefNameDefs;
-    std::vector<slang::CompilerOptionEntry> options;
 
     int argi = 1;
     while (argi < argc) {
@@ -651,31 +200,46 @@ int main(int argc, const char** args) {
         else if (arg == "--base-dir") {
             baseDir = args[argi++];
         }
+        else if (arg == "--cache-dir") {
+            cacheDir = args[argi++];
+        }
         else if (arg == "--base-ns") {
-            baseNamespace = args[argi++];
+            opts.BaseNamespace = args[argi++];
         }
         else if (arg.starts_with("-I")) {
-            includeDirs.push_back(arg.substr(2).data());
+            opts.IncludeDirs.push_back(arg.substr(2).data());
         }
         else if (arg.starts_with("-D")) {
             size_t valPos = arg.find('=');
 
             if (valPos == std::string::npos) {
-                prepDefs.push_back({ .name = &arg[2], .value = "" });
+                opts.Macros.push_back({ .name = &arg[2], .value = "" });
             } else {
                 char* name = prefNameDefs.emplace_back(new char[valPos - 2 + 1]).get();  // must malloc for stable address
                 strncpy(name, &arg[2], valPos - 2);
-                prepDefs.push_back({ .name = name, .value = &arg[valPos + 1] });
+                opts.Macros.push_back({ .name = name, .value = &arg[valPos + 1] });
             }
         }
         else if (arg.starts_with("-O")) {
-            optLevel = std::clamp(arg[2] - '0', 0, 3);
+            opts.OptLevel = std::clamp(arg[2] - '0', 0, 3);
         }
         else if (arg.starts_with("-g")) {
-            debugLevel = std::clamp(arg[2] - '0', 0, 3);
+            opts.DebugLevel = std::clamp(arg[2] - '0', 0, 3);
+        }
+        else if (arg.starts_with("-j")) {
+            numJobs = (uint32_t)std::clamp(atoi(&arg[2]), 1, 256);
         }
         else if (arg == "--row-major") {
-            matrixLayout = SLANG_MATRIX_LAYOUT_ROW_MAJOR;
+            opts.MatrixLayout = SLANG_MATRIX_LAYOUT_ROW_MAJOR;
+        }
+        else if (arg == "--whole-program") {
+            opts.Codegen.WholeProgram = true;
+        }
+        else if (arg == "--embed-spirv") {
+            opts.Codegen.EmbedSpirv = true;
+        }
+        else if (arg == "--cpu-kernels") {
+            opts.Codegen.CpuKernels = true;
         }
         else if (arg == "--skip-unchanged") {
             skipUnchanged = true;
@@ -683,6 +247,9 @@ int main(int argc, const char** args) {
         else if (arg == "--watch") {
             watchChanges = true;
         }
+        else if (arg == "--reload-frames") {
+            reloadFrames = true;
+        }
         else if (arg == "--verbose") {
             verbose = true;
         }
@@ -698,13 +265,19 @@ int main(int argc, const char** args) {
         printf("  --output-dir <path>       Output directory for compiled shaders and headers (required)\n");
         printf("  --base-dir <path>         Base directory for relative source files (defaults to cwd)\n");
         printf("  --base-ns <string>        Base namespace for generated header files\n");
+        printf("  --cache-dir <path>        Directory for persistent compilation cache (disabled if unset)\n");
         printf("  -I<path>                  Add preprocessor include search directory\n");
         printf("  -D<key>[=value]           Add preprocessor definition\n");
         printf("  -O<level=0..3>            Optimization level for spirv-opt.\n");
         printf("  -g<level=0..3>            Embed debug info in compiled binaries.\n");
+        printf("  -j<count>                 Number of sources to compile in parallel (defaults to number of cores).\n");
         printf("  --row-major               Set default matrix ordering to row-major.\n");
-        printf("  --skip-unchanged          Skip compilation of unchanged sources (comparing by binary timestamp)\n");
+        printf("  --whole-program           Emit a single SPIR-V module with all entry points, instead of one per entry point.\n");
+        printf("  --embed-spirv             Embed SPIR-V binaries using #embed instead of hex arrays (requires C23 #embed support).\n");
+        printf("  --cpu-kernels             Also emit compute entry points as C++ for havx::CpuDispatcher (requires Slang prelude headers).\n");
+        printf("  --skip-unchanged          Skip compilation of unchanged sources (by binary timestamp, implied by --cache-dir)\n");
         printf("  --watch                   Watch for changes in source directories and print paths to stdout.\n");
+        printf("  --reload-frames           In watch mode, write recompiled SPIR-V to stdout as binary messages for ReloadWatcher.\n");
         printf("  --verbose                 Print extra debug information.\n");
         return 1;
     }
@@ -712,34 +285,18 @@ int main(int argc, const char** args) {
     Slang::ComPtr<slang::IGlobalSession> globalSession;
     slang::createGlobalSession(globalSession.writeRef());
 
-    options.push_back({ slang::CompilerOptionName::ForceCLayout, { .intValue0 = 1 } });
-    options.push_back({ slang::CompilerOptionName::VulkanUseEntryPointName, { .intValue0 = 1 } });
-    options.push_back({ slang::CompilerOptionName::Optimization, { .intValue0 = optLevel } });
-    options.push_back({ slang::CompilerOptionName::DebugInformation, { .intValue0 = debugLevel } });
-    options.push_back({ slang::CompilerOptionName::Capability, { .intValue0 = globalSession->findCapability("vk_mem_model") } });
-
-    slang::TargetDesc targetDesc = {
-        .format = SLANG_SPIRV,
-        .profile = globalSession->findProfile("spirv_1_6"),
-        .flags = SLANG_TARGET_FLAG_GENERATE_SPIRV_DIRECTLY | SLANG_TARGET_FLAG_GENERATE_WHOLE_PROGRAM,
-        .compilerOptionEntries = options.data(),
-        .compilerOptionEntryCount = (uint32_t)options.size(),
-    };
-    slang::SessionDesc sessionDesc = {
-        .targets = &targetDesc,
-        .targetCount = 1,
-        .defaultMatrixLayoutMode = matrixLayout,
-        .searchPaths = includeDirs.data(),
-        .searchPathCount = (uint32_t)includeDirs.size(),
-        .preprocessorMacros = prepDefs.data(),
-        .preprocessorMacroCount = (uint32_t)prepDefs.size(),
-        .compilerOptionEntries = options.data(),
-        .compilerOptionEntryCount = (uint32_t)options.size(),
-    };
+    slang::SessionDesc sessionDesc = opts.CreateSessionDesc(globalSession);
+
+    std::unique_ptr<CompileCache> cache;
+    std::unique_ptr<ModuleCache> moduleCache;
+
+    if (!cacheDir.empty()) {
+        opts.CreateCaches(globalSession, cacheDir, baseDir, nullptr, cache, moduleCache);
+    }
 
-    bool hasError = false;
+    std::atomic<bool> hasError = false;
 
-    auto CompileSource = [&](std::filesystem::path sourceFile, slang::ISession* session, TypeGraph& typeGraph) {
+    auto ResolveSource = [&](std::filesystem::path& sourceFile, std::filesystem::path& outputFile) {
         if (!sourceFile.is_absolute()) {
             sourceFile = baseDir / sourceFile;
         } else if (!IsSubpath(sourceFile, baseDir)) {
@@ -752,55 +309,226 @@ int main(int argc, const char** args) {
             hasError = true;
             return false;
         }
-        std::filesystem::path outputFile = outputDir / std::filesystem::relative(sourceFile, baseDir);
+        outputFile = outputDir / std::filesystem::relative(sourceFile, baseDir);
         outputFile.replace_extension(".spv");
+        return true;
+    };
+    // Checks whether outputs are up to date, restoring them from the cache if possible.
+    // With the cache enabled, sources are compared by content and `--skip-unchanged` has no effect.
+    auto IsUpToDate = [&](const std::filesystem::path& sourceFile, const std::filesystem::path& outputFile) {
+        std::filesystem::path headerFile = outputFile;
+        headerFile.replace_extension(".h");
+
+        if (cache != nullptr) {
+            std::vector<std::string> relDeps;
+            std::string key = cache->Lookup(sourceFile, relDeps);
+            std::string currKey;
+            std::vector<std::string> spirvSuffixes;
+            ParseDependencyList(headerFile, &currKey, &spirvSuffixes);
+
+            if (key.empty()) return false;
+
+            // Other outputs may have been deleted or be left over from an interrupted build, restore them if so.
+            auto HasOutput = [&](std::string_view ext) {
+                return std::filesystem::exists(std::filesystem::path(outputFile).replace_extension(ext));
+            };
+            if (key == currKey && HasOutput(".cpp") && std::all_of(spirvSuffixes.begin(), spirvSuffixes.end(), HasOutput)) {
+                return true;
+            }
 
-        if (skipUnchanged && !watchChanges) {
-            std::error_code ec;
-            auto sourceTs = std::filesystem::last_write_time(sourceFile, ec);
-            auto binaryTs = sourceTs.min();
-
-            std::filesystem::path headerFile = outputFile;
-            headerFile.replace_extension(".h");
-            
-            if (std::filesystem::exists(headerFile)) {
-                binaryTs = std::filesystem::last_write_time(headerFile, ec);
-
-                for (auto& depPath : ParseDependencyList(headerFile)) {
-                    auto depTs = std::filesystem::last_write_time(depPath, ec);
-                    if (!ec && depTs > sourceTs) sourceTs = depTs;
-                }
+            ShaderOutputs outputs;
+            if (!cache->Load(key, relDeps, outputs)) return false;
+
+            WriteShaderOutputs(outputFile, outputs, key);
+            printf("Restored %s\n", std::filesystem::relative(sourceFile, baseDir).string().data());
+            return true;
+        }
+        if (!skipUnchanged) return false;
+
+        std::error_code ec;
+        auto sourceTs = std::filesystem::last_write_time(sourceFile, ec);
+        auto binaryTs = sourceTs.min();
+
+        if (std::filesystem::exists(headerFile)) {
+            binaryTs = std::filesystem::last_write_time(headerFile, ec);
+
+            for (auto& depPath : ParseDependencyList(headerFile)) {
+                auto depTs = std::filesystem::last_write_time(depPath, ec);
+                if (!ec && depTs > sourceTs) sourceTs = depTs;
             }
+        }
+        return sourceTs <= binaryTs;
+    };
+    // Global sessions are expensive to create, so the extra ones used for compiling permutations are kept around.
+    std::vector<Slang::ComPtr<slang::IGlobalSession>> spareGlobalSessions;
+    std::mutex spareGlobalSessionsMutex;
+
+    // Sources and their permutations are both compiled in parallel, so they share a budget of `numJobs` threads.
+    // Source workers hand their job back when they run out of sources, permutations only use what's left over.
+    std::atomic<int32_t> numIdleJobs = 0;
+
+    auto TryAcquireJob = [&]() {
+        int32_t count = numIdleJobs.load();
+        while (count > 0 && !numIdleJobs.compare_exchange_weak(count, count - 1)) {}
+        return count > 0;
+    };
 
-            if (sourceTs <= binaryTs) {
-                if (verbose) printf("Up to date: '%s'\n", sourceFile.string().data());
-                return true;
+    // Compiles every permutation of a source in parallel. Defines are fixed per session, so each variant gets a new one.
+    // Imported modules are compiled with the variant's defines as well, so they aren't loaded from the module cache.
+    auto CompileVariants = [&](const std::filesystem::path& sourceFile, slang::IGlobalSession* globalSession, const SourceDirectives& directives,
+                               std::vector<ShaderOutputs>& variants) {
+        std::atomic<uint32_t> nextVariantIndex = 0;
+        std::atomic<bool> failed = false;
+
+        auto RunWorker = [&](slang::IGlobalSession* workerGlobalSession) {
+            for (uint32_t v; !failed && (v = nextVariantIndex++) < variants.size();) {
+                std::vector<slang::PreprocessorMacroDesc> macros = opts.Macros;
+                uint32_t stride = 1;
+
+                for (auto& decl : directives.Permutations) {
+                    macros.push_back({ decl.Name.data(), decl.Values[(v / stride) % decl.Values.size()].data() });
+                    stride *= decl.Values.size();
+                }
+                slang::SessionDesc variantSessionDesc = sessionDesc;
+                variantSessionDesc.preprocessorMacros = macros.data();
+                variantSessionDesc.preprocessorMacroCount = (uint32_t)macros.size();
+
+                Slang::ComPtr<slang::ISession> session;
+                workerGlobalSession->createSession(variantSessionDesc, session.writeRef());
+                TypeGraph typeGraph = { .BaseNamespace = opts.BaseNamespace };
+
+                if (!CompileShader(workerGlobalSession, session, sourceFile, &typeGraph, opts.Codegen, directives, v, variants[v])) {
+                    fprintf(stderr, "error: failed to compile variant %d of '%s'\n", v, sourceFile.filename().string().data());
+                    failed = true;
+                }
             }
+        };
+        uint32_t numWorkers = 1;
+        while (numWorkers < variants.size() && TryAcquireJob()) numWorkers++;
+        std::vector<std::thread> workers;
+
+        for (uint32_t i = 1; i < numWorkers; i++) {
+            workers.emplace_back([&]() {
+                Slang::ComPtr<slang::IGlobalSession> workerGlobalSession;
+                {
+                    std::lock_guard lock(spareGlobalSessionsMutex);
+                    if (!spareGlobalSessions.empty()) {
+                        workerGlobalSession = spareGlobalSessions.back();
+                        spareGlobalSessions.pop_back();
+                    }
+                }
+                if (workerGlobalSession == nullptr) {
+                    slang::createGlobalSession(workerGlobalSession.writeRef());
+                }
+                RunWorker(workerGlobalSession.get());
+
+                std::lock_guard lock(spareGlobalSessionsMutex);
+                spareGlobalSessions.push_back(workerGlobalSession);
+            });
         }
+        RunWorker(globalSession);
 
+        for (auto& worker : workers) worker.join();
+        numIdleJobs += numWorkers - 1;
+        return !failed;
+    };
+    auto CompileSource = [&](const std::filesystem::path& sourceFile, const std::filesystem::path& outputFile,
+                             slang::IGlobalSession* globalSession, slang::ISession* session, TypeGraph& typeGraph,
+                             ShaderOutputs* outputsOut = nullptr) {
         printf("Building %s\n", std::filesystem::relative(sourceFile, baseDir).string().data());
-        if (!CompileShader(globalSession.get(), session, sourceFile, outputFile, baseDir, &typeGraph)) {
-            fprintf(stderr, "error: failed to compile shader '%s'\n", std::filesystem::path(sourceFile).filename().string().data());
-            return false;
+
+        SourceDirectives directives;
+        if (!ParseDirectives(sourceFile, directives)) return false;
+
+        ShaderOutputs outputs;
+
+        if (directives.Permutations.empty()) {
+            if (moduleCache != nullptr) {
+                moduleCache->Preload(session, sourceFile);
+            }
+            if (!CompileShader(globalSession, session, sourceFile, &typeGraph, opts.Codegen, directives, 0, outputs)) {
+                fprintf(stderr, "error: failed to compile shader '%s'\n", std::filesystem::path(sourceFile).filename().string().data());
+                return false;
+            }
+            if (moduleCache != nullptr) {
+                moduleCache->Save(session, sourceFile);
+            }
+        } else {
+            uint32_t numVariants = 1;
+            for (auto& decl : directives.Permutations) numVariants *= decl.Values.size();
+
+            std::vector<ShaderOutputs> variants(numVariants);
+            if (!CompileVariants(sourceFile, globalSession, directives, variants) || !MergeVariantOutputs(variants, sourceFile)) {
+                fprintf(stderr, "error: failed to compile shader '%s'\n", std::filesystem::path(sourceFile).filename().string().data());
+                return false;
+            }
+            outputs = std::move(variants[0]);
         }
+        std::string relativeSourcePath = std::filesystem::relative(sourceFile, baseDir).generic_string();
+        outputs.Unit = GenerateUnit(outputFile, relativeSourcePath, opts.Codegen, outputs, !directives.Permutations.empty());
+
+        std::string key = cache != nullptr ? cache->Store(sourceFile, outputs) : "";
+        WriteShaderOutputs(outputFile, outputs, key);
+
+        if (outputsOut != nullptr) *outputsOut = std::move(outputs);
         return true;
     };
 
     if (!watchChanges) {
-        Slang::ComPtr<slang::ISession> session;
-        globalSession->createSession(sessionDesc, session.writeRef());
-        TypeGraph typeGraph = { .BaseNamespace = baseNamespace };
+        std::vector<std::pair<std::filesystem::path, std::filesystem::path>> pendingSources;
 
         while (argi < argc) {
-            if (!CompileSource(args[argi++], session.get(), typeGraph)) {
-                hasError = true;
+            std::filesystem::path sourceFile = args[argi++], outputFile;
+            if (!ResolveSource(sourceFile, outputFile)) continue;
+
+            if (IsUpToDate(sourceFile, outputFile)) {
+                if (verbose) printf("Up to date: '%s'\n", sourceFile.string().data());
+                continue;
+            }
+            pendingSources.push_back({ sourceFile, outputFile });
+        }
+
+        // Slang sessions are not thread safe, so each worker needs its own global session.
+        // Generated files only depend on the source being compiled, so they are the same regardless of scheduling.
+        uint32_t numWorkers = std::min(numJobs, (uint32_t)pendingSources.size());
+        std::atomic<uint32_t> nextSourceIndex = 0;
+        numIdleJobs = (int32_t)(numJobs - numWorkers);
+
+        auto RunWorker = [&](slang::IGlobalSession* workerGlobalSession) {
+            Slang::ComPtr<slang::ISession> session;
+            workerGlobalSession->createSession(sessionDesc, session.writeRef());
+            TypeGraph typeGraph = { .BaseNamespace = opts.BaseNamespace };
+
+            for (uint32_t i; (i = nextSourceIndex++) < pendingSources.size();) {
+                auto& [sourceFile, outputFile] = pendingSources[i];
+                if (!CompileSource(sourceFile, outputFile, workerGlobalSession, session.get(), typeGraph)) {
+                    hasError = true;
+                }
             }
+            numIdleJobs++;
+        };
+        std::vector<std::thread> workers;
+
+        for (uint32_t i = 1; i < numWorkers; i++) {
+            workers.emplace_back([&]() {
+                Slang::ComPtr<slang::IGlobalSession> workerGlobalSession;
+                slang::createGlobalSession(workerGlobalSession.writeRef());
+                RunWorker(workerGlobalSession.get());
+            });
         }
+        if (numWorkers > 0) RunWorker(globalSession.get());
+
+        for (auto& worker : workers) worker.join();
     } else {
         printf("Watching for changes in '%s'...\n", baseDir.string().data());
 
-        // Create mapping of source -> dependent files
-        std::unordered_multimap<std::filesystem::path, std::filesystem::path> depMap;
+        #if _WIN32
+        // Frames contain raw binary data, which must not go through newline translation.
+        if (reloadFrames) _setmode(_fileno(stdout), _O_BINARY);
+        #endif
+
+        // Mapping of source -> canonical paths of itself and imported/included files
+        std::unordered_map<std::filesystem::path, std::vector<std::string>> sourceDeps;
 
         for (auto& entry : std::filesystem::recursive_directory_iterator(outputDir)) {
             if (!entry.is_regular_file() || entry.path().extension() != ".h") continue;
@@ -808,13 +536,21 @@ int main(int argc, const char** args) {
             auto deps = ParseDependencyList(entry.path());
             if (deps.empty()) continue;
 
-            depMap.insert({ deps[0], deps[0] }); // convenience: source maps to itself
-    
-            for (uint32_t i = 1; i < deps.size(); i++) {
-                depMap.insert({ deps[i], deps[0] });
-            }
+            std::filesystem::path sourceFile = deps[0];
+            sourceDeps[sourceFile] = std::move(deps);
         }
 
+        // Workers and their sessions are kept alive between changes, so that modules which have not been touched
+        // don't need to be parsed and checked again. Slang can't evict individual modules from a session,
+        // so sessions that loaded any of the changed files are discarded and recreated.
+        struct WatchWorker {
+            Slang::ComPtr<slang::IGlobalSession> GlobalSession;
+            Slang::ComPtr<slang::ISession> Session;
+            TypeGraph Types;
+        };
+        std::vector<WatchWorker> workers(numJobs);
+        workers[0].GlobalSession = globalSession;
+
         auto watcher = havx::FileWatcher(std::string_view((char*)baseDir.u8string().data()));
 
         while (true) {
@@ -824,23 +560,109 @@ int main(int argc, const char** args) {
             std::vector<std::string> changedFiles;
             watcher.PollChanges(changedFiles);
 
-            Slang::ComPtr<slang::ISession> session;
-            globalSession->createSession(sessionDesc, session.writeRef());
-            TypeGraph typeGraph = { .BaseNamespace = baseNamespace };
+            auto startTime = std::chrono::steady_clock::now();
+            std::unordered_set<std::string> changedPaths;
 
             for (std::string& path : changedFiles) {
-                auto iter = depMap.equal_range(std::filesystem::absolute(baseDir / std::filesystem::path((char8_t*)path.data())));
-
-                for (; iter.first != iter.second; iter.first++) {
-                    auto& sourceFile = iter.first->second;
-                    if (CompileSource(sourceFile, session.get(), typeGraph)) {
-                        std::filesystem::path outputFile = outputDir / std::filesystem::relative(sourceFile, baseDir);
-                        outputFile.replace_extension(".spv");
-                        printf("Recompiled %s -> %s\n", sourceFile.string().data(), (char*)outputFile.u8string().data());
+                auto fullPath = std::filesystem::weakly_canonical(baseDir / std::filesystem::path((char8_t*)path.data()));
+                changedPaths.insert((char*)fullPath.u8string().data());
+            }
+
+            std::vector<std::pair<std::filesystem::path, std::filesystem::path>> pendingSources;
+
+            for (auto& [sourceFile, deps] : sourceDeps) {
+                bool isAffected = std::any_of(deps.begin(), deps.end(), [&](const std::string& dep) { return changedPaths.contains(dep); });
+                if (!isAffected) continue;
+
+                std::filesystem::path resolvedSource = sourceFile, outputFile;
+                if (!ResolveSource(resolvedSource, outputFile)) continue;
+
+                pendingSources.push_back({ resolvedSource, outputFile });
+            }
+            if (pendingSources.empty()) continue;
+
+            std::vector<ShaderOutputs> pendingOutputs(pendingSources.size());
+            std::vector<uint8_t> compiledSources(pendingSources.size());
+            uint32_t numWorkers = std::min(numJobs, (uint32_t)pendingSources.size());
+            std::atomic<uint32_t> nextSourceIndex = 0;
+            numIdleJobs = (int32_t)(numJobs - numWorkers);
+
+            // Idle workers must be invalidated as well, otherwise they could pick up stale modules on later changes.
+            // Dependencies include the module's own file and everything it `#include`s or `__include`s.
+            auto IsModuleStale = [&](slang::IModule* module) {
+                for (int32_t i = 0; i < module->getDependencyFileCount(); i++) {
+                    const char* path = module->getDependencyFilePath(i);
+                    if (path == nullptr || path[0] == '\0') continue;
+
+                    if (changedPaths.contains((char*)std::filesystem::weakly_canonical(path).u8string().data())) return true;
+                }
+                return false;
+            };
+            for (auto& worker : workers) {
+                if (worker.Session == nullptr) continue;
+
+                for (SlangInt i = 0; i < worker.Session->getLoadedModuleCount(); i++) {
+                    if (IsModuleStale(worker.Session->getLoadedModule(i))) {
+                        worker.Session = nullptr;
+                        break;
                     }
                 }
             }
+
+            auto RunWorker = [&](WatchWorker& worker) {
+                if (worker.GlobalSession == nullptr) {
+                    slang::createGlobalSession(worker.GlobalSession.writeRef());
+                }
+                if (worker.Session == nullptr) {
+                    worker.GlobalSession->createSession(sessionDesc, worker.Session.writeRef());
+                    worker.Types = { .BaseNamespace = opts.BaseNamespace };
+                }
+
+                for (uint32_t i; (i = nextSourceIndex++) < pendingSources.size();) {
+                    auto& [sourceFile, outputFile] = pendingSources[i];
+
+                    if (CompileSource(sourceFile, outputFile, worker.GlobalSession.get(), worker.Session.get(), worker.Types, &pendingOutputs[i])) {
+                        compiledSources[i] = true;
+                    } else {
+                        // Failed compiles may leave partially loaded modules behind.
+                        worker.Session = nullptr;
+                        worker.Types = { .BaseNamespace = opts.BaseNamespace };
+                        worker.GlobalSession->createSession(sessionDesc, worker.Session.writeRef());
+                    }
+                }
+                numIdleJobs++;
+            };
+            std::vector<std::thread> threads;
+
+            for (uint32_t i = 1; i < numWorkers; i++) {
+                threads.emplace_back([&, i]() { RunWorker(workers[i]); });
+            }
+            RunWorker(workers[0]);
+
+            for (auto& thread : threads) thread.join();
+
+            // Notifications are only written once all workers are done, so binary frames won't be interleaved with diagnostics.
+            for (size_t i = 0; i < pendingSources.size(); i++) {
+                if (!compiledSources[i]) continue;
+                auto& [sourceFile, outputFile] = pendingSources[i];
+                ShaderOutputs& outputs = pendingOutputs[i];
+
+                if (reloadFrames) {
+                    WriteReloadFrame(sourceFile, outputs);
+                } else {
+                    printf("Recompiled %s -> %s\n", sourceFile.string().data(), (char*)outputFile.u8string().data());
+                }
+                // Refresh dependency lists, since imports may have been added or removed.
+                if (!outputs.Dependencies.empty()) {
+                    std::filesystem::path depSourceFile = outputs.Dependencies[0];
+                    sourceDeps[depSourceFile] = std::move(outputs.Dependencies);
+                }
+            }
+            if (verbose) {
+                auto elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+                printf("Rebuilt %zu sources in %.1fms\n", pendingSources.size(), elapsedMs);
+            }
         }
     }
     return hasError ? 1 : 0;
-}
\ No newline at end of file
+}
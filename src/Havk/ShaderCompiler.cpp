@@ -0,0 +1,1453 @@
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+#include <slang.h>
+#include <slang-com-ptr.h>
+
+// Workaround for VulkanSDK inconsistency
+#if __has_include(<spirv-headers/spirv.hpp>)
+    #include <spirv-headers/spirv.hpp>
+#else
+    #include <spirv/unified1/spirv.hpp>
+#endif
+
+#include <Havx/SystemUtils.h>
+
+#include "ShaderCompiler.h"
+
+namespace havk::detail {
+
+bool IsFileContentEquals(const std::filesystem::path& path, const uint8_t* data, size_t length) {
+    auto fs = std::ifstream(path, std::ios::binary | std::ios::ate);
+    if (!fs.good() || (size_t)fs.tellg() != length) return false;
+
+    fs.seekg(0);
+    char buffer[4096];
+
+    for (size_t pos = 0; pos < length; pos += sizeof(buffer)) {
+        size_t chunkLen = std::min(sizeof(buffer), length - pos);
+        fs.read(buffer, chunkLen);
+
+        if (!fs.good() || memcmp(data + pos, buffer, chunkLen) != 0) return false;
+    }
+    return true;
+}
+
+bool WriteFileAtomic(const std::filesystem::path& path, std::string_view data) {
+    if (path.empty()) return false;
+
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+
+    auto tempPath = path;
+    tempPath += ".tmp" + std::to_string(std::random_device()());
+
+    if (!havx::WriteFileBytes((char*)tempPath.u8string().data(), data.data(), data.size(), true)) return false;
+
+    std::filesystem::rename(tempPath, path, ec);
+    if (!ec) return true;
+
+    std::filesystem::remove(tempPath, ec);
+    return false;
+}
+
+void ContentHasher::Add(const void* data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        State = (State ^ ((const uint8_t*)data)[i]) * 0x100000001b3ull;
+    }
+}
+
+void ContentHasher::Add(std::string_view str) {
+    uint64_t length = str.size();  // length prefix avoids ambiguity between consecutive strings
+    Add(&length, sizeof(length));
+    Add(str.data(), str.size());
+}
+
+bool ContentHasher::AddFile(const std::filesystem::path& path) {
+    std::ifstream is(path, std::ios::binary);
+    if (!is.good()) return false;
+
+    char buffer[4096];
+    while (is.read(buffer, sizeof(buffer)) || is.gcount() > 0) {
+        Add(buffer, (size_t)is.gcount());
+    }
+    return true;
+}
+
+std::string ContentHasher::GetHex() const {
+    char str[17];
+    snprintf(str, sizeof(str), "%016llx", (unsigned long long)State);
+    return str;
+}
+
+static bool IsBuiltinDescriptorHandle(slang::TypeReflection* type) {
+    const char* name = type->getName();
+    return strcmp(name, "ImageHandle") == 0 || strcmp(name, "SamplerHandle") == 0 || strcmp(name, "AccelStructHandle") == 0;
+}
+
+TypeGraph::TypeInfo* TypeGraph::GetInfo(slang::TypeReflection* type) {
+    auto iter = Entries.find(type);
+    return iter != Entries.end() ? &iter->second : nullptr;
+}
+
+void TypeGraph::RegisterTypes(slang::IModule* module, slang::DeclReflection* entity, const std::string& parentNs) {
+    std::string ns = parentNs;
+    if (ns.empty() && !BaseNamespace.empty()) {
+        ns = BaseNamespace;
+    }
+    if (entity->getKind() == slang::DeclReflection::Kind::Namespace) {
+        if (!ns.empty()) ns += "::";
+        ns += entity->getName();
+    }
+
+    for (uint32_t i = 0; i < entity->getChildrenCount(); i++) {
+        slang::DeclReflection* child = entity->getChild(i);
+
+        switch (child->getKind()) {
+            case slang::DeclReflection::Kind::Struct:
+            case slang::DeclReflection::Kind::Enum: {
+                Entries.insert({ child->getType(), { .Module = module, .Namespace = ns } });
+                break;
+            }
+            case slang::DeclReflection::Kind::Func: {
+                ParentNamespaces.insert({ child->asFunction(), ns });
+                break;
+            }
+            case slang::DeclReflection::Kind::Namespace: {
+                RegisterTypes(module, child, ns);
+                break;
+            }
+            default: break;
+        }
+    }
+}
+
+void TypeGraph::GetOrderedDependencies(slang::TypeReflection* type, std::vector<slang::TypeReflection*>& postOrder) {
+    if (std::find(postOrder.begin(), postOrder.end(), type) != postOrder.end()) return;
+
+    switch (type->getKind()) {
+        case slang::TypeReflection::Kind::Struct: {
+            for (uint32_t i = 0; i < type->getFieldCount(); i++) {
+                auto field = type->getFieldByIndex(i);
+                GetOrderedDependencies(field->getType(), postOrder);
+            }
+            postOrder.push_back(type);
+            break;
+        }
+        case slang::TypeReflection::Kind::Enum: {
+            postOrder.push_back(type);
+            break;
+        }
+        case slang::TypeReflection::Kind::Pointer: {
+            auto elemType = type->getGenericContainer()->getConcreteType(type->getGenericContainer()->getTypeParameter(0));
+            GetOrderedDependencies(elemType, postOrder);
+            break;
+        }
+        case slang::TypeReflection::Kind::Array:
+            GetOrderedDependencies(type->getElementType(), postOrder);
+            break;
+        case slang::TypeReflection::Kind::Scalar:
+        case slang::TypeReflection::Kind::Vector:
+        case slang::TypeReflection::Kind::Matrix:
+            return; // ignore primitive types
+        default: {
+            fprintf(stderr, "warn: Don't know how to process type '%s' kind=%d\n", type->getName(), type->getKind());
+            return;
+        }
+    }
+}
+
+struct CodePrinter {
+    TypeGraph* Types;
+    std::string Buffer;
+    int IndentLevel = 0;
+
+    std::string CurrentNamespace;
+
+    CodePrinter(TypeGraph* tg) : Types(tg) { }
+
+    void Indent() { Buffer.append(IndentLevel * 4, ' '); }
+
+    void Begin(const char* fmt, const char* arg1 = nullptr, const char* arg2 = nullptr) {
+        Indent();
+        AppendFmt(fmt, arg1, arg2);
+        IndentLevel++;
+    }
+    void End(const char* fmt, const char* arg1 = nullptr) {
+        IndentLevel--;
+        Indent();
+        AppendFmt(fmt, arg1);
+    }
+
+    void SetNamespace(std::string_view ns) {
+        if (ns.empty() && !CurrentNamespace.empty()) {
+            End("}; // namespace %s\n", CurrentNamespace.data());
+            CurrentNamespace = "";
+        } else if (!ns.empty() && CurrentNamespace != ns) {
+            Begin("namespace %s {\n", ns.data());
+            CurrentNamespace = ns;
+        }
+    }
+
+    void Append(std::string_view str) { Buffer.append(str); }
+    void AppendFmt(const char* fmt, ...) {
+        if (fmt[0] == '\t') {
+            Indent();
+            fmt++;
+        }
+        size_t currSize = Buffer.size();
+
+        while (true) {
+            size_t availSize = Buffer.capacity() - currSize;
+            Buffer.resize(currSize + availSize);
+    
+            va_list args;
+            va_start(args, fmt);
+            size_t appSize = vsnprintf(Buffer.data() + currSize, availSize, fmt, args);
+            va_end(args);
+    
+            if (appSize < availSize) {
+                Buffer.resize(currSize + appSize);
+                break;
+            }
+            Buffer.reserve(Buffer.capacity() * 2);
+        }
+    }
+    
+    void PrintTypeRef(slang::TypeReflection* type) {
+        const char* name = type->getName();
+        auto kind = type->getKind();
+
+        switch (type->getKind()) {
+            case slang::TypeReflection::Kind::Pointer: {
+                auto elemType = type->getGenericContainer()->getConcreteType(type->getGenericContainer()->getTypeParameter(0));
+                Append("havk::DevicePtr<");
+                PrintTypeRef(elemType);
+                Append(">");
+                break;
+            }
+            case slang::TypeReflection::Kind::Vector:
+            case slang::TypeReflection::Kind::Matrix: {
+                Append("havk::vectors::");
+                switch (type->getElementType()->getScalarType()) {
+                    case slang::TypeReflection::Int32: Append("int"); break;
+                    case slang::TypeReflection::UInt32: Append("uint"); break;
+                    case slang::TypeReflection::Float16: Append("float16_t"); break;
+                    case slang::TypeReflection::Float32: Append("float"); break;
+                    default: PrintTypeRef(type->getElementType());
+                }
+                if (kind == slang::TypeReflection::Kind::Vector){
+                    AppendFmt("%d", type->getColumnCount());
+                } else {
+                    AppendFmt("%dx%d", type->getRowCount(), type->getColumnCount());
+                }
+                break;
+            }
+            case slang::TypeReflection::Kind::Scalar: {
+                switch (type->getScalarType()) {
+                    case slang::TypeReflection::Int32: Append("int32_t"); break;
+                    case slang::TypeReflection::UInt32: Append("uint32_t"); break;
+                    case slang::TypeReflection::Float16: Append("havk::vectors::float16_t"); break;
+                    default: Append(name); break;
+                }
+                break;
+            }
+            case slang::TypeReflection::Kind::Struct: {
+                auto info = Types->GetInfo(type);
+                // If we don't have info about this type, it's probably a builtin
+                if (info == nullptr) {
+                    if (IsBuiltinDescriptorHandle(type)) {
+                        Append("havk::");
+                        Append(type->getName());
+                        break;
+                    }
+                    Slang::ComPtr<slang::IBlob> fullNameBlob;
+                    type->getFullName(fullNameBlob.writeRef());
+
+                    // "A.B.C" -> "A::B::"
+                    const char* str = (const char*)fullNameBlob->getBufferPointer();
+                    while (const char* end = strchr(str, '.')) {
+                        Append(std::string_view(str, end));
+                        Append("::");
+                        str = end + 1;
+                    }
+                } else if (!info->Namespace.empty()) {
+                    Append(info->Namespace);
+                    Append("::");
+                }
+                Append(name);
+                // TODO: should we care about generics?
+                break;
+            }
+            default:
+                Append(type->getName());
+                fprintf(stderr, "warn: Don't know how to emit ref to type '%s' kind=%d\n", type->getName(), type->getKind());
+                break;
+        }
+    }
+    
+    void PrintField(slang::TypeReflection* type, std::string_view name) {
+        auto kind = type->getKind();
+
+        if (type->isArray()) {
+            PrintTypeRef(type->unwrapArray());
+            AppendFmt(" %s", name.data());
+
+            do {
+                size_t size = type->getElementCount();
+                AppendFmt(size == 0 ? "[]" : "[%zu]", size);   
+                type = type->getElementType();
+            } while (type->isArray());
+
+            Append(";\n");
+        } else {
+            PrintTypeRef(type);
+            AppendFmt(" %s;\n", name.data());
+        }
+    }
+    void PrintTypeDef(slang::TypeReflection* type) {
+        if (auto info = Types->GetInfo(type)) {
+            SetNamespace(info->Namespace);
+        }
+
+        if (type->getKind() == slang::TypeReflection::Kind::Struct) {
+            Begin("struct %s {\n", type->getName());
+
+            for (uint32_t i = 0; i < type->getFieldCount(); i++) {
+                auto field = type->getFieldByIndex(i);
+
+                Indent();
+                PrintField(field->getType(), field->getName());
+            }
+            End("};\n");
+        } else if (type->getKind() == slang::TypeReflection::Kind::Enum) {
+            AppendFmt("\tenum class %s : ", type->getName());
+            PrintTypeRef(type->getElementType());
+            Append(" {\n");
+            IndentLevel++;
+
+            for (uint32_t i = 0; i < type->getFieldCount(); i++) {
+                auto field = type->getFieldByIndex(i);
+                int64_t value = 0;
+                field->getDefaultValueInt(&value);
+                AppendFmt("\t%s = %lld,\n", field->getName(), value);
+            }
+            End("};\n");
+        } else {
+            fprintf(stderr, "warn: Don't know how to emit decl for type '%s' kind=%d\n", type->getName(), type->getKind());
+        }
+    }
+    void PrintImplicitParamStruct(slang::TypeLayoutReflection* type) {
+        std::vector<slang::VariableLayoutReflection*> fields;
+        
+        for (uint32_t i = 0; i < type->getFieldCount(); i++) {
+            slang::VariableLayoutReflection* field = type->getFieldByIndex(i);
+            if (field->getCategory() == slang::ParameterCategory::Uniform) {
+                fields.push_back(field);
+            }
+        }
+        if (fields.size() == 1 && fields[0]->getType()->getKind() == slang::TypeReflection::Kind::Struct) {
+            AppendFmt("\tusing Params = ");
+            PrintTypeRef(fields[0]->getType());
+            Append(";\n");
+            return;
+        }
+        Begin("struct Params {\n");
+
+        for (auto field : fields) {
+            AppendFmt("\t/* %2d */ ", field->getOffset());
+            PrintField(field->getType(), field->getName());
+        }
+        End("};\n");
+    }
+};
+
+static void PrintDiags(slang::IBlob* blob) {
+    if (blob != nullptr) {
+        fprintf(stderr, "%s\n", (const char*)blob->getBufferPointer());
+    }
+}
+
+// Generates key struct mapping permutation values to an index in the `Variants` table.
+static void PrintVariantKey(CodePrinter& code, const std::vector<PermutationDecl>& permutations) {
+    uint32_t numVariants = 1;
+
+    code.Begin("struct Variant {\n");
+    for (auto& decl : permutations) {
+        code.AppendFmt("\tint %s = %s;\n", decl.Name.data(), decl.Values[0].data());
+    }
+    code.Append("\n");
+    code.Begin("uint32_t GetIndex() const {\n");
+    code.AppendFmt("\tuint32_t index = 0;\n");
+
+    for (auto& decl : permutations) {
+        code.Begin("switch (%s) {\n", decl.Name.data());
+        for (uint32_t i = 0; i < decl.Values.size(); i++) {
+            code.AppendFmt("\tcase %s: index += %u; break;\n", decl.Values[i].data(), i * numVariants);
+        }
+        code.AppendFmt("\tdefault: assert(!\"Undeclared permutation value\"); break;\n");
+        code.End("}\n");
+        numVariants *= decl.Values.size();
+    }
+    code.AppendFmt("\treturn index;\n");
+    code.End("}\n");
+    code.End("};\n");
+
+    code.AppendFmt("\tstatic const havk::ModuleDesc Variants[%u];\n", numVariants);
+    code.AppendFmt("\tstatic const havk::ModuleDesc& GetModule(const Variant& key) { return Variants[key.GetIndex()]; }\n");
+}
+// Generates table with all combinations of `// @tune` values for spec constants used by an entry point.
+static void PrintTuneCandidates(CodePrinter& code, const std::vector<PermutationDecl>& tuneParams,
+                                const std::vector<slang::VariableLayoutReflection*>& usedSpecConstants) {
+    std::vector<const PermutationDecl*> params;  // In field declaration order
+    uint32_t numCandidates = 1;
+
+    for (auto* par : usedSpecConstants) {
+        for (auto& decl : tuneParams) {
+            if (decl.Name != par->getName()) continue;
+            params.push_back(&decl);
+            numCandidates *= decl.Values.size();
+        }
+    }
+    if (params.empty()) return;
+
+    code.AppendFmt("\tstatic constexpr SpecConst TuneCandidates[%u] = {\n", numCandidates);
+    code.IndentLevel++;
+    for (uint32_t i = 0; i < numCandidates; i++) {
+        code.AppendFmt("\t{ ");
+        uint32_t stride = 1;
+
+        for (auto* decl : params) {
+            code.AppendFmt(".%s = %s, ", decl->Name.data(), decl->Values[(i / stride) % decl->Values.size()].data());
+            stride *= decl->Values.size();
+        }
+        code.Append("},\n");
+    }
+    code.End("};\n");
+}
+
+// Must match `DescriptorHeap::kMaxPushConstantSize`.
+static const uint32_t kMaxPushConstantSize = 256;
+
+bool SpillPushConstants(std::vector<uint8_t>& binary, const std::vector<std::string>& entryNames) {
+    std::vector<uint32_t> code(binary.size() / 4);
+    memcpy(code.data(), binary.data(), code.size() * 4);
+    if (code.size() < 5 || code[0] != spv::MagicNumber) return false;
+
+    uint32_t idBound = code[3];
+
+    auto ForEachInst = [&](auto&& fn) {
+        for (size_t pos = 5; pos < code.size();) {
+            uint32_t numWords = code[pos] >> 16;
+            if (numWords == 0 || pos + numWords > code.size()) return;
+            fn(pos, (spv::Op)(code[pos] & 0xFFFF), numWords);
+            pos += numWords;
+        }
+    };
+    auto Emit = [](std::vector<uint32_t>& dest, spv::Op op, std::initializer_list<uint32_t> operands) {
+        dest.push_back((uint32_t)(operands.size() + 1) << 16 | op);
+        dest.insert(dest.end(), operands.begin(), operands.end());
+    };
+    auto IsType = [](spv::Op op) { return op >= spv::OpTypeVoid && op <= spv::OpTypeForwardPointer; };
+
+    // Find push constant variables that need rewriting
+    std::unordered_set<uint32_t> pcVars, spilledVars, keptVars;
+    std::unordered_map<uint32_t, size_t> typeDefs;  // Result id -> instruction position
+    std::unordered_map<uint32_t, uint32_t> varTypes;
+    uint32_t intType = 0, zeroConst = 0;
+    bool hasPsbCapability = false;
+
+    ForEachInst([&](size_t pos, spv::Op op, uint32_t numWords) {
+        if (IsType(op)) typeDefs[code[pos + 1]] = pos;
+        if (op == spv::OpTypeInt && code[pos + 2] == 32 && intType == 0) intType = code[pos + 1];
+        if (op == spv::OpConstant && code[pos + 1] == intType && numWords == 4 && code[pos + 3] == 0) zeroConst = code[pos + 2];
+        if (op == spv::OpCapability && code[pos + 1] == spv::CapabilityPhysicalStorageBufferAddresses) hasPsbCapability = true;
+
+        if (op == spv::OpVariable && code[pos + 3] == spv::StorageClassPushConstant) {
+            pcVars.insert(code[pos + 2]);
+            varTypes[code[pos + 2]] = code[pos + 1];
+        }
+    });
+    ForEachInst([&](size_t pos, spv::Op op, uint32_t numWords) {
+        if (op != spv::OpEntryPoint) return;
+
+        const char* name = (const char*)&code[pos + 3];
+        size_t nameWords = strnlen(name, (numWords - 3) * 4) / 4 + 1;
+        bool isSpilled = std::find(entryNames.begin(), entryNames.end(), name) != entryNames.end();
+
+        for (size_t i = pos + 3 + nameWords; i < pos + numWords; i++) {
+            if (pcVars.contains(code[i])) (isSpilled ? spilledVars : keptVars).insert(code[i]);
+        }
+    });
+    if (spilledVars.empty()) return true;
+
+    for (uint32_t var : spilledVars) {
+        if (keptVars.contains(var)) {
+            fprintf(stderr, "error: push constant block is shared by entry points with and without spilled parameters.\n");
+            return false;
+        }
+    }
+
+    // New declarations are placed at the end of their respective sections.
+    std::vector<uint32_t> newAnnotations, newGlobals;
+    std::unordered_map<uint32_t, uint32_t> psbPtrTypes;  // PushConstant pointer type -> PhysicalStorageBuffer pointer type
+    std::unordered_map<uint32_t, uint32_t> memberPtrTypes;  // Spilled var -> PushConstant pointer to block pointer
+
+    auto GetPsbPointerType = [&](uint32_t pcPtrType) {
+        uint32_t& psbType = psbPtrTypes[pcPtrType];
+        if (psbType == 0) {
+            psbType = idBound++;
+            Emit(newGlobals, spv::OpTypePointer, { psbType, spv::StorageClassPhysicalStorageBuffer, code[typeDefs[pcPtrType] + 3] });
+        }
+        return psbType;
+    };
+    if (intType == 0) {
+        intType = idBound++;
+        Emit(newGlobals, spv::OpTypeInt, { intType, 32, 0 });
+    }
+    if (zeroConst == 0) {
+        zeroConst = idBound++;
+        Emit(newGlobals, spv::OpConstant, { intType, zeroConst, 0 });
+    }
+    for (uint32_t var : spilledVars) {
+        uint32_t blockPtrType = GetPsbPointerType(varTypes[var]);
+        uint32_t structType = idBound++, varPtrType = idBound++, memberPtrType = idBound++;
+
+        Emit(newAnnotations, spv::OpDecorate, { structType, spv::DecorationBlock });
+        Emit(newAnnotations, spv::OpMemberDecorate, { structType, 0, spv::DecorationOffset, 0 });
+        Emit(newGlobals, spv::OpTypeStruct, { structType, blockPtrType });
+        Emit(newGlobals, spv::OpTypePointer, { varPtrType, spv::StorageClassPushConstant, structType });
+        Emit(newGlobals, spv::OpTypePointer, { memberPtrType, spv::StorageClassPushConstant, blockPtrType });
+        Emit(newGlobals, spv::OpVariable, { varPtrType, var, spv::StorageClassPushConstant });
+        memberPtrTypes[var] = memberPtrType;
+    }
+
+    // Find pointers derived from spilled vars and which functions use them. Result ids are unique
+    // and definitions come before uses in the same function, so a single pass is enough.
+    std::unordered_set<uint32_t> derivedPtrs = spilledVars;
+    std::unordered_map<size_t, std::vector<uint32_t>> funcVars;  // OpFunction position -> spilled vars accessed
+    size_t currFuncPos = 0;
+    bool unsupportedUse = false;
+
+    ForEachInst([&](size_t pos, spv::Op op, uint32_t numWords) {
+        if (op == spv::OpFunction) currFuncPos = pos;
+
+        uint32_t base = 0;
+        if (op == spv::OpAccessChain || op == spv::OpInBoundsAccessChain || op == spv::OpLoad) {
+            base = code[pos + 3];
+        } else if (op == spv::OpFunctionCall || op == spv::OpCopyObject || op == spv::OpPhi || op == spv::OpSelect ||
+                   op == spv::OpStore || op == spv::OpCopyMemory || op == spv::OpPtrEqual || op == spv::OpPtrNotEqual) {
+            for (size_t i = pos + 1; i < pos + numWords; i++) unsupportedUse |= derivedPtrs.contains(code[i]);
+        }
+        if (!derivedPtrs.contains(base)) return;
+
+        if (spilledVars.contains(base)) {
+            auto& vars = funcVars[currFuncPos];
+            if (std::find(vars.begin(), vars.end(), base) == vars.end()) vars.push_back(base);
+        }
+        if (op != spv::OpLoad) {
+            derivedPtrs.insert(code[pos + 2]);
+            GetPsbPointerType(code[pos + 1]);
+        }
+    });
+    if (unsupportedUse) {
+        fprintf(stderr, "error: spilled parameters can only be accessed directly.\n");
+        return false;
+    }
+
+    // Push constant layouts only guarantee scalar alignment, so this is capped to 4 bytes.
+    std::function<uint32_t(uint32_t)> GetLoadAlignment = [&](uint32_t typeId) -> uint32_t {
+        auto def = typeDefs.find(typeId);
+        if (def == typeDefs.end()) return 4;
+        const uint32_t* inst = &code[def->second];
+
+        switch (inst[0] & 0xFFFF) {
+            case spv::OpTypeInt:
+            case spv::OpTypeFloat: return std::clamp(inst[2] / 8, 1u, 4u);
+            case spv::OpTypeVector:
+            case spv::OpTypeMatrix:
+            case spv::OpTypeArray: return GetLoadAlignment(inst[2]);
+            case spv::OpTypeStruct: {
+                uint32_t align = 4;
+                for (uint32_t i = 2; i < (inst[0] >> 16); i++) align = std::min(align, GetLoadAlignment(inst[i]));
+                return align;
+            }
+            default: return 4;
+        }
+    };
+
+    // Rewrite. Functions load block pointers at the start of their first block, after local variables.
+    std::vector<uint32_t> result(code.begin(), code.begin() + 5);
+    std::unordered_map<uint32_t, uint32_t> loadedPtrs;  // Spilled var -> block pointer loaded in current function
+    std::vector<uint32_t>* funcLoads = nullptr;     // Vars that need to be loaded by current function
+    std::vector<uint32_t>* pendingLoads = nullptr;  // Set after the first label, until the first non-variable instruction
+    bool emittedAnnotations = false, emittedGlobals = false;
+
+    ForEachInst([&](size_t pos, spv::Op op, uint32_t numWords) {
+        if (!emittedAnnotations && (IsType(op) || op == spv::OpFunction)) {
+            result.insert(result.end(), newAnnotations.begin(), newAnnotations.end());
+            emittedAnnotations = true;
+        }
+        if (!emittedGlobals && op == spv::OpFunction) {
+            result.insert(result.end(), newGlobals.begin(), newGlobals.end());
+            emittedGlobals = true;
+        }
+        if (op == spv::OpCapability && !hasPsbCapability) {
+            Emit(result, spv::OpCapability, { spv::CapabilityPhysicalStorageBufferAddresses });
+            hasPsbCapability = true;
+        }
+        if (pendingLoads != nullptr && op != spv::OpVariable && op != spv::OpLine && op != spv::OpNoLine) {
+            for (uint32_t var : *pendingLoads) {
+                uint32_t memberPtr = idBound++, blockPtr = idBound++;
+                Emit(result, spv::OpAccessChain, { memberPtrTypes[var], memberPtr, var, zeroConst });
+                Emit(result, spv::OpLoad, { psbPtrTypes[varTypes[var]], blockPtr, memberPtr });
+                loadedPtrs[var] = blockPtr;
+            }
+            pendingLoads = nullptr;
+        }
+
+        size_t start = result.size();
+        result.insert(result.end(), &code[pos], &code[pos + numWords]);
+
+        switch (op) {
+            case spv::OpMemoryModel: {
+                result[start + 1] = spv::AddressingModelPhysicalStorageBuffer64;
+                break;
+            }
+            case spv::OpVariable: {
+                if (spilledVars.contains(code[pos + 2])) result.resize(start);  // Re-declared with new type before functions
+                break;
+            }
+            case spv::OpFunction: {
+                auto vars = funcVars.find(pos);
+                funcLoads = vars != funcVars.end() ? &vars->second : nullptr;
+                loadedPtrs.clear();
+                break;
+            }
+            case spv::OpLabel: {
+                pendingLoads = std::exchange(funcLoads, nullptr);
+                break;
+            }
+            case spv::OpAccessChain:
+            case spv::OpInBoundsAccessChain: {
+                if (!derivedPtrs.contains(code[pos + 3])) break;
+
+                result[start + 1] = psbPtrTypes[code[pos + 1]];
+                if (loadedPtrs.contains(code[pos + 3])) result[start + 3] = loadedPtrs[code[pos + 3]];
+                break;
+            }
+            case spv::OpLoad: {
+                if (!derivedPtrs.contains(code[pos + 3])) break;
+                if (loadedPtrs.contains(code[pos + 3])) result[start + 3] = loadedPtrs[code[pos + 3]];
+
+                // Add `Aligned` memory operand, required for PSB loads. Its literal comes first since `Volatile` has none.
+                uint32_t align = GetLoadAlignment(code[pos + 1]);
+                if (numWords == 4) {
+                    result.insert(result.end(), { (uint32_t)spv::MemoryAccessAlignedMask, align });
+                } else if (!(result[start + 4] & spv::MemoryAccessAlignedMask)) {
+                    result[start + 4] |= spv::MemoryAccessAlignedMask;
+                    result.insert(result.begin() + (ptrdiff_t)start + 5, align);
+                }
+                result[start] = (uint32_t)(result.size() - start) << 16 | op;
+                break;
+            }
+            default: break;
+        }
+    });
+    result[3] = idBound;
+
+    binary.resize(result.size() * 4);
+    memcpy(binary.data(), result.data(), binary.size());
+    return true;
+}
+
+bool CompileShader(
+    slang::IGlobalSession* globalSession, slang::ISession* session,
+    const std::filesystem::path& sourceFile, TypeGraph* typeGraph, const CodegenOptions& codegenOpts,
+    const SourceDirectives& directives, uint32_t variantIndex, ShaderOutputs& outputs
+) {
+    // Parsing
+    Slang::ComPtr<slang::IBlob> diagnostics;
+    slang::IModule* module = session->loadModule((char*)sourceFile.u8string().data(), diagnostics.writeRef());
+
+    PrintDiags(diagnostics);
+    if (!module) return false;
+
+    // Compositing
+    std::vector<slang::IComponentType*> components = { module };
+    std::vector<Slang::ComPtr<slang::IEntryPoint>> entryPoints;
+
+    for (int32_t i = 0; i < module->getDefinedEntryPointCount(); i++) {
+        module->getDefinedEntryPoint(i, entryPoints.emplace_back().writeRef());
+        components.push_back(entryPoints.back());
+    }
+    Slang::ComPtr<slang::IComponentType> program;
+    session->createCompositeComponentType(components.data(), (SlangInt)components.size(), program.writeRef(), diagnostics.writeRef());
+
+    PrintDiags(diagnostics);
+    if (!program) return false;
+
+    // Linking
+    Slang::ComPtr<slang::IComponentType> linkedProgram;
+    program->link(linkedProgram.writeRef(), diagnostics.writeRef());
+    PrintDiags(diagnostics);
+
+    // Reflect
+    slang::ProgramLayout* layout = linkedProgram->getLayout();
+    slang::TypeLayoutReflection* globalPushConstType = nullptr;
+    std::vector<slang::VariableLayoutReflection*> definedSpecConstants;
+
+    for (uint32_t j = 0; j < layout->getParameterCount(); j++) {
+        slang::VariableLayoutReflection* par = layout->getParameterByIndex(j);
+        if (std::string_view(par->getName()).starts_with("havk__")) continue;
+
+        if (par->getCategory() == slang::ParameterCategory::PushConstantBuffer) {
+            if (globalPushConstType != nullptr) {
+                fprintf(stderr, "error: Only either one push constant binding or uniform entry point parameters can be defined.\n");
+                return false;
+            }
+            globalPushConstType = par->getTypeLayout()->getElementTypeLayout();
+        } else if (par->getCategory() == slang::ParameterCategory::SpecializationConstant) {
+            definedSpecConstants.push_back(par);
+        }
+    }
+    for (auto& decl : directives.TuneParams) {
+        auto isDecl = [&](slang::VariableLayoutReflection* par) { return decl.Name == par->getName(); };
+        if (std::find_if(definedSpecConstants.begin(), definedSpecConstants.end(), isDecl) == definedSpecConstants.end()) {
+            fprintf(stderr, "warning: tuned parameter '%s' is not a specialization constant.\n", decl.Name.data());
+        }
+    }
+
+    // Code gen
+    // By default, each entry point gets its own module so that drivers don't have to parse and discard unrelated code
+    // on every pipeline creation. Identical binaries are shared.
+    std::vector<uint32_t> entryBinaryIndices;
+
+    std::string variantSuffix = variantIndex != 0 ? "#" + std::to_string(variantIndex) : "";
+
+    // Parameters over the push constant limit are passed through scratch memory instead.
+    std::vector<std::string> spilledEntries;
+
+    for (uint32_t i = 0; i < layout->getEntryPointCount(); i++) {
+        slang::EntryPointReflection* entryReflect = layout->getEntryPointByIndex(i);
+        slang::VariableLayoutReflection* sigLayout = entryReflect->getVarLayout();
+        slang::TypeLayoutReflection* pcLayout = globalPushConstType;
+
+        if (sigLayout->getCategory() == slang::ParameterCategory::PushConstantBuffer) {
+            pcLayout = sigLayout->getTypeLayout()->getElementTypeLayout();
+        }
+        if (pcLayout != nullptr && pcLayout->getSize() > kMaxPushConstantSize) {
+            spilledEntries.push_back(entryReflect->getName());
+        }
+    }
+
+    for (uint32_t i = 0; i < layout->getEntryPointCount(); i++) {
+        const char* entryName = layout->getEntryPointByIndex(i)->getName();
+
+        if (codegenOpts.WholeProgram && i > 0) {
+            entryBinaryIndices.push_back(0);
+            outputs.Spirv[0].EntryPoints.push_back(entryName + variantSuffix);
+            continue;
+        }
+        Slang::ComPtr<slang::IBlob> kernelBlob = nullptr;
+        if (codegenOpts.WholeProgram) {
+            linkedProgram->getTargetCode(0, kernelBlob.writeRef(), diagnostics.writeRef());
+        } else {
+            linkedProgram->getEntryPointCode(i, 0, kernelBlob.writeRef(), diagnostics.writeRef());
+        }
+        PrintDiags(diagnostics);
+        if (!kernelBlob) return false;
+
+        auto kernelData = (const uint8_t*)kernelBlob->getBufferPointer();
+        auto kernelCode = std::vector<uint8_t>(kernelData, kernelData + kernelBlob->getBufferSize());
+
+        if (!spilledEntries.empty() && !SpillPushConstants(kernelCode, spilledEntries)) {
+            fprintf(stderr, "error: failed to spill parameters of entry point '%s'\n", entryName);
+            return false;
+        }
+        auto existing = std::find_if(outputs.Spirv.begin(), outputs.Spirv.end(), [&](const SpirvBinary& bin) { return bin.Data == kernelCode; });
+        entryBinaryIndices.push_back((uint32_t)(existing - outputs.Spirv.begin()));
+
+        if (existing == outputs.Spirv.end()) {
+            std::string suffix = codegenOpts.WholeProgram ? "" : std::string(".") + entryName;
+            if (variantIndex != 0) suffix += ".v" + std::to_string(variantIndex);
+            existing = outputs.Spirv.insert(existing, { .Suffix = suffix + ".spv", .Data = std::move(kernelCode) });
+        }
+        existing->EntryPoints.push_back(entryName + variantSuffix);
+    }
+
+    // CPU kernels
+    // Each entry point gets a full copy of the generated C++, which is wrapped in a separate namespace by `GenerateUnit()`.
+    std::vector<std::string> cpuKernelCode(layout->getEntryPointCount());
+
+    if (codegenOpts.CpuKernels && (!directives.Permutations.empty() || globalPushConstType != nullptr)) {
+        fprintf(stderr, "warning: CPU kernels are not supported with permutations or global push constants, skipping '%s'.\n",
+                sourceFile.filename().string().data());
+    } else if (codegenOpts.CpuKernels) {
+        globalSession->setLanguagePrelude(SLANG_SOURCE_LANGUAGE_CPP, "");  // Included by the unit instead
+
+        for (uint32_t i = 0; i < layout->getEntryPointCount(); i++) {
+            if (layout->getEntryPointByIndex(i)->getStage() != SLANG_STAGE_COMPUTE) continue;
+
+            Slang::ComPtr<slang::IBlob> codeBlob = nullptr;
+            linkedProgram->getEntryPointCode(i, 1, codeBlob.writeRef(), diagnostics.writeRef());
+            PrintDiags(diagnostics);
+            if (!codeBlob) return false;
+
+            cpuKernelCode[i].assign((const char*)codeBlob->getBufferPointer(), codeBlob->getBufferSize());
+        }
+    }
+
+    // Populate type graph so we can query which modules/namespace decls are in.
+    // Slang unfortunately does not provide a way to query that info from from types.
+    for (uint32_t i = 0; i < module->getDependencyFileCount(); i++) {
+        std::string_view depPath = module->getDependencyFilePath(i);
+        if (depPath.ends_with("/Havk/Core.slang") || depPath.ends_with("\\Havk\\Core.slang")) continue;
+
+        slang::IModule* depModule = session->loadModule(depPath.data());
+        if (depModule == nullptr) continue;  // file is related to an #include
+
+        typeGraph->RegisterTypes(depModule, depModule->getModuleReflection());
+    }
+
+    // Find all types we define and depend on, in topological / post DFS order
+    // Roots are sorted by name so that output doesn't depend on map iteration order (pointer keys).
+    std::vector<std::pair<std::string, slang::TypeReflection*>> ownTypes;
+    std::vector<slang::TypeReflection*> sortedTypes;
+
+    for (auto& [type, info] : typeGraph->Entries) {
+        if (info.Module == module) {
+            ownTypes.push_back({ info.Namespace + "::" + type->getName(), type });
+        }
+    }
+    std::sort(ownTypes.begin(), ownTypes.end());
+
+    for (auto& [name, type] : ownTypes) {
+        typeGraph->GetOrderedDependencies(type, sortedTypes);
+    }
+    
+    for (uint32_t i = 0; i < layout->getEntryPointCount(); i++) {
+        slang::EntryPointReflection* entryReflect = layout->getEntryPointByIndex(i);
+        slang::VariableLayoutReflection* sigLayout = entryReflect->getVarLayout();
+
+        if (sigLayout->getCategory() == slang::ParameterCategory::PushConstantBuffer) {
+            auto pcLayout = sigLayout->getTypeLayout()->getElementTypeLayout();
+
+            for (uint32_t i = 0; i < pcLayout->getFieldCount(); i++) {
+                typeGraph->GetOrderedDependencies(pcLayout->getFieldByIndex(i)->getType(), sortedTypes);
+            }
+        }
+    }
+    if (globalPushConstType != nullptr) {
+        typeGraph->GetOrderedDependencies(globalPushConstType->getType(), sortedTypes);
+    }
+    
+    // Generate bridge code
+    // SPIR-V data is defined in a separate compilation unit to avoid triggering recompilation of dependent sources.
+    CodePrinter headerCode(typeGraph);
+
+    for (int32_t i = 0; i < module->getDependencyFileCount(); i++) {
+        outputs.Dependencies.push_back((char*)std::filesystem::canonical(module->getDependencyFilePath(i)).u8string().data());
+    }
+
+    headerCode.Append("\n#pragma once\n");
+    headerCode.Append("#include <Havk/ShaderBridge.h>\n");
+
+    std::unordered_set<slang::IModule*> includedModules;
+
+    for (auto& type : sortedTypes) {
+        auto info = typeGraph->GetInfo(type);
+
+        if (info != nullptr && info->Module != module && includedModules.insert(info->Module).second) {
+            auto path = std::filesystem::relative(info->Module->getFilePath(), sourceFile.parent_path());
+            std::string relPath = path.replace_extension().string();
+            std::replace(relPath.begin(), relPath.end(), '\\', '/');
+            headerCode.AppendFmt("#include \"%s.h\"\n", relPath.data());
+        }
+    }
+
+    // Generate types defined in this module
+    for (auto& type : sortedTypes) {
+        auto info = typeGraph->GetInfo(type);
+
+        if (info != nullptr && info->Module == module) {
+            headerCode.PrintTypeDef(type);
+        }
+    }
+
+    if (module->getDefinedEntryPointCount() > 0) {
+        Slang::ComPtr<slang::IBlob> reflectJson = nullptr;
+        layout->toJson(reflectJson.writeRef());
+        auto reflectData = (const uint8_t*)reflectJson->getBufferPointer();
+        outputs.ReflectJson.assign(reflectData, reflectData + reflectJson->getBufferSize());
+
+        // Header
+
+        for (uint32_t i = 0; i < layout->getEntryPointCount(); i++) {
+            slang::EntryPointReflection* entryReflect = layout->getEntryPointByIndex(i);
+            auto ns = typeGraph->ParentNamespaces.at(entryReflect->getFunction());
+
+            headerCode.SetNamespace(ns);
+            auto& entryInfo = outputs.EntryPoints.emplace_back(
+                EntryPointInfo { .Name = entryReflect->getName(), .Namespace = ns, .BinaryIndices = { entryBinaryIndices[i] } });
+            entryInfo.CpuCode = std::move(cpuKernelCode[i]);
+
+            headerCode.Begin("struct %s {\n", entryReflect->getName());
+
+            slang::TypeLayoutReflection* pcLayout = globalPushConstType;
+            slang::VariableLayoutReflection* sigLayout = entryReflect->getVarLayout();
+            bool isImplicitPcStruct = false;
+            
+            if (sigLayout->getCategory() == slang::ParameterCategory::PushConstantBuffer) {
+                if (globalPushConstType != nullptr) {
+                    fprintf(stderr, "error: Only either one push constant binding or uniform entry point parameters can be defined.");
+                    return false;
+                }
+                pcLayout = sigLayout->getTypeLayout()->getElementTypeLayout();
+                isImplicitPcStruct = true;
+            }
+            if (isImplicitPcStruct) {
+                headerCode.PrintImplicitParamStruct(pcLayout);
+            } else if (pcLayout != nullptr) {
+                headerCode.AppendFmt("\tusing Params = %s;\n", pcLayout->getName());
+            } else {
+                headerCode.AppendFmt("\tusing Params = void;\n");
+            }
+
+            headerCode.AppendFmt("\tstatic const havk::ModuleDesc Module;\n");
+            if (!entryInfo.CpuCode.empty()) {
+                headerCode.AppendFmt("\tstatic const havk::CpuKernel CpuKernel;\n");
+            }
+
+            if (!directives.Permutations.empty()) {
+                PrintVariantKey(headerCode, directives.Permutations);
+            }
+
+            if (entryReflect->getStage() == SLANG_STAGE_COMPUTE || entryReflect->getStage() == SLANG_STAGE_MESH) {
+                SlangUInt numThreads[4] = {};
+                entryReflect->getComputeThreadGroupSize(3, numThreads);
+                entryReflect->getComputeWaveSize(&numThreads[3]);
+
+                headerCode.AppendFmt("\tstatic constexpr havk::vectors::uint3 GroupSize = { %d, %d, %d };\n", numThreads[0], numThreads[1], numThreads[2]);
+                if (numThreads[3] != 0) {
+                    headerCode.AppendFmt("\tstatic constexpr uint32_t WaveSize = %d;\n", numThreads[3]);
+
+                    // Full subgroups can only be guaranteed when rows map evenly to subgroups.
+                    entryInfo.WaveSize = (uint32_t)numThreads[3];
+                    entryInfo.RequireFullSubgroups = numThreads[0] % numThreads[3] == 0;
+                }
+            }
+
+            // Generate spec constants
+            std::vector<slang::VariableLayoutReflection*> usedSpecConstants;
+
+            if (definedSpecConstants.size() > 0) {
+                Slang::ComPtr<slang::IMetadata> metadata;
+                linkedProgram->getEntryPointMetadata(i, 0, metadata.writeRef());
+
+                for (auto* par : definedSpecConstants) {
+                    bool isUsed;
+                    metadata->isParameterLocationUsed((SlangParameterCategory)par->getCategory(),
+                                                      par->getBindingSpace(), par->getBindingIndex(), isUsed);
+                    if (isUsed) usedSpecConstants.push_back(par);
+                }
+            }
+
+            if (usedSpecConstants.size() == 0) {
+                headerCode.AppendFmt("\tusing SpecConst = void;\n");
+            } else {
+                headerCode.Begin("struct SpecConst {\n");
+                for (auto* par : usedSpecConstants) {
+                    headerCode.AppendFmt("\thavk::SpecOpt<");
+                    headerCode.PrintTypeRef(par->getType());
+                    headerCode.AppendFmt("> %s;\n", par->getName());
+                }
+                headerCode.Append("\n");
+
+                headerCode.Begin("operator havk::SpecConstMap() const {\n");
+                headerCode.AppendFmt("\thavk::SpecConstMap map;\n");
+                for (auto* par : usedSpecConstants) {
+                    const char* name = par->getName();
+                    headerCode.AppendFmt("\tif (%s.present) map.Add(%d, %s.value);\n", name, par->getBindingIndex(), name);
+                }
+                headerCode.AppendFmt("\treturn map;\n");
+                headerCode.End("}\n");
+
+                headerCode.Begin("uint64_t GetHash() const {\n");
+                headerCode.AppendFmt("\thavk::SpecConstHasher hasher;\n");
+                for (auto* par : usedSpecConstants) {
+                    const char* name = par->getName();
+                    headerCode.AppendFmt("\tif (%s.present) hasher.Add(%d, %s.value);\n", name, par->getBindingIndex(), name);
+                }
+                headerCode.AppendFmt("\treturn hasher.State;\n");
+                headerCode.End("}\n");
+                headerCode.AppendFmt("\tbool operator==(const SpecConst&) const = default;\n");
+
+                headerCode.End("};\n");
+                PrintTuneCandidates(headerCode, directives.TuneParams, usedSpecConstants);
+            }
+
+            headerCode.End("};\n");
+        }
+    }
+    headerCode.SetNamespace("");
+    outputs.Header = std::move(headerCode.Buffer);
+    return true;
+}
+
+std::string GenerateUnit(const std::filesystem::path& outputFile, std::string_view relativeSourcePath,
+                         const CodegenOptions& codegenOpts, const ShaderOutputs& outputs, bool hasPermutations) {
+    CodePrinter unitCode(nullptr);
+
+    // Header always sits next to the unit, don't bake the output path so that outputs can be cached across build dirs.
+    unitCode.AppendFmt("#include \"%s\"\n", (char*)std::filesystem::path(outputFile).replace_extension(".h").filename().u8string().data());
+
+    if (outputs.Spirv.empty()) return std::move(unitCode.Buffer);
+
+    if (codegenOpts.EmbedSpirv) {
+        // The unit no longer changes along with the binaries, so stamp it with a hash to trigger rebuilds
+        // without relying on the build system tracking #embed dependencies.
+        ContentHasher spirvHash;
+        for (auto& bin : outputs.Spirv) {
+            spirvHash.Add(bin.Data.data(), bin.Data.size());
+        }
+        unitCode.AppendFmt("\n// SPIR-V hash: %s\n", spirvHash.GetHex().data());
+        unitCode.Append("#if __clang__\n#pragma clang diagnostic ignored \"-Wc23-extensions\"\n#endif\n");
+    }
+    for (uint32_t j = 0; j < outputs.Spirv.size(); j++) {
+        auto& bin = outputs.Spirv[j];
+
+        if (codegenOpts.EmbedSpirv) {
+            auto binPath = std::filesystem::path(outputFile).replace_extension(bin.Suffix);
+            unitCode.AppendFmt("\nalignas(4) static const uint8_t g_ModuleSpirvCode%d[] = {\n", j);
+            unitCode.AppendFmt("#embed \"%s\"", (char*)binPath.filename().u8string().data());
+        } else {
+            unitCode.AppendFmt("\nstatic const uint32_t g_ModuleSpirvCode%d[] = {", j);
+            auto spirvData = (const uint32_t*)bin.Data.data();
+            size_t spirvWordCount = bin.Data.size() / 4;
+            for (size_t i = 0; i < spirvWordCount; i++) {
+                if (i % 8 == 0) unitCode.Append("\n    ");
+                unitCode.AppendFmt("0x%08X, ", spirvData[i]);
+            }
+        }
+        unitCode.Append("\n};\n");
+    }
+
+    auto PrintModuleDesc = [&](const EntryPointInfo& entry, uint32_t variantIndex) {
+        uint32_t binIndex = entry.BinaryIndices[variantIndex];
+        unitCode.AppendFmt(codegenOpts.EmbedSpirv ? "\t.Code = (const uint32_t*)g_ModuleSpirvCode%d,\n" : "\t.Code = g_ModuleSpirvCode%d,\n", binIndex);
+        unitCode.AppendFmt("\t.CodeSize = sizeof(g_ModuleSpirvCode%d),\n", binIndex);
+        if (entry.RequireFullSubgroups) unitCode.AppendFmt("\t.Flags = havk::ModuleDesc::kRequireFullSubgroups,\n");
+        unitCode.AppendFmt("\t.EntryPoint = \"%s\",\n", entry.Name.data());
+        unitCode.AppendFmt("\t.SourcePath = \"%.*s\",\n", (int)relativeSourcePath.size(), relativeSourcePath.data());
+        if (variantIndex != 0) unitCode.AppendFmt("\t.Variant = %d,\n", variantIndex);
+        if (entry.WaveSize != 0) unitCode.AppendFmt("\t.RequiredSubgroupSize = %d,\n", entry.WaveSize);
+    };
+    for (auto& entry : outputs.EntryPoints) {
+        unitCode.SetNamespace(entry.Namespace);
+
+        unitCode.Begin("const havk::ModuleDesc %s::Module = {\n", entry.Name.data());
+        PrintModuleDesc(entry, 0);
+        unitCode.End("};\n");
+
+        // Declared by `PrintVariantKey()` whenever there are permutations, even if they only have a single value.
+        if (hasPermutations) {
+            unitCode.AppendFmt("\tconst havk::ModuleDesc %s::Variants[%d] = {\n", entry.Name.data(), (int)entry.BinaryIndices.size());
+            unitCode.IndentLevel++;
+
+            for (uint32_t i = 0; i < entry.BinaryIndices.size(); i++) {
+                unitCode.Begin("{\n");
+                PrintModuleDesc(entry, i);
+                unitCode.End("},\n");
+            }
+            unitCode.End("};\n");
+        }
+    }
+
+    // Generated C++ has no linkage so that definitions from different sources don't clash.
+    bool hasCpuKernels = std::any_of(outputs.EntryPoints.begin(), outputs.EntryPoints.end(), [](auto& e) { return !e.CpuCode.empty(); });
+    if (hasCpuKernels) {
+        unitCode.SetNamespace("");
+        unitCode.Append("\n#include <slang-cpp-prelude.h>\n");
+        unitCode.Append("#undef SLANG_PRELUDE_EXPORT\n#define SLANG_PRELUDE_EXPORT\n");
+
+        for (uint32_t i = 0; i < outputs.EntryPoints.size(); i++) {
+            if (outputs.EntryPoints[i].CpuCode.empty()) continue;
+
+            unitCode.AppendFmt("\nnamespace { namespace cpu_kernel%d {\n", i);
+            unitCode.Append(outputs.EntryPoints[i].CpuCode);
+            unitCode.Append("\n} }\n");
+        }
+    }
+    for (uint32_t i = 0; i < outputs.EntryPoints.size(); i++) {
+        auto& entry = outputs.EntryPoints[i];
+        if (entry.CpuCode.empty()) continue;
+
+        unitCode.SetNamespace(entry.Namespace);
+        unitCode.Begin("const havk::CpuKernel %s::CpuKernel = {\n", entry.Name.data());
+        unitCode.Begin(".RunGroups = [](const void* params, const uint32_t start[3], const uint32_t end[3]) {\n");
+        unitCode.AppendFmt("\tComputeVaryingInput input = { { start[0], start[1], start[2] }, { end[0], end[1], end[2] } };\n");
+        unitCode.AppendFmt("\t::cpu_kernel%d::%s(&input, (void*)params, nullptr);\n", i, entry.Name.data());
+        unitCode.End("},\n");
+        unitCode.End("};\n");
+    }
+    unitCode.SetNamespace("");
+    return std::move(unitCode.Buffer);
+}
+
+bool ParseDirectives(const std::filesystem::path& sourceFile, SourceDirectives& result) {
+    std::ifstream is(sourceFile);
+    uint64_t numVariants = 1, numTuneCandidates = 1;
+
+    for (std::string line; std::getline(is, line);) {
+        bool isTune = line.starts_with("// @tune ");
+        if (!isTune && !line.starts_with("// @permute ")) continue;
+
+        std::istringstream tokens(line.substr(line.find(' ', 4)));
+        auto& decl = (isTune ? result.TuneParams : result.Permutations).emplace_back();
+        tokens >> decl.Name;
+        std::vector<long long> parsedValues;  // Compared instead of strings, so that e.g. `1` and `01` are duplicates.
+
+        for (std::string value; tokens >> value;) {
+            char* valueEnd;
+            long long parsedValue = strtoll(value.data(), &valueEnd, 0);
+
+            if (*valueEnd != '\0' || std::find(parsedValues.begin(), parsedValues.end(), parsedValue) != parsedValues.end()) {
+                fprintf(stderr, "error: %s '%s' in '%s' has invalid or duplicated value '%s' (only integers are supported).\n",
+                        isTune ? "tuned parameter" : "permutation", decl.Name.data(), sourceFile.filename().string().data(), value.data());
+                return false;
+            }
+            decl.Values.push_back(value);
+            parsedValues.push_back(parsedValue);
+        }
+        if (decl.Values.empty()) {
+            fprintf(stderr, "error: %s '%s' in '%s' has no values.\n", isTune ? "tuned parameter" : "permutation", decl.Name.data(),
+                    sourceFile.filename().string().data());
+            return false;
+        }
+        (isTune ? numTuneCandidates : numVariants) *= decl.Values.size();
+    }
+    if (numVariants > kMaxVariants) {
+        fprintf(stderr, "error: '%s' declares too many permutations (%llu, max is %u).\n",
+                sourceFile.filename().string().data(), (unsigned long long)numVariants, kMaxVariants);
+        return false;
+    }
+    if (numTuneCandidates > kMaxTuneCandidates) {
+        fprintf(stderr, "error: '%s' declares too many tuning candidates (%llu, max is %u).\n",
+                sourceFile.filename().string().data(), (unsigned long long)numTuneCandidates, kMaxTuneCandidates);
+        return false;
+    }
+    return true;
+}
+
+std::string CompileCache::Lookup(const std::filesystem::path& sourceFile, std::vector<std::string>& relDeps) {
+    relDeps.clear();
+    std::ifstream is(GetManifestPath(sourceFile));
+
+    for (std::string line; std::getline(is, line);) {
+        relDeps.push_back(line);
+    }
+    return relDeps.empty() ? "" : ComputeKey(relDeps);
+}
+
+bool CompileCache::Load(std::string_view key, const std::vector<std::string>& relDeps, ShaderOutputs& outputs) {
+    auto data = havx::ReadFileBytes((char*)GetEntryPath(key).u8string().data());
+    size_t pos = 0;
+
+    auto ReadSection = [&](auto& dest) {
+        uint64_t length;
+        if (data.size() - pos < sizeof(length)) return false;
+        memcpy(&length, &data[pos], sizeof(length));
+        pos += sizeof(length);
+
+        if (data.size() - pos < length) return false;
+        dest.assign(data.data() + pos, data.data() + pos + length);
+        pos += length;
+        return true;
+    };
+    std::string numBinaries;
+    if (!ReadSection(outputs.Header) || !ReadSection(outputs.Unit) ||
+        !ReadSection(outputs.ReflectJson) || !ReadSection(numBinaries)) {
+        return false;
+    }
+    size_t binaryCount = strtoul(numBinaries.data(), nullptr, 10);
+    if (binaryCount > data.size()) return false;
+    outputs.Spirv.resize(binaryCount);
+
+    for (auto& bin : outputs.Spirv) {
+        std::string entryNames;
+        if (!ReadSection(bin.Suffix) || !ReadSection(bin.Data) || !ReadSection(entryNames)) return false;
+
+        for (size_t start = 0; start < entryNames.size();) {
+            size_t end = std::min(entryNames.find('\n', start), entryNames.size());
+            bin.EntryPoints.push_back(entryNames.substr(start, end - start));
+            start = end + 1;
+        }
+    }
+    std::string numEntryPoints;
+    if (!ReadSection(numEntryPoints)) return false;
+    size_t entryCount = strtoul(numEntryPoints.data(), nullptr, 10);
+    if (entryCount > data.size()) return false;
+    outputs.EntryPoints.resize(entryCount);
+
+    for (auto& entry : outputs.EntryPoints) {
+        std::string info;
+        if (!ReadSection(entry.Name) || !ReadSection(entry.Namespace) || !ReadSection(info)) return false;
+
+        // "<wave size> <require full subgroups> <binary index>..."
+        std::istringstream is(info);
+        is >> entry.WaveSize >> entry.RequireFullSubgroups;
+        for (uint32_t index; is >> index;) entry.BinaryIndices.push_back(index);
+    }
+    outputs.Dependencies.clear();
+
+    for (auto& relPath : relDeps) {
+        outputs.Dependencies.push_back((char*)std::filesystem::weakly_canonical(BaseDir / relPath).u8string().data());
+    }
+    return true;
+}
+
+std::string CompileCache::Store(const std::filesystem::path& sourceFile, const ShaderOutputs& outputs) {
+    std::vector<std::string> relDeps;
+    std::string manifest;
+
+    for (auto& depPath : outputs.Dependencies) {
+        auto relPath = std::filesystem::path((char8_t*)depPath.data()).lexically_relative(BaseDir);
+        relDeps.push_back((char*)relPath.generic_u8string().data());
+        manifest += relDeps.back() + "\n";
+    }
+    std::string key = ComputeKey(relDeps);
+    if (key.empty()) return "";
+
+    std::string data;
+    auto WriteSection = [&](std::string_view section) {
+        uint64_t length = section.size();
+        data.append((char*)&length, sizeof(length));
+        data.append(section);
+    };
+    WriteSection(outputs.Header);
+    WriteSection(outputs.Unit);
+    WriteSection(std::string_view((char*)outputs.ReflectJson.data(), outputs.ReflectJson.size()));
+    WriteSection(std::to_string(outputs.Spirv.size()));
+
+    for (auto& bin : outputs.Spirv) {
+        std::string entryNames;
+        for (auto& name : bin.EntryPoints) entryNames.append(name).append(1, '\n');
+
+        WriteSection(bin.Suffix);
+        WriteSection(std::string_view((char*)bin.Data.data(), bin.Data.size()));
+        WriteSection(entryNames);
+    }
+    WriteSection(std::to_string(outputs.EntryPoints.size()));
+
+    for (auto& entry : outputs.EntryPoints) {
+        std::string info = std::to_string(entry.WaveSize) + (entry.RequireFullSubgroups ? " 1" : " 0");
+        for (uint32_t index : entry.BinaryIndices) info += " " + std::to_string(index);
+
+        WriteSection(entry.Name);
+        WriteSection(entry.Namespace);
+        WriteSection(info);
+    }
+    if (!WriteFileAtomic(GetEntryPath(key), data) || !WriteFileAtomic(GetManifestPath(sourceFile), manifest)) return "";
+
+    return key;
+}
+
+std::string CompileCache::ComputeKey(const std::vector<std::string>& relDeps) {
+    ContentHasher hasher = OptionsHash;
+
+    for (auto& relPath : relDeps) {
+        hasher.Add(relPath);
+        if (!hasher.AddFile(BaseDir / relPath)) return "";
+    }
+    return hasher.GetHex();
+}
+
+std::filesystem::path CompileCache::GetManifestPath(const std::filesystem::path& sourceFile) {
+    ContentHasher hasher = OptionsHash;
+    hasher.Add((char*)std::filesystem::relative(sourceFile, BaseDir).generic_u8string().data());
+    if (!hasher.AddFile(sourceFile)) return {};
+
+    return Dir / "manifests" / (hasher.GetHex() + ".txt");
+}
+
+std::filesystem::path CompileCache::GetEntryPath(std::string_view key) {
+    return Dir / key.substr(0, 2) / (std::string(key) + ".bin");
+}
+
+void ModuleCache::Preload(slang::ISession* session, const std::filesystem::path& sourceFile) {
+    std::ifstream is(GetEntryPath(GetRelativePath(sourceFile), ".imports"));
+
+    // List is in load order, which will load most modules after their imports.
+    for (std::string relPath; std::getline(is, relPath);) {
+        std::string path = (char*)std::filesystem::weakly_canonical(BaseDir / relPath).u8string().data();
+        if (IsLoaded(session, path)) continue;
+
+        std::string name;
+        Slang::ComPtr<slang::IBlob> blob;
+        if (ReadEntry(relPath, name, blob) && session->isBinaryModuleUpToDate(path.data(), blob)) {
+            session->loadModuleFromIRBlob(name.data(), path.data(), blob);
+        }
+    }
+}
+
+void ModuleCache::Save(slang::ISession* session, const std::filesystem::path& sourceFile) {
+    std::string sourceRelPath = GetRelativePath(sourceFile);
+    std::string importList;
+
+    slang::IModule* sourceModule = FindLoaded(session, sourceRelPath);
+    if (sourceModule == nullptr) return;
+
+    std::unordered_set<std::string> depPaths;
+    for (int32_t i = 0; i < sourceModule->getDependencyFileCount(); i++) {
+        depPaths.insert(GetRelativePath(sourceModule->getDependencyFilePath(i)));
+    }
+
+    // Iterate over loaded modules rather than dependencies to keep load order.
+    for (SlangInt i = 0; i < session->getLoadedModuleCount(); i++) {
+        slang::IModule* module = session->getLoadedModule(i);
+        const char* path = module->getFilePath();
+        if (path == nullptr || path[0] == '\0') continue;
+
+        std::string relPath = GetRelativePath(path);
+        if (relPath == sourceRelPath || !depPaths.contains(relPath)) continue;
+        importList += relPath + "\n";
+
+        std::string name;
+        Slang::ComPtr<slang::IBlob> blob;
+        std::string canonPath = (char*)std::filesystem::weakly_canonical(path).u8string().data();
+        if (ReadEntry(relPath, name, blob) && session->isBinaryModuleUpToDate(canonPath.data(), blob)) continue;
+
+        if (module->serialize(blob.writeRef()) != SLANG_OK) continue;
+
+        std::string data;
+        name = module->getName();
+        uint32_t nameLen = (uint32_t)name.size();
+        data.append((char*)&nameLen, sizeof(nameLen));
+        data.append(name);
+        data.append((const char*)blob->getBufferPointer(), blob->getBufferSize());
+        WriteFileAtomic(GetEntryPath(relPath, ".slang-module"), data);
+    }
+    WriteFileAtomic(GetEntryPath(sourceRelPath, ".imports"), importList);
+}
+
+bool ModuleCache::ReadEntry(const std::string& relPath, std::string& name, Slang::ComPtr<slang::IBlob>& blob) {
+    auto data = havx::ReadFileBytes((char*)GetEntryPath(relPath, ".slang-module").u8string().data());
+    uint32_t nameLen;
+    if (data.size() < sizeof(nameLen)) return false;
+    memcpy(&nameLen, data.data(), sizeof(nameLen));
+    if (data.size() - sizeof(nameLen) < nameLen) return false;
+
+    name.assign((char*)&data[sizeof(nameLen)], nameLen);
+    size_t blobOffset = sizeof(nameLen) + nameLen;
+    blob = nullptr;
+    blob.attach(slang_createBlob(data.data() + blobOffset, data.size() - blobOffset));
+    return true;
+}
+
+slang::IModule* ModuleCache::FindLoaded(slang::ISession* session, const std::string& relPath) {
+    for (SlangInt i = 0; i < session->getLoadedModuleCount(); i++) {
+        slang::IModule* module = session->getLoadedModule(i);
+        const char* path = module->getFilePath();
+        if (path != nullptr && path[0] != '\0' && GetRelativePath(path) == relPath) return module;
+    }
+    return nullptr;
+}
+
+bool ModuleCache::IsLoaded(slang::ISession* session, const std::string& path) {
+    for (SlangInt i = 0; i < session->getLoadedModuleCount(); i++) {
+        const char* modulePath = session->getLoadedModule(i)->getFilePath();
+        if (modulePath != nullptr && path == (char*)std::filesystem::weakly_canonical(modulePath).u8string().data()) return true;
+    }
+    return false;
+}
+
+std::string ModuleCache::GetRelativePath(const std::filesystem::path& path) {
+    return (char*)std::filesystem::weakly_canonical(path).lexically_relative(BaseDir).generic_u8string().data();
+}
+
+std::filesystem::path ModuleCache::GetEntryPath(const std::string& relPath, const char* ext) {
+    ContentHasher hasher = OptionsHash;
+    hasher.Add(relPath);
+    return Dir / (hasher.GetHex() + ext);
+}
+
+slang::SessionDesc SessionOptions::CreateSessionDesc(slang::IGlobalSession* globalSession) {
+    Entries.clear();
+    Entries.push_back({ slang::CompilerOptionName::ForceCLayout, { .intValue0 = 1 } });
+    Entries.push_back({ slang::CompilerOptionName::VulkanUseEntryPointName, { .intValue0 = 1 } });
+    Entries.push_back({ slang::CompilerOptionName::Optimization, { .intValue0 = OptLevel } });
+    Entries.push_back({ slang::CompilerOptionName::DebugInformation, { .intValue0 = DebugLevel } });
+    Entries.push_back({ slang::CompilerOptionName::Capability, { .intValue0 = globalSession->findCapability("vk_mem_model") } });
+
+    Targets[0] = {
+        .format = SLANG_SPIRV,
+        .profile = globalSession->findProfile("spirv_1_6"),
+        .flags = SLANG_TARGET_FLAG_GENERATE_SPIRV_DIRECTLY | (Codegen.WholeProgram ? SLANG_TARGET_FLAG_GENERATE_WHOLE_PROGRAM : 0u),
+        .compilerOptionEntries = Entries.data(),
+        .compilerOptionEntryCount = (uint32_t)Entries.size(),
+    };
+    Targets[1] = {
+        .format = SLANG_CPP_SOURCE,
+        .compilerOptionEntries = Entries.data(),
+        .compilerOptionEntryCount = (uint32_t)Entries.size(),
+    };
+    return {
+        .targets = Targets,
+        .targetCount = Codegen.CpuKernels ? 2 : 1,
+        .defaultMatrixLayoutMode = MatrixLayout,
+        .searchPaths = IncludeDirs.data(),
+        .searchPathCount = (uint32_t)IncludeDirs.size(),
+        .preprocessorMacros = Macros.data(),
+        .preprocessorMacroCount = (uint32_t)Macros.size(),
+        .compilerOptionEntries = Entries.data(),
+        .compilerOptionEntryCount = (uint32_t)Entries.size(),
+    };
+}
+
+void SessionOptions::CreateCaches(slang::IGlobalSession* globalSession, const std::filesystem::path& cacheDir, const std::filesystem::path& baseDir,
+                                  const char* variant, std::unique_ptr<CompileCache>& cache, std::unique_ptr<ModuleCache>& moduleCache) {
+    cache = std::make_unique<CompileCache>();
+    cache->Dir = cacheDir;
+    cache->BaseDir = std::filesystem::weakly_canonical(baseDir);
+
+    ContentHasher& hasher = cache->OptionsHash;
+    hasher.Add("havk-shader-cache-v6");
+    if (variant != nullptr) hasher.Add(variant);
+#ifdef HAVK_SHADER_TOOL_HASH
+    hasher.Add(HAVK_SHADER_TOOL_HASH);
+#endif
+    hasher.Add(globalSession->getBuildTagString());
+    hasher.Add(BaseNamespace);
+    hasher.Add(&OptLevel, sizeof(OptLevel));
+    hasher.Add(&DebugLevel, sizeof(DebugLevel));
+    hasher.Add(&MatrixLayout, sizeof(MatrixLayout));
+    hasher.Add(&Codegen.EmbedSpirv, sizeof(bool));
+    hasher.Add(&Codegen.WholeProgram, sizeof(bool));
+    hasher.Add(&Codegen.CpuKernels, sizeof(bool));
+
+    for (auto& def : Macros) {
+        hasher.Add(def.name);
+        hasher.Add(def.value);
+    }
+    // Include dirs affect module resolution, but absolute paths would prevent sharing.
+    for (const char* dir : IncludeDirs) {
+        hasher.Add((char*)std::filesystem::relative(dir, cache->BaseDir).generic_u8string().data());
+    }
+    moduleCache = std::make_unique<ModuleCache>();
+    moduleCache->Dir = cacheDir / "modules";
+    moduleCache->BaseDir = cache->BaseDir;
+    moduleCache->OptionsHash = hasher;
+}
+
+};  // namespace havk::detail
@@ -0,0 +1,175 @@
+#pragma once
+// Shader compilation pipeline shared by ShaderBuildTool and RuntimeCompiler. Internal, not part of the public API.
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <slang.h>
+#include <slang-com-ptr.h>
+
+namespace havk::detail {
+
+bool IsFileContentEquals(const std::filesystem::path& path, const uint8_t* data, size_t length);
+// Cache may be shared by concurrent builds, write to a temp file and then move it to the final path.
+bool WriteFileAtomic(const std::filesystem::path& path, std::string_view data);
+
+// 64-bit FNV-1a
+struct ContentHasher {
+    uint64_t State = 0xcbf29ce484222325ull;
+
+    void Add(const void* data, size_t length);
+    void Add(std::string_view str);
+    bool AddFile(const std::filesystem::path& path);
+    std::string GetHex() const;
+};
+
+struct TypeGraph {
+    struct TypeInfo {
+        slang::IModule* Module;
+        std::string Namespace;
+    };
+    std::unordered_map<slang::TypeReflection*, TypeInfo> Entries;
+    std::unordered_map<slang::FunctionReflection*, std::string> ParentNamespaces;
+
+    std::string BaseNamespace;
+
+    TypeInfo* GetInfo(slang::TypeReflection* type);
+    void RegisterTypes(slang::IModule* module, slang::DeclReflection* entity, const std::string& parentNs = "");
+    void GetOrderedDependencies(slang::TypeReflection* type, std::vector<slang::TypeReflection*>& postOrder);
+};
+
+struct CodegenOptions {
+    bool EmbedSpirv = false;    // Reference SPIR-V binaries via #embed instead of printing hex arrays.
+    bool WholeProgram = false;  // Emit a single SPIR-V module containing all entry points.
+    bool CpuKernels = false;    // Also emit compute entry points as C++ through Slang's CPU target. Requires session target 1 to be C++.
+};
+// Preprocessor permutation, declared in source files as `// @permute NAME value1 value2 ...`.
+// Variants are compiled for every combination of values, with index `sum(valueIndex[i] * stride[i])`,
+// where stride of the first declaration is 1.
+struct PermutationDecl {
+    std::string Name;
+    std::vector<std::string> Values;  // Integer literals
+};
+static const uint32_t kMaxVariants = 1024;
+static const uint32_t kMaxTuneCandidates = 64;
+
+struct SourceDirectives {
+    std::vector<PermutationDecl> Permutations;  // `// @permute NAME values...`
+    std::vector<PermutationDecl> TuneParams;    // `// @tune NAME values...`, candidate values for spec constants.
+};
+
+struct SpirvBinary {
+    std::string Suffix;  // Output file extension: `.spv` for whole program, or `.EntryName.spv`.
+    std::vector<uint8_t> Data;
+    std::vector<std::string> EntryPoints;  // Names of entry points sharing this binary, suffixed with `#<variant>` for variants other than 0.
+};
+struct EntryPointInfo {
+    std::string Name, Namespace;
+    std::vector<uint32_t> BinaryIndices;  // Index into `ShaderOutputs::Spirv` for each variant.
+    uint32_t WaveSize = 0;
+    bool RequireFullSubgroups = false;
+    std::string CpuCode;  // C++ source for the CPU target, empty if not enabled.
+};
+struct ShaderOutputs {
+    std::vector<std::string> Dependencies;  // Canonical paths of source and all imported/included files.
+    std::string Header, Unit;               // Header code excludes preamble with dependency list.
+    std::vector<SpirvBinary> Spirv;         // Empty if module has no entry points.
+    std::vector<EntryPointInfo> EntryPoints;  // `CpuCode` is not restored from cache.
+    std::vector<uint8_t> ReflectJson;
+};
+
+// Rewrites push constant blocks used by the given entry points so that they are read through a
+// PhysicalStorageBuffer pointer held in push constants instead. At runtime, parameters larger than
+// `kMaxPushConstantSize` are copied to scratch memory, see `CommandList::PushConstants()`.
+//
+// Only access chains and loads are handled, which is all Slang emits for uniform parameters.
+bool SpillPushConstants(std::vector<uint8_t>& binary, const std::vector<std::string>& entryNames);
+
+// Compiles a single variant of a source file. Outputs will have an empty `Unit`, which is generated by `GenerateUnit()`.
+bool CompileShader(
+    slang::IGlobalSession* globalSession, slang::ISession* session,
+    const std::filesystem::path& sourceFile, TypeGraph* typeGraph, const CodegenOptions& codegenOpts,
+    const SourceDirectives& directives, uint32_t variantIndex, ShaderOutputs& outputs
+);
+
+// Generates the compilation unit defining SPIR-V binaries and module descriptors.
+std::string GenerateUnit(const std::filesystem::path& outputFile, std::string_view relativeSourcePath,
+                         const CodegenOptions& codegenOpts, const ShaderOutputs& outputs, bool hasPermutations);
+
+bool ParseDirectives(const std::filesystem::path& sourceFile, SourceDirectives& result);
+
+// Persistent content-addressed cache for compiled outputs.
+// Paths are stored relative to the base dir, so the cache can be shared across build directories
+// as long as dependencies are found at the same relative locations.
+//
+// Dependencies are only known after compiling, so lookups take two steps:
+// - Manifest: keyed by options + source path and contents, lists dependencies from the last compilation.
+// - Entry: keyed by options + paths and contents of all dependencies, holds compiled outputs.
+struct CompileCache {
+    std::filesystem::path Dir;
+    std::filesystem::path BaseDir;
+    ContentHasher OptionsHash;  // Compiler version, options, and anything else that affects outputs.
+
+    // Returns entry key for source based on the last recorded manifest, or empty if not available.
+    std::string Lookup(const std::filesystem::path& sourceFile, std::vector<std::string>& relDeps);
+
+    bool Load(std::string_view key, const std::vector<std::string>& relDeps, ShaderOutputs& outputs);
+
+    // Saves outputs to cache. Returns the entry key, or empty on failure.
+    std::string Store(const std::filesystem::path& sourceFile, const ShaderOutputs& outputs);
+
+private:
+    std::string ComputeKey(const std::vector<std::string>& relDeps);
+    std::filesystem::path GetManifestPath(const std::filesystem::path& sourceFile);
+    std::filesystem::path GetEntryPath(std::string_view key);
+};
+
+// Cache of serialized Slang IR for imported modules, so that they don't need to be parsed and checked
+// again by every session. Validity is checked by Slang, against a digest of source contents and options.
+// Like CompileCache, entries are keyed by paths relative to the base dir so they can be shared across build dirs.
+struct ModuleCache {
+    std::filesystem::path Dir;
+    std::filesystem::path BaseDir;
+    ContentHasher OptionsHash;
+
+    // Loads cached IR for modules imported by a source during its last compilation, as recorded by `Save()`.
+    void Preload(slang::ISession* session, const std::filesystem::path& sourceFile);
+    // Serializes modules imported by the given source that are missing or outdated in the cache, and records them
+    // for the next `Preload()`. Sessions may be reused across sources, so other loaded modules are ignored.
+    void Save(slang::ISession* session, const std::filesystem::path& sourceFile);
+
+private:
+    bool ReadEntry(const std::string& relPath, std::string& name, Slang::ComPtr<slang::IBlob>& blob);
+    slang::IModule* FindLoaded(slang::ISession* session, const std::string& relPath);
+    static bool IsLoaded(slang::ISession* session, const std::string& path);
+    std::string GetRelativePath(const std::filesystem::path& path);
+    std::filesystem::path GetEntryPath(const std::string& relPath, const char* ext);
+};
+
+struct SessionOptions {
+    std::string BaseNamespace;
+    int OptLevel = SLANG_OPTIMIZATION_LEVEL_NONE;
+    int DebugLevel = SLANG_DEBUG_INFO_LEVEL_NONE;
+    SlangMatrixLayoutMode MatrixLayout = SLANG_MATRIX_LAYOUT_COLUMN_MAJOR;
+    CodegenOptions Codegen = {};
+    std::vector<const char*> IncludeDirs;
+    std::vector<slang::PreprocessorMacroDesc> Macros;
+
+    // Referenced by the session descriptor.
+    std::vector<slang::CompilerOptionEntry> Entries;
+    slang::TargetDesc Targets[2] = {};
+
+    slang::SessionDesc CreateSessionDesc(slang::IGlobalSession* globalSession);
+
+    // Creates caches keyed by everything that affects outputs. `variant` separates entries whose
+    // contents differ between users, e.g. RuntimeCompiler doesn't generate `Unit`.
+    void CreateCaches(slang::IGlobalSession* globalSession, const std::filesystem::path& cacheDir, const std::filesystem::path& baseDir,
+                      const char* variant, std::unique_ptr<CompileCache>& cache, std::unique_ptr<ModuleCache>& moduleCache);
+};
+
+};  // namespace havk::detail
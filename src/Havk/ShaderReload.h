@@ -3,21 +3,29 @@
 #include "Havk.h"
 #include "Havx/SystemUtils.h"
 
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <filesystem>
 
 namespace havk {
 
 struct ReloadWatcher {
-    using ReloadCallback = std::function<void(Span<const ModuleDesc> modules)>;
+    using PipelinePtr = std::unique_ptr<Pipeline, Resource::QueuedDeleter>;
+    // Creates a replacement for a pipeline using updated modules. Invoked from the rebuild thread.
+    using ReloadCallback = std::function<PipelinePtr(Span<const ModuleDesc> modules)>;
 
     ReloadWatcher(std::string_view srcBaseDir, std::string_view fullWatcherCmd) {
         _srcBaseDir = srcBaseDir;
         _watcherProcess = std::make_unique<havx::JobProcess>(fullWatcherCmd, srcBaseDir);
+        _rebuildThread = std::thread(&ReloadWatcher::RunRebuildThread, this);
     }
+    ~ReloadWatcher();
 
-    void BeginTracking(Pipeline* pipe, Span<const ModuleDesc> modules, ReloadCallback&& cb);
+    void BeginTracking(Pipeline* pipe, Span<const ModuleDesc> modules, std::string_view name, ReloadCallback&& cb);
     void StopTracking(Pipeline* pipe);
 
     void Poll(DeviceContext* ctx);
@@ -29,16 +37,54 @@ struct ReloadWatcher {
 
 private:
     struct PipelineRebuildInfo {
-        std::string ModulePaths;  // String list separated by '\0'
+        std::string Name;
+        std::string ModulePaths;             // String list separated by '\0'
+        std::vector<uint64_t> ModuleHashes;  // Hash of current SPIR-V code for each module
+        std::vector<ModuleDesc> ModuleParams;  // Original descs, only with fields that aren't replaced on reload (code and names cleared).
+        uint64_t TrackingId;                 // Guards against completed rebuilds for a different pipeline at the same address
         ReloadCallback ReloadCb;
     };
+    struct RebuildJob {
+        Pipeline* Target;
+        uint64_t TrackingId;
+        ReloadCallback ReloadCb;
+        std::string ModulePaths;  // Copied so that module names outlive the pipeline
+        std::vector<ModuleDesc> Modules;
+        std::vector<std::shared_ptr<const std::vector<uint32_t>>> Code;
+
+        PipelinePtr Result;
+        std::string Error;
+    };
     std::unordered_map<Pipeline*, PipelineRebuildInfo> _pipelines;
+    std::unordered_map<std::string, std::vector<Pipeline*>> _pipelinesBySource;  // Keyed by source path of first module
+    uint64_t _nextTrackingId = 1;
+
     std::unique_ptr<havx::JobProcess> _watcherProcess;
     std::string _srcBaseDir;
-
     std::string _stdoutBuffer;
+
+    // Pipelines are created on a background thread so that the app doesn't stall while drivers compile
+    // big shaders. Finished pipelines are swapped in by Poll(), and old handles go through the deletion queue.
+    std::thread _rebuildThread;
+    std::mutex _jobMutex;
+    std::condition_variable _jobCond;
+    std::deque<std::unique_ptr<RebuildJob>> _pendingJobs;
+    std::vector<std::unique_ptr<RebuildJob>> _completedJobs;
+    bool _shutdown = false;
+
+    void RunRebuildThread();
+    void ApplyCompletedJobs(DeviceContext* ctx);
 };
 
+// FNV-1a 64, must match hashes sent by ShaderBuildTool.
+static uint64_t HashSpirvCode(const void* data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ ((const uint8_t*)data)[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
 static bool ReadLine(std::string_view& buffer, std::string_view& line) {
     while (true) {
         size_t endPos = buffer.find('\n');
@@ -75,18 +121,101 @@ inline std::unique_ptr<ReloadWatcher> ReloadWatcher::TryCreateForCurrentApp() {
     return std::make_unique<ReloadWatcher>(baseDir, watcherCmd);
 }
 
-inline void ReloadWatcher::BeginTracking(Pipeline* pipe, Span<const ModuleDesc> modules, ReloadCallback&& cb) {
+inline ReloadWatcher::~ReloadWatcher() {
+    {
+        std::lock_guard lock(_jobMutex);
+        _shutdown = true;
+    }
+    _jobCond.notify_all();
+    _rebuildThread.join();
+}
+
+inline void ReloadWatcher::BeginTracking(Pipeline* pipe, Span<const ModuleDesc> modules, std::string_view name, ReloadCallback&& cb) {
     std::string modPaths = "";
+    std::vector<uint64_t> modHashes;
+    std::vector<ModuleDesc> modParams;
 
     for (auto& mod : modules) {
         if (mod.SourcePath == nullptr) return;
 
         modPaths.append(mod.SourcePath).append(1, '\0');
         modPaths.append(mod.EntryPoint).append(1, '\0');
+        modHashes.push_back(HashSpirvCode(mod.Code, mod.CodeSize));
+        modParams.push_back({
+            .Flags = mod.Flags | ModuleDesc::kNoReload,
+            .Variant = mod.Variant,
+            .RequiredSubgroupSize = mod.RequiredSubgroupSize,
+        });
+    }
+    _pipelines.insert({ pipe, {
+        .Name = std::string(name),
+        .ModulePaths = modPaths,
+        .ModuleHashes = modHashes,
+        .ModuleParams = modParams,
+        .TrackingId = _nextTrackingId++,
+        .ReloadCb = std::move(cb),
+    } });
+    _pipelinesBySource[modules[0].SourcePath].push_back(pipe);
+}
+inline void ReloadWatcher::StopTracking(Pipeline* pipe) {
+    auto iter = _pipelines.find(pipe);
+    if (iter == _pipelines.end()) return;
+
+    auto sourcePipes = _pipelinesBySource.find(iter->second.ModulePaths.c_str());
+    std::erase(sourcePipes->second, pipe);
+    if (sourcePipes->second.empty()) _pipelinesBySource.erase(sourcePipes);
+
+    _pipelines.erase(iter);
+}
+
+inline void ReloadWatcher::RunRebuildThread() {
+    std::unique_lock lock(_jobMutex);
+
+    while (true) {
+        _jobCond.wait(lock, [&] { return _shutdown || !_pendingJobs.empty(); });
+        if (_shutdown) break;
+
+        auto job = std::move(_pendingJobs.front());
+        _pendingJobs.pop_front();
+        lock.unlock();
+
+        try {
+            job->Result = job->ReloadCb(job->Modules);
+        } catch (const std::exception& ex) {
+            job->Error = ex.what();
+        } catch (...) {
+            // Anything escaping this thread would terminate the process.
+            job->Error = "unknown exception";
+        }
+        lock.lock();
+        _completedJobs.push_back(std::move(job));
+    }
+}
+
+inline void ReloadWatcher::ApplyCompletedJobs(DeviceContext* ctx) {
+    std::vector<std::unique_ptr<RebuildJob>> completedJobs;
+    {
+        std::lock_guard lock(_jobMutex);
+        completedJobs.swap(_completedJobs);
+    }
+    for (auto& job : completedJobs) {
+        auto iter = _pipelines.find(job->Target);
+        if (iter == _pipelines.end() || iter->second.TrackingId != job->TrackingId) continue;  // pipeline was destroyed in the meantime
+
+        PipelineRebuildInfo& info = iter->second;
+
+        if (job->Result == nullptr) {
+            ctx->Log(LogLevel::Error, "[ShaderReload] Failed to rebuild pipeline '%s': %s", info.Name.data(), job->Error.data());
+            std::fill(info.ModuleHashes.begin(), info.ModuleHashes.end(), 0);  // allow retry with same code
+            continue;
+        }
+        ctx->Log(LogLevel::Info, "Reloaded pipeline '%s'", info.Name.data());
+
+        // Recording happens on this thread, so swapping here is safe. The result now owns
+        // the old handle, which will be destroyed once in-flight command lists complete.
+        std::swap(job->Result->Handle, job->Target->Handle);
     }
-    _pipelines.insert({ pipe, { .ModulePaths = modPaths, .ReloadCb = std::move(cb) } });
 }
-inline void ReloadWatcher::StopTracking(Pipeline* pipe) { _pipelines.erase(pipe); }
 
 inline void ReloadWatcher::Poll(DeviceContext* ctx) {
     if (_watcherProcess == nullptr) return;
@@ -97,30 +226,81 @@ inline void ReloadWatcher::Poll(DeviceContext* ctx) {
         _watcherProcess = nullptr;
         return;
     }
+    ApplyCompletedJobs(ctx);
+
     _watcherProcess->ReadStdout(_stdoutBuffer);
     std::string_view buffer = _stdoutBuffer;
 
-    for (std::string_view line; ReadLine(buffer, line); ) {
-        if (!line.starts_with("Recompiled ")) {
+    for (std::string_view line, lineStart = buffer; ReadLine(buffer, line); lineStart = buffer) {
+        if (!line.starts_with("@reload ")) {
             ctx->Log(LogLevel::Info, "[ShaderReload] %.*s", (int)line.size(), line.data());
             continue;
         }
-        line.remove_prefix(strlen("Recompiled "));
+        // Recompiled binaries are sent inline after the header line, see WriteReloadFrame() in ShaderBuildTool.
+        // Format: "@reload <payloadSize> <sourcePath>\n" followed by payload:
+        //   u32 entryCount, then for each entry: [u32 nameLen][name][u64 spirvHash][u32 spirvSize][spirv]
+        line.remove_prefix(strlen("@reload "));
+        size_t splitPos = line.find(' ');
+        size_t payloadSize = strtoull(line.data(), nullptr, 10);
+
+        if (buffer.size() < payloadSize) {
+            buffer = lineStart;  // wait for rest of the frame
+            break;
+        }
+        std::string_view payload = buffer.substr(0, payloadSize);
+        buffer.remove_prefix(payloadSize);
 
-        size_t splitPos = line.find(" -> ");
-        auto relSourcePath = std::filesystem::relative(std::u8string_view{ (char8_t*)line.data(), splitPos }, _srcBaseDir);
-        auto spirvData = havx::ReadFileBytes(line.substr(splitPos + 4));
+        line.remove_prefix(splitPos + 1);
+        auto relSourcePath = std::filesystem::relative(std::u8string_view{ (char8_t*)line.data(), line.size() }, _srcBaseDir);
 
-        if (spirvData.empty()) {
-            // We'll occasionally be too late for a reload cycle and fail to open the
-            // SPIR-V file because it is being rewriten with contents of a newer change.
-            ctx->Log(LogLevel::Warn, "[ShaderReload] Could not reload '%s'. (Failed to read SPIR-V file. Try again?)", relSourcePath.filename().string().c_str());
+        struct EntryCode {
+            uint64_t Hash;
+            std::shared_ptr<std::vector<uint32_t>> Code;  // copied out of the stream buffer for alignment, shared by jobs
+        };
+        std::unordered_map<std::string, EntryCode> entries;
+
+        auto ReadBytes = [&](void* dest, size_t size) {
+            if (payload.size() < size) return false;
+            memcpy(dest, payload.data(), size);
+            payload.remove_prefix(size);
+            return true;
+        };
+        uint32_t entryCount = 0;
+        bool validPayload = ReadBytes(&entryCount, sizeof(entryCount));
+
+        for (uint32_t i = 0; i < entryCount && validPayload; i++) {
+            uint32_t nameLen = 0, codeSize = 0;
+            std::string name;
+            EntryCode entry;
+
+            validPayload = ReadBytes(&nameLen, sizeof(nameLen)) && payload.size() >= nameLen;
+            if (!validPayload) break;
+            name = payload.substr(0, nameLen);
+            payload.remove_prefix(nameLen);
+
+            validPayload = ReadBytes(&entry.Hash, sizeof(entry.Hash)) && ReadBytes(&codeSize, sizeof(codeSize)) && codeSize % 4 == 0;
+            if (!validPayload) break;
+            entry.Code = std::make_shared<std::vector<uint32_t>>(codeSize / 4);
+            validPayload = ReadBytes(entry.Code->data(), codeSize);
+
+            entries.insert({ std::move(name), std::move(entry) });
+        }
+        if (!validPayload) {
+            ctx->Log(LogLevel::Error, "[ShaderReload] Could not reload '%s'. (Malformed message from watcher)", relSourcePath.filename().string().c_str());
             continue;
         }
 
-        for (auto& [pipe, info] : _pipelines) {
-            std::vector<ModuleDesc> modules;
-            std::string& srcPaths = info.ModulePaths;
+        auto sourcePipes = _pipelinesBySource.find((char*)relSourcePath.generic_u8string().data());
+        if (sourcePipes == _pipelinesBySource.end()) continue;
+
+        for (Pipeline* pipe : sourcePipes->second) {
+            PipelineRebuildInfo& info = _pipelines[pipe];
+            auto job = std::make_unique<RebuildJob>();
+            std::vector<uint64_t> newHashes;
+            std::string& srcPaths = job->ModulePaths;
+            bool hasChanges = false;
+
+            srcPaths = info.ModulePaths;
 
             for (size_t pos = 0; pos < srcPaths.size();) {
                 size_t sepPos = srcPaths.find('\0', pos) + 1;
@@ -128,23 +308,48 @@ inline void ReloadWatcher::Poll(DeviceContext* ctx) {
                 const char* entryPoint = srcPaths.data() + sepPos;
 
                 if (relSourcePath.compare(sourcePath) != 0) {
-                    assert(modules.empty());
+                    assert(job->Modules.empty());
+                    break;
+                }
+                // Entries for permutations other than the first are keyed as `Name#Variant`.
+                const ModuleDesc& params = info.ModuleParams[job->Modules.size()];
+                uint32_t variant = params.Variant;
+                auto entry = entries.find(variant != 0 ? std::string(entryPoint) + "#" + std::to_string(variant) : std::string(entryPoint));
+                if (entry == entries.end()) {
+                    ctx->Log(LogLevel::Warn, "[ShaderReload] Could not reload '%s'. (Entry point '%s' no longer exists)", relSourcePath.filename().string().c_str(), entryPoint);
+                    job->Modules.clear();
                     break;
                 }
+                auto& [hash, code] = entry->second;
+                hasChanges |= hash != info.ModuleHashes[job->Modules.size()];
+                newHashes.push_back(hash);
 
-                assert((uintptr_t)spirvData.data() % 4 == 0);
-                modules.push_back({
-                    .Code = (const uint32_t*)spirvData.data(),
-                    .CodeSize = (uint32_t)spirvData.size(),
-                    .Flags = ModuleDesc::kNoReload,
+                job->Code.push_back(code);
+                job->Modules.push_back({
+                    .Code = code->data(),
+                    .CodeSize = (uint32_t)(code->size() * 4),
+                    .Flags = params.Flags,
                     .EntryPoint = entryPoint,
                     .SourcePath = sourcePath,
+                    .Variant = variant,
+                    .RequiredSubgroupSize = params.RequiredSubgroupSize,
                 });
                 pos = srcPaths.find('\0', sepPos) + 1;
             }
-            if (!modules.empty()) {
-                info.ReloadCb(modules);
+            // Skip pipelines whose code didn't actually change, e.g. after edits to unrelated entry points or comments.
+            if (job->Modules.empty() || !hasChanges) continue;
+
+            ctx->Log(LogLevel::Info, "Reloading pipeline '%s'", info.Name.data());
+            info.ModuleHashes = std::move(newHashes);
+
+            job->Target = pipe;
+            job->TrackingId = info.TrackingId;
+            job->ReloadCb = info.ReloadCb;
+            {
+                std::lock_guard lock(_jobMutex);
+                _pendingJobs.push_back(std::move(job));
             }
+            _jobCond.notify_one();
         }
     }
     _stdoutBuffer.erase(0, (size_t)(buffer.data() - _stdoutBuffer.data()));
@@ -0,0 +1,86 @@
+#include "CpuDispatcher.h"
+
+#include <algorithm>
+
+namespace havx {
+
+CpuDispatcher::CpuDispatcher(uint32_t numThreads) {
+    if (numThreads == 0) numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    for (uint32_t i = 1; i < numThreads; i++) {
+        _workers.emplace_back([this]() { RunWorker(); });
+    }
+}
+CpuDispatcher::~CpuDispatcher() {
+    {
+        std::lock_guard lock(_mutex);
+        _stopping = true;
+    }
+    _jobAvailable.notify_all();
+    for (auto& worker : _workers) worker.join();
+}
+
+void CpuDispatcher::DispatchGroups(const havk::CpuKernel& kernel, havk::vectors::uint3 numGroups, const void* params) {
+    if (numGroups.x == 0 || numGroups.y == 0 || numGroups.z == 0) return;
+
+    // Rows are split into more tiles than threads, to balance out uneven progress.
+    uint32_t numRows = numGroups.y * numGroups.z;
+    uint32_t tilesPerRow = std::clamp(GetThreadCount() * 8 / numRows, 1u, numGroups.x);
+    uint32_t tileWidth = (numGroups.x + tilesPerRow - 1) / tilesPerRow;
+    tilesPerRow = (numGroups.x + tileWidth - 1) / tileWidth;
+
+    Job job = {
+        .Kernel = &kernel,
+        .Params = params,
+        .NumGroups = numGroups,
+        .TileWidth = tileWidth,
+        .TilesPerRow = tilesPerRow,
+        .NumTiles = numRows * tilesPerRow,
+    };
+    // Late workers from the previous job may still be checking for tiles, and must not see a partially updated job.
+    std::unique_lock lock(_mutex);
+    _jobDone.wait(lock, [&]() { return _activeWorkers == 0; });
+    _job = job;
+    _jobId++;
+    _nextTile = 0;
+    lock.unlock();
+
+    if (job.NumTiles > 1) _jobAvailable.notify_all();
+    RunTiles(job);
+
+    lock.lock();
+    _jobDone.wait(lock, [&]() { return _activeWorkers == 0; });
+}
+
+void CpuDispatcher::RunWorker() {
+    uint64_t lastJobId = 0;
+
+    while (true) {
+        std::unique_lock lock(_mutex);
+        _jobAvailable.wait(lock, [&]() { return _stopping || _jobId != lastJobId; });
+        if (_stopping) break;
+
+        Job job = _job;
+        lastJobId = _jobId;
+        _activeWorkers++;
+        lock.unlock();
+
+        RunTiles(job);
+
+        lock.lock();
+        if (--_activeWorkers == 0) _jobDone.notify_all();
+    }
+}
+
+void CpuDispatcher::RunTiles(const Job& job) {
+    for (uint32_t tile; (tile = _nextTile++) < job.NumTiles;) {
+        uint32_t row = tile / job.TilesPerRow;
+        uint32_t startX = (tile % job.TilesPerRow) * job.TileWidth;
+        uint32_t start[3] = { startX, row % job.NumGroups.y, row / job.NumGroups.y };
+        uint32_t end[3] = { std::min(startX + job.TileWidth, job.NumGroups.x), start[1] + 1, start[2] + 1 };
+
+        job.Kernel->RunGroups(job.Params, start, end);
+    }
+}
+
+};  // namespace havx
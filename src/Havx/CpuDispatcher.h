@@ -0,0 +1,59 @@
+#pragma once
+#include <Havk/Havk.h>
+
+#include <atomic>
+#include <concepts>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace havx {
+
+// Compute programs generated with `ShaderBuildTool --cpu-kernels`.
+template<typename T>
+concept CpuProgramShape = havk::ComputeProgramShape<T> && std::same_as<decltype(T::CpuKernel), const havk::CpuKernel>;
+
+// Runs compute kernels compiled through Slang's C++ target on a thread pool, without a GPU.
+// Work groups are split into tiles along X, and each tile runs serially on a single thread.
+//
+// Pointers in parameter structs are plain host addresses, see `HostPtr()`.
+// Descriptor handles, global parameters and group barriers are not supported by the CPU target.
+struct CpuDispatcher {
+    // Uses all hardware threads if `numThreads` is 0. The calling thread counts as one of them.
+    CpuDispatcher(uint32_t numThreads = 0);
+    ~CpuDispatcher();
+
+    template<CpuProgramShape TCompute>
+    void Dispatch(havk::vectors::uint3 numInvocs, const TCompute::Params& pc) {
+        auto numGroups = (numInvocs + TCompute::GroupSize - 1u) / TCompute::GroupSize;
+        DispatchGroups(TCompute::CpuKernel, numGroups, &pc);
+    }
+    // Blocks until all groups have completed.
+    void DispatchGroups(const havk::CpuKernel& kernel, havk::vectors::uint3 numGroups, const void* params);
+
+    uint32_t GetThreadCount() const { return (uint32_t)_workers.size() + 1; }
+
+private:
+    struct Job {
+        const havk::CpuKernel* Kernel;
+        const void* Params;
+        havk::vectors::uint3 NumGroups;
+        uint32_t TileWidth, TilesPerRow, NumTiles;
+    };
+    std::vector<std::thread> _workers;
+    std::mutex _mutex;
+    std::condition_variable _jobAvailable, _jobDone;
+    Job _job = {};
+    uint64_t _jobId = 0;
+    uint32_t _activeWorkers = 0;
+    bool _stopping = false;
+    std::atomic<uint32_t> _nextTile = 0;
+
+    void RunWorker();
+    void RunTiles(const Job& job);
+};
+
+template<typename T>
+havk::DevicePtr<T> HostPtr(T* ptr) { return { (VkDeviceAddress)(uintptr_t)ptr }; }
+
+};  // namespace havx
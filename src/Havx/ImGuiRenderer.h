@@ -131,20 +131,27 @@ struct ImGuiRenderer {
 
     void Render(havk::Image& image, havk::CommandList& cmdList) {
         ImGui::Render();
+        RenderOverlay(ImGui::GetDrawData(), image, cmdList);
 
+        if (ImGui::GetIO().ConfigFlags & ImGuiConfigFlags_ViewportsEnable) {
+            ImGui::UpdatePlatformWindows();
+            ImGui::RenderPlatformWindowsDefault();
+        }
+    }
+
+    // Render given draw data on top of image. Unlike `Render()`, this doesn't call `ImGui::Render()` or render
+    // platform windows, so it can be used with draw data snapshots from another thread (multi-viewports must be
+    // disabled in that case). Texture updates still modify the ImTextureData objects referenced by the draw data.
+    // ImDrawList callbacks are invoked from the calling thread.
+    void RenderOverlay(ImDrawData* drawData, havk::Image& image, havk::CommandList& cmdList) {
         VkFormat unormFormat = GetUNormFormat(image.Format);
         auto unormView = image.Format != unormFormat ? image.GetSubView({ .Format = unormFormat }) : image;
         cmdList.BeginRendering({
             .Attachments = { havk::RenderAttachment::Overlay(unormView) },
             .SrcStages = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
         });
-        RenderDrawLists(ImGui::GetDrawData(), cmdList);
+        RenderDrawLists(drawData, cmdList);
         cmdList.EndRendering();
-
-        if (ImGui::GetIO().ConfigFlags & ImGuiConfigFlags_ViewportsEnable) {
-            ImGui::UpdatePlatformWindows();
-            ImGui::RenderPlatformWindowsDefault();
-        }
     }
 
     void RenderDrawLists(ImDrawData* draw_data, havk::CommandList& cmdList) {
@@ -156,11 +163,7 @@ struct ImGuiRenderer {
         // Catch up with texture updates. Most of the times, the list will have 1 element with an OK status, aka nothing to do.
         // (This almost always points to ImGui::GetPlatformIO().Textures[] but is part of ImDrawData to allow overriding or disabling
         // texture updates).
-        if (draw_data->Textures != nullptr) {
-            for (ImTextureData* tex : *draw_data->Textures) {
-                if (tex->Status != ImTextureStatus_OK) UpdateTexture(tex);
-            }
-        }
+        UpdateTextures(draw_data);
 
         if (draw_data->TotalVtxCount == 0) return;
 
@@ -171,8 +174,9 @@ struct ImGuiRenderer {
         // Setup desired Vulkan state
         BindRenderState(draw_data, cmdList, fb_width, fb_height, *renderBuffer);
 
+        // Not using `ImGuiPlatformIO::Renderer_RenderState` as that is shared with the main thread.
         RenderState state = { .Instance = this, .DrawData = draw_data, .CmdList = cmdList };
-        ImGui::GetPlatformIO().Renderer_RenderState = &state;
+        t_currRenderState = &state;
 
         auto linearSampler = Device->DescriptorHeap->GetSampler({
             .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
@@ -252,7 +256,24 @@ struct ImGuiRenderer {
         }
         renderBuffer->Flush(0, VK_WHOLE_SIZE);
 
-        ImGui::GetPlatformIO().Renderer_RenderState = nullptr;
+        t_currRenderState = nullptr;
+    }
+
+    // Apply pending texture updates referenced by draw data.
+    void UpdateTextures(ImDrawData* draw_data) {
+        if (draw_data->Textures == nullptr) return;
+
+        for (ImTextureData* tex : *draw_data->Textures) {
+            if (tex->Status != ImTextureStatus_OK) UpdateTexture(tex);
+        }
+    }
+    static bool HasPendingTextureUpdates(ImDrawData* draw_data) {
+        if (draw_data->Textures == nullptr) return false;
+
+        for (ImTextureData* tex : *draw_data->Textures) {
+            if (tex->Status != ImTextureStatus_OK) return true;
+        }
+        return false;
     }
 
     // Get ImGui texture ID. The image *must* be visible to STAGE_FRAGMENT and under READ_ONLY or GENERAL layout
@@ -265,13 +286,15 @@ struct ImGuiRenderer {
     static havk::Image* GetTexturePtr(ImTextureID id) { return (havk::Image*)(id & ~uintptr_t(7)); }
     static VkFilter GetTextureFilter(ImTextureID id) { return (VkFilter)(id & 1); }
 
+    // Add a draw list callback for recording custom commands. The callback runs on whichever thread renders
+    // the draw data, which is the render thread under `MainWindow::RunPipelinedLoop()`.
     template<std::invocable<ImDrawData*, havk::CommandList&, VkFormat> TCallback>
     static void AddShaderCallback(ImDrawList* drawList, TCallback&& cb) {
         auto cb_ = new TCallback(std::move(cb));
 
         drawList->AddCallback([](const ImDrawList* drawList, const ImDrawCmd* cmd) {
             auto* cb_ = (TCallback*)cmd->UserCallbackData;
-            auto state = (RenderState*)ImGui::GetPlatformIO().Renderer_RenderState;
+            auto state = t_currRenderState;
             (*cb_)(state->DrawData, state->CmdList, state->Instance->OutputFormat);
             delete cb_;
         }, cb_);
@@ -284,6 +307,8 @@ struct ImGuiRenderer {
     };
 
 private:
+    static inline thread_local RenderState* t_currRenderState = nullptr;
+
     void BindRenderState(ImDrawData* draw_data, havk::CommandList& cmdList, int fb_width, int fb_height, havk::Buffer& renderBuffer) {
         cmdList.SetViewport({ 0, 0, (float)fb_width, (float)fb_height, 0.0f, 1.0f });
 
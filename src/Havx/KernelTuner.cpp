@@ -0,0 +1,201 @@
+#include "KernelTuner.h"
+#include "SystemUtils.h"
+
+#include <algorithm>
+
+namespace havx {
+
+KernelTuner::KernelTuner(havk::DeviceContext* ctx, std::string_view resultsPath) : _ctx(ctx), _resultsPath(resultsPath) {
+    VkQueryPoolCreateInfo poolCI = {
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = VK_QUERY_TYPE_TIMESTAMP,
+        .queryCount = kMaxPendingQueries * 2,
+    };
+    HAVK_CHECK(vkCreateQueryPool(ctx->Device, &poolCI, nullptr, &_queryPool));
+    vkResetQueryPool(ctx->Device, _queryPool, 0, poolCI.queryCount);
+
+    // Assumes tuned programs are dispatched on the main queue.
+    uint32_t numFamilies = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(ctx->PhysicalDevice.Handle, &numFamilies, nullptr);
+    auto families = std::vector<VkQueueFamilyProperties>(numFamilies);
+    vkGetPhysicalDeviceQueueFamilyProperties(ctx->PhysicalDevice.Handle, &numFamilies, families.data());
+    uint32_t validBits = families[ctx->GetQueue(havk::QueueDomain::Main)->FamilyIndex].timestampValidBits;
+    _timestampMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+
+    for (uint32_t i = kMaxPendingQueries; i > 0; i--) {
+        _freeSlots.push_back(i - 1);
+    }
+
+    for (uint8_t byte : ctx->PhysicalDevice.IdProps.deviceUUID) {
+        char hex[3];
+        snprintf(hex, sizeof(hex), "%02x", byte);
+        _deviceId += hex;
+    }
+    LoadResults();
+}
+KernelTuner::~KernelTuner() {
+    vkDestroyQueryPool(_ctx->Device, _queryPool, nullptr);
+}
+
+uint32_t KernelTuner::BeginDispatch(havk::CommandList& cmdList, const havk::ModuleDesc& mod, uint32_t numCandidates,
+                                   havk::vectors::uint3 numGroups) {
+    if (!_pendingQueries.empty()) PollResults();
+
+    ProgramState& state = GetState(mod, numCandidates);
+    if (state.Selected >= 0) return (uint32_t)state.Selected;
+
+    // Timings don't scale linearly with dispatch size, so candidates are only compared on dispatches of the same size.
+    uint64_t totalGroups = (uint64_t)numGroups.x * numGroups.y * numGroups.z;
+    auto iter = state.SamplesBySize.find(totalGroups);
+
+    if (iter == state.SamplesBySize.end()) {
+        if (state.SamplesBySize.size() >= kMaxSizesPerProgram) return 0;
+
+        SizeSamples newSize = { .NumGroups = totalGroups, .Samples = std::vector<std::vector<float>>(numCandidates) };
+        iter = state.SamplesBySize.emplace(totalGroups, std::move(newSize)).first;
+    }
+    SizeSamples& size = iter->second;
+
+    // Cycle through candidates that still need samples.
+    uint32_t candidate = size.NextCandidate;
+    while (size.Samples[candidate].size() >= kSamplesPerCandidate) {
+        candidate = (candidate + 1) % numCandidates;
+    }
+    if (_freeSlots.empty()) return candidate;
+
+    size.NextCandidate = (candidate + 1) % numCandidates;
+
+    _activeQuery = { .Program = &state, .Size = &size, .Candidate = candidate, .Slot = _freeSlots.back() };
+    _hasActiveQuery = true;
+    _freeSlots.pop_back();
+
+    vkCmdWriteTimestamp(cmdList.Handle, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, _queryPool, _activeQuery.Slot * 2 + 0);
+    return candidate;
+}
+void KernelTuner::EndDispatch(havk::CommandList& cmdList, const havk::ModuleDesc& mod) {
+    if (!_hasActiveQuery) return;
+
+    vkCmdWriteTimestamp(cmdList.Handle, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, _queryPool, _activeQuery.Slot * 2 + 1);
+    _pendingQueries.push_back(_activeQuery);
+    _hasActiveQuery = false;
+}
+
+void KernelTuner::Reset() {
+    _ctx->WaitIdle();
+    PollResults();
+
+    // Pending queries from dropped command lists would never become available.
+    for (auto& query : _pendingQueries) {
+        vkResetQueryPool(_ctx->Device, _queryPool, query.Slot * 2, 2);
+        _freeSlots.push_back(query.Slot);
+    }
+    _pendingQueries.clear();
+    _programs.clear();
+    _savedResults.clear();
+    SaveResults();
+}
+
+KernelTuner::ProgramState& KernelTuner::GetState(const havk::ModuleDesc& mod, uint32_t numCandidates) {
+    auto iter = _programs.find(&mod);
+    if (iter != _programs.end()) [[likely]] return iter->second;
+
+    ProgramState& state = _programs[&mod];
+    state.Key = std::string(mod.SourcePath ? mod.SourcePath : "") + ":" + mod.EntryPoint + "#" + std::to_string(mod.Variant);
+    state.NumCandidates = numCandidates;
+
+    // Results are discarded if candidates changed, even though they could only have been reordered.
+    auto saved = _savedResults.find(state.Key);
+    if (saved != _savedResults.end() && saved->second.NumCandidates == numCandidates && saved->second.Selected < numCandidates) {
+        state.Selected = (int32_t)saved->second.Selected;
+    } else if (numCandidates == 1 || _timestampMask == 0) {
+        state.Selected = 0;
+    }
+    return state;
+}
+
+void KernelTuner::PollResults() {
+    double msPerTick = _ctx->PhysicalDevice.Props.limits.timestampPeriod * 1e-6;
+
+    std::erase_if(_pendingQueries, [&](const PendingQuery& query) {
+        uint64_t data[4];  // [ts0, avail0, ts1, avail1]
+        vkGetQueryPoolResults(_ctx->Device, _queryPool, query.Slot * 2, 2, sizeof(data), data, sizeof(uint64_t) * 2,
+                              VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+        if (data[1] == 0 || data[3] == 0) return false;
+
+        vkResetQueryPool(_ctx->Device, _queryPool, query.Slot * 2, 2);
+        _freeSlots.push_back(query.Slot);
+
+        // Sizes are dropped once a candidate is selected.
+        ProgramState& state = *query.Program;
+        if (state.Selected >= 0) return true;
+
+        SizeSamples& size = *query.Size;
+        uint64_t elapsedTicks = (data[2] - data[0]) & _timestampMask;
+        size.Samples[query.Candidate].push_back((float)((double)elapsedTicks * msPerTick));
+
+        auto isDone = [&](auto& samples) { return samples.size() >= kSamplesPerCandidate; };
+        if (std::all_of(size.Samples.begin(), size.Samples.end(), isDone)) {
+            SelectBest(state, size);
+        }
+        return true;
+    });
+}
+
+void KernelTuner::SelectBest(ProgramState& state, SizeSamples& size) {
+    // Median is less sensitive to outliers from cold caches and clock ramp-up.
+    std::vector<float> medians;
+    for (auto& samples : size.Samples) {
+        std::nth_element(samples.begin(), samples.begin() + (ptrdiff_t)(samples.size() / 2), samples.end());
+        medians.push_back(samples[samples.size() / 2]);
+    }
+    auto best = std::min_element(medians.begin(), medians.end());
+    state.Selected = (int32_t)(best - medians.begin());
+
+    _ctx->Log(havk::LogLevel::Info, "[KernelTuner] Selected candidate %d for '%s' (%.3fms, worst %.3fms, %llu groups)", state.Selected,
+              state.Key.data(), *best, *std::max_element(medians.begin(), medians.end()), (unsigned long long)size.NumGroups);
+    state.SamplesBySize.clear();
+
+    _savedResults[state.Key] = { .NumCandidates = state.NumCandidates, .Selected = (uint32_t)state.Selected };
+    SaveResults();
+}
+
+// Results are saved as tab-separated lines of `deviceUUID key numCandidates selected`.
+void KernelTuner::LoadResults() {
+    if (_resultsPath.empty()) return;
+
+    auto data = ReadFileBytes(_resultsPath);
+    std::string_view text((char*)data.data(), data.size());
+
+    for (size_t pos = 0; pos < text.size();) {
+        size_t end = std::min(text.find('\n', pos), text.size());
+        std::string_view line = text.substr(pos, end - pos);
+        pos = end + 1;
+
+        size_t sep1 = line.find('\t'), sep2 = line.rfind('\t');
+        size_t sep0 = line.substr(0, sep2).rfind('\t');
+        if (sep1 == std::string_view::npos || sep0 <= sep1 || sep2 <= sep0) continue;
+
+        if (line.substr(0, sep1) != _deviceId) {
+            _otherDeviceResults.append(line).append(1, '\n');
+            continue;
+        }
+        std::string key(line.substr(sep1 + 1, sep0 - sep1 - 1));
+        _savedResults[key] = {
+            .NumCandidates = (uint32_t)strtoul(std::string(line.substr(sep0 + 1, sep2 - sep0 - 1)).data(), nullptr, 10),
+            .Selected = (uint32_t)strtoul(std::string(line.substr(sep2 + 1)).data(), nullptr, 10),
+        };
+    }
+}
+void KernelTuner::SaveResults() {
+    if (_resultsPath.empty()) return;
+
+    std::string text = _otherDeviceResults;
+    for (auto& [key, result] : _savedResults) {
+        text += _deviceId + "\t" + key + "\t" + std::to_string(result.NumCandidates) + "\t" + std::to_string(result.Selected) + "\n";
+    }
+    if (!WriteFileBytes(_resultsPath, text.data(), text.size(), true)) {
+        _ctx->Log(havk::LogLevel::Warn, "[KernelTuner] Failed to save results to '%s'", _resultsPath.data());
+    }
+}
+
+};  // namespace havx
@@ -0,0 +1,83 @@
+#pragma once
+#include <Havk/Havk.h>
+
+#include <string>
+#include <unordered_map>
+
+namespace havx {
+
+// Online auto-tuner for compute programs declaring `// @tune` specialization constants.
+//
+// The first dispatches of each program cycle through candidates, which are timed with timestamp queries,
+// and the fastest one is picked for all dispatches afterwards. Since a single candidate runs per dispatch,
+// tuning has no side effects other than a few slower dispatches, but inputs at first use should be representative.
+// Candidates are only compared on dispatches with the same number of groups, and the first size for which all
+// candidates were sampled decides.
+//
+// Results are persisted per device UUID, so tuning only happens once per device and driver.
+//
+// Current limitations:
+// - Not thread safe
+// - Command lists that are recorded but never submitted will leak query slots
+// - Programs whose dispatch size changes every time are never tuned
+struct KernelTuner final : havk::ProgramTuner {
+    static constexpr uint32_t kSamplesPerCandidate = 5;
+    static constexpr uint32_t kMaxPendingQueries = 128;
+    static constexpr uint32_t kMaxSizesPerProgram = 8;
+
+    // Loads and saves results from `resultsPath`, if not empty.
+    KernelTuner(havk::DeviceContext* ctx, std::string_view resultsPath);
+    ~KernelTuner();
+
+    uint32_t BeginDispatch(havk::CommandList& cmdList, const havk::ModuleDesc& mod, uint32_t numCandidates,
+                           havk::vectors::uint3 numGroups) override;
+    void EndDispatch(havk::CommandList& cmdList, const havk::ModuleDesc& mod) override;
+
+    // Discards all results and starts tuning again on the next dispatches.
+    void Reset();
+
+private:
+    struct SizeSamples {
+        uint64_t NumGroups;
+        uint32_t NextCandidate = 0;
+        std::vector<std::vector<float>> Samples;  // Elapsed milliseconds per candidate
+    };
+    struct ProgramState {
+        std::string Key;  // `SourcePath:EntryPoint#Variant`
+        uint32_t NumCandidates;
+        int32_t Selected = -1;
+        std::unordered_map<uint64_t, SizeSamples> SamplesBySize;  // Keyed by total number of groups
+    };
+    struct PendingQuery {
+        ProgramState* Program;
+        SizeSamples* Size;
+        uint32_t Candidate;
+        uint32_t Slot;
+    };
+    struct SavedResult {
+        uint32_t NumCandidates;
+        uint32_t Selected;
+    };
+
+    havk::DeviceContext* _ctx;
+    VkQueryPool _queryPool = nullptr;
+    uint64_t _timestampMask = 0;  // Of `timestampValidBits`, zero if timestamps are not supported.
+    std::vector<uint32_t> _freeSlots;
+    std::vector<PendingQuery> _pendingQueries;
+    PendingQuery _activeQuery = {};
+    bool _hasActiveQuery = false;
+
+    std::unordered_map<const havk::ModuleDesc*, ProgramState> _programs;
+    std::unordered_map<std::string, SavedResult> _savedResults;  // For current device
+    std::string _otherDeviceResults;                             // Lines kept as is when saving
+    std::string _resultsPath;
+    std::string _deviceId;
+
+    ProgramState& GetState(const havk::ModuleDesc& mod, uint32_t numCandidates);
+    void PollResults();
+    void SelectBest(ProgramState& state, SizeSamples& size);
+    void LoadResults();
+    void SaveResults();
+};
+
+};  // namespace havx
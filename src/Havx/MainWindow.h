@@ -12,7 +12,12 @@
 #include "SystemUtils.h"
 #include "ImGuiRenderer.h"
 
+#include <condition_variable>
+#include <exception>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
+#include <utility>
 
 namespace havx {
 
@@ -191,6 +196,133 @@ public:
         OverlayRenderer.reset();
     }
 
+    // Pipelined variant of `RunLoop()`, which overlaps CPU work of consecutive frames across two threads:
+    // - Main thread: event polling, ImGui, and `updateFrame()` for frame N+1.
+    // - Render thread: `renderFrame()`, overlay recording, submit and present for frame N.
+    //
+    // Frame data and ImGui draw lists are double-buffered, so neither thread will block on the other
+    // unless it gets more than one frame ahead. Caveats:
+    // - Havk objects are not thread safe. `updateFrame()` should only produce CPU state into TFrameData,
+    //   all device work (including uploads) must be done from `renderFrame()`.
+    // - ImGui multi-viewports are disabled, because platform windows must be rendered from the main thread.
+    // - ImGui texture updates (e.g. font atlas growth) will briefly drain the pipeline.
+    template<typename TFrameData>
+    void RunPipelinedLoop(havk::Swapchain& swapchain, std::invocable<TFrameData&> auto updateFrame,
+                          std::invocable<const TFrameData&, havk::Image&, havk::CommandList&> auto renderFrame) {
+        struct FrameSlot {
+            TFrameData Data = {};
+            havk::vectors::uint2 Size;
+            ImDrawData DrawData;
+            bool HasOverlay = false;
+            bool Pending = false;  // Published by main thread, waiting to be rendered.
+        };
+        FrameSlot slots[2];
+        std::mutex mutex;
+        std::condition_variable cond;
+        bool stopRequested = false;
+        std::exception_ptr renderError;
+
+        if (OverlayRenderer != nullptr) {
+            ImGui::GetIO().ConfigFlags &= ~ImGuiConfigFlags_ViewportsEnable;
+        }
+
+        std::thread renderThread([&]() {
+            try {
+                for (uint32_t readIndex = 0;; readIndex ^= 1) {
+                    FrameSlot& slot = slots[readIndex];
+                    {
+                        std::unique_lock lock(mutex);
+                        cond.wait(lock, [&] { return slot.Pending || stopRequested; });
+                        if (!slot.Pending) break;
+                    }
+                    auto [frame, cmds] = swapchain.AcquireImage(slot.Size);
+                    swapchain.Context->GarbageCollect();
+
+                    renderFrame(std::as_const(slot.Data), *frame, *cmds);
+
+                    if (slot.HasOverlay) {
+                        OverlayRenderer->RenderOverlay(&slot.DrawData, *frame, *cmds);
+                    }
+                    swapchain.Present();
+
+                    std::lock_guard lock(mutex);
+                    slot.Pending = false;
+                    cond.notify_all();
+                }
+            } catch (...) {
+                std::lock_guard lock(mutex);
+                renderError = std::current_exception();
+                slots[0].Pending = slots[1].Pending = false;
+                cond.notify_all();
+            }
+        });
+
+        uint32_t writeIndex = 0;
+
+        while (!glfwWindowShouldClose(Handle)) {
+            glfwPollEvents();
+
+            int width, height;
+            glfwGetFramebufferSize(Handle, &width, &height);
+
+            if (width == 0 || height == 0) {
+                glfwWaitEvents();
+                continue;
+            }
+            FrameSlot& slot = slots[writeIndex];
+            {
+                // Slot was last published two frames ago, this only blocks if the render thread is falling behind.
+                std::unique_lock lock(mutex);
+                cond.wait(lock, [&] { return !slot.Pending; });
+                if (renderError) break;
+            }
+            NewFrame();
+
+            slot.Size = { width, height };
+            updateFrame(slot.Data);
+
+            if (OverlayRenderer != nullptr) {
+                if (ImGui::IsKeyPressed(ImGuiKey_F11)) {
+                    ToggleFullScreen();
+                }
+                ImGui::Render();
+                ImDrawData* drawData = ImGui::GetDrawData();
+
+                if (ImGuiRenderer::HasPendingTextureUpdates(drawData)) {
+                    // Wait for render thread to go idle, since texture updates need to access the device.
+                    std::unique_lock lock(mutex);
+                    cond.wait(lock, [&] { return !slots[0].Pending && !slots[1].Pending; });
+                    OverlayRenderer->UpdateTextures(drawData);
+                }
+                CloneDrawData(slot.DrawData, *drawData);
+                slot.HasOverlay = true;
+            }
+            {
+                std::lock_guard lock(mutex);
+                slot.Pending = true;
+                cond.notify_all();
+            }
+            writeIndex ^= 1;
+            WaitFrameInterval();
+        }
+        {
+            std::lock_guard lock(mutex);
+            stopRequested = true;
+            cond.notify_all();
+        }
+        renderThread.join();
+
+        for (FrameSlot& slot : slots) {
+            for (ImDrawList* list : slot.DrawData.CmdLists) IM_DELETE(list);
+        }
+        // Must release ImGui renderer before device is destroyed
+        OverlayRenderer.reset();
+
+        if (renderError) {
+            std::rethrow_exception(renderError);
+        }
+    }
+
     static constexpr double kFrameLimitMonitor = -1, kFrameLimitNone = DBL_MAX;
 
     void SetFrameRateLimit(double maxFramesPerSec, havk::Swapchain* swapchain) {
@@ -217,6 +349,15 @@ public:
         return mode->refreshRate;
     }
 
+    // Deep copy draw lists, so they can be rendered after the next call to `ImGui::NewFrame()`.
+    static void CloneDrawData(ImDrawData& dest, const ImDrawData& src) {
+        for (ImDrawList* list : dest.CmdLists) IM_DELETE(list);
+
+        dest = src;
+        dest.Textures = nullptr;  // Updates must be applied by the caller
+        for (ImDrawList*& list : dest.CmdLists) list = list->CloneOutput();
+    }
+
     void ToggleFullScreen() {
         bool isFullscreen = glfwGetWindowMonitor(Handle) != nullptr;
 
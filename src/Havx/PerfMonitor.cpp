@@ -1,837 +1,1403 @@
-#include "PerfMonitor.h"
+#include "PerfMonitorInternal.h"
 #include "SystemUtils.h"
-
-#define IMGUI_DEFINE_MATH_OPERATORS
-#include <imgui.h>
-#include <imgui_internal.h>
-#include <implot.h>
-#include <implot_internal.h>
+#include "Yson.h"
 
 #include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 namespace havx {
 
-constexpr int kMaxStackDepth = 32;
-constexpr int kSampleHistorySize = 256;
-constexpr int kTsqSlotsPerFrame = 2048;
-
-struct Scope {
-    std::vector<std::unique_ptr<Scope>> Children;
-    uint32_t LastRecordedFrameNo = 0;
-    uint32_t LastTsqSlot[2] = {};
-    double LastHostBeginTime = 0;
-    float ElapsedSamplesCPU[kSampleHistorySize] = {};
-    float ElapsedSamplesGPU[kSampleHistorySize] = {};
-    char Label[256] = "";
-    uint32_t Color = 0;
-    bool ShowInPlot = true;
+static std::mutex g_threadTracesMutex;
+static std::vector<std::unique_ptr<ThreadTrace>> g_threadTraces;
+static std::atomic<ThreadTrace*> g_ownerTrace;  // Trace of thread calling NewFrame(), null if not profiling.
+static std::string g_traceRequestPath;
+static uint32_t g_traceRequestNumFrames;
+static bool g_cmdProfilingEnabled;
+static thread_local ThreadTrace* t_threadTrace;
+static std::mutex g_labelIdsMutex;
+static std::unordered_map<std::string, uint32_t> g_labelIds;
+static uint32_t g_numContexts;
+
+// Releases the trace of an exiting thread, so that threads created later can reuse it along with its timeline lane.
+// Kept apart from `t_threadTrace` because thread_locals with destructors are slower to access.
+struct ThreadTraceOwner {
+    ThreadTrace* Trace = nullptr;
+
+    ~ThreadTraceOwner() {
+        if (Trace == nullptr) return;
+        std::lock_guard lock(g_threadTracesMutex);
+        Trace->InUse = false;
+    }
 };
-struct PerfmonContext {
-    havk::DeviceContext* Device = nullptr;
-    havk::CommandList* CmdList = nullptr;
-
-    VkQueryPool TsqPool;
-    uint32_t TsqFirstSlot = 0, TsqNextSlot = 0;
-    uint32_t TsqPrevFrameNumSlots = 0;
-    uint32_t CurrFrameNo = 0;
-    double PrevFrameTime = 0;
-    float ElapsedFrameIntervals[kSampleHistorySize] = {};
-
-    Scope RootScope;
-    Scope* Stack[kMaxStackDepth];
-    uint32_t StackDepth = 0;
-
-    // UI
-    Scope *PrevSelectedScope = nullptr, *PrevHoveredScope = nullptr;
-
-    // VK_KHR_performance_query
-    VkQueryPool PerfQueryPool = nullptr;
-    uint32_t PerfNumReqPasses = 0;
-    uint32_t PerfQueryRecordedFrameNo = UINT_MAX;
-    bool PerfQueryWantRecord = false;
-    bool PerfQueryMustRecreate = false;
-
-    std::vector<VkPerformanceCounterKHR> HwCounters;
-    std::vector<VkPerformanceCounterDescriptionKHR> HwCounterDescs;
-
-    std::vector<uint32_t> HwCounterEnabledIndices;
-    std::vector<VkPerformanceCounterResultKHR> HwCounterResults[2];  // Baseline and SavedRef
-
-    PFN_vkAcquireProfilingLockKHR vfn_AcquireProfilingLockKHR;
-    PFN_vkReleaseProfilingLockKHR vfn_ReleaseProfilingLockKHR;
-    PFN_vkGetPhysicalDeviceQueueFamilyPerformanceQueryPassesKHR vfn_GetPhysicalDeviceQueueFamilyPerformanceQueryPassesKHR;
-
-    PerfmonContext(havk::DeviceContext* ctx) : Device(ctx) {
-        VkQueryPoolCreateInfo tsPoolCI = {
-            .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
-            .queryType = VK_QUERY_TYPE_TIMESTAMP,
-            .queryCount = kTsqSlotsPerFrame * 2,
-        };
-        HAVK_CHECK(vkCreateQueryPool(Device->Device, &tsPoolCI, nullptr, &TsqPool));
-        vkResetQueryPool(Device->Device, TsqPool, 0, tsPoolCI.queryCount);
-
-        if (ctx->PhysicalDevice.Features.PerformanceQuery) {
-            InitializeHwCounters();
+static thread_local ThreadTraceOwner t_threadTraceOwner;
+
+static ThreadTrace* GetThreadTrace() {
+    if (t_threadTrace == nullptr) [[unlikely]] {
+        std::lock_guard lock(g_threadTracesMutex);
+        ThreadTrace* trace = nullptr;
+
+        // Skip traces with pending events, they would be attributed to the new thread otherwise.
+        for (auto& freeTrace : g_threadTraces) {
+            if (freeTrace->InUse || freeTrace.get() == g_ownerTrace.load(std::memory_order_relaxed)) continue;
+            if (freeTrace->ReadPos.load(std::memory_order_relaxed) != freeTrace->WritePos.load(std::memory_order_relaxed)) continue;
+
+            trace = freeTrace.get();
+            trace->InUse = true;
+            trace->StackDepth = 0;
+            break;
         }
-        ctx->Log(havk::LogLevel::Debug, "Bound PerfMon to device context %p (%s)", ctx, ctx->PhysicalDevice.Props.deviceName);
+        if (trace == nullptr) {
+            trace = g_threadTraces.emplace_back(std::make_unique<ThreadTrace>()).get();
+            trace->Index = (uint32_t)g_threadTraces.size() - 1;
+        }
+        snprintf(trace->Name, sizeof(trace->Name), "Thread %u", trace->Index);
+        t_threadTraceOwner.Trace = trace;
+        t_threadTrace = trace;
     }
-    ~PerfmonContext() {
-        Device->WaitIdle();
-        vkDestroyQueryPool(Device->Device, TsqPool, nullptr);
+    return t_threadTrace;
+}
 
-        if (PerfQueryPool) {
-            vkDestroyQueryPool(Device->Device, PerfQueryPool, nullptr);
-            vfn_ReleaseProfilingLockKHR(Device->Device);
+// Scopes with equal labels get the same id, even if entered from different call sites.
+static uint32_t InternLabel(const char* label) {
+    std::lock_guard lock(g_labelIdsMutex);
+    auto [iter, inserted] = g_labelIds.try_emplace(label, (uint32_t)g_labelIds.size() + 1);
+    return iter->second;
+}
+
+// Streams Chrome trace-event JSON to a file from a background thread, so that captures don't stall the frame.
+// Chunks must be a sequence of events, each followed by a comma.
+struct TraceWriter {
+    FILE* File = nullptr;
+    std::thread Worker;
+    std::mutex Mutex;
+    std::condition_variable DataAvailable;
+    std::string PendingData;
+    bool Stopping = false;
+
+    TraceWriter(const std::string& path) {
+#if _WIN32
+        _wfopen_s(&File, Win32_StringToWide(path).c_str(), L"wb");
+#else
+        File = fopen(path.c_str(), "wb");
+#endif
+        if (File == nullptr) return;
+
+        fputs("{\"traceEvents\":[\n", File);
+        Worker = std::thread([this]() { RunWorker(); });
+    }
+    ~TraceWriter() {
+        if (File == nullptr) return;
+        {
+            std::lock_guard lock(Mutex);
+            Stopping = true;
         }
+        DataAvailable.notify_one();
+        Worker.join();
+        fclose(File);
     }
 
-    void DrawFrame() {
-        double currTime = havx::GetMonotonicTime();
-        if (PrevFrameTime > 0.0) {
-            ElapsedFrameIntervals[CurrFrameNo % kSampleHistorySize] = currTime - PrevFrameTime;
-        } else {
-            ElapsedFrameIntervals[CurrFrameNo % kSampleHistorySize] = 0.0f;
-        }
-        PrevFrameTime = currTime;
+    void Write(std::string_view chunk) {
+        if (chunk.empty()) return;
 
-        ImGui::Begin("PerfMonitor");
+        std::lock_guard lock(Mutex);
+        PendingData += chunk;
+        DataAvailable.notify_one();
+    }
+    // Last event must not be followed by a comma.
+    void Finish(std::string_view lastEvents) {
+        std::string footer = std::string(lastEvents) + "\n],\"displayTimeUnit\":\"ms\"}\n";
+        Write(footer);
+    }
 
-        {
-            double sum = 0, max = 0;
-            int numSamples = 0;
-            for (uint32_t i = 0; i < kSampleHistorySize; i++) {
-                float value = ElapsedFrameIntervals[(CurrFrameNo - i) % kSampleHistorySize];
-                if (value == 0 || sum > 1) break;
-
-                if (value > max) max = value;
-                sum += value;
-                numSamples++;
-            }
-            sum /= numSamples;
-            ImGui::Text("Frame: %.2fms (%.1f FPS, Longest: %.2fms)", sum * 1000, 1.0 / sum, max * 1000);
-        }
-
-        const double oneMB = 1024 * 1024;
-        VmaBudget budgets[VK_MAX_MEMORY_HEAPS] = {};
-        vmaGetHeapBudgets(Device->Allocator, budgets);
-
-        const VmaBudget& memBudget = budgets[0];
-
-        ImGui::Text("Memory: %.1fMB used, %.1fMB reserved (%d allocs)",
-                    memBudget.statistics.allocationBytes / oneMB,
-                    memBudget.statistics.blockBytes / oneMB,
-                    memBudget.statistics.allocationCount);
-
-        DrawTimingsOverview();
-
-        if (HwCounters.size() > 0 && ImGui::CollapsingHeader("Hardware Counters")) {
-            DrawHwCounters();
-        }
-        ImGui::End();
-    }
-
-    void DrawTimingsOverview() {
-        Scope* currHoveredScope = nullptr;
-
-        const auto childFrameFlags = ImGuiChildFlags_AutoResizeX | ImGuiChildFlags_ResizeY;
-        const auto plotFlags = ImPlotFlags_Equal;
-
-        auto frameMinSize = ImGui::GetContentRegionAvail();
-        frameMinSize.y = std::max(200.0f, frameMinSize.y * 0.49f);
-        ImGui::BeginChild("##PerfPlotFrame", frameMinSize, childFrameFlags);
-
-        if (ImPlot::BeginPlot("##PerfTimingHistory", ImGui::GetContentRegionAvail(), ImPlotFlags_NoLegend)) {
-            ImPlot::SetupAxes(nullptr, nullptr, ImPlotAxisFlags_NoTickLabels, 0);
-            ImPlot::SetupAxisFormat(ImAxis_Y1,[](double value, char* buf, int size, void*) {
-                return snprintf(buf, (size_t)size, "%gms", value);
-            });
-            ImPlot::SetupAxisLimitsConstraints(ImAxis_X1, 0, kSampleHistorySize);
-            ImPlot::SetupAxisLimitsConstraints(ImAxis_Y1, 0, 250);
-            ImPlot::SetupAxisLimits(ImAxis_Y1, 0, 16, ImPlotCond_Once);
-            ImPlot::SetupLock();
-
-            auto leafScopes = GetPlotLeafScopes();
-            std::sort(leafScopes.begin(), leafScopes.end(), [](Scope* a, Scope* b) {
-                return a->ElapsedSamplesGPU[0] > b->ElapsedSamplesGPU[0];
-            });
-
-            float frameTicksX[kSampleHistorySize];
-            for (uint32_t i = 0; i < kSampleHistorySize; i++) frameTicksX[i] = i;
-
-            float accumHistory[2][kSampleHistorySize] = {};
-            uint32_t j = 0;
-
-            ImPlotPoint hoverPoint = ImPlot::GetPlotMousePos();
-
-            for (Scope* scope : leafScopes) {
-                ImPlotItem* plotItem = ImPlot::GetItem(scope->Label);
-
-                if (plotItem != nullptr) {
-                    if (scope->Color != 0) {
-                        plotItem->Color = scope->Color;
-                    } else {
-                        scope->Color = plotItem->Color;
-                    }
-                    plotItem->LegendHovered = PrevHoveredScope == scope;
-                }
-                float* prevHistory = accumHistory[(j + 0) % 2];
-                float* currHistory = accumHistory[(j + 1) % 2];
-                j++;
-
-                for (uint32_t j = 0; j < kSampleHistorySize; j++) {
-                    currHistory[j] = prevHistory[j] + scope->ElapsedSamplesGPU[j] * 1000;
-                }
-                ImPlotSpec spec;
-                spec.FillAlpha = 0.5f;
-
-                uint32_t hoverX = (uint32_t)round(hoverPoint.x);
-                if (hoverX < kSampleHistorySize && hoverPoint.y >= prevHistory[hoverX] && hoverPoint.y <= currHistory[hoverX]) {
-                    currHoveredScope = scope;
-                    spec.FillAlpha = 0.75f;
-                    if (plotItem != nullptr) plotItem->LegendHovered = true;
-                }
-                ImPlot::PlotShaded(scope->Label, frameTicksX, currHistory, prevHistory, kSampleHistorySize, spec);
-                ImPlot::PlotLine(scope->Label, currHistory, kSampleHistorySize, 1, 0, spec);
-            }
+    void RunWorker() {
+        std::string data;
 
-            ImPlot::EndPlot();
-        }
-        ImGui::EndChild();
+        while (true) {
+            std::unique_lock lock(Mutex);
+            DataAvailable.wait(lock, [&]() { return Stopping || !PendingData.empty(); });
+            if (PendingData.empty() && Stopping) break;
 
-        const auto scopeTableFlags = ImGuiTableFlags_Resizable | ImGuiTableFlags_Hideable | ImGuiTableFlags_Reorderable |
-                                     ImGuiTableFlags_BordersOuter | ImGuiTableFlags_NoBordersInBody;
+            std::swap(data, PendingData);
+            lock.unlock();
 
-        const auto baseNodeFlags = ImGuiTreeNodeFlags_SpanAllColumns | ImGuiTreeNodeFlags_DefaultOpen | ImGuiTreeNodeFlags_DrawLinesFull |
-                                   ImGuiTreeNodeFlags_FramePadding | ImGuiTreeNodeFlags_AllowOverlap;
+            fwrite(data.data(), 1, data.size(), File);
+            data.clear();
+        }
+    }
 
-        ImGui::BeginChild("##PerfScopeFrame", frameMinSize, childFrameFlags);
+    static void AppendSlice(std::string& out, const char* name, uint32_t pid, uint32_t tid, double beginTime, double endTime) {
+        char buffer[128];
+        snprintf(buffer, sizeof(buffer), "{\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"name\":", pid, tid,
+                 beginTime * 1e6, (endTime - beginTime) * 1e6);
+        out += buffer;
+        AppendString(out, name);
+        out += "},\n";
+    }
+    static void AppendMetadata(std::string& out, const char* kind, uint32_t pid, uint32_t tid, const char* name) {
+        char buffer[128];
+        snprintf(buffer, sizeof(buffer), "{\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"name\":\"%s\",\"args\":{\"name\":", pid, tid, kind);
+        out += buffer;
+        AppendString(out, name);
+        out += "}},\n";
+    }
+    static void AppendString(std::string& out, const char* str) {
+        out += '"';
+        for (; *str != '\0'; str++) {
+            char ch = *str;
+            if (ch == '"' || ch == '\\') {
+                out += '\\';
+                out += ch;
+            } else if ((uint8_t)ch < 0x20) {
+                char buffer[8];
+                snprintf(buffer, sizeof(buffer), "\\u%04x", ch);
+                out += buffer;
+            } else {
+                out += ch;
+            }
+        }
+        out += '"';
+    }
+};
+PerfmonContext::PerfmonContext(havk::DeviceContext* ctx) : Device(ctx) {
+    VkQueryPoolCreateInfo tsPoolCI = {
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = VK_QUERY_TYPE_TIMESTAMP,
+        .queryCount = kTsqSlotsPerFrame * kTsqFrameRing,
+    };
+    HAVK_CHECK(vkCreateQueryPool(Device->Device, &tsPoolCI, nullptr, &TsqPool));
+    vkResetQueryPool(Device->Device, TsqPool, 0, tsPoolCI.queryCount);
+    TsqSecondsPerTick = Device->PhysicalDevice.Props.limits.timestampPeriod * 1e-9;
+    RootScope.Depth = UINT32_MAX;  // So that top-level scopes are at depth 0
+    Generation = ++g_numContexts;
+
+    if (ctx->PhysicalDevice.Features.CalibratedTimestamps) {
+        InitializeClockCalibration();
+    }
+    if (ctx->PhysicalDevice.Features.PerformanceQuery) {
+        InitializeHwCounters();
+    }
+    Device->SubmitHook_ = [this](havk::CommandList& list, VkQueue queue, VkSubmitInfo& submitInfo, VkFence fence) {
+        OnSubmit(list, queue, submitInfo, fence);
+    };
+    ctx->Log(havk::LogLevel::Debug, "Bound PerfMon to device context %p (%s)", ctx, ctx->PhysicalDevice.Props.deviceName);
+}
 
-        if (ImGui::BeginTable("Scope Timings", 5, scopeTableFlags, ImGui::GetContentRegionAvail())) {
-            const float charWidth = ImGui::CalcTextSize("A").x;
+PerfmonContext::~PerfmonContext() {
+    if (Trace != nullptr) {
+        FinishTrace();
+    }
+    Device->SubmitHook_ = nullptr;
+    Device->ReusableCommandLists_ = false;
+    // Other threads must not be recording at this point, see `DeviceContext::CommandObserver_`.
+    if (Device->CommandObserver_ == this) Device->CommandObserver_ = nullptr;
+    Device->WaitIdle();
+    vkDestroyQueryPool(Device->Device, TsqPool, nullptr);
+
+    for (auto& frame : CmdQueryFrames) {
+        vkDestroyQueryPool(Device->Device, frame.TimestampPool, nullptr);
+        vkDestroyQueryPool(Device->Device, frame.StatsPool, nullptr);
+    }
+    for (auto& queries : SubmitQueryPools) {
+        vkDestroyQueryPool(Device->Device, queries->Pool, nullptr);
+        vkDestroyCommandPool(Device->Device, queries->CmdPool, nullptr);
+    }
 
-            ImGui::TableSetupColumn("Scope", ImGuiTableColumnFlags_NoHide | ImGuiTableColumnFlags_WidthStretch, charWidth * 30.0f);
-            ImGui::TableSetupColumn("CPU Avg", ImGuiTableColumnFlags_WidthStretch, charWidth * 7.0f);
-            ImGui::TableSetupColumn("%CPU", ImGuiTableColumnFlags_WidthStretch, charWidth * 4.0f);
-            ImGui::TableSetupColumn("GPU Avg", ImGuiTableColumnFlags_WidthStretch, charWidth * 7.0f);
-            ImGui::TableSetupColumn("%GPU", ImGuiTableColumnFlags_WidthStretch, charWidth * 4.0f);
-            ImGui::TableHeadersRow();
-            ImGui::PushStyleVarY(ImGuiStyleVar_CellPadding, 0);
+    if (PerfQueryPool) {
+        vkDestroyQueryPool(Device->Device, PerfQueryPool, nullptr);
+        vfn_ReleaseProfilingLockKHR(Device->Device);
+    }
+}
 
-            double histTotalElapsedCPU = 0, histTotalElapsedGPU = 0;
-            for (auto& child : RootScope.Children) {
-                for (uint32_t i = 0; i < kSampleHistorySize; i++) {
-                    histTotalElapsedCPU += child->ElapsedSamplesCPU[i];
-                    histTotalElapsedGPU += child->ElapsedSamplesGPU[i];
-                }
-            }
+void PerfmonContext::Bind(havk::CommandList* list) {
+    if (CmdList != nullptr && TsqRecording) {
+        TsqFrames[CurrFrameNo % kTsqFrameRing].NumSlots = TsqNextSlot - TsqFirstSlot;
+    }
+    PollTimestamps();
+    DrainThreadTraces();
+    DrainSubmits();
+    UpdateTraceCapture();
+
+    // Device and host clocks drift apart, resync them every now and then.
+    if (TimelineEnd - GpuClockSyncTime > 1.0) {
+        if (GpuClockCalibrated) {
+            CalibrateGpuClock();
+        } else {
+            GpuClockKnown = false;
+        }
+    }
 
-            auto drawTimingColumn = [&](Scope* scope, bool cpuTimings) {
-                float sumElapsed = 0;
-                int numSamples = 0;
-
-                for (uint32_t i = 0; i < kSampleHistorySize; i++) {
-                    float value = cpuTimings ? scope->ElapsedSamplesCPU[i] : scope->ElapsedSamplesGPU[i];
-                    if (value > 0) {
-                        sumElapsed += value;
-                        numSamples++;
-                    }
-                }
-                char buffer[32];
-                float avgElapsed = (numSamples > 0) ? (sumElapsed / numSamples) : 0.0f;
-                ImGui::Text("%s", FormatTime(buffer, avgElapsed));
-
-                ImGui::TableNextColumn();
-
-                double total = cpuTimings ? histTotalElapsedCPU : histTotalElapsedGPU;
-                float pct = (total > 0) ? (float)((sumElapsed / total) * 100.0) : 0.0f;
-                ImGui::Text("%.1f%%", pct);
-            };
+    if (CurrFrameNo > 0) {
+        ElapsedFrameIntervals[CurrFrameNo % kSampleHistorySize] = (float)(TimelineEnd - TimelineBegin);
+    }
+    // Capture is done once a replayable frame has no scopes at the next level.
+    if (HwCaptureActive && HwCaptureListReusable && PerfQueryRecordedFrameNo != CurrFrameNo) {
+        FinishHwCapture();
+    }
+    CmdList = list;
+    CurrFrameNo++;
+    HwCaptureListReusable = list->Reusable_;
+    UpdateCommandProfiling();
+
+    // Timestamps are only read once available, so a frame can't reuse an entry that is still pending.
+    // Entries from lists that were never submitted would stay pending forever, and are dropped after a while.
+    uint32_t ringIndex = CurrFrameNo % kTsqFrameRing;
+    TsqFrame& frame = TsqFrames[ringIndex];
+
+    if (frame.NumPendingScopes > 0 && ++frame.NumSkips < kTsqFrameRing) {
+        TsqRecording = false;
+        return;
+    }
+    if (frame.NumPendingScopes > 0) {
+        ForEachScope([&](Scope* scope) { scope->TsqSlots[ringIndex].clear(); });
+    }
+    frame = { .FrameNo = CurrFrameNo, .CpuBeginTime = TimelineEnd, .Queue = list->Queue };
+    TsqRecording = true;
+    TsqFirstSlot = ringIndex * kTsqSlotsPerFrame;
+    TsqNextSlot = TsqFirstSlot;
+    vkResetQueryPool(Device->Device, TsqPool, TsqFirstSlot, kTsqSlotsPerFrame);
+}
 
-            auto drawScope = [&](auto& visitScope, Scope* scope) -> void {
-                ImGui::PushID(scope);
-                ImGui::TableNextRow();
-                ImGui::TableNextColumn();
-
-                ImGuiTreeNodeFlags nodeFlags = baseNodeFlags;
-
-                if (scope->Children.empty()) {
-                    nodeFlags |= ImGuiTreeNodeFlags_Leaf | ImGuiTreeNodeFlags_NoTreePushOnOpen;
-                }
-                if (PrevSelectedScope == scope) {
-                    nodeFlags |= ImGuiTreeNodeFlags_Selected;
-                }
-
-                bool open = ImGui::TreeNodeEx("##Node", nodeFlags);
-
-                if (ImGui::IsItemActivated()) {
-                    PrevSelectedScope = scope;
-                }
-                if (ImGui::IsItemHovered()) {
-                    currHoveredScope = scope;
-                }
-
-                ImGui::SameLine();
-                scope->ShowInPlot ^= DrawScopeLabel(scope);
-
-                ImGui::TableNextColumn();
-                drawTimingColumn(scope, true);
-                ImGui::TableNextColumn();
-                drawTimingColumn(scope, false);
-                ImGui::TableNextColumn();
-
-                if (open && !scope->Children.empty()) {
-                    for (auto& child : scope->Children) {
-                        visitScope(visitScope, child.get());
-                    }
-                    ImGui::TreePop();
-                }
-                ImGui::PopID();
-            };
+void PerfmonContext::PollTimestamps() {
+    std::vector<uint64_t> data;  // [timestamp, availability] pairs
 
-            for (auto& child : RootScope.Children) {
-                drawScope(drawScope, child.get());
-            }
+    for (uint32_t ringIndex = 0; ringIndex < kTsqFrameRing; ringIndex++) {
+        TsqFrame& frame = TsqFrames[ringIndex];
+        if (frame.NumPendingScopes == 0) continue;
 
-            ImGui::PopStyleVar(1);
-            ImGui::EndTable();
-        }
-        ImGui::EndChild();
+        uint32_t firstSlot = ringIndex * kTsqSlotsPerFrame;
+        data.resize(frame.NumSlots * 2);
+        vkGetQueryPoolResults(Device->Device, TsqPool, firstSlot, frame.NumSlots, data.size() * sizeof(uint64_t), data.data(),
+                              sizeof(uint64_t) * 2, VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
 
-        if (currHoveredScope != nullptr) {
-            DrawScopeTooltip(currHoveredScope);
+        bool traced = IsFrameTraced(frame.FrameNo);
+        if (!GpuClockKnown) {
+            EstimateGpuClockOffset(frame, data);
         }
-        PrevHoveredScope = currHoveredScope;
-    }
+        std::vector<ThreadTrace::Event> events;
 
-    bool DrawScopeLabel(Scope* scope) {
-        ImVec4 color = ImGui::ColorConvertU32ToFloat4(scope->Color != 0 ? scope->Color : IM_COL32(31, 140, 255, 255));
-        if (!scope->ShowInPlot) color.w = 0.5f;
+        ForEachScope([&](Scope* scope) {
+            auto& slots = scope->TsqSlots[ringIndex];
+            if (slots.empty()) return;
 
-        float s = ImGui::GetFrameHeight();
-        bool clicked = ImGui::ColorButton("##ScopeColor", color, ImGuiColorEditFlags_NoTooltip, ImVec2(s, s));
+            int64_t ticks = 0;
+            for (uint32_t firstCallSlot : slots) {
+                uint32_t slot = firstCallSlot - firstSlot;
+                if (slot >= frame.NumSlots || data[slot * 2 + 1] == 0 || data[slot * 2 + 3] == 0) return;
 
-        ImGui::SameLine();
-        ImGui::TextUnformatted(scope->Label);
+                ticks += (int64_t)(data[slot * 2 + 2] - data[slot * 2 + 0]);
+            }
+            scope->ElapsedSamplesGPU[frame.FrameNo % kSampleHistorySize] = (float)((double)ticks * TsqSecondsPerTick);
+
+            uint32_t color = scope->Color;
+            color = (color & 255) << 16 | (color & 0xFF00) | (color >> 16 & 255);
+
+            for (uint32_t firstCallSlot : slots) {
+                uint32_t slot = firstCallSlot - firstSlot;
+                auto& event = events.emplace_back(ThreadTrace::Event{
+                    .Label = scope->Label,
+                    .Color = color,
+                    .Depth = scope->Depth,
+                    .BeginTime = GetGpuTime(data[slot * 2 + 0]),
+                    .EndTime = GetGpuTime(data[slot * 2 + 2]),
+                });
+                if (traced) TraceWriter::AppendSlice(TraceChunk, scope->Label, kTraceGpuPid, 1, event.BeginTime, event.EndTime);
+            }
+            slots.clear();
+            frame.NumPendingScopes--;
+        });
 
-        return clicked;
+        if (frame.Queue != nullptr && !events.empty()) {
+            AddTimelineEvents(GetGpuTimelineLane(frame.Queue), events);
+        }
     }
-    void DrawScopeTooltip(Scope* scope) {
-        if (!ImGui::BeginTooltip()) return;
-
-        DrawScopeLabel(scope);
+}
 
-        if (ImGui::BeginTable("Timings Detail", 2)) {
-            ImGui::TableSetupColumn("CPU");
-            ImGui::TableSetupColumn("GPU");
-            ImGui::TableHeadersRow();
+void PerfmonContext::UpdateCommandProfiling() {
+    PollCommandQueries();
+    CmdQueryList.store(nullptr, std::memory_order_relaxed);
+    CmdQueryActive = false;
 
-            for (uint32_t j = 0; j < 2; j++) {
-                ImGui::TableNextColumn();
+    if (!g_cmdProfilingEnabled) {
+        if (Device->CommandObserver_ == this) Device->CommandObserver_ = nullptr;
+        return;
+    }
+    if (Device->CommandObserver_ != this) {
+        ResetCommandStats();
+        Device->CommandObserver_ = this;
+    }
+    // Same as for TsqFrames, entries of lists that were never submitted are dropped after a while.
+    CommandQueryFrame& frame = CmdQueryFrames[CurrFrameNo % kTsqFrameRing];
+    if (!frame.Commands.empty() && ++frame.NumSkips < kTsqFrameRing) return;
 
-                float* samples = (j == 0) ? scope->ElapsedSamplesCPU : scope->ElapsedSamplesGPU;
+    if (frame.TimestampPool == nullptr) {
+        VkQueryPoolCreateInfo tsPoolCI = {
+            .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+            .queryType = VK_QUERY_TYPE_TIMESTAMP,
+            .queryCount = kMaxCommandQueriesPerFrame * 2,
+        };
+        HAVK_CHECK(vkCreateQueryPool(Device->Device, &tsPoolCI, nullptr, &frame.TimestampPool));
+
+        if (Device->PhysicalDevice.Features.PipelineStatistics) {
+            VkQueryPoolCreateInfo statsPoolCI = {
+                .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+                .queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS,
+                .queryCount = kMaxCommandQueriesPerFrame,
+                .pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT |
+                                      VK_QUERY_PIPELINE_STATISTIC_CLIPPING_INVOCATIONS_BIT |
+                                      VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT |
+                                      VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT,
+            };
+            HAVK_CHECK(vkCreateQueryPool(Device->Device, &statsPoolCI, nullptr, &frame.StatsPool));
+        }
+    }
+    vkResetQueryPool(Device->Device, frame.TimestampPool, 0, kMaxCommandQueriesPerFrame * 2);
+    if (frame.StatsPool) vkResetQueryPool(Device->Device, frame.StatsPool, 0, kMaxCommandQueriesPerFrame);
 
-                double sum = 0, sumsq = 0, min = 1e6, max = 0;
-                int numSamples = 0;
+    frame.Commands.clear();
+    frame.NumSkips = 0;
+    CmdQueryList.store(CmdList, std::memory_order_release);
+}
 
-                for (uint32_t i = 1; i < kSampleHistorySize; i++) {
-                    float elapsed = samples[(CurrFrameNo - i) % kSampleHistorySize];
-                    if (elapsed == 0) break;
+void PerfmonContext::PollCommandQueries() {
+    std::vector<uint64_t> timestamps;  // [timestamp, availability] pairs
+    std::vector<uint64_t> stats;       // [VS, clipping, FS, CS, availability]
+
+    for (auto& frame : CmdQueryFrames) {
+        if (frame.Commands.empty()) continue;
+
+        uint32_t numCmds = (uint32_t)frame.Commands.size();
+        timestamps.resize(numCmds * 4);
+        vkGetQueryPoolResults(Device->Device, frame.TimestampPool, 0, numCmds * 2, timestamps.size() * sizeof(uint64_t),
+                              timestamps.data(), sizeof(uint64_t) * 2, VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+        if (frame.StatsPool) {
+            stats.resize(numCmds * 5);
+            vkGetQueryPoolResults(Device->Device, frame.StatsPool, 0, numCmds, stats.size() * sizeof(uint64_t), stats.data(),
+                                  sizeof(uint64_t) * 5, VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+        }
+        // Commands of a frame complete together, so only merge once all of them are available.
+        bool available = true;
+        for (uint32_t i = 0; i < numCmds && available; i++) {
+            bool statsAvailable = !frame.Commands[i].HasPipelineStats || stats[i * 5 + 4] != 0;
+            available = timestamps[i * 4 + 1] != 0 && timestamps[i * 4 + 3] != 0 && statsAvailable;
+        }
+        if (!available) continue;
 
-                    sum += elapsed;
-                    sumsq += elapsed * elapsed;
-                    if (elapsed < min) min = elapsed;
-                    if (elapsed > max) max = elapsed;
-                    numSamples++;
-                }
-                double avg = sum / numSamples;
-                double stdDev = sqrt((sumsq / numSamples) - (avg * avg));
+        for (uint32_t i = 0; i < numCmds; i++) {
+            CommandStats* cmd = frame.Commands[i].Stats;
+            cmd->GpuTime += (double)(int64_t)(timestamps[i * 4 + 2] - timestamps[i * 4 + 0]) * TsqSecondsPerTick;
+            cmd->NumCalls++;
 
-                char buffer[32];
-                ImGui::Text("Avg: %s", FormatTime(buffer, avg));
-                ImGui::Text("Min: %s", FormatTime(buffer, min));
-                ImGui::Text("Max: %s", FormatTime(buffer, max));
-                ImGui::Text("SD: %s", FormatTime(buffer, stdDev));
+            if (frame.Commands[i].HasPipelineStats) {
+                const uint64_t* values = &stats[i * 5];
+                cmd->Invocations += values[0] + values[2] + values[3];
+                cmd->Primitives += values[1];
             }
-            ImGui::EndTable();
         }
-        ImGui::EndTooltip();
+        frame.Commands.clear();
+        CmdStatsNumFrames++;
     }
-    static char* FormatTime(char buffer[32], float valueSec) {
-        const char* unit = "s";
-        if (valueSec < 1) unit = "ms", valueSec *= 1000;
-        if (valueSec < 1) unit = "us", valueSec *= 1000;
-        if (valueSec < 1) unit = "ns", valueSec *= 1000;
-        snprintf(buffer, 32, "%.2f%s", valueSec, unit);
-        return buffer;
+}
+
+void PerfmonContext::ResetCommandStats() {
+    // Pending frames point to entries in the map, so keep them around.
+    for (auto& [name, stats] : CmdStats) {
+        stats = {};
     }
+    CmdStatsNumFrames = 0;
+    CmdStatsNumDropped = 0;
+}
 
-    void DrawHwCounters() {
-        ImGui::BeginDisabled(PrevSelectedScope == nullptr);
-        {
-            static bool streamCapture = false;
-            ImGui::BeginDisabled(streamCapture);
-            ImGui::SetNextItemShortcut(ImGuiKey_Equal, ImGuiInputFlags_RouteAlways | ImGuiInputFlags_Repeat);
-            bool captureOnce = ImGui::Button("Capture");
-            ImGui::SetItemTooltip("Shortcut: =");
-            ImGui::EndDisabled();
-
-            ImGui::SameLine();
-            ImGui::SetNextItemShortcut(ImGuiKey_LeftBracket, ImGuiInputFlags_RouteAlways);
-            if (ImGui::Button("Save Ref")) {
-                HwCounterResults[1] = std::vector { HwCounterResults[0] };
-            }
-            ImGui::SetItemTooltip("Shortcut: [");
+void PerfmonContext::BeginCommand(havk::CommandList& cmdList, const havk::Pipeline* pipeline, const char* name) {
+    // May be called from any thread, for any list. A match means we're on the thread recording the owner's list.
+    if (&cmdList != CmdQueryList.load(std::memory_order_acquire)) return;
 
-            ImGui::SameLine();
-            ImGui::Checkbox("Stream Capture", &streamCapture);
-            PerfQueryWantRecord = captureOnce || streamCapture;
-        }
-        ImGui::EndDisabled();
+    CommandQueryFrame& frame = CmdQueryFrames[CurrFrameNo % kTsqFrameRing];
+    if (frame.Commands.size() >= kMaxCommandQueriesPerFrame) {
+        CmdStatsNumDropped++;
+        return;
+    }
+    std::string_view key = pipeline != nullptr && !pipeline->Name.empty() ? std::string_view(pipeline->Name) : name;
+    auto iter = CmdStats.find(key);
+    if (iter == CmdStats.end()) {
+        iter = CmdStats.emplace(key, CommandStats()).first;
+    }
+    // Graphics statistics can only be queried on queues supporting graphics.
+    bool hasPipelineStats = pipeline != nullptr && frame.StatsPool && cmdList.Queue == Device->GetQueue(havk::QueueDomain::Main);
+    uint32_t index = (uint32_t)frame.Commands.size();
+    frame.Commands.push_back({ .Stats = &iter->second, .HasPipelineStats = hasPipelineStats });
+
+    vkCmdWriteTimestamp(cmdList.Handle, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, frame.TimestampPool, index * 2 + 0);
+    if (hasPipelineStats) {
+        vkCmdBeginQuery(cmdList.Handle, frame.StatsPool, index, 0);
+    }
+    CmdQueryActive = true;
+}
+void PerfmonContext::EndCommand(havk::CommandList& cmdList) {
+    if (&cmdList != CmdQueryList.load(std::memory_order_acquire) || !CmdQueryActive) return;
 
-        ImGui::SameLine();
-        ImGui::TextDisabled("%s", PrevSelectedScope ? PrevSelectedScope->Label : "(no selection)");
+    CommandQueryFrame& frame = CmdQueryFrames[CurrFrameNo % kTsqFrameRing];
+    uint32_t index = (uint32_t)frame.Commands.size() - 1;
 
-        if (PerfNumReqPasses >= 2) {
-            ImGui::SameLine();
-            ImGui::TextColored(ImGui::GetStyleColorVec4(ImGuiCol_PlotLinesHovered), "%d passes", PerfNumReqPasses);
-            ImGui::SetItemTooltip("Performance query requires command list to be submitted multiple times for accurate results. This will degrade overall performance and may corrupt data.");
-        }
+    if (frame.Commands[index].HasPipelineStats) {
+        vkCmdEndQuery(cmdList.Handle, frame.StatsPool, index);
+    }
+    vkCmdWriteTimestamp(cmdList.Handle, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, frame.TimestampPool, index * 2 + 1);
+    CmdQueryActive = false;
+}
 
-        const auto tableFlags = ImGuiTableFlags_Borders | ImGuiTableFlags_ScrollY | ImGuiTableFlags_RowBg | ImGuiTableFlags_Resizable |
-                                ImGuiTableFlags_Reorderable;
+void PerfmonContext::DrainThreadTraces() {
+    double currTime = GetMonotonicTime();
+    TimelineBegin = TimelineEnd;
+    TimelineEnd = currTime;
 
-        auto drawRow = [&](uint32_t index, bool isEnabled) {
-            auto& counter = HwCounters[index];
-            auto& desc = HwCounterDescs[index];
+    std::lock_guard lock(g_threadTracesMutex);
+    TimelineLanes.resize(g_threadTraces.size());
+    std::vector<ThreadTrace::Event> events;
 
-            ImGui::TableNextRow();
-            ImGui::TableNextColumn();
-            ImGui::PushID((int)index);
+    for (uint32_t i = 0; i < g_threadTraces.size(); i++) {
+        ThreadTrace& trace = *g_threadTraces[i];
+        TimelineLane& lane = TimelineLanes[i];
+        lane.Name = trace.Name;
 
-            ImGui::PushStyleColor(ImGuiCol_Text, ImGui::GetStyleColorVec4(isEnabled ? ImGuiCol_Text : ImGuiCol_TextDisabled));
-            if (ImGui::Checkbox(desc.name, &isEnabled)) {
-                if (isEnabled) {
-                    HwCounterEnabledIndices.push_back(index);
-                } else {
-                    std::erase(HwCounterEnabledIndices, index);
-                }
-                PerfQueryMustRecreate = true;
-            }
-            ImGui::PopStyleColor();
+        if (uint32_t numDropped = trace.NumDropped.exchange(0)) {
+            lane.Name += " (" + std::to_string(numDropped) + " dropped)";
+        }
 
-            if (ImGui::IsItemHovered(ImGuiHoveredFlags_ForTooltip)) {
-                bool perfImpact = (desc.flags & VK_PERFORMANCE_COUNTER_DESCRIPTION_PERFORMANCE_IMPACTING_BIT_KHR);
-                bool concImpact = (desc.flags & VK_PERFORMANCE_COUNTER_DESCRIPTION_CONCURRENTLY_IMPACTED_BIT_KHR);
+        events.clear();
+        uint32_t readPos = trace.ReadPos.load(std::memory_order_relaxed);
+        uint32_t writePos = trace.WritePos.load(std::memory_order_acquire);
+        for (; readPos != writePos; readPos++) {
+            events.push_back(trace.Events[readPos % ThreadTrace::kCapacity]);
+        }
+        trace.ReadPos.store(readPos, std::memory_order_release);
 
-                ImGui::SetItemTooltip("%s%s%s", desc.description,                  //
-                                      perfImpact ? " [Impacts performance]" : "",  //
-                                      concImpact ? " [Affected by concurrent submits]" : "");
+        if (IsFrameTraced(CurrFrameNo)) {
+            for (auto& event : events) {
+                TraceWriter::AppendSlice(TraceChunk, event.Label, kTraceCpuPid, i + 1, event.BeginTime, event.EndTime);
             }
+        }
+        AddTimelineEvents(lane, events);
+
+        if (&trace == g_ownerTrace.load(std::memory_order_relaxed) || events.empty()) continue;
+
+        // Events are pushed on exit, so parents come after children. Rebuild nesting from begin order.
+        std::sort(events.begin(), events.end(), [](auto& a, auto& b) {
+            return a.BeginTime != b.BeginTime ? a.BeginTime < b.BeginTime : a.Depth < b.Depth;
+        });
+        Scope* threadRoot = FindOrCreateChild(&RootScope, trace.Name);
+        threadRoot->IsThreadRoot = true;
+        // Parents may be missing if they were dropped or are still open, so default to the root.
+        Scope* parents[kMaxStackDepth + 1];
+        std::fill(std::begin(parents), std::end(parents), threadRoot);
+
+        for (auto& event : events) {
+            Scope* scope = FindOrCreateChild(parents[event.Depth], event.Label);
+            parents[event.Depth + 1] = scope;
+            AddCpuSample(scope, (float)(event.EndTime - event.BeginTime));
+            if (event.Depth == 0) AddCpuSample(threadRoot, (float)(event.EndTime - event.BeginTime));
+        }
+    }
+}
 
-            if (isEnabled) {
-                auto& currResults = HwCounterResults[0];
-                auto& prevResults = HwCounterResults[1];
-                uint32_t j = std::find(HwCounterEnabledIndices.begin(), HwCounterEnabledIndices.end(), index) - HwCounterEnabledIndices.begin();
+void PerfmonContext::AddTimelineEvents(TimelineLane& lane, std::span<const ThreadTrace::Event> events) {
+    if (TimelineFrozen) return;
 
-                char text[64];
-                double currValue = 0;
+    std::erase_if(lane.Events, [&](auto& event) { return event.EndTime < TimelineEnd - kTimelineHistorySec; });
+    lane.Events.insert(lane.Events.end(), events.begin(), events.end());
+}
+void PerfmonContext::DrainSubmits() {
+    std::vector<SubmitEvent> submits;
+    std::lock_guard lock(SubmitMutex);
+    InFlightSubmits.insert(InFlightSubmits.end(), PendingSubmits.begin(), PendingSubmits.end());
+    PendingSubmits.clear();
+
+    // Batches on a queue complete in submission order, so bubbles can be found by comparing with the previous one.
+    std::vector<havk::DeviceQueue*> blockedQueues;
+    std::vector<SubmitEvent> stillInFlight;
+
+    for (auto& submit : InFlightSubmits) {
+        bool blocked = std::find(blockedQueues.begin(), blockedQueues.end(), submit.Queue) != blockedQueues.end();
+
+        if (blocked || (submit.QuerySlot != UINT_MAX && !ReadSubmitTimestamps(submit))) {
+            if (!blocked) blockedQueues.push_back(submit.Queue);
+            stillInFlight.push_back(submit);
+        } else {
+            submits.push_back(submit);
+        }
+    }
+    std::swap(InFlightSubmits, stillInFlight);
+    if (TimelineFrozen) return;
 
-                if (j < currResults.size()) {
-                    currValue = GetHwCounterValue(counter, currResults[j]);
-                    FormatHwCounterValue(text, sizeof(text), counter, currValue);
+    double historyBegin = TimelineEnd - kTimelineHistorySec;
+    std::erase_if(RecentSubmits, [&](auto& submit) { return submit.EndTime < historyBegin; });
+    std::erase_if(RecentBubbles, [&](auto& bubble) { return bubble.EndTime < historyBegin; });
+    RecentSubmits.insert(RecentSubmits.end(), submits.begin(), submits.end());
+}
+bool PerfmonContext::ReadSubmitTimestamps(SubmitEvent& submit) {
+    auto iter = std::find_if(SubmitQueryPools.begin(), SubmitQueryPools.end(), [&](auto& q) { return q->Queue == submit.Queue; });
+    SubmitQueries& queries = **iter;
+
+    uint64_t data[4];  // [timestamp, availability] pairs
+    vkGetQueryPoolResults(Device->Device, queries.Pool, submit.QuerySlot * 2, 2, sizeof(data), data, sizeof(uint64_t) * 2,
+                          VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+    if (data[1] == 0 || data[3] == 0) return false;
+
+    queries.SlotBusy[submit.QuerySlot] = false;
+    submit.QuerySlot = UINT_MAX;
+    submit.GpuBeginTime = GetGpuTime(data[0]);
+    submit.GpuEndTime = GetGpuTime(data[2]);
+
+    double idleBeginTime = queries.LastGpuEndTime;
+    queries.LastGpuEndTime = std::max(queries.LastGpuEndTime, submit.GpuEndTime);
+
+    if (idleBeginTime != 0 && submit.GpuBeginTime - idleBeginTime >= kMinBubbleSec && !TimelineFrozen) {
+        RecentBubbles.push_back({
+            .Queue = submit.Queue,
+            .BeginTime = idleBeginTime,
+            .EndTime = submit.GpuBeginTime,
+            .Cause = FindBubbleCause(submit, idleBeginTime),
+            .WaitingForCpu = submit.BeginTime > idleBeginTime,
+        });
+    }
+    return true;
+}
+const char* PerfmonContext::FindBubbleCause(const SubmitEvent& submit, double idleBeginTime) {
+    if (submit.BeginTime <= idleBeginTime || submit.ThreadIndex >= TimelineLanes.size()) return submit.Caller;
 
-                    ImGui::TableNextColumn();
-                    ImGui::TextUnformatted(text);
-                }
-                if (j < prevResults.size()) {
-                    double prevValue = GetHwCounterValue(counter, prevResults[j]);
-                    double ratio = currValue / prevValue;
+    // Submit was late, blame the deepest scope that kept the submitting thread busy for most of the gap.
+    const ThreadTrace::Event* cause = nullptr;
+    double idleDuration = submit.BeginTime - idleBeginTime;
 
-                    FormatHwCounterValue(text, sizeof(text), counter, prevValue);
+    for (auto& event : TimelineLanes[submit.ThreadIndex].Events) {
+        double overlap = std::min(event.EndTime, submit.BeginTime) - std::max(event.BeginTime, idleBeginTime);
+        if (overlap >= idleDuration * 0.5 && (cause == nullptr || event.Depth > cause->Depth)) cause = &event;
+    }
+    return cause != nullptr ? cause->Label : submit.Caller;
+}
+uint32_t PerfmonContext::AcquireSubmitQuerySlot(havk::DeviceQueue* queue, uint64_t submitTimestamp, SubmitQueries*& queries) {
+    auto iter = std::find_if(SubmitQueryPools.begin(), SubmitQueryPools.end(), [&](auto& q) { return q->Queue == queue; });
 
-                    ImVec4 color = ImGui::GetStyleColorVec4(fabs(ratio - 1) < 0.02 ? ImGuiCol_TextDisabled : ImGuiCol_Text);
+    if (iter == SubmitQueryPools.end()) {
+        auto& newQueries = SubmitQueryPools.emplace_back(std::make_unique<SubmitQueries>());
+        newQueries->Queue = queue;
+        iter = SubmitQueryPools.end() - 1;
 
-                    ImGui::TableNextColumn();
-                    ImGui::TextColored(color, "%s", text);
+        uint32_t numFamilies = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(Device->PhysicalDevice.Handle, &numFamilies, nullptr);
+        auto families = std::vector<VkQueueFamilyProperties>(numFamilies);
+        vkGetPhysicalDeviceQueueFamilyProperties(Device->PhysicalDevice.Handle, &numFamilies, families.data());
+        if (families[queue->FamilyIndex].timestampValidBits == 0) return UINT_MAX;
 
-                    bool raiseBetter = counter.unit == VK_PERFORMANCE_COUNTER_UNIT_HERTZ_KHR ||
-                                       counter.unit == VK_PERFORMANCE_COUNTER_UNIT_PERCENTAGE_KHR;
-                    double cmpRatio = raiseBetter ? ratio : 1.0 / ratio;
-                    if (cmpRatio < 0.95) color = ImVec4(0.878f, 0.314f, 0.314f, 1.000f);
-                    if (cmpRatio > 1.05) color = ImVec4(0.314f, 0.816f, 0.376f, 1.000f);
+        VkQueryPoolCreateInfo tsPoolCI = {
+            .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+            .queryType = VK_QUERY_TYPE_TIMESTAMP,
+            .queryCount = kMaxSubmitsInFlight * 2,
+        };
+        HAVK_CHECK(vkCreateQueryPool(Device->Device, &tsPoolCI, nullptr, &newQueries->Pool));
 
-                    ImGui::TableNextColumn();
-                    ImGui::TextColored(color, "%.2fx", ratio);
-                }
-            }
-            ImGui::PopID();
+        VkCommandPoolCreateInfo cmdPoolCI = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .queueFamilyIndex = queue->FamilyIndex,
         };
+        HAVK_CHECK(vkCreateCommandPool(Device->Device, &cmdPoolCI, nullptr, &newQueries->CmdPool));
 
-        ImVec2 size = ImGui::GetContentRegionAvail();
-        size.y = std::max(size.y, ImGui::GetTextLineHeight() * 25.0f);
-        if (ImGui::BeginTable("Hardware Counter Values", 4, tableFlags, size)) {
-            const float charWidth = ImGui::CalcTextSize("A").x;
+        VkCommandBufferAllocateInfo cmdBufferCI = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = newQueries->CmdPool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = kMaxSubmitsInFlight,
+        };
+        HAVK_CHECK(vkAllocateCommandBuffers(Device->Device, &cmdBufferCI, newQueries->BeginCmds));
+        HAVK_CHECK(vkAllocateCommandBuffers(Device->Device, &cmdBufferCI, newQueries->EndCmds));
 
-            ImGui::TableSetupColumn("Counter", ImGuiTableColumnFlags_WidthStretch, charWidth * 15.0f);
-            ImGui::TableSetupColumn("Value", ImGuiTableColumnFlags_WidthStretch, charWidth * 7.0f);
-            ImGui::TableSetupColumn("Ref", ImGuiTableColumnFlags_WidthStretch, charWidth * 7.0f);
-            ImGui::TableSetupColumn("Ratio", ImGuiTableColumnFlags_WidthStretch, charWidth * 5.0f);
-            ImGui::TableHeadersRow();
+        // Slots are only reused once the batch they were submitted with has completed, so these can be recorded once
+        // and submitted many times without SIMULTANEOUS_USE.
+        VkCommandBufferBeginInfo beginInfo = { .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
 
-            auto order = std::vector<uint32_t>(HwCounters.size());
-            for (uint32_t i = 0; i < HwCounters.size(); i++) {
-                order[i] = i;
-            }
-            // Sort so that enabled counters appear first, then by category
-            const uint32_t kEnabledBit = 1 << 31;
-            for (uint32_t i : HwCounterEnabledIndices) {
-                order[i] |= kEnabledBit;
-            }
-            std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
-                if ((a ^ b) & kEnabledBit) return a > b;
-                auto& ca = HwCounterDescs[a & ~kEnabledBit];
-                auto& cb = HwCounterDescs[b & ~kEnabledBit];
-                return strcmp(ca.category, cb.category) < 0;
-            });
-
-            // Draw enabled counters
-            auto ctrIt = order.begin();
-            for (; ctrIt < order.end(); ctrIt++) {
-                if ((*ctrIt & kEnabledBit) == 0) break;
-                drawRow(*ctrIt & ~kEnabledBit, true);
-            }
+        for (uint32_t i = 0; i < kMaxSubmitsInFlight; i++) {
+            HAVK_CHECK(vkBeginCommandBuffer(newQueries->BeginCmds[i], &beginInfo));
+            vkCmdWriteTimestamp(newQueries->BeginCmds[i], VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, newQueries->Pool, i * 2 + 0);
+            HAVK_CHECK(vkEndCommandBuffer(newQueries->BeginCmds[i]));
 
-            // Draw available counters
-            while (ctrIt < order.end()) {
-                auto& baseCtr = HwCounterDescs[*ctrIt];
+            HAVK_CHECK(vkBeginCommandBuffer(newQueries->EndCmds[i], &beginInfo));
+            vkCmdWriteTimestamp(newQueries->EndCmds[i], VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, newQueries->Pool, i * 2 + 1);
+            HAVK_CHECK(vkEndCommandBuffer(newQueries->EndCmds[i]));
+        }
+    }
+    queries = iter->get();
+    if (queries->Pool == nullptr) return UINT_MAX;
+
+    // Timestamps become available before the batch completes, so its command buffers may still be pending
+    // after results were read.
+    uint64_t completedTimestamp = 0;
+    vkGetSemaphoreCounterValue(Device->Device, queue->SubmitSemaphore, &completedTimestamp);
+
+    for (uint32_t i = 0; i < kMaxSubmitsInFlight; i++) {
+        uint32_t slot = (queries->NextSlot + i) % kMaxSubmitsInFlight;
+        if (queries->SlotBusy[slot] || queries->SlotSubmitTimestamps[slot] > completedTimestamp) continue;
+
+        queries->SlotBusy[slot] = true;
+        queries->SlotSubmitTimestamps[slot] = submitTimestamp;
+        queries->NextSlot = slot + 1;
+        vkResetQueryPool(Device->Device, queries->Pool, slot * 2, 2);
+        return slot;
+    }
+    return UINT_MAX;
+}
+PerfMon::QueueStats PerfmonContext::GetQueueStats(havk::DeviceQueue* queue) {
+    std::vector<std::pair<double, double>> busyRanges;
+    for (auto& submit : RecentSubmits) {
+        if (submit.Queue == queue && submit.GpuEndTime != 0) busyRanges.push_back({ submit.GpuBeginTime, submit.GpuEndTime });
+    }
+    PerfMon::QueueStats stats = { .NumSubmits = (uint32_t)busyRanges.size() };
+    if (busyRanges.empty()) return stats;
 
-                ImGui::TableNextRow();
-                ImGui::TableNextColumn();
-                ImGui::SeparatorText(baseCtr.category);
+    // Batches may overlap slightly, only count time between them.
+    std::sort(busyRanges.begin(), busyRanges.end());
+    double lastEnd = busyRanges[0].second;
 
-                for (; ctrIt < order.end(); ctrIt++) {
-                    auto& counter = HwCounterDescs[*ctrIt];
-                    if (strcmp(counter.category, baseCtr.category) != 0) break;
+    for (auto& [begin, end] : busyRanges) {
+        if (begin > lastEnd) stats.IdleTime += begin - lastEnd;
+        lastEnd = std::max(lastEnd, end);
+    }
+    double span = lastEnd - busyRanges[0].first;
+    stats.Utilization = span > 0 ? 1.0 - stats.IdleTime / span : 1.0;
 
-                    drawRow(*ctrIt, false);
-                }
-            }
-            ImGui::EndTable();
-        }
-    }
-
-    void Bind(havk::CommandList* list) {
-        // Read device timestamps from previous frame
-        // Previous command list must have been submitted, otherwise we'll deadlock on WAIT_BIT.
-        if (TsqPrevFrameNumSlots > 0) {
-            uint32_t prevFrameNo = (CurrFrameNo - 1);
-            uint32_t firstSlot = (prevFrameNo % 2) * kTsqSlotsPerFrame;
-            uint32_t numSlots = TsqPrevFrameNumSlots;
-            auto timestamps = std::make_unique<int64_t[]>(numSlots);
-            vkGetQueryPoolResults(Device->Device, TsqPool, firstSlot, numSlots, numSlots * sizeof(int64_t), timestamps.get(), 8,
-                                  VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
-
-            double secondsPerTick = Device->PhysicalDevice.Props.limits.timestampPeriod * 1e-9;
-
-            auto assignResult = [&](auto& assignToNode, Scope* scope) -> void {
-                uint32_t slot = scope->LastTsqSlot[prevFrameNo % 2] - firstSlot;
-
-                if (slot < numSlots) {
-                    int64_t ts0 = timestamps[slot];
-                    int64_t ts1 = timestamps[slot + 1];
-                    scope->ElapsedSamplesGPU[prevFrameNo % kSampleHistorySize] = (ts1 - ts0) * secondsPerTick;
-                }
-                for (auto& child : scope->Children) {
-                    assignToNode(assignToNode, child.get());
-                }
-            };
-            assignResult(assignResult, &RootScope);
+    for (auto& bubble : RecentBubbles) {
+        if (bubble.Queue != queue) continue;
+
+        stats.NumBubbles++;
+        if (bubble.EndTime - bubble.BeginTime > stats.LongestBubble) {
+            stats.LongestBubble = bubble.EndTime - bubble.BeginTime;
+            stats.LongestBubbleCause = bubble.Cause;
         }
-        CmdList = list;
-        CurrFrameNo++;
-        TsqPrevFrameNumSlots = TsqNextSlot - TsqFirstSlot;
-        TsqFirstSlot = (CurrFrameNo % 2) * kTsqSlotsPerFrame;
-        TsqNextSlot = TsqFirstSlot;
-        vkResetQueryPool(Device->Device, TsqPool, TsqFirstSlot, kTsqSlotsPerFrame);
     }
+    return stats;
+}
+std::string PerfmonContext::GetQueueName(havk::DeviceQueue* queue) {
+    const char* domainNames[] = { "Main", "AsyncCompute", "AsyncTransfer" };
+    for (uint32_t i = 0; i < (uint32_t)havk::QueueDomain::Count_; i++) {
+        if (Device->GetQueue((havk::QueueDomain)i) == queue) return std::string("GPU ") + domainNames[i];
+    }
+    return "GPU";
+}
+TimelineLane& PerfmonContext::GetGpuTimelineLane(havk::DeviceQueue* queue) {
+    for (auto& lane : GpuTimelineLanes) {
+        if (lane.Queue == queue) return lane;
+    }
+    auto& lane = GpuTimelineLanes.emplace_back();
+    lane.Queue = queue;
+    lane.Name = GetQueueName(queue);
+    return lane;
+}
 
-    Scope* BeginScope(const char* label) {
-        HAVK_ASSERT(StackDepth < kMaxStackDepth);
+void PerfmonContext::CalibrateGpuClock() {
+    if (vfn_GetCalibratedTimestampsKHR == nullptr) return;
 
-        Scope* scope = FindOrCreateScope(label);
-        Stack[StackDepth++] = scope;
+    VkCalibratedTimestampInfoKHR infos[2] = {
+        { .sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_KHR, .timeDomain = VK_TIME_DOMAIN_DEVICE_KHR },
+        { .sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_KHR, .timeDomain = HostTimeDomain },
+    };
+    uint64_t bestDeviation = UINT64_MAX;
 
-        scope->LastRecordedFrameNo = CurrFrameNo;
+    for (uint32_t i = 0; i < 8; i++) {
+        uint64_t timestamps[2], deviation;
+        if (vfn_GetCalibratedTimestampsKHR(Device->Device, 2, infos, timestamps, &deviation) != VK_SUCCESS) return;
+        if (deviation >= bestDeviation) continue;
 
-        if (TsqNextSlot < TsqFirstSlot + kTsqSlotsPerFrame) {
-            vkCmdWriteTimestamp(CmdList->Handle, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, TsqPool, TsqNextSlot);
-            scope->LastTsqSlot[CurrFrameNo % 2] = TsqNextSlot;
-            TsqNextSlot += 2;
-        } else {
-            scope->LastTsqSlot[CurrFrameNo % 2] = UINT_MAX;
-        }
-        if (scope == PrevSelectedScope && PerfQueryWantRecord && HwCounterEnabledIndices.size() > 0) {
-            if (!PerfQueryPool || PerfQueryMustRecreate) {
-                HAVK_ASSERT(PerfQueryRecordedFrameNo != CurrFrameNo);
-                if (PerfQueryPool) {
-                    Device->WaitIdle();
-                    vkDestroyQueryPool(Device->Device, PerfQueryPool, nullptr);
-                }
-                if (PerfQueryMustRecreate) {
-                    SaveOrLoadSettings(true);
-                }
-                PerfQueryMustRecreate = false;
-                HAVK_ASSERT(CmdList->Queue == Device->GetQueue(havk::QueueDomain::Main));
-
-                VkQueryPoolPerformanceCreateInfoKHR perfQueryCI = {
-                    .sType = VK_STRUCTURE_TYPE_QUERY_POOL_PERFORMANCE_CREATE_INFO_KHR,
-                    .queueFamilyIndex = CmdList->Queue->FamilyIndex,
-                    .counterIndexCount = (uint32_t)HwCounterEnabledIndices.size(),
-                    .pCounterIndices = HwCounterEnabledIndices.data(),
-                };
-                vfn_GetPhysicalDeviceQueueFamilyPerformanceQueryPassesKHR(Device->PhysicalDevice.Handle, &perfQueryCI, &PerfNumReqPasses);
-
-                VkQueryPoolCreateInfo queryPoolCI = {
-                    .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
-                    .pNext = &perfQueryCI,
-                    .queryType = VK_QUERY_TYPE_PERFORMANCE_QUERY_KHR,
-                    .queryCount = 1,
-                };
-                HAVK_CHECK(vkCreateQueryPool(Device->Device, &queryPoolCI, NULL, &PerfQueryPool));
-            }
-            vkResetQueryPool(Device->Device, PerfQueryPool, 0, 1);
-            vkCmdBeginQuery(CmdList->Handle, PerfQueryPool, 0, 0);
-            PerfQueryRecordedFrameNo = CurrFrameNo;
-        }
-        scope->LastHostBeginTime = GetMonotonicTime();
-        return scope;
+        bestDeviation = deviation;
+        GpuClockOffset = ConvertMonotonicTicks(timestamps[1]) - (double)timestamps[0] * TsqSecondsPerTick;
     }
-    void EndScope(Scope* scope) {
-        auto currStack = Stack[--StackDepth];
-        HAVK_ASSERT(StackDepth >= 0 && scope == currStack);
+    GpuClockCalibrated = true;
+    GpuClockKnown = true;
+    GpuClockSyncTime = GetMonotonicTime();
+}
+
+void PerfmonContext::EstimateGpuClockOffset(const TsqFrame& frame, const std::vector<uint64_t>& data) {
+    uint64_t firstTicks = UINT64_MAX;
+    for (uint32_t slot = 0; slot < frame.NumSlots; slot++) {
+        if (data[slot * 2 + 1] != 0) firstTicks = std::min(firstTicks, data[slot * 2 + 0]);
+    }
+    if (firstTicks == UINT64_MAX) return;
+
+    GpuClockOffset = frame.CpuBeginTime - (double)firstTicks * TsqSecondsPerTick;
+    GpuClockKnown = true;
+    GpuClockSyncTime = GetMonotonicTime();
+}
 
-        float elapsed = (float)(GetMonotonicTime() - scope->LastHostBeginTime);
-        scope->ElapsedSamplesCPU[CurrFrameNo % kSampleHistorySize] = elapsed;
+void PerfmonContext::UpdateTraceCapture() {
+    if (Trace != nullptr) {
+        if (IsFrameTraced(CurrFrameNo)) {
+            char name[32];
+            snprintf(name, sizeof(name), "Frame %u", CurrFrameNo - TraceFirstFrameNo);
+            TraceWriter::AppendSlice(TraceChunk, name, kTraceCpuPid, 0, TimelineBegin, TimelineEnd);
+        }
+        Trace->Write(TraceChunk);
+        TraceChunk.clear();
 
-        uint32_t tsqSlot = scope->LastTsqSlot[CurrFrameNo % 2];
-        if (tsqSlot != UINT_MAX) {
-            vkCmdWriteTimestamp(CmdList->Handle, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, TsqPool, tsqSlot + 1);
+        // Wait for GPU timestamps of the last frames, unless they were dropped.
+        bool gpuPending = false;
+        for (auto& frame : TsqFrames) {
+            gpuPending |= frame.NumPendingScopes > 0 && IsFrameTraced(frame.FrameNo);
         }
-        if (scope == PrevSelectedScope && PerfQueryPool && PerfQueryRecordedFrameNo == CurrFrameNo) {
-            vkCmdEndQuery(CmdList->Handle, PerfQueryPool, 0);
+        if (CurrFrameNo + 1 >= TraceEndFrameNo && !gpuPending) {
+            FinishTrace();
         }
     }
+    if (Trace == nullptr && !g_traceRequestPath.empty()) {
+        StartTrace(g_traceRequestPath, g_traceRequestNumFrames);
+        g_traceRequestPath.clear();
+    }
+}
 
-    Scope* FindOrCreateScope(const char* label) {
-        Scope* parent = StackDepth == 0 ? &RootScope : Stack[StackDepth - 1];
+void PerfmonContext::StartTrace(const std::string& path, uint32_t numFrames) {
+    Trace = std::make_unique<TraceWriter>(path);
 
-        for (auto& child : parent->Children) {
-            if (strcmp(child->Label, label) == 0) return child.get();
+    if (Trace->File == nullptr) {
+        Device->Log(havk::LogLevel::Warn, "Failed to open trace file '%s'", path.data());
+        Trace = nullptr;
+        return;
+    }
+    CalibrateGpuClock();
+    TracePath = path;
+    GpuClockKnown = GpuClockCalibrated;
+    TraceFirstFrameNo = CurrFrameNo + 1;
+    TraceEndFrameNo = TraceFirstFrameNo + std::max(numFrames, 1u);
+}
+
+void PerfmonContext::FinishTrace() {
+    std::string events = TraceChunk;
+    TraceChunk.clear();
+
+    TraceWriter::AppendMetadata(events, "process_name", kTraceCpuPid, 0, "CPU");
+    TraceWriter::AppendMetadata(events, "process_name", kTraceGpuPid, 0, GpuClockCalibrated ? "GPU" : "GPU (estimated clock offset)");
+    TraceWriter::AppendMetadata(events, "thread_name", kTraceCpuPid, 0, "Frames");
+    TraceWriter::AppendMetadata(events, "thread_name", kTraceGpuPid, 1, "Main queue");
+    {
+        std::lock_guard lock(g_threadTracesMutex);
+        for (uint32_t i = 0; i < g_threadTraces.size(); i++) {
+            TraceWriter::AppendMetadata(events, "thread_name", kTraceCpuPid, i + 1, g_threadTraces[i]->Name);
         }
-        Scope* child = parent->Children.emplace_back(std::make_unique<Scope>()).get();
-        strncpy(child->Label, label, sizeof(Scope::Label) - 1);
-        return child;
     }
+    events.resize(events.size() - 2);  // Trailing comma
+    Trace->Finish(events);
+    Trace = nullptr;
 
-    std::vector<Scope*> GetPlotLeafScopes() {
-        std::vector<Scope*> leafScopes;
+    Device->Log(havk::LogLevel::Info, "Saved PerfMon trace to '%s'", TracePath.data());
+}
 
-        auto visitScope = [&](auto& visitScope, Scope* scope) -> void {
-            if (!scope->ShowInPlot) return;
+void PerfmonContext::TraceHwCounters() {
+    if (!IsFrameTraced(PerfQueryRecordedFrameNo) || PrevSelectedScope == nullptr) return;
+
+    std::string events;
+    double timestamp = GetMonotonicTime() * 1e6;
+    auto& results = HwCounterResults[0];
+
+    for (uint32_t i = 0; i < results.size(); i++) {
+        uint32_t index = HwCounterEnabledIndices[i];
+        char buffer[96];
+        snprintf(buffer, sizeof(buffer), "{\"ph\":\"C\",\"pid\":%u,\"ts\":%.3f,\"name\":", kTraceGpuPid, timestamp);
+        events += buffer;
+        TraceWriter::AppendString(events, HwCounterDescs[index].name);
+        events += ",\"args\":{";
+        TraceWriter::AppendString(events, PrevSelectedScope->Label);
+        snprintf(buffer, sizeof(buffer), ":%.17g}},\n", GetHwCounterValue(HwCounters[index], results[i]));
+        events += buffer;
+    }
+    Trace->Write(events);
+}
 
-            if (scope->Children.empty()) {
-                leafScopes.push_back(scope);
-            }
-            for (auto& child : scope->Children) {
-                visitScope(visitScope, child.get());
-            }
-        };
-        for (auto& child : RootScope.Children) {
-            visitScope(visitScope, child.get());
+void PerfmonContext::AddCpuSample(Scope* scope, float elapsed) {
+    if (scope->LastRecordedFrameNo != CurrFrameNo) {
+        // Clear samples of frames in which the scope wasn't recorded, so that they don't count towards stats.
+        uint32_t numStaleFrames = std::min(CurrFrameNo - scope->LastRecordedFrameNo, (uint32_t)kSampleHistorySize);
+        for (uint32_t i = 0; i < numStaleFrames; i++) {
+            scope->ElapsedSamplesCPU[(CurrFrameNo - i) % kSampleHistorySize] = 0;
+            scope->ElapsedSamplesGPU[(CurrFrameNo - i) % kSampleHistorySize] = 0;
         }
-        return leafScopes;
+        scope->LastRecordedFrameNo = CurrFrameNo;
+        scope->NumCalls = 0;
     }
+    scope->ElapsedSamplesCPU[CurrFrameNo % kSampleHistorySize] += elapsed;
+    scope->NumCalls++;
+}
 
-    bool InitializeHwCounters() {
-#define LD_PFN(name) vfn_##name = (PFN_vk##name)vkGetInstanceProcAddr(Device->Instance, "vk" #name)
-        auto LD_PFN(EnumeratePhysicalDeviceQueueFamilyPerformanceQueryCountersKHR);
+void PerfmonContext::BeginScope(Scope* scope, uint32_t& tsqSlot) {
+    HAVK_ASSERT(StackDepth < kMaxStackDepth);
+    Stack[StackDepth++] = scope;
 
-        this->LD_PFN(GetPhysicalDeviceQueueFamilyPerformanceQueryPassesKHR);
-        this->LD_PFN(AcquireProfilingLockKHR);
-        this->LD_PFN(ReleaseProfilingLockKHR);
-#undef LD_PFN
+    tsqSlot = UINT_MAX;
 
-        VkAcquireProfilingLockInfoKHR lockInfo = {
-            .sType = VK_STRUCTURE_TYPE_ACQUIRE_PROFILING_LOCK_INFO_KHR,
-            .timeout = 1'000'000'000,  // nanoseconds
-        };
-        VkResult result = vfn_AcquireProfilingLockKHR(Device->Device, &lockInfo);
-        if (result != VK_SUCCESS) {
-            Device->Log(havk::LogLevel::Warn, "Failed to acquire GPU profiling lock!");
-            return false;
-        }
-
-        uint32_t queueFamily = Device->GetQueue(havk::QueueDomain::Main)->FamilyIndex;
-        uint32_t numCounters;
-        HAVK_CHECK(vfn_EnumeratePhysicalDeviceQueueFamilyPerformanceQueryCountersKHR(Device->PhysicalDevice.Handle, queueFamily,
-                                                                                     &numCounters, NULL, NULL));
-        HwCounters.resize(numCounters);
-        HwCounterDescs.resize(numCounters);
-
-        for (uint32_t i = 0; i < numCounters; i++) {
-            HwCounters[i].sType = VK_STRUCTURE_TYPE_PERFORMANCE_COUNTER_KHR;
-            HwCounterDescs[i].sType = VK_STRUCTURE_TYPE_PERFORMANCE_COUNTER_DESCRIPTION_KHR;
-        }
-        HAVK_CHECK(vfn_EnumeratePhysicalDeviceQueueFamilyPerformanceQueryCountersKHR(Device->PhysicalDevice.Handle, queueFamily,
-                                                                                     &numCounters, HwCounters.data(), HwCounterDescs.data()));
-
-        Device->SubmitHook_ = [this](havk::CommandList& list, VkQueue queue, VkSubmitInfo& submitInfo, VkFence fence) {
-            if (!PerfQueryPool || PerfQueryRecordedFrameNo != CurrFrameNo || list.Handle != CmdList->Handle) {
-                HAVK_CHECK(vkQueueSubmit(queue, 1, &submitInfo, fence));
-                return;
+    if (TsqRecording && TsqNextSlot < TsqFirstSlot + kTsqSlotsPerFrame) {
+        auto& slots = scope->TsqSlots[CurrFrameNo % kTsqFrameRing];
+        if (slots.empty()) TsqFrames[CurrFrameNo % kTsqFrameRing].NumPendingScopes++;
+
+        vkCmdWriteTimestamp(CmdList->Handle, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, TsqPool, TsqNextSlot);
+        tsqSlot = TsqNextSlot;
+        slots.push_back(tsqSlot);
+        TsqNextSlot += 2;
+    }
+    // Performance queries can't be nested. Counters are collected for the first call of the selected scope,
+    // or for all calls of scopes at the level being captured.
+    bool wantQuery = HwCaptureActive ? HwCaptureListReusable && scope->Depth == HwCaptureDepth
+                                     : PerfQueryWantRecord && scope == PrevSelectedScope && PerfQueryRecordedFrameNo != CurrFrameNo;
+
+    if (wantQuery && PerfQueryActiveScope == nullptr && HwCounterEnabledIndices.size() > 0) {
+        if (!PerfQueryPool || PerfQueryMustRecreate) {
+            if (PerfQueryPool) {
+                Device->WaitIdle();
+                vkDestroyQueryPool(Device->Device, PerfQueryPool, nullptr);
             }
-            VkPerformanceQuerySubmitInfoKHR perfQuerySubmitInfo = {
-                .sType = VK_STRUCTURE_TYPE_PERFORMANCE_QUERY_SUBMIT_INFO_KHR,
-                .pNext = submitInfo.pNext,
-                .counterPassIndex = 0,
+            PerfQueryMustRecreate = false;
+            HAVK_ASSERT(CmdList->Queue == Device->GetQueue(havk::QueueDomain::Main));
+
+            VkQueryPoolPerformanceCreateInfoKHR perfQueryCI = {
+                .sType = VK_STRUCTURE_TYPE_QUERY_POOL_PERFORMANCE_CREATE_INFO_KHR,
+                .queueFamilyIndex = CmdList->Queue->FamilyIndex,
+                .counterIndexCount = (uint32_t)HwCounterEnabledIndices.size(),
+                .pCounterIndices = HwCounterEnabledIndices.data(),
             };
-            submitInfo.pNext = &perfQuerySubmitInfo;
-
-            // FIXME: We'll often get DEVICE_LOST after recreating query pool, maybe a driver bug since VVL is silent?
-            // TODO: Not sure how multi pass queries are supposed to work. Spec says we can just submit multiple
-            //       times but VVL complains about semaphore reuse and we get a deadlock... It seems that wouldn't
-            //       even make sense as recurring buffers/textures will be overwritten on extra passes?
-            //       Don't really care for now, and we can just ignore NOT_READY from vkGetQueryPoolResults().
-            for (uint32_t pass = 0; pass < 1; pass++) {
-                perfQuerySubmitInfo.counterPassIndex = pass;
-                HAVK_CHECK(vkQueueSubmit(queue, 1, &submitInfo, fence));
-                HAVK_CHECK(vkQueueWaitIdle(queue));
-            }
-            // TODO: consider making this async
-            auto& results = HwCounterResults[0];
-            results.resize(HwCounterEnabledIndices.size());
-            size_t dataSize = results.size() * sizeof(VkPerformanceCounterResultKHR);
-            vkGetQueryPoolResults(Device->Device, PerfQueryPool, 0, 1, dataSize, results.data(), dataSize, 0);
-        };
-        SaveOrLoadSettings(false);
+            vfn_GetPhysicalDeviceQueueFamilyPerformanceQueryPassesKHR(Device->PhysicalDevice.Handle, &perfQueryCI, &PerfNumReqPasses);
+
+            VkQueryPoolCreateInfo queryPoolCI = {
+                .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+                .pNext = &perfQueryCI,
+                .queryType = VK_QUERY_TYPE_PERFORMANCE_QUERY_KHR,
+                .queryCount = kMaxPerfQueriesPerFrame,
+            };
+            HAVK_CHECK(vkCreateQueryPool(Device->Device, &queryPoolCI, NULL, &PerfQueryPool));
+        }
+        if (PerfQueryRecordedFrameNo != CurrFrameNo) {
+            // Results of previous frames were read back by SubmitHook_ already.
+            vkResetQueryPool(Device->Device, PerfQueryPool, 0, kMaxPerfQueriesPerFrame);
+            PerfQueryScopes.clear();
+            PerfQueryNumDropped = 0;
+            PerfQueryRecordedFrameNo = CurrFrameNo;
+        }
+        if (PerfQueryScopes.size() < kMaxPerfQueriesPerFrame) {
+            vkCmdBeginQuery(CmdList->Handle, PerfQueryPool, (uint32_t)PerfQueryScopes.size(), 0);
+            PerfQueryScopes.push_back(scope);
+            PerfQueryActiveScope = scope;
+        } else {
+            PerfQueryNumDropped++;
+        }
+    }
+}
+
+void PerfmonContext::EndScope(Scope* scope, uint32_t tsqSlot, float elapsed) {
+    HAVK_ASSERT(StackDepth > 0);
+    auto currStack = Stack[--StackDepth];
+    HAVK_ASSERT(scope == currStack);
 
-        return true;
+    AddCpuSample(scope, elapsed);
+
+    if (TsqRecording && tsqSlot != UINT_MAX) {
+        vkCmdWriteTimestamp(CmdList->Handle, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, TsqPool, tsqSlot + 1);
+    }
+    if (scope == PerfQueryActiveScope) {
+        vkCmdEndQuery(CmdList->Handle, PerfQueryPool, (uint32_t)PerfQueryScopes.size() - 1);
+        PerfQueryActiveScope = nullptr;
     }
+}
 
-    void SaveOrLoadSettings(bool save) {
-        if (ImGui::GetIO().IniFilename == nullptr) return;
+Scope* PerfmonContext::FindOrCreateChild(Scope* parent, const char* label) {
+    for (auto& child : parent->Children) {
+        if (strcmp(child->Label, label) == 0) return child.get();
+    }
+    Scope* child = parent->Children.emplace_back(std::make_unique<Scope>()).get();
+    strncpy(child->Label, label, sizeof(Scope::Label) - 1);
+    child->Depth = parent->Depth + 1;
+    child->LabelId = InternLabel(child->Label);
+    return child;
+}
+Scope* PerfmonContext::FindOrCreateChild(Scope* parent, PerfMon::ScopeSite& site) {
+    if (site.CachedParent == parent && site.CacheGeneration == Generation) [[likely]] {
+        return (Scope*)site.CachedScope;
+    }
+    uint32_t labelId = site.LabelId.load(std::memory_order_relaxed);
+    if (labelId == 0) {
+        labelId = InternLabel(site.Label);
+        site.LabelId.store(labelId, std::memory_order_relaxed);
+    }
+    auto iter = std::find_if(parent->Children.begin(), parent->Children.end(), [&](auto& child) { return child->LabelId == labelId; });
+    Scope* child = iter != parent->Children.end() ? iter->get() : FindOrCreateChild(parent, site.Label);
 
-        std::string path = ImGui::GetIO().IniFilename;
-        while (!path.empty() && path.back() != '/' && path.back() != '\\') path.pop_back();
-        path += "havk_perfmon_state.txt";
+    site.CachedParent = parent;
+    site.CachedScope = child;
+    site.CacheGeneration = Generation;
+    return child;
+}
 
-        if (save) {
-            std::string str;
+void PerfmonContext::InitializeClockCalibration() {
+#if _WIN32
+    HostTimeDomain = VK_TIME_DOMAIN_QUERY_PERFORMANCE_COUNTER_KHR;
+#else
+    HostTimeDomain = VK_TIME_DOMAIN_CLOCK_MONOTONIC_KHR;
+#endif
+    auto vfn_GetPhysicalDeviceCalibrateableTimeDomainsKHR = (PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsKHR)vkGetInstanceProcAddr(
+        Device->Instance, "vkGetPhysicalDeviceCalibrateableTimeDomainsKHR");
+
+    uint32_t numDomains = 0;
+    vfn_GetPhysicalDeviceCalibrateableTimeDomainsKHR(Device->PhysicalDevice.Handle, &numDomains, nullptr);
+    auto domains = std::vector<VkTimeDomainKHR>(numDomains);
+    vfn_GetPhysicalDeviceCalibrateableTimeDomainsKHR(Device->PhysicalDevice.Handle, &numDomains, domains.data());
+
+    bool hasDevice = std::find(domains.begin(), domains.end(), VK_TIME_DOMAIN_DEVICE_KHR) != domains.end();
+    bool hasHost = std::find(domains.begin(), domains.end(), HostTimeDomain) != domains.end();
+    if (!hasDevice || !hasHost) return;
+
+    vfn_GetCalibratedTimestampsKHR = (PFN_vkGetCalibratedTimestampsKHR)vkGetDeviceProcAddr(Device->Device, "vkGetCalibratedTimestampsKHR");
+    CalibrateGpuClock();
+}
 
-            str += "# EnabledHwCounters\n";
+bool PerfmonContext::InitializeHwCounters() {
+#define LD_PFN(name) vfn_##name = (PFN_vk##name)vkGetInstanceProcAddr(Device->Instance, "vk" #name)
+    auto LD_PFN(EnumeratePhysicalDeviceQueueFamilyPerformanceQueryCountersKHR);
 
-            for (uint32_t i = 0; i < HwCounterEnabledIndices.size(); i++) {
-                str += HwCounterDescs[HwCounterEnabledIndices[i]].name;
-                str += '\n';
-            }
-            havx::WriteFileBytes(path, str.data(), str.size(), true);
-        } else {
-            std::vector<uint8_t> data = havx::ReadFileBytes(path);
-            std::string_view str = { (char*)data.data(), data.size() };
+    this->LD_PFN(GetPhysicalDeviceQueueFamilyPerformanceQueryPassesKHR);
+    this->LD_PFN(AcquireProfilingLockKHR);
+    this->LD_PFN(ReleaseProfilingLockKHR);
+#undef LD_PFN
 
-            while (!str.empty()) {
-                auto line = str.substr(0, str.find('\n'));
-                str = str.substr(std::min(str.size(), line.size() + 1));
+    VkAcquireProfilingLockInfoKHR lockInfo = {
+        .sType = VK_STRUCTURE_TYPE_ACQUIRE_PROFILING_LOCK_INFO_KHR,
+        .timeout = 1'000'000'000,  // nanoseconds
+    };
+    VkResult result = vfn_AcquireProfilingLockKHR(Device->Device, &lockInfo);
+    if (result != VK_SUCCESS) {
+        Device->Log(havk::LogLevel::Warn, "Failed to acquire GPU profiling lock!");
+        return false;
+    }
 
-                if (line.starts_with("#")) continue;
+    uint32_t queueFamily = Device->GetQueue(havk::QueueDomain::Main)->FamilyIndex;
+    uint32_t numCounters;
+    HAVK_CHECK(vfn_EnumeratePhysicalDeviceQueueFamilyPerformanceQueryCountersKHR(Device->PhysicalDevice.Handle, queueFamily,
+                                                                                 &numCounters, NULL, NULL));
+    HwCounters.resize(numCounters);
+    HwCounterDescs.resize(numCounters);
 
-                for (uint32_t i = 0; i < HwCounterDescs.size(); i++) {
-                    if (line.compare(HwCounterDescs[i].name) == 0) {
-                        HwCounterEnabledIndices.push_back(i);
-                        break;
-                    }
-                }
-            }
+    for (uint32_t i = 0; i < numCounters; i++) {
+        HwCounters[i].sType = VK_STRUCTURE_TYPE_PERFORMANCE_COUNTER_KHR;
+        HwCounterDescs[i].sType = VK_STRUCTURE_TYPE_PERFORMANCE_COUNTER_DESCRIPTION_KHR;
+    }
+    HAVK_CHECK(vfn_EnumeratePhysicalDeviceQueueFamilyPerformanceQueryCountersKHR(Device->PhysicalDevice.Handle, queueFamily,
+                                                                                 &numCounters, HwCounters.data(), HwCounterDescs.data()));
+    return true;
+}
+
+void PerfmonContext::OnSubmit(havk::CommandList& list, VkQueue queue, VkSubmitInfo& submitInfo, VkFence fence) {
+    // May be called from any thread, and even while not profiling.
+    ThreadTrace* ownerTrace = g_ownerTrace.load(std::memory_order_relaxed);
+    bool profiling = ownerTrace != nullptr;
+
+    // Wrap the batch with timestamps, to measure how long the queue stays idle between submits.
+    VkCommandBuffer cmdBuffers[8];
+    uint32_t querySlot = UINT_MAX;
+
+    if (profiling && submitInfo.commandBufferCount + 2 <= std::size(cmdBuffers)) {
+        SubmitQueries* queries;
+        {
+            std::lock_guard lock(SubmitMutex);
+            // Submit() reserves the timeline value before calling the hook.
+            querySlot = AcquireSubmitQuerySlot(list.Queue, list.Queue->NextSubmitTimestamp - 1, queries);
+        }
+        if (querySlot != UINT_MAX) {
+            cmdBuffers[0] = queries->BeginCmds[querySlot];
+            std::copy_n(submitInfo.pCommandBuffers, submitInfo.commandBufferCount, &cmdBuffers[1]);
+            cmdBuffers[submitInfo.commandBufferCount + 1] = queries->EndCmds[querySlot];
+            submitInfo.pCommandBuffers = cmdBuffers;
+            submitInfo.commandBufferCount += 2;
         }
     }
+    double beginTime = GetMonotonicTime();
 
-    static double GetHwCounterValue(const VkPerformanceCounterKHR& counter, const VkPerformanceCounterResultKHR& result) {
-        switch (counter.storage) {
-            case VK_PERFORMANCE_COUNTER_STORAGE_INT32_KHR: return result.int32;
-            case VK_PERFORMANCE_COUNTER_STORAGE_INT64_KHR: return result.int64;
-            case VK_PERFORMANCE_COUNTER_STORAGE_UINT32_KHR: return result.uint32;
-            case VK_PERFORMANCE_COUNTER_STORAGE_UINT64_KHR: return result.uint64;
-            case VK_PERFORMANCE_COUNTER_STORAGE_FLOAT32_KHR: return result.float32;
-            case VK_PERFORMANCE_COUNTER_STORAGE_FLOAT64_KHR: return result.float64;
-            default: return 0;
-        }
-    }
-
-    static int FormatHwCounterValue(char* buffer, uint32_t bufferSize, const VkPerformanceCounterKHR& counter, double value) {
-        const char* unitText = "";
-        double logScale = 0, logBias = 0;
-
-        // clang-format off
-        switch (counter.unit) {
-            case VK_PERFORMANCE_COUNTER_UNIT_PERCENTAGE_KHR: unitText = "%"; break;
-            case VK_PERFORMANCE_COUNTER_UNIT_BYTES_KHR: unitText = "B"; logScale = 1024; break;
-            case VK_PERFORMANCE_COUNTER_UNIT_BYTES_PER_SECOND_KHR: unitText = "B/s"; logScale = 1024; break;
-            case VK_PERFORMANCE_COUNTER_UNIT_KELVIN_KHR: unitText = "°C"; value -= 273.15; break;
-            case VK_PERFORMANCE_COUNTER_UNIT_WATTS_KHR: unitText = "W"; break;
-            case VK_PERFORMANCE_COUNTER_UNIT_VOLTS_KHR: unitText = "v"; break;
-            case VK_PERFORMANCE_COUNTER_UNIT_AMPS_KHR: unitText = "amp"; break;
-            case VK_PERFORMANCE_COUNTER_UNIT_HERTZ_KHR: unitText = "Hz"; logScale = 1000; break;
-            case VK_PERFORMANCE_COUNTER_UNIT_CYCLES_KHR: unitText = "cycles"; logScale = 1000; break;
-            case VK_PERFORMANCE_COUNTER_UNIT_NANOSECONDS_KHR: unitText = "s"; logScale = 1000; logBias = -3; break;
-            case VK_PERFORMANCE_COUNTER_UNIT_GENERIC_KHR: logScale = 1000; break;
-            default: break;
-        }
-        // clang-format on
-        const char* prefix = "";
-
-        if (value != 0 && logScale != 0) {
-            double mag = floor(log(fabs(value)) / log(logScale)) + logBias;
-            mag = fmin(fmax(mag, -3.0), 3.0);
-
-            if (mag != 0) {
-                value /= pow(logScale, mag - logBias);
-                const char* prefixes[] = { "n", "u", "m", "", "k", "M", "G", "T" };
-                prefix = prefixes[(int)mag + 3];
-            }
+    // Frame and HW counter state is owned by the thread calling NewFrame(), which is also the only one recording CmdList.
+    bool isOwnerThread = profiling && GetThreadTrace() == ownerTrace;
+
+    if (isOwnerThread && PerfQueryPool && PerfQueryRecordedFrameNo == CurrFrameNo && CmdList != nullptr && list.Handle == CmdList->Handle) {
+        SubmitWithHwCounters(list, queue, submitInfo, fence);
+    } else {
+        HAVK_CHECK(vkQueueSubmit(queue, 1, &submitInfo, fence));
+    }
+    double endTime = GetMonotonicTime();
+
+    if (!profiling) return;
+
+    ThreadTrace* trace = GetThreadTrace();
+    trace->Push({ .Label = "vkQueueSubmit", .Color = 0xE04040, .Depth = trace->StackDepth, .BeginTime = beginTime, .EndTime = endTime });
+
+    std::lock_guard lock(SubmitMutex);
+    PendingSubmits.push_back({
+        .Queue = list.Queue,
+        .BeginTime = beginTime,
+        .EndTime = endTime,
+        .Caller = trace->StackDepth > 0 ? trace->Stack[trace->StackDepth - 1].Label : nullptr,
+        .ThreadIndex = trace->Index,
+        .QuerySlot = querySlot,
+    });
+}
+void PerfmonContext::SubmitWithHwCounters(havk::CommandList& list, VkQueue queue, VkSubmitInfo& submitInfo, VkFence fence) {
+    VkPerformanceQuerySubmitInfoKHR perfQuerySubmitInfo = {
+        .sType = VK_STRUCTURE_TYPE_PERFORMANCE_QUERY_SUBMIT_INFO_KHR,
+        .pNext = submitInfo.pNext,
+        .counterPassIndex = 0,
+    };
+    submitInfo.pNext = &perfQuerySubmitInfo;
+    HAVK_CHECK(vkQueueSubmit(queue, 1, &submitInfo, fence));
+    HAVK_CHECK(vkQueueWaitIdle(queue));
+
+    // Replay the list for remaining passes, without semaphores since they were already waited and signaled by the first one.
+    // Results are only accurate if the workload is reusable, i.e. it doesn't consume its own outputs from previous passes.
+    // FIXME: We'll often get DEVICE_LOST after recreating query pool, maybe a driver bug since VVL is silent?
+    uint32_t numPasses = list.Reusable_ ? PerfNumReqPasses : 1;
+    perfQuerySubmitInfo.pNext = nullptr;
+
+    for (uint32_t pass = 1; pass < numPasses; pass++) {
+        ResetReplayedQueries();
+        perfQuerySubmitInfo.counterPassIndex = pass;
+        VkSubmitInfo replayInfo = {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .pNext = &perfQuerySubmitInfo,
+            .commandBufferCount = 1,
+            .pCommandBuffers = &list.Handle,
+        };
+        HAVK_CHECK(vkQueueSubmit(queue, 1, &replayInfo, nullptr));
+        HAVK_CHECK(vkQueueWaitIdle(queue));
+    }
+    if (PerfQueryNumDropped > 0) {
+        Device->Log(havk::LogLevel::Warn, "[PerfMon] Hardware counters were not collected for %u scopes past the limit of %u per frame",
+                    PerfQueryNumDropped, kMaxPerfQueriesPerFrame);
+    }
+    // TODO: consider making this async
+    uint32_t numCounters = (uint32_t)HwCounterEnabledIndices.size();
+    auto results = std::vector<VkPerformanceCounterResultKHR>(PerfQueryScopes.size() * numCounters);
+    size_t stride = numCounters * sizeof(VkPerformanceCounterResultKHR);
+    vkGetQueryPoolResults(Device->Device, PerfQueryPool, 0, (uint32_t)PerfQueryScopes.size(), PerfQueryScopes.size() * stride,
+                          results.data(), stride, 0);
+
+    if (!HwCaptureActive) {
+        HwCounterResults[0].assign(results.begin(), results.begin() + numCounters);
+        TraceHwCounters();
+        return;
+    }
+    for (uint32_t i = 0; i < PerfQueryScopes.size(); i++) {
+        Scope* scope = PerfQueryScopes[i];
+        scope->HwCounterSums.resize(numCounters);
+        scope->HwCounterNumCalls++;
+
+        for (uint32_t j = 0; j < numCounters; j++) {
+            scope->HwCounterSums[j] += GetHwCounterValue(HwCounters[HwCounterEnabledIndices[j]], results[i * numCounters + j]);
         }
-        return snprintf(buffer, bufferSize, "%.3f%s%s", value, prefix, unitText);
     }
-};
+    HwCaptureDepth++;
+}
 
-static PerfmonContext* g_ctx;
+void PerfmonContext::ResetReplayedQueries() {
+    // Queries written by the previous pass must be unavailable again before the list writes them. Only performance
+    // queries are allowed to span passes.
+    if (TsqRecording) {
+        vkResetQueryPool(Device->Device, TsqPool, TsqFirstSlot, kTsqSlotsPerFrame);
+    }
+    CommandQueryFrame& cmdFrame = CmdQueryFrames[CurrFrameNo % kTsqFrameRing];
+    if (CmdQueryList.load(std::memory_order_relaxed) != nullptr) {
+        vkResetQueryPool(Device->Device, cmdFrame.TimestampPool, 0, kMaxCommandQueriesPerFrame * 2);
+        if (cmdFrame.StatsPool) vkResetQueryPool(Device->Device, cmdFrame.StatsPool, 0, kMaxCommandQueriesPerFrame);
+    }
+}
+
+void PerfmonContext::StartHwCapture() {
+    ForEachScope([&](Scope* scope) {
+        scope->HwCounterSums.clear();
+        scope->HwCounterNumCalls = 0;
+    });
+    HwCaptureActive = true;
+    HwCaptureDepth = 0;
+    // Lists begun from now on can be replayed, the bound one may not be.
+    Device->ReusableCommandLists_ = true;
+    HwCaptureListReusable = false;
+}
+void PerfmonContext::FinishHwCapture() {
+    HwCaptureActive = false;
+    Device->ReusableCommandLists_ = false;
+}
+
+double PerfmonContext::GetScopeHwCounterValue(Scope* scope, uint32_t index) {
+    if (index >= scope->HwCounterSums.size()) return 0;
+
+    double sum = scope->HwCounterSums[index];
+    switch (HwCounters[HwCounterEnabledIndices[index]].unit) {
+        case VK_PERFORMANCE_COUNTER_UNIT_PERCENTAGE_KHR:
+        case VK_PERFORMANCE_COUNTER_UNIT_HERTZ_KHR:
+        case VK_PERFORMANCE_COUNTER_UNIT_BYTES_PER_SECOND_KHR:
+        case VK_PERFORMANCE_COUNTER_UNIT_KELVIN_KHR:
+        case VK_PERFORMANCE_COUNTER_UNIT_WATTS_KHR:
+        case VK_PERFORMANCE_COUNTER_UNIT_VOLTS_KHR:
+        case VK_PERFORMANCE_COUNTER_UNIT_AMPS_KHR: return sum / scope->HwCounterNumCalls;
+        default: return sum;
+    }
+}
+double PerfmonContext::GetHwCounterValue(const VkPerformanceCounterKHR& counter, const VkPerformanceCounterResultKHR& result) {
+    switch (counter.storage) {
+        case VK_PERFORMANCE_COUNTER_STORAGE_INT32_KHR: return result.int32;
+        case VK_PERFORMANCE_COUNTER_STORAGE_INT64_KHR: return (double)result.int64;
+        case VK_PERFORMANCE_COUNTER_STORAGE_UINT32_KHR: return result.uint32;
+        case VK_PERFORMANCE_COUNTER_STORAGE_UINT64_KHR: return (double)result.uint64;
+        case VK_PERFORMANCE_COUNTER_STORAGE_FLOAT32_KHR: return result.float32;
+        case VK_PERFORMANCE_COUNTER_STORAGE_FLOAT64_KHR: return result.float64;
+        default: return 0;
+    }
+}
+
+
+PerfmonContext* g_ctx;
 
 void PerfMon::NewFrame(havk::CommandList& list) {
     if (!g_ctx || g_ctx->Device != list.Context) {
         if (g_ctx) Shutdown();
         g_ctx = new PerfmonContext(list.Context);
     }
+    g_ownerTrace = GetThreadTrace();
     g_ctx->Bind(&list);
 }
 void PerfMon::Shutdown() {
     if (g_ctx) {
+        g_ownerTrace = nullptr;
         delete g_ctx;
         g_ctx = nullptr;
+
+        // Pending events may point to labels of deleted scopes.
+        std::lock_guard lock(g_threadTracesMutex);
+        for (auto& trace : g_threadTraces) {
+            trace->ReadPos.store(trace->WritePos.load(std::memory_order_acquire), std::memory_order_release);
+        }
     }
 }
-void PerfMon::DrawFrame() {
-    if (g_ctx) g_ctx->DrawFrame();
+void PerfMon::CaptureTrace(const char* path, uint32_t numFrames) {
+    g_traceRequestPath = path;
+    g_traceRequestNumFrames = numFrames;
+}
+bool PerfMon::IsCapturingTrace() {
+    return !g_traceRequestPath.empty() || (g_ctx && g_ctx->Trace != nullptr);
+}
+void PerfMon::CaptureHwCounters() {
+    if (g_ctx && !g_ctx->HwCounterEnabledIndices.empty()) {
+        g_ctx->StartHwCapture();
+    }
+}
+bool PerfMon::IsCapturingHwCounters() {
+    return g_ctx && g_ctx->HwCaptureActive;
+}
+void PerfMon::SetCommandProfiling(bool enabled) {
+    g_cmdProfilingEnabled = enabled;
+}
+bool PerfMon::IsCommandProfiling() {
+    return g_cmdProfilingEnabled;
 }
 
-PerfMon::ScopeHandle PerfMon::BeginScope(const char* label, uint32_t color) {
-    if (!g_ctx || !g_ctx->CmdList) return {};
-    Scope* scope = g_ctx->BeginScope(label);
-    if (color != 0) {
-        scope->Color = IM_COL32(color >> 16 & 255, color >> 8 & 255, color >> 0 & 255, 255);
+PerfMon::TimingStats GetSampleStats(const float* samples, uint32_t currFrameNo, uint32_t lastRecordedFrameNo, uint32_t numFrames) {
+    std::vector<float> values;
+    numFrames = std::min(numFrames, (uint32_t)kSampleHistorySize - 1);
+
+    // Current frame is still being recorded, start from the previous one.
+    for (uint32_t i = 1; i <= numFrames; i++) {
+        uint32_t frameNo = currFrameNo - i;
+        // Ring entries after the last recorded frame still hold samples from a previous lap.
+        if ((int32_t)(frameNo - lastRecordedFrameNo) > 0) continue;
+
+        float value = samples[frameNo % kSampleHistorySize];
+        if (value > 0) values.push_back(value);
     }
-    return { .InternalData = scope };
+    PerfMon::TimingStats stats = { .NumSamples = (uint32_t)values.size() };
+    if (values.empty()) return stats;
+
+    std::sort(values.begin(), values.end());
+    auto percentile = [&](double p) { return values[(size_t)std::ceil(p * (double)values.size()) - 1]; };
+
+    double sum = 0;
+    for (float value : values) sum += value;
+
+    stats.Mean = sum / (double)values.size();
+    stats.Min = values.front();
+    stats.Max = values.back();
+    stats.P50 = percentile(0.50);
+    stats.P95 = percentile(0.95);
+    stats.P99 = percentile(0.99);
+    return stats;
+}
+static Scope* FindScope(Scope* root, std::string_view path) {
+    Scope* scope = root;
+
+    while (scope != nullptr && !path.empty()) {
+        std::string_view label = path.substr(0, path.find('/'));
+        path = path.substr(std::min(path.size(), label.size() + 1));
+
+        auto iter = std::find_if(scope->Children.begin(), scope->Children.end(), [&](auto& child) { return label == child->Label; });
+        scope = iter != scope->Children.end() ? iter->get() : nullptr;
+    }
+    return scope != root ? scope : nullptr;
+}
+static void WriteStats(yson::Writer& wr, std::string_view key, const PerfMon::TimingStats& stats) {
+    wr.BeginObject(key);
+    wr.WriteUInt("numSamples", stats.NumSamples);
+    wr.WriteNum("mean", stats.Mean);
+    wr.WriteNum("min", stats.Min);
+    wr.WriteNum("max", stats.Max);
+    wr.WriteNum("p50", stats.P50);
+    wr.WriteNum("p95", stats.P95);
+    wr.WriteNum("p99", stats.P99);
+    wr.EndObject();
+}
+
+PerfMon::TimingStats PerfMon::GetFrameStats(uint32_t numFrames) {
+    if (!g_ctx) return {};
+    return GetSampleStats(g_ctx->ElapsedFrameIntervals, g_ctx->CurrFrameNo, g_ctx->CurrFrameNo, numFrames);
+}
+bool PerfMon::GetQueueStats(havk::QueueDomain queue, QueueStats& stats) {
+    if (!g_ctx || g_ctx->Device->GetQueue(queue) == nullptr) return false;
+
+    stats = g_ctx->GetQueueStats(g_ctx->Device->GetQueue(queue));
+    return stats.NumSubmits > 0;
+}
+bool PerfMon::GetScopeStats(std::string_view path, TimingStats& cpuStats, TimingStats& gpuStats, uint32_t numFrames) {
+    Scope* scope = g_ctx ? FindScope(&g_ctx->RootScope, path) : nullptr;
+    if (scope == nullptr) return false;
+
+    cpuStats = GetSampleStats(scope->ElapsedSamplesCPU, g_ctx->CurrFrameNo, scope->LastRecordedFrameNo, numFrames);
+    gpuStats = GetSampleStats(scope->ElapsedSamplesGPU, g_ctx->CurrFrameNo, scope->LastRecordedFrameNo, numFrames);
+    return true;
+}
+std::string PerfMon::GetSummary(uint32_t numFrames) {
+    if (!g_ctx) return "";
+
+    yson::Writer wr;
+    wr.BeginObject();
+    wr.WriteStr("device", g_ctx->Device->PhysicalDevice.Props.deviceName);
+    wr.WriteUInt("numFrames", std::min(numFrames, (uint32_t)kSampleHistorySize - 1));
+    WriteStats(wr, "frameInterval", GetFrameStats(numFrames));
+
+    auto writeScope = [&](auto& writeScope, Scope* scope) -> void {
+        wr.BeginObject();
+        wr.WriteStr("label", scope->Label);
+        wr.WriteUInt("numCalls", scope->NumCalls);
+        WriteStats(wr, "cpu", GetSampleStats(scope->ElapsedSamplesCPU, g_ctx->CurrFrameNo, scope->LastRecordedFrameNo, numFrames));
+        WriteStats(wr, "gpu", GetSampleStats(scope->ElapsedSamplesGPU, g_ctx->CurrFrameNo, scope->LastRecordedFrameNo, numFrames));
+
+        if (scope->HwCounterNumCalls > 0) {
+            wr.BeginObject("hwCounters");
+            for (uint32_t i = 0; i < scope->HwCounterSums.size(); i++) {
+                wr.WriteNum(g_ctx->HwCounterDescs[g_ctx->HwCounterEnabledIndices[i]].name, g_ctx->GetScopeHwCounterValue(scope, i));
+            }
+            wr.EndObject();
+        }
+
+        if (!scope->Children.empty()) {
+            wr.BeginArray("children");
+            for (auto& child : scope->Children) {
+                writeScope(writeScope, child.get());
+            }
+            wr.EndArray();
+        }
+        wr.EndObject();
+    };
+    wr.BeginArray("scopes");
+    for (auto& child : g_ctx->RootScope.Children) {
+        writeScope(writeScope, child.get());
+    }
+    wr.EndArray();
+
+    wr.BeginArray("queues");
+    for (auto& queries : g_ctx->SubmitQueryPools) {
+        QueueStats stats = g_ctx->GetQueueStats(queries->Queue);
+        if (stats.NumSubmits == 0) continue;
+
+        wr.BeginObject();
+        wr.WriteStr("name", g_ctx->GetQueueName(queries->Queue));
+        wr.WriteUInt("numSubmits", stats.NumSubmits);
+        wr.WriteNum("utilization", stats.Utilization);
+        wr.WriteNum("idleTime", stats.IdleTime);
+        wr.WriteUInt("numBubbles", stats.NumBubbles);
+        wr.WriteNum("longestBubble", stats.LongestBubble);
+        if (stats.LongestBubbleCause != nullptr) wr.WriteStr("longestBubbleCause", stats.LongestBubbleCause);
+        wr.EndObject();
+    }
+    wr.EndArray();
+
+    if (g_ctx->CmdStatsNumFrames > 0) {
+        std::vector<std::pair<const std::string, CommandStats>*> commands;
+        for (auto& entry : g_ctx->CmdStats) {
+            if (entry.second.NumCalls > 0) commands.push_back(&entry);
+        }
+        std::sort(commands.begin(), commands.end(), [](auto a, auto b) { return a->second.GpuTime > b->second.GpuTime; });
+
+        // Per frame averages, over frames since profiling was enabled.
+        double numFrames = g_ctx->CmdStatsNumFrames;
+        wr.BeginArray("commands");
+        for (auto entry : commands) {
+            auto& [name, stats] = *entry;
+            wr.BeginObject();
+            wr.WriteStr("name", name);
+            wr.WriteNum("numCalls", (double)stats.NumCalls / numFrames);
+            wr.WriteNum("gpuTime", stats.GpuTime / numFrames);
+            wr.WriteNum("invocations", (double)stats.Invocations / numFrames);
+            wr.WriteNum("primitives", (double)stats.Primitives / numFrames);
+            wr.EndObject();
+        }
+        wr.EndArray();
+    }
+    wr.EndObject();
+    return std::move(wr.Buffer);
+}
+
+void PerfMon::SetThreadName(const char* name) {
+    ThreadTrace* trace = GetThreadTrace();
+    std::lock_guard lock(g_threadTracesMutex);
+    strncpy(trace->Name, name, sizeof(ThreadTrace::Name) - 1);
+}
+
+static PerfMon::ScopeHandle EnterScope(const char* label, uint32_t color, PerfMon::ScopeSite* site) {
+    ThreadTrace* ownerTrace = g_ownerTrace.load(std::memory_order_relaxed);
+    if (ownerTrace == nullptr) return {};
+
+    ThreadTrace* trace = GetThreadTrace();
+    if (trace->StackDepth >= kMaxStackDepth) return {};
+
+    auto& entry = trace->Stack[trace->StackDepth++];
+    entry = { .Label = label, .Color = color, .TreeScope = nullptr };
+
+    if (trace == ownerTrace && g_ctx->CmdList) {
+        Scope* parent = g_ctx->GetCurrentScope();
+        entry.TreeScope = site != nullptr ? g_ctx->FindOrCreateChild(parent, *site) : g_ctx->FindOrCreateChild(parent, label);
+        g_ctx->BeginScope(entry.TreeScope, entry.TsqSlot);
+        entry.Label = entry.TreeScope->Label;  // Stable copy for the timeline
+
+        if (color != 0) {
+            entry.TreeScope->Color = 0xFF000000 | (color >> 16 & 255) | (color & 0xFF00) | (color & 255) << 16;
+        }
+    }
+    entry.BeginTime = GetMonotonicTime();
+    return { .InternalData = trace };
+}
+PerfMon::ScopeHandle PerfMon::BeginScope(const char* label, uint32_t color) {
+    return EnterScope(label, color, nullptr);
+}
+PerfMon::ScopeHandle PerfMon::BeginScope(ScopeSite& site) {
+    return EnterScope(site.Label, site.Color, &site);
 }
 PerfMon::ScopeHandle::~ScopeHandle() {
-    if (InternalData) g_ctx->EndScope((Scope*)InternalData);
+    if (!InternalData) return;
+
+    double endTime = GetMonotonicTime();
+    auto trace = (ThreadTrace*)InternalData;
+    auto& entry = trace->Stack[--trace->StackDepth];
+
+    if (entry.TreeScope != nullptr && trace == g_ownerTrace.load(std::memory_order_relaxed)) {
+        g_ctx->EndScope(entry.TreeScope, entry.TsqSlot, (float)(endTime - entry.BeginTime));
+    }
+    trace->Push({ .Label = entry.Label, .Color = entry.Color, .Depth = trace->StackDepth, .BeginTime = entry.BeginTime, .EndTime = endTime });
     InternalData = nullptr;
 }
 PerfMon::ScopeHandle& PerfMon::ScopeHandle::SetText(const char* fmt, ...) {
@@ -1,11 +1,19 @@
 #pragma once
 #include <Havk/Havk.h>
 
+#include <atomic>
+
 // Very basic CPU+GPU frame profiler.
-// 
-// Current limitations:
-// - Only one call per scope is supported
-// - Not thread safe
+//
+// Scopes can be entered from any thread and multiple times per frame, in which case timings are summed.
+// Scopes entered outside the thread calling NewFrame() only record CPU timings, and their labels must be string literals.
+// They are listed per thread in the timeline view and under a node for each thread in the scope tree.
+//
+// The timeline also shows queue submits and GPU scopes per queue, with idle gaps between them. GPU timestamps are mapped
+// to GetMonotonicTime() using VK_KHR_calibrated_timestamps if available, otherwise they are aligned to the start of frames.
+// Submitted batches are wrapped with timestamps, from which queue utilization and the causes of idle gaps are derived.
+//
+// Statistics can also be queried without the UI, which lives in a separate file and is the only part depending on ImGui.
 //
 // GPU performance counters are also shown if VK_KHR_performance_query is available.
 // As of mid 2025, this ext is only implemented on Intel and AMD (Mesa RADV) drivers.
@@ -19,20 +27,91 @@ struct ScopeHandle {
     ScopeHandle& SetText(const char* fmt, ...);
 };
 
+// Static descriptor of a scope call site, as declared by the ZoneScoped macros. The label is interned on first use, and
+// the tree node entered from here is cached, so that entering the scope doesn't need to search for it by label.
+struct ScopeSite {
+    const char* Label;
+    uint32_t Color = 0;
+    std::atomic<uint32_t> LabelId = 0;
+
+    // Only accessed by the thread calling NewFrame().
+    void* CachedParent = nullptr;
+    void* CachedScope = nullptr;
+    uint32_t CacheGeneration = 0;
+};
+
+// Timings in seconds, over frames in which a scope was recorded.
+struct TimingStats {
+    uint32_t NumSamples = 0;
+    double Mean = 0, Min = 0, Max = 0;
+    double P50 = 0, P95 = 0, P99 = 0;
+};
+
+// Queue occupancy over the last half second, measured between the start and end of each submitted batch.
+struct QueueStats {
+    uint32_t NumSubmits = 0;
+    double Utilization = 0;  // Busy fraction of the time between start of the first and end of the last submit
+    double IdleTime = 0;
+    uint32_t NumBubbles = 0;  // Idle gaps of at least 50us
+    double LongestBubble = 0;
+    // Scope that delayed the submit ending the longest bubble, or where it was submitted from if it was
+    // waiting for a semaphore. Valid until the next call to NewFrame(), may be null.
+    const char* LongestBubbleCause = nullptr;
+};
+
 // Bind CommandList and DeviceContext from where profiling will happen.
-// This function marks frame boundaries, and must not be called again until the previously bound list has been submitted.
+// This function marks frame boundaries. GPU timings are read back without waiting, and show up a few frames later.
 void NewFrame(havk::CommandList& list);
 
 // Call this before destroying any previously bound DeviceContext.
 void Shutdown();
 
+// Sets the calling thread's name in the timeline view.
+void SetThreadName(const char* name);
+
+// Saves CPU/GPU scopes and counters of the next `numFrames` to a Chrome trace-event JSON file, which can be opened
+// in ui.perfetto.dev. Must be called from the thread calling NewFrame(), capture starts on the next call.
+// GPU timestamps are mapped to the CPU clock with VK_KHR_calibrated_timestamps, or roughly aligned to frame start if unavailable.
+void CaptureTrace(const char* path, uint32_t numFrames);
+bool IsCapturingTrace();
+
+// Collects all enabled hardware counters for every scope, replaying each frame as many times as the counters require.
+// Takes one frame per level of nested scopes, whose workload must be reusable, i.e. not depend on its own outputs.
+// Results are merged per scope and included in GetSummary().
+void CaptureHwCounters();
+bool IsCapturingHwCounters();
+
+// Measures GPU time and pipeline statistics of every dispatch, draw and transfer command recorded into the list passed
+// to NewFrame(), and ranks them by pipeline. Times span from completion of preceding work to completion of the command,
+// and don't stop later commands from overlapping with it, so they are approximate and won't add up to the frame time.
+// Only the thread calling NewFrame() should record into that list. Stats are reset when enabled, and included in
+// GetSummary().
+void SetCommandProfiling(bool enabled);
+bool IsCommandProfiling();
+
 // This function should not be called directly, but wrapped in a macro so that calls can be
 // easily stripped out in release builds. See also, `HAVK_PERFMON_OVERRIDE_TRACY_MACROS`.
+// Labels are compared against those of sibling scopes on every call, prefer the `ScopeSite` overload where possible.
 ScopeHandle BeginScope(const char* label, uint32_t color = 0);
+ScopeHandle BeginScope(ScopeSite& site);
 
-// Draw UI using ImGui. Must only be called after all Begin()/End() calls.
+// Draw UI using ImGui. Must only be called after all Begin()/End() calls. Implemented in `havk::extensions`.
 void DrawFrame();
 
+// Statistics over the last `numFrames` completed frames, up to 255. Must be called from the thread calling NewFrame().
+// GPU timings are read back a few frames late, so the most recent frames are not counted until then.
+TimingStats GetFrameStats(uint32_t numFrames = 255);
+
+// `path` is a list of nested scope labels separated by '/', e.g. "Render/Shadows". Scopes from other threads are
+// nested under the thread name. Timings of multiple calls in a frame are summed. Returns false if the scope doesn't exist.
+bool GetScopeStats(std::string_view path, TimingStats& cpuStats, TimingStats& gpuStats, uint32_t numFrames = 255);
+
+// Returns false if no submits to the queue were measured recently. Must be called from the thread calling NewFrame().
+bool GetQueueStats(havk::QueueDomain queue, QueueStats& stats);
+
+// Returns a YSON document with stats of all scopes, for logging or comparison by benchmarks.
+std::string GetSummary(uint32_t numFrames = 255);
+
 };  // namespace havx::PerfMon
 
 #if defined(_MSC_VER) && !defined(__clang__)
@@ -48,7 +127,9 @@ void DrawFrame();
     #undef ZoneScoped
     #undef ZoneScopedN
     #undef ZoneScopedNC
-    #define ZoneScopedNC(name, color) auto __havk_perf_scope = havx::PerfMon::BeginScope(name, color)
+    #define ZoneScopedNC(name, color)                                                     \
+        static havx::PerfMon::ScopeSite __havk_perf_site = { .Label = name, .Color = color }; \
+        auto __havk_perf_scope = havx::PerfMon::BeginScope(__havk_perf_site)
     #define ZoneScopedN(name) ZoneScopedNC(name, 0)
     #define ZoneScoped ZoneScopedN(HAVK_PERFMON_FILE_NAME ":" HAVK_PERFMON_STRINGIFY(__LINE__))
 #endif
\ No newline at end of file
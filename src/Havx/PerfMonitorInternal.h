@@ -0,0 +1,323 @@
+#pragma once
+#include "PerfMonitor.h"
+
+#include <atomic>
+#include <climits>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Shared state of PerfMonitor.cpp and PerfMonitorUI.cpp. The core must not depend on ImGui.
+namespace havx {
+
+constexpr int kMaxStackDepth = 32;
+constexpr int kSampleHistorySize = 256;
+constexpr int kTsqSlotsPerFrame = 2048;
+constexpr int kTsqFrameRing = 4;  // Frames whose timestamps can be pending at once, should be more than frames in flight.
+constexpr uint32_t kTraceCpuPid = 1, kTraceGpuPid = 2;
+constexpr double kTimelineHistorySec = 0.5;
+constexpr uint32_t kMaxPerfQueriesPerFrame = 256;
+constexpr uint32_t kMaxCommandQueriesPerFrame = 4096;
+constexpr uint32_t kMaxSubmitsInFlight = 64;  // Per queue
+constexpr double kMinBubbleSec = 50e-6;       // Shorter idle gaps only count towards utilization
+
+struct Scope {
+    std::vector<std::unique_ptr<Scope>> Children;
+    uint32_t LastRecordedFrameNo = 0;
+    uint32_t NumCalls = 0;  // In last recorded frame
+    uint32_t Depth = 0;
+    uint32_t LabelId = 0;  // Interned, see PerfMon::ScopeSite
+    std::vector<uint32_t> TsqSlots[kTsqFrameRing];  // First slot of each pending call, per ring frame.
+    float ElapsedSamplesCPU[kSampleHistorySize] = {};  // Sum over all calls in frame
+    float ElapsedSamplesGPU[kSampleHistorySize] = {};
+    char Label[256] = "";
+    uint32_t Color = 0;  // ABGR as in ImU32, or 0 for default
+    bool ShowInPlot = true;
+    bool IsThreadRoot = false;  // Parent of scopes recorded by other threads, CPU time is the sum of top-level scopes.
+    // Sums over all calls from last multi-pass capture, per enabled counter.
+    std::vector<double> HwCounterSums;
+    uint32_t HwCounterNumCalls = 0;
+};
+
+// Per-thread buffer of completed scopes, for the timeline and for scopes entered outside the thread calling NewFrame().
+// Events are only written by the owning thread, and drained by NewFrame().
+struct ThreadTrace {
+    static constexpr uint32_t kCapacity = 8192;
+
+    struct Event {
+        const char* Label;
+        uint32_t Color;  // 0xRRGGBB, or 0 for default
+        uint32_t Depth;
+        double BeginTime, EndTime;
+    };
+    struct StackEntry {
+        const char* Label;
+        uint32_t Color;
+        double BeginTime;
+        Scope* TreeScope;  // Only set on the thread calling NewFrame().
+        uint32_t TsqSlot;
+    };
+    Event Events[kCapacity];
+    std::atomic<uint32_t> WritePos = 0, ReadPos = 0;
+    std::atomic<uint32_t> NumDropped = 0;
+
+    StackEntry Stack[kMaxStackDepth];
+    uint32_t StackDepth = 0;
+    uint32_t Index = 0;  // Into g_threadTraces and PerfmonContext::TimelineLanes
+    char Name[64] = "";
+    bool InUse = true;  // Cleared when the thread exits, guarded by g_threadTracesMutex
+
+    void Push(const Event& event) {
+        uint32_t pos = WritePos.load(std::memory_order_relaxed);
+        if (pos - ReadPos.load(std::memory_order_acquire) >= kCapacity) {
+            NumDropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        Events[pos % kCapacity] = event;
+        WritePos.store(pos + 1, std::memory_order_release);
+    }
+};
+
+struct TimelineLane {
+    std::string Name;
+    std::vector<ThreadTrace::Event> Events;
+    havk::DeviceQueue* Queue = nullptr;  // GPU lanes only
+};
+struct SubmitEvent {
+    havk::DeviceQueue* Queue;
+    double BeginTime, EndTime;  // Of vkQueueSubmit() call
+    double GpuBeginTime = 0, GpuEndTime = 0;  // Of batch execution, zero if not measured
+    const char* Caller = nullptr;  // Innermost scope of submitting thread
+    uint32_t ThreadIndex = 0;
+    uint32_t QuerySlot = UINT_MAX;
+};
+// Time a queue spent idle between two submits.
+struct QueueBubble {
+    havk::DeviceQueue* Queue;
+    double BeginTime, EndTime;
+    const char* Cause;  // CPU scope that delayed the next submit, or where it was submitted from. May be null.
+    bool WaitingForCpu;  // Queue ran dry before the next submit was issued, otherwise it was waiting for semaphores.
+};
+// Timestamps written at the start and end of each submitted batch, by command buffers recorded once per slot.
+struct SubmitQueries {
+    havk::DeviceQueue* Queue;
+    VkQueryPool Pool = nullptr;  // Null if the queue doesn't support timestamps
+    VkCommandPool CmdPool = nullptr;
+    VkCommandBuffer BeginCmds[kMaxSubmitsInFlight], EndCmds[kMaxSubmitsInFlight];
+    bool SlotBusy[kMaxSubmitsInFlight] = {};  // Results not read yet
+    uint64_t SlotSubmitTimestamps[kMaxSubmitsInFlight] = {};  // Value of queue's SubmitSemaphore signaled by last use
+    uint32_t NextSlot = 0;
+    double LastGpuEndTime = 0;
+};
+struct TsqFrame {
+    uint32_t FrameNo = 0;
+    uint32_t NumSlots = 0;
+    uint32_t NumPendingScopes = 0;
+    uint32_t NumSkips = 0;  // Times this entry was still pending when its turn came around.
+    double CpuBeginTime = 0;
+    havk::DeviceQueue* Queue = nullptr;
+};
+
+// Sums over all profiled frames, of commands using the same pipeline.
+struct CommandStats {
+    double GpuTime = 0;
+    uint64_t NumCalls = 0;
+    uint64_t Invocations = 0;  // Vertex, fragment and compute shader invocations
+    uint64_t Primitives = 0;   // Clipping invocations
+};
+// Timestamp and pipeline statistics queries around each command recorded in a frame, see PerfMon::SetCommandProfiling().
+struct CommandQueryFrame {
+    struct Entry {
+        CommandStats* Stats;
+        bool HasPipelineStats;
+    };
+    VkQueryPool TimestampPool = nullptr;  // Two slots per command
+    VkQueryPool StatsPool = nullptr;      // Null if pipelineStatisticsQuery is not supported
+    std::vector<Entry> Commands;  // Pending until results are read back
+    uint32_t NumSkips = 0;
+};
+struct StringHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view str) const { return std::hash<std::string_view>()(str); }
+};
+
+struct TraceWriter;
+
+struct PerfmonContext final : havk::CommandObserver {
+    havk::DeviceContext* Device = nullptr;
+    havk::CommandList* CmdList = nullptr;
+
+    VkQueryPool TsqPool;
+    uint32_t TsqFirstSlot = 0, TsqNextSlot = 0;
+    TsqFrame TsqFrames[kTsqFrameRing];
+    bool TsqRecording = false;
+    uint32_t CurrFrameNo = 0;
+    uint32_t Generation = 0;  // Invalidates scopes cached in ScopeSites by previous contexts.
+    float ElapsedFrameIntervals[kSampleHistorySize] = {};
+
+    Scope RootScope;
+    Scope* Stack[kMaxStackDepth];
+    uint32_t StackDepth = 0;
+
+    // Events of the last kTimelineHistorySec, per thread and per queue. GPU events lag behind by a few frames.
+    std::vector<TimelineLane> TimelineLanes;
+    std::vector<TimelineLane> GpuTimelineLanes;
+    double TimelineBegin = 0, TimelineEnd = 0;  // Of last completed frame
+    bool TimelineFrozen = false;
+
+    // Submits from all threads, collected by the hook. Those with timestamps wait in InFlightSubmits until read back.
+    std::mutex SubmitMutex;
+    std::vector<SubmitEvent> PendingSubmits, InFlightSubmits, RecentSubmits;
+    std::vector<std::unique_ptr<SubmitQueries>> SubmitQueryPools;
+    std::vector<QueueBubble> RecentBubbles;
+
+    // Device timestamps map to GetMonotonicTime() as `ticks * TsqSecondsPerTick + GpuClockOffset`.
+    double TsqSecondsPerTick = 0;
+    double GpuClockOffset = 0;
+    bool GpuClockCalibrated = false;
+    bool GpuClockKnown = false;  // Calibrated, or estimated from a frame's first timestamp
+    double GpuClockSyncTime = 0;
+    VkTimeDomainKHR HostTimeDomain;
+    PFN_vkGetCalibratedTimestampsKHR vfn_GetCalibratedTimestampsKHR = nullptr;
+
+    // Trace capture
+    std::unique_ptr<TraceWriter> Trace;
+    std::string TracePath;
+    std::string TraceChunk;  // Events collected in current Bind()
+    uint32_t TraceFirstFrameNo = 0, TraceEndFrameNo = 0;
+
+    // UI. Hardware counters are recorded for the selected scope.
+    Scope *PrevSelectedScope = nullptr, *PrevHoveredScope = nullptr;
+    int TraceUiNumFrames = 60;
+    int TimelineUiNumFrames = 3;
+    bool SettingsLoaded = false;
+
+    // VK_KHR_performance_query
+    VkQueryPool PerfQueryPool = nullptr;
+    uint32_t PerfNumReqPasses = 0;
+    uint32_t PerfQueryRecordedFrameNo = UINT_MAX;
+    std::vector<Scope*> PerfQueryScopes;  // Of each query recorded in PerfQueryRecordedFrameNo
+    Scope* PerfQueryActiveScope = nullptr;
+    uint32_t PerfQueryNumDropped = 0;  // Scopes past kMaxPerfQueriesPerFrame in PerfQueryRecordedFrameNo
+    bool PerfQueryWantRecord = false;
+    bool PerfQueryMustRecreate = false;
+
+    // Multi-pass capture of all scopes. Queries can't be nested, so each frame captures one level of the tree.
+    bool HwCaptureActive = false;
+    bool HwCaptureListReusable = false;  // Whether the list bound for current frame can be replayed
+    uint32_t HwCaptureDepth = 0;
+
+    std::vector<VkPerformanceCounterKHR> HwCounters;
+    std::vector<VkPerformanceCounterDescriptionKHR> HwCounterDescs;
+
+    std::vector<uint32_t> HwCounterEnabledIndices;
+    std::vector<VkPerformanceCounterResultKHR> HwCounterResults[2];  // Baseline and SavedRef
+
+    // Per-command GPU costs, installed as CommandObserver_ while enabled. Only commands recorded into the bound list
+    // are measured, queries are created on first use and share the ring index of TsqFrames.
+    CommandQueryFrame CmdQueryFrames[kTsqFrameRing];
+    // Observer callbacks run on whichever thread records a list, so they compare against this before touching any state.
+    // Set by the owner thread after preparing the frame, null while not recording.
+    std::atomic<havk::CommandList*> CmdQueryList = nullptr;
+    bool CmdQueryActive = false;  // Between BeginCommand() and EndCommand()
+    std::unordered_map<std::string, CommandStats, StringHash, std::equal_to<>> CmdStats;
+    uint32_t CmdStatsNumFrames = 0;
+    uint32_t CmdStatsNumDropped = 0;  // Commands past kMaxCommandQueriesPerFrame
+
+    PFN_vkAcquireProfilingLockKHR vfn_AcquireProfilingLockKHR;
+    PFN_vkReleaseProfilingLockKHR vfn_ReleaseProfilingLockKHR;
+    PFN_vkGetPhysicalDeviceQueueFamilyPerformanceQueryPassesKHR vfn_GetPhysicalDeviceQueueFamilyPerformanceQueryPassesKHR;
+
+    PerfmonContext(havk::DeviceContext* ctx);
+    ~PerfmonContext();
+    void Bind(havk::CommandList* list);
+    // Reads device timestamps of previous frames without waiting. Scopes whose results aren't available stay pending.
+    void PollTimestamps();
+    // Starts command queries for the current frame, or stops them if profiling was disabled.
+    void UpdateCommandProfiling();
+    void PollCommandQueries();
+    void ResetCommandStats();
+    void BeginCommand(havk::CommandList& cmdList, const havk::Pipeline* pipeline, const char* name) override;
+    void EndCommand(havk::CommandList& cmdList) override;
+    // Collects scopes completed by all threads since the last frame, merging those from other threads into the tree.
+    void DrainThreadTraces();
+    // Appends events to a timeline lane, and drops those older than kTimelineHistorySec.
+    void AddTimelineEvents(TimelineLane& lane, std::span<const ThreadTrace::Event> events);
+    // Collects submits and reads back their timestamps, recording the bubbles between them.
+    void DrainSubmits();
+    bool ReadSubmitTimestamps(SubmitEvent& submit);
+    const char* FindBubbleCause(const SubmitEvent& submit, double idleBeginTime);
+    // Returns a free slot in the queue's submit queries, or UINT_MAX. Must be called with SubmitMutex held.
+    uint32_t AcquireSubmitQuerySlot(havk::DeviceQueue* queue, uint64_t submitTimestamp, SubmitQueries*& queries);
+    PerfMon::QueueStats GetQueueStats(havk::DeviceQueue* queue);
+    std::string GetQueueName(havk::DeviceQueue* queue);
+    TimelineLane& GetGpuTimelineLane(havk::DeviceQueue* queue);
+    // Samples device and host clocks together, keeping the pair with the lowest deviation.
+    void CalibrateGpuClock();
+    // Without calibrated timestamps, align the first GPU timestamp of a frame with the CPU frame start.
+    // GPU work actually starts a bit later, so scopes will appear earlier than they ran.
+    void EstimateGpuClockOffset(const TsqFrame& frame, const std::vector<uint64_t>& data);
+    // Flushes events collected for the last frame, and starts or finishes capture.
+    void UpdateTraceCapture();
+    void StartTrace(const std::string& path, uint32_t numFrames);
+    void FinishTrace();
+    // Installed as SubmitHook_, records submit times and collects hardware counters.
+    void OnSubmit(havk::CommandList& list, VkQueue queue, VkSubmitInfo& submitInfo, VkFence fence);
+    void SubmitWithHwCounters(havk::CommandList& list, VkQueue queue, VkSubmitInfo& submitInfo, VkFence fence);
+    // Host-resets queries written by the bound list, before it is replayed for another counter pass.
+    void ResetReplayedQueries();
+    void StartHwCapture();
+    void FinishHwCapture();
+    // Called after counters for the selected scope were read back.
+    void TraceHwCounters();
+    void AddCpuSample(Scope* scope, float elapsed);
+    void BeginScope(Scope* scope, uint32_t& tsqSlot);
+    void EndScope(Scope* scope, uint32_t tsqSlot, float elapsed);
+    static Scope* FindOrCreateChild(Scope* parent, const char* label);
+    Scope* FindOrCreateChild(Scope* parent, PerfMon::ScopeSite& site);
+    void InitializeClockCalibration();
+    bool InitializeHwCounters();
+    static double GetHwCounterValue(const VkPerformanceCounterKHR& counter, const VkPerformanceCounterResultKHR& result);
+    // Merged over all calls of a scope, rates and percentages are averaged. `index` is into HwCounterEnabledIndices.
+    double GetScopeHwCounterValue(Scope* scope, uint32_t index);
+
+    Scope* GetCurrentScope() { return StackDepth == 0 ? &RootScope : Stack[StackDepth - 1]; }
+    double GetGpuTime(uint64_t ticks) { return (double)ticks * TsqSecondsPerTick + GpuClockOffset; }
+    bool IsFrameTraced(uint32_t frameNo) { return Trace != nullptr && frameNo >= TraceFirstFrameNo && frameNo < TraceEndFrameNo; }
+    template<typename F>
+    void ForEachScope(F&& fn) {
+        auto visitScope = [&](auto& visitScope, Scope* scope) -> void {
+            fn(scope);
+            for (auto& child : scope->Children) {
+                visitScope(visitScope, child.get());
+            }
+        };
+        visitScope(visitScope, &RootScope);
+    }
+
+    // PerfMonitorUI.cpp
+    void DrawFrame();
+    void DrawTimingsOverview();
+    bool DrawScopeLabel(Scope* scope);
+    void DrawScopeTooltip(Scope* scope);
+    static char* FormatTime(char buffer[32], float valueSec);
+    void DrawTimeline();
+    void DrawHwCounters();
+    void DrawScopeHwCounters();
+    void DrawCommandStats();
+    void DrawQueueStats();
+    void DrawBubbleCause(const QueueBubble& bubble);
+    std::vector<Scope*> GetPlotLeafScopes();
+    void SaveOrLoadSettings(bool save);
+    static int FormatHwCounterValue(char* buffer, uint32_t bufferSize, const VkPerformanceCounterKHR& counter, double value);
+};
+
+extern PerfmonContext* g_ctx;
+
+// Stats over the ring of per-frame `samples`, skipping frames after `lastRecordedFrameNo` and empty samples.
+PerfMon::TimingStats GetSampleStats(const float* samples, uint32_t currFrameNo, uint32_t lastRecordedFrameNo, uint32_t numFrames);
+
+};  // namespace havx
@@ -0,0 +1,899 @@
+#include "PerfMonitorInternal.h"
+#include "SystemUtils.h"
+
+#define IMGUI_DEFINE_MATH_OPERATORS
+#include <imgui.h>
+#include <imgui_internal.h>
+#include <implot.h>
+#include <implot_internal.h>
+
+#include <algorithm>
+
+namespace havx {
+
+void PerfmonContext::DrawFrame() {
+    if (!SettingsLoaded && HwCounters.size() > 0) {
+        SaveOrLoadSettings(false);
+        PerfQueryMustRecreate = true;
+    }
+    SettingsLoaded = true;
+
+    ImGui::Begin("PerfMonitor");
+
+    {
+        double sum = 0, max = 0;
+        int numSamples = 0;
+        for (uint32_t i = 1; i < kSampleHistorySize; i++) {
+            float value = ElapsedFrameIntervals[(CurrFrameNo - i) % kSampleHistorySize];
+            if (value == 0 || sum > 1) break;
+
+            if (value > max) max = value;
+            sum += value;
+            numSamples++;
+        }
+        sum /= numSamples;
+        ImGui::Text("Frame: %.2fms (%.1f FPS, Longest: %.2fms)", sum * 1000, 1.0 / sum, max * 1000);
+    }
+
+    const double oneMB = 1024 * 1024;
+    VmaBudget budgets[VK_MAX_MEMORY_HEAPS] = {};
+    vmaGetHeapBudgets(Device->Allocator, budgets);
+
+    const VmaBudget& memBudget = budgets[0];
+
+    ImGui::Text("Memory: %.1fMB used, %.1fMB reserved (%d allocs)",
+                memBudget.statistics.allocationBytes / oneMB,
+                memBudget.statistics.blockBytes / oneMB,
+                memBudget.statistics.allocationCount);
+
+    if (Trace != nullptr) {
+        uint32_t numFramesLeft = TraceEndFrameNo > CurrFrameNo ? TraceEndFrameNo - CurrFrameNo : 0;
+        ImGui::Text("Capturing trace: %d frames left", numFramesLeft);
+    } else {
+        if (ImGui::Button("Capture Trace")) {
+            PerfMon::CaptureTrace("havk_trace.json", (uint32_t)TraceUiNumFrames);
+        }
+        ImGui::SetItemTooltip("Saves the next frames to havk_trace.json, which can be opened in ui.perfetto.dev");
+        ImGui::SameLine();
+        ImGui::SetNextItemWidth(ImGui::CalcTextSize("0000000").x);
+        ImGui::DragInt("Frames", &TraceUiNumFrames, 1.0f, 1, 10000);
+    }
+
+    DrawTimingsOverview();
+
+    if (ImGui::CollapsingHeader("Timeline")) {
+        DrawTimeline();
+    }
+
+    if (!SubmitQueryPools.empty() && ImGui::CollapsingHeader("Queues")) {
+        DrawQueueStats();
+    }
+
+    if (ImGui::CollapsingHeader("Commands")) {
+        DrawCommandStats();
+    }
+
+    if (HwCounters.size() > 0 && ImGui::CollapsingHeader("Hardware Counters")) {
+        DrawHwCounters();
+    }
+    ImGui::End();
+}
+
+void PerfmonContext::DrawTimingsOverview() {
+    Scope* currHoveredScope = nullptr;
+
+    const auto childFrameFlags = ImGuiChildFlags_AutoResizeX | ImGuiChildFlags_ResizeY;
+    const auto plotFlags = ImPlotFlags_Equal;
+
+    auto frameMinSize = ImGui::GetContentRegionAvail();
+    frameMinSize.y = std::max(200.0f, frameMinSize.y * 0.49f);
+    ImGui::BeginChild("##PerfPlotFrame", frameMinSize, childFrameFlags);
+
+    if (ImPlot::BeginPlot("##PerfTimingHistory", ImGui::GetContentRegionAvail(), ImPlotFlags_NoLegend)) {
+        ImPlot::SetupAxes(nullptr, nullptr, ImPlotAxisFlags_NoTickLabels, 0);
+        ImPlot::SetupAxisFormat(ImAxis_Y1,[](double value, char* buf, int size, void*) {
+            return snprintf(buf, (size_t)size, "%gms", value);
+        });
+        ImPlot::SetupAxisLimitsConstraints(ImAxis_X1, 0, kSampleHistorySize);
+        ImPlot::SetupAxisLimitsConstraints(ImAxis_Y1, 0, 250);
+        ImPlot::SetupAxisLimits(ImAxis_Y1, 0, 16, ImPlotCond_Once);
+        ImPlot::SetupLock();
+
+        auto leafScopes = GetPlotLeafScopes();
+        std::sort(leafScopes.begin(), leafScopes.end(), [](Scope* a, Scope* b) {
+            return a->ElapsedSamplesGPU[0] > b->ElapsedSamplesGPU[0];
+        });
+
+        float frameTicksX[kSampleHistorySize];
+        for (uint32_t i = 0; i < kSampleHistorySize; i++) frameTicksX[i] = i;
+
+        float accumHistory[2][kSampleHistorySize] = {};
+        uint32_t j = 0;
+
+        ImPlotPoint hoverPoint = ImPlot::GetPlotMousePos();
+
+        for (Scope* scope : leafScopes) {
+            ImPlotItem* plotItem = ImPlot::GetItem(scope->Label);
+
+            if (plotItem != nullptr) {
+                if (scope->Color != 0) {
+                    plotItem->Color = scope->Color;
+                } else {
+                    scope->Color = plotItem->Color;
+                }
+                plotItem->LegendHovered = PrevHoveredScope == scope;
+            }
+            float* prevHistory = accumHistory[(j + 0) % 2];
+            float* currHistory = accumHistory[(j + 1) % 2];
+            j++;
+
+            for (uint32_t j = 0; j < kSampleHistorySize; j++) {
+                currHistory[j] = prevHistory[j] + scope->ElapsedSamplesGPU[j] * 1000;
+            }
+            ImPlotSpec spec;
+            spec.FillAlpha = 0.5f;
+
+            uint32_t hoverX = (uint32_t)round(hoverPoint.x);
+            if (hoverX < kSampleHistorySize && hoverPoint.y >= prevHistory[hoverX] && hoverPoint.y <= currHistory[hoverX]) {
+                currHoveredScope = scope;
+                spec.FillAlpha = 0.75f;
+                if (plotItem != nullptr) plotItem->LegendHovered = true;
+            }
+            ImPlot::PlotShaded(scope->Label, frameTicksX, currHistory, prevHistory, kSampleHistorySize, spec);
+            ImPlot::PlotLine(scope->Label, currHistory, kSampleHistorySize, 1, 0, spec);
+        }
+
+        ImPlot::EndPlot();
+    }
+    ImGui::EndChild();
+
+    const auto scopeTableFlags = ImGuiTableFlags_Resizable | ImGuiTableFlags_Hideable | ImGuiTableFlags_Reorderable |
+                                 ImGuiTableFlags_BordersOuter | ImGuiTableFlags_NoBordersInBody;
+
+    const auto baseNodeFlags = ImGuiTreeNodeFlags_SpanAllColumns | ImGuiTreeNodeFlags_DefaultOpen | ImGuiTreeNodeFlags_DrawLinesFull |
+                               ImGuiTreeNodeFlags_FramePadding | ImGuiTreeNodeFlags_AllowOverlap;
+
+    ImGui::BeginChild("##PerfScopeFrame", frameMinSize, childFrameFlags);
+
+    if (ImGui::BeginTable("Scope Timings", 5, scopeTableFlags, ImGui::GetContentRegionAvail())) {
+        const float charWidth = ImGui::CalcTextSize("A").x;
+
+        ImGui::TableSetupColumn("Scope", ImGuiTableColumnFlags_NoHide | ImGuiTableColumnFlags_WidthStretch, charWidth * 30.0f);
+        ImGui::TableSetupColumn("CPU Avg", ImGuiTableColumnFlags_WidthStretch, charWidth * 7.0f);
+        ImGui::TableSetupColumn("%CPU", ImGuiTableColumnFlags_WidthStretch, charWidth * 4.0f);
+        ImGui::TableSetupColumn("GPU Avg", ImGuiTableColumnFlags_WidthStretch, charWidth * 7.0f);
+        ImGui::TableSetupColumn("%GPU", ImGuiTableColumnFlags_WidthStretch, charWidth * 4.0f);
+        ImGui::TableHeadersRow();
+        ImGui::PushStyleVarY(ImGuiStyleVar_CellPadding, 0);
+
+        double histTotalElapsedCPU = 0, histTotalElapsedGPU = 0;
+        for (auto& child : RootScope.Children) {
+            if (child->IsThreadRoot) continue;
+
+            for (uint32_t i = 0; i < kSampleHistorySize; i++) {
+                histTotalElapsedCPU += child->ElapsedSamplesCPU[i];
+                histTotalElapsedGPU += child->ElapsedSamplesGPU[i];
+            }
+        }
+
+        auto drawTimingColumn = [&](Scope* scope, bool cpuTimings) {
+            float sumElapsed = 0;
+            int numSamples = 0;
+
+            for (uint32_t i = 0; i < kSampleHistorySize; i++) {
+                float value = cpuTimings ? scope->ElapsedSamplesCPU[i] : scope->ElapsedSamplesGPU[i];
+                if (value > 0) {
+                    sumElapsed += value;
+                    numSamples++;
+                }
+            }
+            char buffer[32];
+            float avgElapsed = (numSamples > 0) ? (sumElapsed / numSamples) : 0.0f;
+            ImGui::Text("%s", FormatTime(buffer, avgElapsed));
+
+            ImGui::TableNextColumn();
+
+            double total = cpuTimings ? histTotalElapsedCPU : histTotalElapsedGPU;
+            float pct = (total > 0) ? (float)((sumElapsed / total) * 100.0) : 0.0f;
+            ImGui::Text("%.1f%%", pct);
+        };
+
+        auto drawScope = [&](auto& visitScope, Scope* scope) -> void {
+            ImGui::PushID(scope);
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+
+            ImGuiTreeNodeFlags nodeFlags = baseNodeFlags;
+
+            if (scope->Children.empty()) {
+                nodeFlags |= ImGuiTreeNodeFlags_Leaf | ImGuiTreeNodeFlags_NoTreePushOnOpen;
+            }
+            if (PrevSelectedScope == scope) {
+                nodeFlags |= ImGuiTreeNodeFlags_Selected;
+            }
+
+            bool open = ImGui::TreeNodeEx("##Node", nodeFlags);
+
+            if (ImGui::IsItemActivated()) {
+                PrevSelectedScope = scope;
+            }
+            if (ImGui::IsItemHovered()) {
+                currHoveredScope = scope;
+            }
+
+            ImGui::SameLine();
+            scope->ShowInPlot ^= DrawScopeLabel(scope);
+
+            ImGui::TableNextColumn();
+            drawTimingColumn(scope, true);
+            ImGui::TableNextColumn();
+            drawTimingColumn(scope, false);
+            ImGui::TableNextColumn();
+
+            if (open && !scope->Children.empty()) {
+                for (auto& child : scope->Children) {
+                    visitScope(visitScope, child.get());
+                }
+                ImGui::TreePop();
+            }
+            ImGui::PopID();
+        };
+
+        for (auto& child : RootScope.Children) {
+            drawScope(drawScope, child.get());
+        }
+
+        ImGui::PopStyleVar(1);
+        ImGui::EndTable();
+    }
+    ImGui::EndChild();
+
+    if (currHoveredScope != nullptr) {
+        DrawScopeTooltip(currHoveredScope);
+    }
+    PrevHoveredScope = currHoveredScope;
+}
+
+bool PerfmonContext::DrawScopeLabel(Scope* scope) {
+    ImVec4 color = ImGui::ColorConvertU32ToFloat4(scope->Color != 0 ? scope->Color : IM_COL32(31, 140, 255, 255));
+    if (!scope->ShowInPlot) color.w = 0.5f;
+
+    float s = ImGui::GetFrameHeight();
+    bool clicked = ImGui::ColorButton("##ScopeColor", color, ImGuiColorEditFlags_NoTooltip, ImVec2(s, s));
+
+    ImGui::SameLine();
+    ImGui::TextUnformatted(scope->Label);
+
+    return clicked;
+}
+
+void PerfmonContext::DrawScopeTooltip(Scope* scope) {
+    if (!ImGui::BeginTooltip()) return;
+
+    DrawScopeLabel(scope);
+    if (scope->NumCalls > 1) {
+        ImGui::SameLine();
+        ImGui::TextDisabled("(%d calls)", scope->NumCalls);
+    }
+
+    if (ImGui::BeginTable("Timings Detail", 2)) {
+        ImGui::TableSetupColumn("CPU");
+        ImGui::TableSetupColumn("GPU");
+        ImGui::TableHeadersRow();
+
+        for (uint32_t j = 0; j < 2; j++) {
+            ImGui::TableNextColumn();
+
+            float* samples = (j == 0) ? scope->ElapsedSamplesCPU : scope->ElapsedSamplesGPU;
+
+            double sum = 0, sumsq = 0, min = 1e6, max = 0;
+            int numSamples = 0;
+
+            for (uint32_t i = 1; i < kSampleHistorySize; i++) {
+                float elapsed = samples[(CurrFrameNo - i) % kSampleHistorySize];
+                if (elapsed == 0) break;
+
+                sum += elapsed;
+                sumsq += elapsed * elapsed;
+                if (elapsed < min) min = elapsed;
+                if (elapsed > max) max = elapsed;
+                numSamples++;
+            }
+            double avg = sum / numSamples;
+            double stdDev = sqrt((sumsq / numSamples) - (avg * avg));
+
+            char buffer[32];
+            ImGui::Text("Avg: %s", FormatTime(buffer, avg));
+            ImGui::Text("Min: %s", FormatTime(buffer, min));
+            ImGui::Text("Max: %s", FormatTime(buffer, max));
+            ImGui::Text("SD: %s", FormatTime(buffer, stdDev));
+        }
+        ImGui::EndTable();
+    }
+    ImGui::EndTooltip();
+}
+
+char* PerfmonContext::FormatTime(char buffer[32], float valueSec) {
+    const char* unit = "s";
+    if (valueSec < 1) unit = "ms", valueSec *= 1000;
+    if (valueSec < 1) unit = "us", valueSec *= 1000;
+    if (valueSec < 1) unit = "ns", valueSec *= 1000;
+    snprintf(buffer, 32, "%.2f%s", valueSec, unit);
+    return buffer;
+}
+
+void PerfmonContext::DrawTimeline() {
+    ImGui::Checkbox("Freeze", &TimelineFrozen);
+    ImGui::SameLine();
+    ImGui::SetNextItemWidth(ImGui::CalcTextSize("0000000").x);
+    ImGui::DragInt("Frames##Timeline", &TimelineUiNumFrames, 0.1f, 1, 30);
+
+    if (!GpuClockCalibrated) {
+        ImGui::SameLine();
+        ImGui::TextDisabled("(uncalibrated)");
+        ImGui::SetItemTooltip("Calibrated timestamps are not supported, GPU work is aligned to the start of CPU frames.");
+    }
+
+    // GPU results lag behind by a few frames, show the last ones that completed.
+    double viewEnd = 0;
+    for (auto& lane : GpuTimelineLanes) {
+        for (auto& event : lane.Events) viewEnd = std::max(viewEnd, event.EndTime);
+    }
+    if (viewEnd == 0) viewEnd = TimelineEnd;
+
+    double frameInterval = PerfMon::GetFrameStats(16).Mean;
+    double duration = std::max(frameInterval, 1e-4) * TimelineUiNumFrames;
+    double viewBegin = viewEnd - duration;
+
+    float rowHeight = ImGui::GetTextLineHeightWithSpacing();
+    float labelWidth = ImGui::CalcTextSize("GPU AsyncTransfer ").x;
+    ImDrawList* drawList = ImGui::GetWindowDrawList();
+    char buffer[32];
+
+    auto drawLane = [&](TimelineLane& lane, auto&& drawOverlay) {
+        uint32_t numRows = 1;
+        for (auto& event : lane.Events) numRows = std::max(numRows, event.Depth + 1);
+
+        ImVec2 origin = ImGui::GetCursorScreenPos();
+        float width = std::max(ImGui::GetContentRegionAvail().x - labelWidth, 1.0f);
+        ImGui::TextUnformatted(lane.Name.data());
+        ImGui::SetCursorScreenPos(origin);
+        ImGui::Dummy(ImVec2(labelWidth + width, rowHeight * numRows));
+
+        ImVec2 laneMin = ImVec2(origin.x + labelWidth, origin.y);
+        auto getX = [&](double time) { return laneMin.x + (float)((time - viewBegin) / duration) * width; };
+        drawList->PushClipRect(laneMin, laneMin + ImVec2(width, rowHeight * numRows), true);
+
+        for (auto& event : lane.Events) {
+            if (event.EndTime < viewBegin || event.BeginTime > viewEnd) continue;
+
+            float x0 = getX(event.BeginTime), x1 = getX(event.EndTime);
+            ImVec2 min = ImVec2(x0, laneMin.y + event.Depth * rowHeight);
+            ImVec2 max = ImVec2(std::max(x1, x0 + 1), min.y + rowHeight - 1);
+
+            uint32_t color = event.Color;
+            ImU32 fillColor = color != 0 ? IM_COL32(color >> 16 & 255, color >> 8 & 255, color & 255, 255) : IM_COL32(31, 140, 255, 255);
+            drawList->AddRectFilled(min, max, fillColor);
+
+            if (max.x - min.x > ImGui::CalcTextSize(event.Label).x) {
+                drawList->AddText(min, IM_COL32_WHITE, event.Label);
+            }
+            if (ImGui::IsMouseHoveringRect(min, max) && ImGui::BeginTooltip()) {
+                ImGui::Text("%s: %s", event.Label, FormatTime(buffer, (float)(event.EndTime - event.BeginTime)));
+                ImGui::EndTooltip();
+            }
+        }
+        drawOverlay(getX, laneMin.y, laneMin.y + rowHeight * numRows);
+        drawList->PopClipRect();
+    };
+
+    for (auto& lane : TimelineLanes) {
+        drawLane(lane, [](auto&&...) {});
+    }
+    ImGui::Separator();
+
+    for (auto& lane : GpuTimelineLanes) {
+        drawLane(lane, [&](auto& getX, float y0, float y1) {
+            for (auto& bubble : RecentBubbles) {
+                if (bubble.Queue != lane.Queue || bubble.EndTime < viewBegin || bubble.BeginTime > viewEnd) continue;
+
+                ImVec2 min = ImVec2(getX(bubble.BeginTime), y0);
+                ImVec2 max = ImVec2(std::max(getX(bubble.EndTime), min.x + 1), y0 + rowHeight - 1);
+                drawList->AddRectFilled(min, max, IM_COL32(160, 40, 40, 96));
+
+                if (ImGui::IsMouseHoveringRect(min, max) && ImGui::BeginTooltip()) {
+                    ImGui::Text("Idle: %s", FormatTime(buffer, (float)(bubble.EndTime - bubble.BeginTime)));
+                    DrawBubbleCause(bubble);
+                    ImGui::EndTooltip();
+                }
+            }
+            for (auto& submit : RecentSubmits) {
+                if (submit.Queue != lane.Queue || submit.EndTime < viewBegin || submit.BeginTime > viewEnd) continue;
+
+                float x = getX(submit.EndTime);
+                drawList->AddLine(ImVec2(x, y0), ImVec2(x, y1), IM_COL32(255, 200, 40, 255));
+
+                if (ImGui::IsMouseHoveringRect(ImVec2(x - 2, y0), ImVec2(x + 2, y1)) && ImGui::BeginTooltip()) {
+                    ImGui::Text("vkQueueSubmit: %s", FormatTime(buffer, (float)(submit.EndTime - submit.BeginTime)));
+                    ImGui::EndTooltip();
+                }
+            }
+        });
+    }
+}
+
+void PerfmonContext::DrawHwCounters() {
+    ImGui::BeginDisabled(PrevSelectedScope == nullptr);
+    {
+        static bool streamCapture = false;
+        ImGui::BeginDisabled(streamCapture);
+        ImGui::SetNextItemShortcut(ImGuiKey_Equal, ImGuiInputFlags_RouteAlways | ImGuiInputFlags_Repeat);
+        bool captureOnce = ImGui::Button("Capture");
+        ImGui::SetItemTooltip("Shortcut: =");
+        ImGui::EndDisabled();
+
+        ImGui::SameLine();
+        ImGui::SetNextItemShortcut(ImGuiKey_LeftBracket, ImGuiInputFlags_RouteAlways);
+        if (ImGui::Button("Save Ref")) {
+            HwCounterResults[1] = std::vector { HwCounterResults[0] };
+        }
+        ImGui::SetItemTooltip("Shortcut: [");
+
+        ImGui::SameLine();
+        ImGui::Checkbox("Stream Capture", &streamCapture);
+        PerfQueryWantRecord = captureOnce || streamCapture;
+    }
+    ImGui::EndDisabled();
+
+    ImGui::SameLine();
+    ImGui::TextDisabled("%s", PrevSelectedScope ? PrevSelectedScope->Label : "(no selection)");
+
+    if (PerfNumReqPasses >= 2) {
+        ImGui::SameLine();
+        ImGui::TextColored(ImGui::GetStyleColorVec4(ImGuiCol_PlotLinesHovered), "%d passes", PerfNumReqPasses);
+        ImGui::SetItemTooltip("Enabled counters require multiple passes, captures of the selected scope only record the first one. "
+                              "Use 'Capture All Scopes' to replay frames for all passes.");
+    }
+
+    ImGui::BeginDisabled(HwCaptureActive || HwCounterEnabledIndices.empty());
+    if (ImGui::Button("Capture All Scopes")) {
+        StartHwCapture();
+    }
+    ImGui::SetItemTooltip("Collects enabled counters for every scope, replaying frames once per required pass. "
+                          "Takes one frame per level of nested scopes.");
+    ImGui::EndDisabled();
+
+    if (HwCaptureActive) {
+        ImGui::SameLine();
+        ImGui::TextDisabled("Capturing level %u...", HwCaptureDepth);
+    }
+    DrawScopeHwCounters();
+
+    const auto tableFlags = ImGuiTableFlags_Borders | ImGuiTableFlags_ScrollY | ImGuiTableFlags_RowBg | ImGuiTableFlags_Resizable |
+                            ImGuiTableFlags_Reorderable;
+
+    auto drawRow = [&](uint32_t index, bool isEnabled) {
+        auto& counter = HwCounters[index];
+        auto& desc = HwCounterDescs[index];
+
+        ImGui::TableNextRow();
+        ImGui::TableNextColumn();
+        ImGui::PushID((int)index);
+
+        ImGui::PushStyleColor(ImGuiCol_Text, ImGui::GetStyleColorVec4(isEnabled ? ImGuiCol_Text : ImGuiCol_TextDisabled));
+        if (ImGui::Checkbox(desc.name, &isEnabled)) {
+            if (isEnabled) {
+                HwCounterEnabledIndices.push_back(index);
+            } else {
+                std::erase(HwCounterEnabledIndices, index);
+            }
+            PerfQueryMustRecreate = true;
+            ForEachScope([&](Scope* scope) {
+                scope->HwCounterSums.clear();
+                scope->HwCounterNumCalls = 0;
+            });
+            SaveOrLoadSettings(true);
+        }
+        ImGui::PopStyleColor();
+
+        if (ImGui::IsItemHovered(ImGuiHoveredFlags_ForTooltip)) {
+            bool perfImpact = (desc.flags & VK_PERFORMANCE_COUNTER_DESCRIPTION_PERFORMANCE_IMPACTING_BIT_KHR);
+            bool concImpact = (desc.flags & VK_PERFORMANCE_COUNTER_DESCRIPTION_CONCURRENTLY_IMPACTED_BIT_KHR);
+
+            ImGui::SetItemTooltip("%s%s%s", desc.description,                  //
+                                  perfImpact ? " [Impacts performance]" : "",  //
+                                  concImpact ? " [Affected by concurrent submits]" : "");
+        }
+
+        if (isEnabled) {
+            auto& currResults = HwCounterResults[0];
+            auto& prevResults = HwCounterResults[1];
+            uint32_t j = std::find(HwCounterEnabledIndices.begin(), HwCounterEnabledIndices.end(), index) - HwCounterEnabledIndices.begin();
+
+            char text[64];
+            double currValue = 0;
+
+            if (j < currResults.size()) {
+                currValue = GetHwCounterValue(counter, currResults[j]);
+                FormatHwCounterValue(text, sizeof(text), counter, currValue);
+
+                ImGui::TableNextColumn();
+                ImGui::TextUnformatted(text);
+            }
+            if (j < prevResults.size()) {
+                double prevValue = GetHwCounterValue(counter, prevResults[j]);
+                double ratio = currValue / prevValue;
+
+                FormatHwCounterValue(text, sizeof(text), counter, prevValue);
+
+                ImVec4 color = ImGui::GetStyleColorVec4(fabs(ratio - 1) < 0.02 ? ImGuiCol_TextDisabled : ImGuiCol_Text);
+
+                ImGui::TableNextColumn();
+                ImGui::TextColored(color, "%s", text);
+
+                bool raiseBetter = counter.unit == VK_PERFORMANCE_COUNTER_UNIT_HERTZ_KHR ||
+                                   counter.unit == VK_PERFORMANCE_COUNTER_UNIT_PERCENTAGE_KHR;
+                double cmpRatio = raiseBetter ? ratio : 1.0 / ratio;
+                if (cmpRatio < 0.95) color = ImVec4(0.878f, 0.314f, 0.314f, 1.000f);
+                if (cmpRatio > 1.05) color = ImVec4(0.314f, 0.816f, 0.376f, 1.000f);
+
+                ImGui::TableNextColumn();
+                ImGui::TextColored(color, "%.2fx", ratio);
+            }
+        }
+        ImGui::PopID();
+    };
+
+    ImVec2 size = ImGui::GetContentRegionAvail();
+    size.y = std::max(size.y, ImGui::GetTextLineHeight() * 25.0f);
+    if (ImGui::BeginTable("Hardware Counter Values", 4, tableFlags, size)) {
+        const float charWidth = ImGui::CalcTextSize("A").x;
+
+        ImGui::TableSetupColumn("Counter", ImGuiTableColumnFlags_WidthStretch, charWidth * 15.0f);
+        ImGui::TableSetupColumn("Value", ImGuiTableColumnFlags_WidthStretch, charWidth * 7.0f);
+        ImGui::TableSetupColumn("Ref", ImGuiTableColumnFlags_WidthStretch, charWidth * 7.0f);
+        ImGui::TableSetupColumn("Ratio", ImGuiTableColumnFlags_WidthStretch, charWidth * 5.0f);
+        ImGui::TableHeadersRow();
+
+        auto order = std::vector<uint32_t>(HwCounters.size());
+        for (uint32_t i = 0; i < HwCounters.size(); i++) {
+            order[i] = i;
+        }
+        // Sort so that enabled counters appear first, then by category
+        const uint32_t kEnabledBit = 1 << 31;
+        for (uint32_t i : HwCounterEnabledIndices) {
+            order[i] |= kEnabledBit;
+        }
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            if ((a ^ b) & kEnabledBit) return a > b;
+            auto& ca = HwCounterDescs[a & ~kEnabledBit];
+            auto& cb = HwCounterDescs[b & ~kEnabledBit];
+            return strcmp(ca.category, cb.category) < 0;
+        });
+
+        // Draw enabled counters
+        auto ctrIt = order.begin();
+        for (; ctrIt < order.end(); ctrIt++) {
+            if ((*ctrIt & kEnabledBit) == 0) break;
+            drawRow(*ctrIt & ~kEnabledBit, true);
+        }
+
+        // Draw available counters
+        while (ctrIt < order.end()) {
+            auto& baseCtr = HwCounterDescs[*ctrIt];
+
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::SeparatorText(baseCtr.category);
+
+            for (; ctrIt < order.end(); ctrIt++) {
+                auto& counter = HwCounterDescs[*ctrIt];
+                if (strcmp(counter.category, baseCtr.category) != 0) break;
+
+                drawRow(*ctrIt, false);
+            }
+        }
+        ImGui::EndTable();
+    }
+}
+
+void PerfmonContext::DrawScopeHwCounters() {
+    std::vector<Scope*> scopes;
+    ForEachScope([&](Scope* scope) {
+        if (scope->HwCounterNumCalls > 0) scopes.push_back(scope);
+    });
+    if (scopes.empty()) return;
+
+    const auto tableFlags = ImGuiTableFlags_Borders | ImGuiTableFlags_ScrollX | ImGuiTableFlags_ScrollY | ImGuiTableFlags_RowBg |
+                            ImGuiTableFlags_Resizable | ImGuiTableFlags_Reorderable | ImGuiTableFlags_Hideable | ImGuiTableFlags_Sortable;
+    uint32_t numCounters = (uint32_t)HwCounterEnabledIndices.size();
+    ImVec2 size = ImVec2(0, ImGui::GetTextLineHeightWithSpacing() * std::min(scopes.size() + 2, (size_t)15));
+
+    if (ImGui::BeginTable("Scope Hardware Counters", (int)numCounters + 2, tableFlags, size)) {
+        ImGui::TableSetupScrollFreeze(1, 1);
+        ImGui::TableSetupColumn("Scope", ImGuiTableColumnFlags_NoHide);
+        ImGui::TableSetupColumn("Calls", ImGuiTableColumnFlags_PreferSortDescending);
+        for (uint32_t index : HwCounterEnabledIndices) {
+            ImGui::TableSetupColumn(HwCounterDescs[index].name, ImGuiTableColumnFlags_PreferSortDescending);
+        }
+        ImGui::TableHeadersRow();
+
+        if (ImGuiTableSortSpecs* sortSpecs = ImGui::TableGetSortSpecs(); sortSpecs != nullptr && sortSpecs->SpecsCount > 0) {
+            uint32_t column = (uint32_t)sortSpecs->Specs[0].ColumnIndex;
+            bool descending = sortSpecs->Specs[0].SortDirection == ImGuiSortDirection_Descending;
+
+            std::stable_sort(scopes.begin(), scopes.end(), [&](Scope* a, Scope* b) {
+                if (descending) std::swap(a, b);
+                if (column == 0) return strcmp(a->Label, b->Label) < 0;
+                if (column == 1) return a->HwCounterNumCalls < b->HwCounterNumCalls;
+                return GetScopeHwCounterValue(a, column - 2) < GetScopeHwCounterValue(b, column - 2);
+            });
+        }
+        for (Scope* scope : scopes) {
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::TextUnformatted(scope->Label);
+            ImGui::TableNextColumn();
+            ImGui::Text("%u", scope->HwCounterNumCalls);
+
+            for (uint32_t i = 0; i < numCounters; i++) {
+                char text[64];
+                FormatHwCounterValue(text, sizeof(text), HwCounters[HwCounterEnabledIndices[i]], GetScopeHwCounterValue(scope, i));
+                ImGui::TableNextColumn();
+                ImGui::TextUnformatted(text);
+            }
+        }
+        ImGui::EndTable();
+    }
+}
+
+void PerfmonContext::DrawQueueStats() {
+    const auto tableFlags = ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg | ImGuiTableFlags_Resizable;
+    char buffer[32];
+
+    if (ImGui::BeginTable("Queue Stats", 5, tableFlags)) {
+        ImGui::TableSetupColumn("Queue");
+        ImGui::TableSetupColumn("Utilization");
+        ImGui::TableSetupColumn("Submits");
+        ImGui::TableSetupColumn("Idle");
+        ImGui::TableSetupColumn("Longest Bubble");
+        ImGui::TableHeadersRow();
+
+        for (auto& queries : SubmitQueryPools) {
+            PerfMon::QueueStats stats = GetQueueStats(queries->Queue);
+
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::TextUnformatted(GetQueueName(queries->Queue).data());
+            if (queries->Pool == nullptr) {
+                ImGui::TableNextColumn();
+                ImGui::TextDisabled("No timestamp support");
+                continue;
+            }
+            ImGui::TableNextColumn();
+            ImGui::Text("%.1f%%", stats.Utilization * 100);
+            ImGui::TableNextColumn();
+            ImGui::Text("%u", stats.NumSubmits);
+            ImGui::TableNextColumn();
+            ImGui::TextUnformatted(FormatTime(buffer, (float)stats.IdleTime));
+            ImGui::TableNextColumn();
+            ImGui::Text("%s (%u total)", FormatTime(buffer, (float)stats.LongestBubble), stats.NumBubbles);
+        }
+        ImGui::EndTable();
+    }
+    ImGui::TextDisabled("Over the last %.1fs. Bubbles are idle gaps of at least %.0fus.", kTimelineHistorySec, kMinBubbleSec * 1e6);
+
+    std::vector<QueueBubble*> bubbles;
+    for (auto& bubble : RecentBubbles) bubbles.push_back(&bubble);
+    if (bubbles.empty()) return;
+
+    std::sort(bubbles.begin(), bubbles.end(), [](auto a, auto b) { return a->EndTime - a->BeginTime > b->EndTime - b->BeginTime; });
+    bubbles.resize(std::min(bubbles.size(), (size_t)10));
+
+    if (ImGui::BeginTable("Longest Bubbles", 3, tableFlags)) {
+        ImGui::TableSetupColumn("Queue");
+        ImGui::TableSetupColumn("Duration");
+        ImGui::TableSetupColumn("Cause", ImGuiTableColumnFlags_WidthStretch);
+        ImGui::TableHeadersRow();
+
+        for (QueueBubble* bubble : bubbles) {
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::TextUnformatted(GetQueueName(bubble->Queue).data());
+            ImGui::TableNextColumn();
+            ImGui::TextUnformatted(FormatTime(buffer, (float)(bubble->EndTime - bubble->BeginTime)));
+            ImGui::TableNextColumn();
+            DrawBubbleCause(*bubble);
+        }
+        ImGui::EndTable();
+    }
+}
+void PerfmonContext::DrawBubbleCause(const QueueBubble& bubble) {
+    const char* cause = bubble.Cause != nullptr ? bubble.Cause : "(no scope)";
+    if (bubble.WaitingForCpu) {
+        ImGui::Text("Waiting for CPU in %s", cause);
+    } else {
+        ImGui::Text("Waiting for semaphores or driver, submitted in %s", cause);
+    }
+}
+
+void PerfmonContext::DrawCommandStats() {
+    bool enabled = PerfMon::IsCommandProfiling();
+    if (ImGui::Checkbox("Profile All Commands", &enabled)) {
+        PerfMon::SetCommandProfiling(enabled);
+    }
+    ImGui::SetItemTooltip("Wraps every dispatch, draw and copy in queries. Adds overhead and prevents overlap between commands.");
+    ImGui::SameLine();
+    if (ImGui::Button("Reset")) {
+        ResetCommandStats();
+    }
+    ImGui::SameLine();
+    ImGui::Text("%u frames", CmdStatsNumFrames);
+    if (CmdStatsNumDropped > 0) {
+        ImGui::SameLine();
+        ImGui::Text("(%u commands dropped)", CmdStatsNumDropped);
+    }
+    if (!Device->PhysicalDevice.Features.PipelineStatistics) {
+        ImGui::TextDisabled("Pipeline statistics are not supported by this device.");
+    }
+
+    std::vector<std::pair<const std::string, CommandStats>*> commands;
+    for (auto& entry : CmdStats) {
+        if (entry.second.NumCalls > 0) commands.push_back(&entry);
+    }
+    if (commands.empty()) return;
+
+    const auto tableFlags = ImGuiTableFlags_Borders | ImGuiTableFlags_ScrollY | ImGuiTableFlags_RowBg | ImGuiTableFlags_Resizable |
+                            ImGuiTableFlags_Reorderable | ImGuiTableFlags_Hideable | ImGuiTableFlags_Sortable;
+    ImVec2 size = ImVec2(0, ImGui::GetTextLineHeightWithSpacing() * std::min(commands.size() + 2, (size_t)15));
+    float charWidth = ImGui::CalcTextSize("0").x;
+
+    // Values are per frame averages.
+    if (ImGui::BeginTable("Command Stats", 6, tableFlags, size)) {
+        ImGui::TableSetupScrollFreeze(1, 1);
+        const auto valueFlags = ImGuiTableColumnFlags_PreferSortDescending | ImGuiTableColumnFlags_WidthStretch;
+        ImGui::TableSetupColumn("Pipeline", ImGuiTableColumnFlags_NoHide | ImGuiTableColumnFlags_WidthStretch, charWidth * 30.0f);
+        ImGui::TableSetupColumn("Calls", valueFlags, charWidth * 5.0f);
+        ImGui::TableSetupColumn("GPU Avg", valueFlags | ImGuiTableColumnFlags_DefaultSort, charWidth * 7.0f);
+        ImGui::TableSetupColumn("%GPU", valueFlags, charWidth * 4.0f);
+        ImGui::TableSetupColumn("Invocations", valueFlags, charWidth * 9.0f);
+        ImGui::TableSetupColumn("Primitives", valueFlags, charWidth * 9.0f);
+        ImGui::TableHeadersRow();
+
+        if (ImGuiTableSortSpecs* sortSpecs = ImGui::TableGetSortSpecs(); sortSpecs != nullptr && sortSpecs->SpecsCount > 0) {
+            uint32_t column = (uint32_t)sortSpecs->Specs[0].ColumnIndex;
+            bool descending = sortSpecs->Specs[0].SortDirection == ImGuiSortDirection_Descending;
+
+            std::stable_sort(commands.begin(), commands.end(), [&](auto a, auto b) {
+                if (descending) std::swap(a, b);
+                switch (column) {
+                    case 0: return a->first < b->first;
+                    case 1: return a->second.NumCalls < b->second.NumCalls;
+                    case 4: return a->second.Invocations < b->second.Invocations;
+                    case 5: return a->second.Primitives < b->second.Primitives;
+                    default: return a->second.GpuTime < b->second.GpuTime;
+                }
+            });
+        }
+        double totalGpuTime = 0;
+        for (auto entry : commands) totalGpuTime += entry->second.GpuTime;
+
+        double numFrames = std::max(CmdStatsNumFrames, 1u);
+        char text[32];
+
+        for (auto entry : commands) {
+            auto& [name, stats] = *entry;
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::TextUnformatted(name.data());
+            ImGui::TableNextColumn();
+            ImGui::Text("%.1f", stats.NumCalls / numFrames);
+            ImGui::TableNextColumn();
+            ImGui::TextUnformatted(FormatTime(text, (float)(stats.GpuTime / numFrames)));
+            ImGui::TableNextColumn();
+            ImGui::Text("%.1f", totalGpuTime > 0 ? stats.GpuTime / totalGpuTime * 100 : 0.0);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.0f", stats.Invocations / numFrames);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.0f", stats.Primitives / numFrames);
+        }
+        ImGui::EndTable();
+    }
+}
+
+std::vector<Scope*> PerfmonContext::GetPlotLeafScopes() {
+    std::vector<Scope*> leafScopes;
+
+    auto visitScope = [&](auto& visitScope, Scope* scope) -> void {
+        if (!scope->ShowInPlot || scope->IsThreadRoot) return;
+
+        if (scope->Children.empty()) {
+            leafScopes.push_back(scope);
+        }
+        for (auto& child : scope->Children) {
+            visitScope(visitScope, child.get());
+        }
+    };
+    for (auto& child : RootScope.Children) {
+        visitScope(visitScope, child.get());
+    }
+    return leafScopes;
+}
+
+void PerfmonContext::SaveOrLoadSettings(bool save) {
+    if (ImGui::GetIO().IniFilename == nullptr) return;
+
+    std::string path = ImGui::GetIO().IniFilename;
+    while (!path.empty() && path.back() != '/' && path.back() != '\\') path.pop_back();
+    path += "havk_perfmon_state.txt";
+
+    if (save) {
+        std::string str;
+
+        str += "# EnabledHwCounters\n";
+
+        for (uint32_t i = 0; i < HwCounterEnabledIndices.size(); i++) {
+            str += HwCounterDescs[HwCounterEnabledIndices[i]].name;
+            str += '\n';
+        }
+        havx::WriteFileBytes(path, str.data(), str.size(), true);
+    } else {
+        std::vector<uint8_t> data = havx::ReadFileBytes(path);
+        std::string_view str = { (char*)data.data(), data.size() };
+
+        while (!str.empty()) {
+            auto line = str.substr(0, str.find('\n'));
+            str = str.substr(std::min(str.size(), line.size() + 1));
+
+            if (line.starts_with("#")) continue;
+
+            for (uint32_t i = 0; i < HwCounterDescs.size(); i++) {
+                if (line.compare(HwCounterDescs[i].name) == 0) {
+                    HwCounterEnabledIndices.push_back(i);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+int PerfmonContext::FormatHwCounterValue(char* buffer, uint32_t bufferSize, const VkPerformanceCounterKHR& counter, double value) {
+    const char* unitText = "";
+    double logScale = 0, logBias = 0;
+
+    // clang-format off
+    switch (counter.unit) {
+        case VK_PERFORMANCE_COUNTER_UNIT_PERCENTAGE_KHR: unitText = "%"; break;
+        case VK_PERFORMANCE_COUNTER_UNIT_BYTES_KHR: unitText = "B"; logScale = 1024; break;
+        case VK_PERFORMANCE_COUNTER_UNIT_BYTES_PER_SECOND_KHR: unitText = "B/s"; logScale = 1024; break;
+        case VK_PERFORMANCE_COUNTER_UNIT_KELVIN_KHR: unitText = "°C"; value -= 273.15; break;
+        case VK_PERFORMANCE_COUNTER_UNIT_WATTS_KHR: unitText = "W"; break;
+        case VK_PERFORMANCE_COUNTER_UNIT_VOLTS_KHR: unitText = "v"; break;
+        case VK_PERFORMANCE_COUNTER_UNIT_AMPS_KHR: unitText = "amp"; break;
+        case VK_PERFORMANCE_COUNTER_UNIT_HERTZ_KHR: unitText = "Hz"; logScale = 1000; break;
+        case VK_PERFORMANCE_COUNTER_UNIT_CYCLES_KHR: unitText = "cycles"; logScale = 1000; break;
+        case VK_PERFORMANCE_COUNTER_UNIT_NANOSECONDS_KHR: unitText = "s"; logScale = 1000; logBias = -3; break;
+        case VK_PERFORMANCE_COUNTER_UNIT_GENERIC_KHR: logScale = 1000; break;
+        default: break;
+    }
+    // clang-format on
+    const char* prefix = "";
+
+    if (value != 0 && logScale != 0) {
+        double mag = floor(log(fabs(value)) / log(logScale)) + logBias;
+        mag = fmin(fmax(mag, -3.0), 3.0);
+
+        if (mag != 0) {
+            value /= pow(logScale, mag - logBias);
+            const char* prefixes[] = { "n", "u", "m", "", "k", "M", "G", "T" };
+            prefix = prefixes[(int)mag + 3];
+        }
+    }
+    return snprintf(buffer, bufferSize, "%.3f%s%s", value, prefix, unitText);
+}
+
+void PerfMon::DrawFrame() {
+    if (g_ctx) g_ctx->DrawFrame();
+}
+
+};  // namespace havx
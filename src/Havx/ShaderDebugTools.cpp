@@ -14,7 +14,9 @@
 #include "Shaders/Havk/DebugTools.h"
 
 #include <bit>
+#include <deque>
 #include <map>
+#include <mutex>
 
 using namespace havk::vectors;
 namespace shbind = havx::shader::dbg;
@@ -34,6 +36,7 @@ static float asfloat(uint32_t x) { return std::bit_cast<float>(x); }
 struct ProgramData {
     std::vector<std::pair<uint32_t, std::string>> StringDefs;
     std::string SourcePath;
+    uint32_t Id;
 };
 
 struct ShapeDrawBatch {
@@ -334,7 +337,9 @@ struct ImageViewerState {
 
 struct ShadebugContext {
     havk::DeviceContext* Device;
-    std::vector<ProgramData> Programs;
+    // Pipelines may be created from the shader reload thread. Deque keeps existing entries stable while new ones are added.
+    std::deque<ProgramData> Programs;
+    std::mutex ProgramsMutex;
 
     havk::BufferPtr StorageBuffer;
 
@@ -362,7 +367,11 @@ struct ShadebugContext {
 
         device->OnCreatePipelineHook_ = [this](havk::Span<const havk::ModuleDesc> mods, VkBaseInStructure* createInfo,
                                                VkPipelineShaderStageCreateInfo* stages, VkPipeline* pipeline) {
-            ProgramData* progData = LoadProgramMetadata(mods[0].SourcePath);
+            ProgramData* progData;
+            {
+                std::lock_guard lock(ProgramsMutex);
+                progData = LoadProgramMetadata(mods[0].SourcePath);
+            }
 
             havk::SpecConstMap specMap;
             VkSpecializationInfo newSpecInfo;
@@ -375,7 +384,7 @@ struct ShadebugContext {
                                                        (const uint8_t*)currSpec->pData + currSpec->dataSize);
                 }
                 specMap.Add(kConstId_ContextPtr, StorageBuffer->DeviceAddress);
-                specMap.Add(kConstId_ProgramId, (uint32_t)(progData - Programs.data()));
+                specMap.Add(kConstId_ProgramId, progData->Id);
                 specMap.Add(kConstId_MaxWidgetSlots, kMaxWidgetSlots);
 
                 newSpecInfo = specMap.GetSpecInfo();
@@ -427,6 +436,7 @@ struct ShadebugContext {
 
         auto& program = Programs.emplace_back();
         program.SourcePath = sourcePath;
+        program.Id = (uint32_t)(Programs.size() - 1);
 
         while (reader.ReadNext()) {
             if (reader.MatchObject("hashedStrings")) {
@@ -445,7 +455,11 @@ struct ShadebugContext {
     }
 
     const char* GetProgramString(uint32_t programId, uint32_t stringId) {
-        for (auto& entry : Programs[programId].StringDefs) {
+        std::unique_lock lock(ProgramsMutex);
+        ProgramData& program = Programs[programId];
+        lock.unlock();
+
+        for (auto& entry : program.StringDefs) {
             if (entry.first == stringId) return entry.second.c_str();
         }
         return "";
@@ -480,6 +480,15 @@ double GetMonotonicTime() {
     return (double)tp.tv_sec + (double)tp.tv_nsec * 1E-9;
 #endif
 }
+double ConvertMonotonicTicks(uint64_t ticks) {
+#if _WIN32
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    return (double)ticks / freq.QuadPart;
+#else
+    return (double)ticks * 1E-9;
+#endif
+}
 
 std::vector<uint8_t> ReadFileBytes(std::string_view path) {
     FILE* fs;
@@ -45,6 +45,8 @@ void PreciseSleep(double seconds);
 // Returns high resolution timestamp, in seconds.
 // QueryPerformanceCounter / clock_gettime(CLOCK_MONOTONIC).
 double GetMonotonicTime();
+// Converts a raw value of the same clock (QPC ticks or nanoseconds) to seconds, e.g. from VK_KHR_calibrated_timestamps.
+double ConvertMonotonicTicks(uint64_t ticks);
 
 #if _WIN32
 // Windows-only bullshit to convert between UTF8 and UTF16 strings
@@ -115,14 +115,14 @@ void Unescape(std::string_view src, std::string &dest, bool append) {
                 }
                 // Convert to UTF8
                 if (cp < 0x80) {
-                    dest.append(1, cp);
+                    dest.append(1, (char)cp);
                 } else if (cp < 0x800) {
-                    dest.append(1, 0xC0 | (cp >> 6 & 31));
-                    dest.append(1, 0x80 | (cp >> 0 & 63));
+                    dest.append(1, (char)(0xC0 | (cp >> 6 & 31)));
+                    dest.append(1, (char)(0x80 | (cp >> 0 & 63)));
                 } else {
-                    dest.append(1, 0xE0 | (cp >> 12 & 15));
-                    dest.append(1, 0x80 | (cp >> 6 & 63));
-                    dest.append(1, 0x80 | (cp >> 0 & 63));
+                    dest.append(1, (char)(0xE0 | (cp >> 12 & 15)));
+                    dest.append(1, (char)(0x80 | (cp >> 6 & 63)));
+                    dest.append(1, (char)(0x80 | (cp >> 0 & 63)));
                 }
                 endPos += 4;
                 break;
@@ -164,7 +164,7 @@ Token Reader::NextToken() {
     }
     if (IsIdentifierChar(ch)) {
         while (Pos < Len && IsIdentifierChar(Input[Pos])) Pos++;
-        return Token(Token::kIdentifier, &Input[startPos], Pos - startPos);
+        return Token(Token::kIdentifier, &Input[startPos], (uint32_t)(Pos - startPos));
     }
     ReportError("Invalid character", startPos, Pos + 1);
     return Token::kEOF;
@@ -179,7 +179,7 @@ Token Reader::ScanString() {
 
         if (Input[Pos - 2] != '\\') break;
     }
-    return Token(Token::kString, &Input[startPos], Pos - startPos - 1);
+    return Token(Token::kString, &Input[startPos], (uint32_t)(Pos - startPos - 1));
 }
 Token Reader::ScanNumber() {
     Token tok;
@@ -1,7 +1,7 @@
 function(target_shader_sources targetName)
     # Multi value arguments must be either followed by another option,
     # or appear after the source list to break ambiguity.
-    set(options PUBLIC PRIVATE)
+    set(options PUBLIC PRIVATE CPU_KERNELS)
     set(oneValueArgs BASE_DIR NAMESPACE)
     set(multiValueArgs COMPILE_DEFS INCLUDE_DIRS EXTRA_ARGS)
     cmake_parse_arguments(arg "${options}" "${oneValueArgs}" "${multiValueArgs}" "${ARGN}")
@@ -59,12 +59,35 @@ function(target_shader_sources targetName)
         set(arg_EXTRA_ARGS "${arg_EXTRA_ARGS};--base-ns;${arg_NAMESPACE}")
     endif()
 
+    if (arg_CPU_KERNELS)
+        set(arg_EXTRA_ARGS "${arg_EXTRA_ARGS};--cpu-kernels")
+        get_property(slangIncludeDirs TARGET ShaderBuildTool PROPERTY SLANG_INCLUDE_DIRS)
+        target_include_directories(${targetName} PRIVATE ${slangIncludeDirs})
+    endif()
+
     if (SHADER_BUILD_DEBUG_INFO)
         set(arg_EXTRA_ARGS "${arg_EXTRA_ARGS};-g2")
     endif()
     if (SHADER_BUILD_OPTIMIZE)
         set(arg_EXTRA_ARGS "${arg_EXTRA_ARGS};-O2")
     endif()
+    if (SHADER_BUILD_WHOLE_PROGRAM)
+        set(arg_EXTRA_ARGS "${arg_EXTRA_ARGS};--whole-program")
+    endif()
+    if (DEFINED SHADER_BUILD_JOBS)
+        set(arg_EXTRA_ARGS "${arg_EXTRA_ARGS};-j${SHADER_BUILD_JOBS}")
+    endif()
+    # Prefer #embed for SPIR-V binaries where supported, big hex arrays are slow to compile.
+    if ((CMAKE_CXX_COMPILER_ID STREQUAL "Clang" AND CMAKE_CXX_COMPILER_VERSION VERSION_GREATER_EQUAL 19) OR
+        (CMAKE_CXX_COMPILER_ID STREQUAL "GNU" AND CMAKE_CXX_COMPILER_VERSION VERSION_GREATER_EQUAL 15))
+        set(arg_EXTRA_ARGS "${arg_EXTRA_ARGS};--embed-spirv")
+    endif()
+    if (NOT DEFINED SHADER_BUILD_CACHE_DIR)
+        set(SHADER_BUILD_CACHE_DIR ${CMAKE_BINARY_DIR}/shader-cache)
+    endif()
+    if (NOT "${SHADER_BUILD_CACHE_DIR}" STREQUAL "")
+        set(arg_EXTRA_ARGS "${arg_EXTRA_ARGS};--cache-dir;${SHADER_BUILD_CACHE_DIR}")
+    endif()
     
     list(TRANSFORM arg_COMPILE_DEFS PREPEND "-D")
 
@@ -80,12 +103,14 @@ function(target_shader_sources targetName)
         ${arg_UNPARSED_ARGUMENTS}
     )
 
-    # Clean output if arguments have changed
+    # Clean output if arguments have changed. Not needed with the cache, because
+    # entry keys already cover options and the tool version.
     get_property(havkSourceDir TARGET ShaderBuildTool PROPERTY SOURCE_DIR)
-    file(TIMESTAMP "${havkSourceDir}/ShaderBuildTool.cpp" hashKeys)
+    file(TIMESTAMP "${havkSourceDir}/Havk/ShaderBuildTool.cpp" toolTimestamp)
+    file(TIMESTAMP "${havkSourceDir}/Havk/ShaderCompiler.cpp" compilerTimestamp)
 
-    string(SHA1 hashKeys "${shaderBuildArgs}-${hashKeys}")
-    if (NOT "${SHADER_BRIDGE_${targetName}_CLEAN_HASH}" STREQUAL ${hashKeys})
+    string(SHA1 hashKeys "${shaderBuildArgs}-${toolTimestamp}-${compilerTimestamp}")
+    if ("${SHADER_BUILD_CACHE_DIR}" STREQUAL "" AND NOT "${SHADER_BRIDGE_${targetName}_CLEAN_HASH}" STREQUAL ${hashKeys})
         file(REMOVE_RECURSE ${outputDir})
         set("SHADER_BRIDGE_${targetName}_CLEAN_HASH" ${hashKeys} CACHE INTERNAL "" FORCE)
         message("Invalidating shader binaries for ${targetName}")
@@ -98,7 +123,7 @@ function(target_shader_sources targetName)
         "base_dir: ${arg_BASE_DIR}\n"
         "output_dir: ${outputDir}\n"
         "sources: ${arg_UNPARSED_ARGUMENTS}\n"
-        "watcher_cmd: $<TARGET_FILE:ShaderBuildTool> --watch $<JOIN:${shaderReloadArgs}, >\n")
+        "watcher_cmd: $<TARGET_FILE:ShaderBuildTool> --watch --reload-frames $<JOIN:${shaderReloadArgs}, >\n")
     string(JOIN "" shaderReloadArgs ${shaderReloadArgs})
 
     file(GENERATE OUTPUT "$<TARGET_FILE:${targetName}>.shaderwatch" 
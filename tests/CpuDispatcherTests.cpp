@@ -0,0 +1,86 @@
+#include <doctest/doctest.h>
+
+#include <Havx/CpuDispatcher.h>
+
+// Hand-written stand-in for a kernel generated with `--cpu-kernels`, counting how many times each group ran.
+struct CS_CountGroups {
+    struct Params {
+        havk::DevicePtr<std::atomic<uint32_t>> Counts;
+        havk::vectors::uint3 NumGroups;
+    };
+    static constexpr havk::vectors::uint3 GroupSize = { 4, 2, 1 };
+    static const havk::CpuKernel CpuKernel;
+};
+const havk::CpuKernel CS_CountGroups::CpuKernel = {
+    .RunGroups = [](const void* params, const uint32_t start[3], const uint32_t end[3]) {
+        auto& pc = *(const CS_CountGroups::Params*)params;
+        auto counts = (std::atomic<uint32_t>*)(uintptr_t)pc.Counts.addr;
+
+        for (uint32_t z = start[2]; z < end[2]; z++) {
+            for (uint32_t y = start[1]; y < end[1]; y++) {
+                for (uint32_t x = start[0]; x < end[0]; x++) {
+                    counts[(z * pc.NumGroups.y + y) * pc.NumGroups.x + x]++;
+                }
+            }
+        }
+    },
+};
+static_assert(havx::CpuProgramShape<CS_CountGroups>);
+
+static void CheckAllGroupsRunOnce(havx::CpuDispatcher& dispatcher, havk::vectors::uint3 numGroups) {
+    CAPTURE(numGroups.x);
+    CAPTURE(numGroups.y);
+    CAPTURE(numGroups.z);
+
+    auto counts = std::vector<std::atomic<uint32_t>>(numGroups.x * numGroups.y * numGroups.z);
+    CS_CountGroups::Params pc = { .Counts = havx::HostPtr(counts.data()), .NumGroups = numGroups };
+    dispatcher.DispatchGroups(CS_CountGroups::CpuKernel, numGroups, &pc);
+
+    for (auto& count : counts) {
+        REQUIRE(count == 1);
+    }
+}
+
+TEST_CASE("cpu dispatcher tiling") {
+    havx::CpuDispatcher dispatcher(4);
+    REQUIRE(dispatcher.GetThreadCount() == 4);
+
+    SUBCASE("fewer groups than tiles") {
+        CheckAllGroupsRunOnce(dispatcher, { 1, 1, 1 });
+        CheckAllGroupsRunOnce(dispatcher, { 3, 1, 1 });
+        CheckAllGroupsRunOnce(dispatcher, { 31, 1, 1 });
+    }
+    SUBCASE("multiple rows and slices") {
+        CheckAllGroupsRunOnce(dispatcher, { 1, 7, 1 });
+        CheckAllGroupsRunOnce(dispatcher, { 5, 3, 2 });
+        CheckAllGroupsRunOnce(dispatcher, { 1, 1, 9 });
+        CheckAllGroupsRunOnce(dispatcher, { 100, 40, 3 });
+    }
+    SUBCASE("uneven tile width") {
+        CheckAllGroupsRunOnce(dispatcher, { 33, 1, 1 });
+        CheckAllGroupsRunOnce(dispatcher, { 1000, 1, 1 });
+    }
+    SUBCASE("empty dispatch") {
+        CS_CountGroups::Params pc = {};
+        dispatcher.DispatchGroups(CS_CountGroups::CpuKernel, { 0, 4, 4 }, &pc);
+    }
+    SUBCASE("repeated dispatches") {
+        for (uint32_t i = 0; i < 200; i++) {
+            CheckAllGroupsRunOnce(dispatcher, { 1 + i % 13, 1 + i % 3, 1 + i % 2 });
+        }
+    }
+}
+
+TEST_CASE("cpu dispatcher invocation count") {
+    havx::CpuDispatcher dispatcher(3);
+
+    // Dispatch<>() rounds invocations up to whole groups of `GroupSize`.
+    havk::vectors::uint3 numGroups = { 3, 2, 5 };
+    auto counts = std::vector<std::atomic<uint32_t>>(numGroups.x * numGroups.y * numGroups.z);
+    CS_CountGroups::Params pc = { .Counts = havx::HostPtr(counts.data()), .NumGroups = numGroups };
+    dispatcher.Dispatch<CS_CountGroups>({ 9, 3, 5 }, pc);
+
+    for (auto& count : counts) {
+        CHECK(count == 1);
+    }
+}
@@ -0,0 +1,35 @@
+#include <doctest/doctest.h>
+
+#include <Havx/PerfMonitorInternal.h>
+
+using namespace havx;
+
+TEST_CASE("PerfMon: sample stats skip frames after last recorded") {
+    // Ring filled over two laps. Frames 745..990 are recent, entries for 991..999 are from the previous lap.
+    float samples[kSampleHistorySize];
+    for (uint32_t frameNo = 744; frameNo < 1000; frameNo++) {
+        samples[frameNo % kSampleHistorySize] = frameNo <= 990 ? 1.0f : 100.0f;
+    }
+
+    SUBCASE("Recorded every frame") {
+        PerfMon::TimingStats stats = GetSampleStats(samples, 1000, 1000, 255);
+        CHECK(stats.NumSamples == 255);
+        CHECK(stats.Max == 100.0f);
+    }
+    SUBCASE("Stopped recording") {
+        PerfMon::TimingStats stats = GetSampleStats(samples, 1000, 990, 255);
+        CHECK(stats.NumSamples == 255 - 9);
+        CHECK(stats.Max == 1.0f);
+
+        stats = GetSampleStats(samples, 1000, 990, 10);
+        CHECK(stats.NumSamples == 1);
+    }
+    SUBCASE("Not recorded within window") {
+        PerfMon::TimingStats stats = GetSampleStats(samples, 1000, 700, 255);
+        CHECK(stats.NumSamples == 0);
+    }
+    SUBCASE("Window before first frame") {
+        PerfMon::TimingStats stats = GetSampleStats(samples, 8, 5, 20);
+        CHECK(stats.NumSamples == 18);
+    }
+}
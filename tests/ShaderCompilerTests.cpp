@@ -0,0 +1,210 @@
+#include <doctest/doctest.h>
+
+#include <Havk/ShaderCompiler.h>
+
+#include <cstring>
+#include <unordered_set>
+
+// Workaround for VulkanSDK inconsistency
+#if __has_include(<spirv-headers/spirv.hpp>)
+    #include <spirv-headers/spirv.hpp>
+#else
+    #include <spirv/unified1/spirv.hpp>
+#endif
+
+using havk::detail::SpillPushConstants;
+
+// Minimal SPIR-V assembler/disassembler for hand-written test modules.
+struct SpirvModule {
+    struct Inst {
+        spv::Op Op;
+        std::vector<uint32_t> Operands;
+    };
+    std::vector<uint32_t> Words = { spv::MagicNumber, 0x10600, 0, 0, 0 };
+
+    void Emit(spv::Op op, std::vector<uint32_t> operands) {
+        Words.push_back((uint32_t)(operands.size() + 1) << 16 | op);
+        Words.insert(Words.end(), operands.begin(), operands.end());
+    }
+    void EmitEntryPoint(uint32_t funcId, const char* name, std::vector<uint32_t> interfaceIds) {
+        std::vector<uint32_t> operands = { spv::ExecutionModelGLCompute, funcId };
+        size_t nameWords = strlen(name) / 4 + 1;
+        operands.resize(2 + nameWords);
+        memcpy(&operands[2], name, strlen(name));
+        operands.insert(operands.end(), interfaceIds.begin(), interfaceIds.end());
+        Emit(spv::OpEntryPoint, operands);
+    }
+    std::vector<uint8_t> GetBinary(uint32_t idBound) {
+        Words[3] = idBound;
+        std::vector<uint8_t> binary(Words.size() * 4);
+        memcpy(binary.data(), Words.data(), binary.size());
+        return binary;
+    }
+
+    static std::vector<Inst> Parse(const std::vector<uint8_t>& binary) {
+        std::vector<uint32_t> words(binary.size() / 4);
+        memcpy(words.data(), binary.data(), binary.size());
+        std::vector<Inst> insts;
+
+        for (size_t pos = 5; pos < words.size();) {
+            uint32_t numWords = words[pos] >> 16;
+            REQUIRE(numWords > 0);
+            REQUIRE(pos + numWords <= words.size());
+            insts.push_back({ (spv::Op)(words[pos] & 0xFFFF), { &words[pos + 1], &words[pos + numWords] } });
+            pos += numWords;
+        }
+        return insts;
+    }
+    static uint32_t GetResultId(const Inst& inst) {
+        if (inst.Op >= spv::OpTypeVoid && inst.Op <= spv::OpTypeForwardPointer) return inst.Operands[0];
+        if (inst.Op == spv::OpLabel) return inst.Operands[0];
+        if (inst.Op == spv::OpConstant || inst.Op == spv::OpVariable || inst.Op == spv::OpFunction || inst.Op == spv::OpAccessChain ||
+            inst.Op == spv::OpLoad) {
+            return inst.Operands[1];
+        }
+        return 0;
+    }
+    static const Inst* FindDef(const std::vector<Inst>& insts, uint32_t id) {
+        for (auto& inst : insts) {
+            if (GetResultId(inst) == id) return &inst;
+        }
+        return nullptr;
+    }
+};
+
+// Compute shader reading a float field of a push constant block, by access chain and by loading the whole block:
+//   struct Params { float A; };  (id 4, pointer 6, variable 10)
+enum : uint32_t {
+    kVoid = 1, kVoidFunc = 2, kFloat = 3, kParams = 4, kMain = 5, kParamsPtr = 6, kFloatPtr = 7, kInt = 8,
+    kZero = 9, kParamsVar = 10, kLabel = 11, kFieldPtr = 12, kFieldLoad = 13, kVolatileLoad = 14, kBlockLoad = 15,
+    kOther = 16, kOtherLabel = 17, kIdBound = 18,
+};
+static std::vector<uint8_t> BuildPushConstantModule(bool withOtherEntry) {
+    SpirvModule mod;
+    mod.Emit(spv::OpCapability, { spv::CapabilityShader });
+    mod.Emit(spv::OpMemoryModel, { spv::AddressingModelLogical, spv::MemoryModelGLSL450 });
+    mod.EmitEntryPoint(kMain, "main", { kParamsVar });
+    if (withOtherEntry) mod.EmitEntryPoint(kOther, "other", { kParamsVar });
+    mod.Emit(spv::OpDecorate, { kParams, spv::DecorationBlock });
+    mod.Emit(spv::OpMemberDecorate, { kParams, 0, spv::DecorationOffset, 0 });
+    mod.Emit(spv::OpTypeVoid, { kVoid });
+    mod.Emit(spv::OpTypeFunction, { kVoidFunc, kVoid });
+    mod.Emit(spv::OpTypeFloat, { kFloat, 32 });
+    mod.Emit(spv::OpTypeStruct, { kParams, kFloat });
+    mod.Emit(spv::OpTypePointer, { kParamsPtr, spv::StorageClassPushConstant, kParams });
+    mod.Emit(spv::OpTypePointer, { kFloatPtr, spv::StorageClassPushConstant, kFloat });
+    mod.Emit(spv::OpTypeInt, { kInt, 32, 1 });
+    mod.Emit(spv::OpConstant, { kInt, kZero, 0 });
+    mod.Emit(spv::OpVariable, { kParamsPtr, kParamsVar, spv::StorageClassPushConstant });
+
+    mod.Emit(spv::OpFunction, { kVoid, kMain, spv::FunctionControlMaskNone, kVoidFunc });
+    mod.Emit(spv::OpLabel, { kLabel });
+    mod.Emit(spv::OpAccessChain, { kFloatPtr, kFieldPtr, kParamsVar, kZero });
+    mod.Emit(spv::OpLoad, { kFloat, kFieldLoad, kFieldPtr });
+    mod.Emit(spv::OpLoad, { kFloat, kVolatileLoad, kFieldPtr, spv::MemoryAccessVolatileMask });
+    mod.Emit(spv::OpLoad, { kParams, kBlockLoad, kParamsVar });
+    mod.Emit(spv::OpReturn, {});
+    mod.Emit(spv::OpFunctionEnd, {});
+
+    if (withOtherEntry) {
+        mod.Emit(spv::OpFunction, { kVoid, kOther, spv::FunctionControlMaskNone, kVoidFunc });
+        mod.Emit(spv::OpLabel, { kOtherLabel });
+        mod.Emit(spv::OpReturn, {});
+        mod.Emit(spv::OpFunctionEnd, {});
+    }
+    return mod.GetBinary(kIdBound);
+}
+
+TEST_CASE("spill push constants") {
+    SUBCASE("rewrites access chains and loads") {
+        auto binary = BuildPushConstantModule(false);
+        REQUIRE(SpillPushConstants(binary, { "main" }));
+        auto insts = SpirvModule::Parse(binary);
+
+        auto FindInst = [&](spv::Op op, auto&& pred) -> const SpirvModule::Inst* {
+            for (auto& inst : insts) {
+                if (inst.Op == op && pred(inst)) return &inst;
+            }
+            return nullptr;
+        };
+        auto IsPsbPointerTo = [&](uint32_t typeId, uint32_t pointeeId) {
+            auto def = SpirvModule::FindDef(insts, typeId);
+            return def != nullptr && def->Op == spv::OpTypePointer && def->Operands[1] == spv::StorageClassPhysicalStorageBuffer &&
+                   def->Operands[2] == pointeeId;
+        };
+
+        CHECK(FindInst(spv::OpCapability, [](auto& i) { return i.Operands[0] == spv::CapabilityPhysicalStorageBufferAddresses; }));
+        auto memModel = FindInst(spv::OpMemoryModel, [](auto&) { return true; });
+        REQUIRE(memModel);
+        CHECK(memModel->Operands[0] == spv::AddressingModelPhysicalStorageBuffer64);
+
+        // Variable now holds a block with a single pointer to the original struct.
+        auto var = SpirvModule::FindDef(insts, kParamsVar);
+        REQUIRE(var);
+        REQUIRE(var->Op == spv::OpVariable);
+        auto varPtrType = SpirvModule::FindDef(insts, var->Operands[0]);
+        REQUIRE(varPtrType);
+        CHECK(varPtrType->Operands[1] == spv::StorageClassPushConstant);
+        auto wrapper = SpirvModule::FindDef(insts, varPtrType->Operands[2]);
+        REQUIRE(wrapper);
+        REQUIRE(wrapper->Op == spv::OpTypeStruct);
+        REQUIRE(wrapper->Operands.size() == 2);
+        CHECK(IsPsbPointerTo(wrapper->Operands[1], kParams));
+        CHECK(FindInst(spv::OpDecorate, [&](auto& i) { return i.Operands[0] == wrapper->Operands[0] && i.Operands[1] == spv::DecorationBlock; }));
+
+        // Block pointer is loaded at the start of the function.
+        auto memberPtr = FindInst(spv::OpAccessChain, [](auto& i) { return i.Operands[2] == kParamsVar; });
+        REQUIRE(memberPtr);
+        CHECK(memberPtr->Operands[3] == kZero);
+        auto blockPtr = FindInst(spv::OpLoad, [&](auto& i) { return i.Operands[2] == memberPtr->Operands[1]; });
+        REQUIRE(blockPtr);
+        CHECK(IsPsbPointerTo(blockPtr->Operands[0], kParams));
+        uint32_t blockPtrId = blockPtr->Operands[1];
+
+        // Original accesses go through the block pointer, as PhysicalStorageBuffer.
+        auto fieldPtr = SpirvModule::FindDef(insts, kFieldPtr);
+        REQUIRE(fieldPtr);
+        CHECK(fieldPtr->Operands[2] == blockPtrId);
+        CHECK(IsPsbPointerTo(fieldPtr->Operands[0], kFloat));
+
+        auto fieldLoad = SpirvModule::FindDef(insts, kFieldLoad);
+        REQUIRE(fieldLoad);
+        std::vector<uint32_t> expectedLoad = { kFloat, kFieldLoad, kFieldPtr, spv::MemoryAccessAlignedMask, 4 };
+        CHECK(fieldLoad->Operands == expectedLoad);
+
+        auto volatileLoad = SpirvModule::FindDef(insts, kVolatileLoad);
+        REQUIRE(volatileLoad);
+        expectedLoad = { kFloat, kVolatileLoad, kFieldPtr, spv::MemoryAccessVolatileMask | spv::MemoryAccessAlignedMask, 4 };
+        CHECK(volatileLoad->Operands == expectedLoad);
+
+        auto blockLoad = SpirvModule::FindDef(insts, kBlockLoad);
+        REQUIRE(blockLoad);
+        expectedLoad = { kParams, kBlockLoad, blockPtrId, spv::MemoryAccessAlignedMask, 4 };
+        CHECK(blockLoad->Operands == expectedLoad);
+
+        // New ids must be within the bound and unique.
+        uint32_t idBound;
+        memcpy(&idBound, &binary[12], 4);
+        std::unordered_set<uint32_t> resultIds;
+
+        for (auto& inst : insts) {
+            uint32_t id = SpirvModule::GetResultId(inst);
+            if (id == 0) continue;
+            CHECK(id < idBound);
+            CHECK(resultIds.insert(id).second);
+        }
+    }
+    SUBCASE("leaves other entry points untouched") {
+        auto binary = BuildPushConstantModule(false);
+        auto original = binary;
+        REQUIRE(SpillPushConstants(binary, { "other" }));
+        CHECK(binary == original);
+    }
+    SUBCASE("rejects blocks shared with non-spilled entry points") {
+        auto binary = BuildPushConstantModule(true);
+        CHECK_FALSE(SpillPushConstants(binary, { "main" }));
+
+        binary = BuildPushConstantModule(true);
+        CHECK(SpillPushConstants(binary, { "main", "other" }));
+    }
+}